@@ -0,0 +1,315 @@
+/*! \file
+ * Implementation of a binary buddy memory allocator, with the same interface
+ * as myalloc.c.  The allocator manages a pool of memory, provides memory
+ * chunks on request, and reintegrates freed memory back into the pool.
+ *
+ * Every block is a power of two in size, and starts at an offset into the
+ * pool that is a multiple of its size, so a block's buddy, the other half
+ * of the block it was split from, is found by flipping one bit of its
+ * offset.  Allocating and freeing each take O(log n) time at worst, for a
+ * pool of n bytes, since a block is split or merged at most once per order.
+ * In exchange, every request is rounded up to a power of two.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "myalloc.h"
+
+
+/*!
+ * These variables are used to specify the size and the growth limit of the
+ * memory pool that the buddy allocator works against.  The buddy allocator
+ * can't add memory to a pool of buddies after the fact, so when the pool
+ * may grow, the address space for all MEMORY_LIMIT bytes is mapped up front,
+ * and the operating system only provides pages as they are touched.
+ */
+int MEMORY_SIZE;
+int MEMORY_LIMIT = 0;
+static unsigned char *mem;
+static int pool_size;
+
+
+/**
+ * Blocks carry no header, so that a request of exactly a power of two bytes
+ * fits in a block of that size.  Instead, every UNIT_SIZE bytes of the pool,
+ * the size of the smallest block, have one byte in block_info, which holds
+ * the order of the block that starts there and whether it is free.  Like
+ * the array of chunks in myalloc.c, the table is mapped apart from the
+ * pool, so all MEMORY_SIZE bytes are left for blocks.  The byte of a unit
+ * that doesn't start a block is always 0, which myfree() relies on to
+ * reject pointers into the middle of a block.
+ *
+ * A free block holds the links of the free list for its order, which the
+ * smallest block has room for.
+ */
+typedef struct BuddyLinks{
+    struct BuddyLinks* next_free;
+    struct BuddyLinks* prev_free;
+}BuddyLinks;
+
+#define MIN_ORDER 5
+#define MAX_ORDER 31
+#define UNIT_SIZE (1 << MIN_ORDER)
+#define BUDDY_FREE 0x80
+#define ORDER_MASK 0x7f
+
+static unsigned char *block_info;
+static int info_size;
+
+/**
+ * There is a free list for each order, and a bit in free_map for each order
+ * whose list is nonempty, so that the smallest free block large enough for
+ * a request is found with a single bit scan.
+ */
+static BuddyLinks* free_lists[MAX_ORDER + 1];
+static uint32_t free_map;
+
+/**
+ * Statistics for printblockinfo(): the bytes of the live blocks, and the
+ * most of them there were at once.
+ */
+static long block_bytes, peak_block_bytes;
+
+
+#define BLOCK_INFO(block) block_info[((block) - mem) >> MIN_ORDER]
+
+void buddyInsert(unsigned char* block, int order);
+void buddyRemove(unsigned char* block, int order);
+
+
+/*!
+ * This function initializes both the allocator state, and the memory pool.
+ * It must be called before myalloc() or myfree() will work at all.
+ *
+ * A pool that isn't a power of two in size is covered by the largest blocks
+ * that fit, from the largest down, which leaves each block at an offset
+ * that is a multiple of its size.  Any bytes at the end that are too few
+ * for a block are left out.
+ */
+void init_myalloc() {
+    int order, offset;
+
+    pool_size = MEMORY_LIMIT > MEMORY_SIZE ? MEMORY_LIMIT : MEMORY_SIZE;
+    mem = mmap(NULL, pool_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr,
+            "init_myalloc: could not get %d bytes from the system\n",
+            pool_size);
+        abort();
+    }
+
+    info_size = pool_size / UNIT_SIZE + 1;
+    block_info = mmap(NULL, info_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block_info == MAP_FAILED) {
+        fprintf(stderr,
+            "init_myalloc: could not get %d bytes from the system\n",
+            info_size);
+        abort();
+    }
+
+    for (order = 0; order <= MAX_ORDER; order++) {
+        free_lists[order] = NULL;
+    }
+    free_map = 0;
+    block_bytes = peak_block_bytes = 0;
+
+    offset = 0;
+    for (order = MAX_ORDER - 1; order >= MIN_ORDER; order--) {
+        if (pool_size - offset >= 1 << order) {
+            buddyInsert(mem + offset, order);
+            offset += 1 << order;
+        }
+    }
+}
+
+
+/**
+ * Puts a block on the free list for its order, and marks it free.
+ * @param block [the block]
+ * @param order [the block's order; the block is 2^order bytes]
+ */
+void buddyInsert(unsigned char* block, int order) {
+    BuddyLinks* links = (BuddyLinks*) block;
+
+    BLOCK_INFO(block) = order | BUDDY_FREE;
+    links->prev_free = NULL;
+    links->next_free = free_lists[order];
+    if (free_lists[order] != NULL) {
+        free_lists[order]->prev_free = links;
+    }
+    free_lists[order] = links;
+    free_map |= (uint32_t) 1 << order;
+}
+
+/**
+ * Takes a free block off the free list for its order, and marks it
+ * allocated.
+ * @param block [the block]
+ * @param order [the block's order]
+ */
+void buddyRemove(unsigned char* block, int order) {
+    BuddyLinks* links = (BuddyLinks*) block;
+
+    if (links->prev_free != NULL) {
+        links->prev_free->next_free = links->next_free;
+    } else {
+        free_lists[order] = links->next_free;
+        if (free_lists[order] == NULL) {
+            free_map &= ~((uint32_t) 1 << order);
+        }
+    }
+    if (links->next_free != NULL) {
+        links->next_free->prev_free = links->prev_free;
+    }
+    BLOCK_INFO(block) = order;
+}
+
+
+/*!
+ * Attempt to allocate a chunk of memory of "size" bytes.  Return 0 if
+ * allocation fails.
+ *
+ * The request is rounded up to the next power of two.  The smallest free
+ * block at least that large is taken, and split in half as many times as
+ * it takes to get down to that size, with every half that isn't needed
+ * going back on the free list for its order.
+ * @param  size [the number of bytes we want to allocate]
+ * @return      [a pointer to the allocated memory if success,
+ * otherwise, returns 0, aka null pointer]
+ *
+ * Time complexity: O(log n), one step for each order the block is split.
+ */
+unsigned char *myalloc(int size) {
+    unsigned char* block;
+    int order, found;
+    uint32_t orders;
+
+    if (size < 0 || size > pool_size) {
+        return (unsigned char*) 0;
+    }
+
+    order = MIN_ORDER;
+    while ((1L << order) < size) {
+        order++;
+    }
+
+    orders = free_map & (~(uint32_t) 0 << order);
+    if (orders == 0) {
+        return (unsigned char*) 0;
+    }
+    found = __builtin_ctz(orders);
+
+    block = (unsigned char*) free_lists[found];
+    buddyRemove(block, found);
+    while (found > order) {
+        found--;
+        buddyInsert(block + (1 << found), found);
+    }
+    BLOCK_INFO(block) = order;
+
+    block_bytes += 1L << order;
+    if (block_bytes > peak_block_bytes) {
+        peak_block_bytes = block_bytes;
+    }
+
+    return block;
+}
+
+
+/*!
+ * Free a previously allocated pointer.  oldptr should be an address returned
+ * by myalloc().
+ *
+ * The block is merged with its buddy for as long as the buddy is free and
+ * whole, that is, not split into smaller blocks; a split buddy has a
+ * smaller order in block_info.  Blocks that cover the end of the pool have
+ * no buddy and are never merged.
+ *
+ * Time complexity: O(log n), one step for each order the block is merged.
+ */
+void myfree(unsigned char *oldptr) {
+    long offset, buddy_offset;
+    int order;
+
+    if (!(oldptr >= mem && oldptr < mem + pool_size)) {
+        fprintf(stderr,
+            "attempting to free outside of memory pool");
+        abort();
+    }
+    offset = oldptr - mem;
+    order = (offset % UNIT_SIZE == 0) ? BLOCK_INFO(oldptr) & ORDER_MASK : 0;
+    if (order < MIN_ORDER || order > MAX_ORDER ||
+        offset % (1L << order) != 0) {
+        fprintf(stderr,
+            "attempting to free a pointer that myalloc didn't return");
+        abort();
+    }
+    if (BLOCK_INFO(oldptr) & BUDDY_FREE) {
+        fprintf(stderr,
+            "block already freed");
+        abort();
+    }
+
+    block_bytes -= 1L << order;
+
+    while (order < MAX_ORDER) {
+        buddy_offset = offset ^ (1L << order);
+        if (buddy_offset + (1L << order) > pool_size ||
+            BLOCK_INFO(mem + buddy_offset) != (order | BUDDY_FREE)) {
+            break;
+        }
+        buddyRemove(mem + buddy_offset, order);
+        if (buddy_offset < offset) {
+            offset = buddy_offset;
+        }
+        /* the upper half no longer starts a block */
+        BLOCK_INFO(mem + (offset | (1L << order))) = 0;
+        order++;
+    }
+
+    buddyInsert(mem + offset, order);
+}
+
+
+/**
+ * This is a debugging function, which prints the number of free blocks of
+ * each order, and the bytes of the live blocks, now and at their peak.
+ */
+void printblockinfo() {
+    BuddyLinks* links;
+    int order, count;
+
+    printf("%s\n", "BLOCKS=============================");
+    printf("total number of bytes %d, %d in block_info\n", pool_size,
+        info_size);
+    for (order = MIN_ORDER; order <= MAX_ORDER; order++) {
+        count = 0;
+        for (links = free_lists[order]; links != NULL;
+             links = links->next_free) {
+            count++;
+        }
+        if (count > 0) {
+            printf("free blocks of %ld bytes: %d\n", 1L << order, count);
+        }
+    }
+    printf("allocated memory %ld, peak allocated memory %ld\n", block_bytes,
+        peak_block_bytes);
+    printf("%s\n", "END_BLOCKS=========================");
+}
+
+
+/*!
+ * Clean up the allocator state.
+ * All this really has to do is unmap the memory pool.  This function mostly
+ * ensures that the test program doesn't leak memory, so it's easy to check
+ * if the allocator does.
+ */
+void close_myalloc() {
+    munmap(mem, pool_size);
+    munmap(block_info, info_size);
+}
@@ -0,0 +1,282 @@
+/*! \file
+ * This is a multithreaded tester for the memory allocator.  Each thread
+ * runs a random mix of allocations and frees, and also hands blocks to
+ * other threads through a shared exchange, so that blocks are freed by
+ * threads other than the ones that allocated them.  The data in every
+ * block is checked before it is freed.
+ *
+ * The test is run with 1, 2, 4, ... threads up to the maximum, and the
+ * throughput of each run is reported, to see how well the allocator
+ * scales with the number of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "myalloc.h"
+
+#define DEFAULT_OPERATIONS 1000000
+#define DEFAULT_MAX_BLOCK 256
+#define DEFAULT_RANDOM_SEED 1
+
+// The number of blocks each thread keeps live, and the number of slots in
+// the exchange that all the threads share.
+#define THREAD_SLOTS 1024
+#define EXCHANGE_SLOTS 256
+
+// One in this many operations goes through the exchange.
+#define EXCHANGE_RATE 8
+
+#define MAX_THREADS 64
+
+
+int num_operations = DEFAULT_OPERATIONS;
+int max_block_size = DEFAULT_MAX_BLOCK;
+unsigned int seed = DEFAULT_RANDOM_SEED;
+
+unsigned char *exchange[EXCHANGE_SLOTS];
+
+// Set if any thread finds a corrupted block or fails to allocate.
+int failure = 0;
+
+
+typedef struct {
+  int index;
+  pthread_t thread;
+  unsigned char *slots[THREAD_SLOTS];
+} THREAD_STATE;
+
+
+double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// allocate a block of a random size, and fill it with data derived from
+//  its size, so that whichever thread frees it can check it
+unsigned char *allocate_and_fill(unsigned int *rand_state) {
+  int size = 4 + rand_r(rand_state) % max_block_size;
+  unsigned char *block = myalloc(size);
+
+  if (block == NULL) {
+    __atomic_store_n(&failure, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  memcpy(block, &size, sizeof(int));
+  memset(block + sizeof(int), size & 0xff, size - sizeof(int));
+  return block;
+}
+
+// check the data in a block, then free it
+void check_and_free(unsigned char *block) {
+  int size, i;
+
+  memcpy(&size, block, sizeof(int));
+  if (size < 4 || size >= 4 + max_block_size) {
+    __atomic_store_n(&failure, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  for (i = sizeof(int); i < size; i++) {
+    if (block[i] != (size & 0xff)) {
+      __atomic_store_n(&failure, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  myfree(block);
+}
+
+
+// The work each thread does.  Most operations allocate into or free from
+//  one of the thread's own slots, and the rest swap a new block into the
+//  exchange and free whatever block was there, which usually came from
+//  another thread.
+void *run_thread(void *arg) {
+  THREAD_STATE *state = (THREAD_STATE *) arg;
+  unsigned int rand_state = seed + state->index;
+  unsigned char *block;
+  int i, slot;
+
+  for (i = 0; i < num_operations; i++) {
+    if (rand_r(&rand_state) % EXCHANGE_RATE == 0) {
+      block = allocate_and_fill(&rand_state);
+      if (block == NULL)
+        break;
+
+      slot = rand_r(&rand_state) % EXCHANGE_SLOTS;
+      block = __atomic_exchange_n(&exchange[slot], block, __ATOMIC_ACQ_REL);
+      if (block != NULL)
+        check_and_free(block);
+    }
+    else {
+      slot = rand_r(&rand_state) % THREAD_SLOTS;
+      if (state->slots[slot] != NULL) {
+        check_and_free(state->slots[slot]);
+        state->slots[slot] = NULL;
+      }
+      else {
+        state->slots[slot] = allocate_and_fill(&rand_state);
+        if (state->slots[slot] == NULL)
+          break;
+      }
+    }
+  }
+
+  // free what is left; whatever ends up in the thread's cache is given
+  //  back to the arena when the thread exits
+  for (slot = 0; slot < THREAD_SLOTS; slot++) {
+    if (state->slots[slot] != NULL)
+      check_and_free(state->slots[slot]);
+  }
+
+  return NULL;
+}
+
+
+// Runs the test with the specified number of threads, and returns the
+//  number of operations per second.
+double run_test(int num_threads) {
+  THREAD_STATE *states;
+  double start, seconds;
+  int i;
+
+  MEMORY_SIZE = 1 << 20;
+  MEMORY_LIMIT = 1 << 30;
+  init_myalloc();
+  memset(exchange, 0, sizeof(exchange));
+
+  states = calloc(num_threads, sizeof(THREAD_STATE));
+  if (states == NULL) {
+    fprintf(stderr, "real memory system out of memory.\n");
+    abort();
+  }
+
+  start = get_time();
+  for (i = 0; i < num_threads; i++) {
+    states[i].index = i;
+    if (pthread_create(&states[i].thread, NULL, run_thread, &states[i])) {
+      fprintf(stderr, "couldn't start thread %d.\n", i);
+      abort();
+    }
+  }
+  for (i = 0; i < num_threads; i++)
+    pthread_join(states[i].thread, NULL);
+  seconds = get_time() - start;
+
+  for (i = 0; i < EXCHANGE_SLOTS; i++) {
+    if (exchange[i] != NULL)
+      check_and_free(exchange[i]);
+  }
+
+  free(states);
+  close_myalloc();
+
+  return (double) num_threads * num_operations / seconds;
+}
+
+
+void usage(char *program) {
+  printf("usage: %s [-s seed] [-t max_threads] [-n operations] "
+         "[-b max_block] [-a arenas]\n", program);
+  printf("\tRuns the multithreaded myalloc tester.\n\n");
+  printf("\t-s seed sets the tester to use a specific random seed\n\n");
+  printf("\t-t max_threads sets the largest number of threads to run\n");
+  printf("\t(default the number of processors)\n\n");
+  printf("\t-n operations sets the number of operations each thread\n");
+  printf("\truns (default %d)\n\n", DEFAULT_OPERATIONS);
+  printf("\t-b max_block sets the largest block to allocate (default %d)\n\n",
+         DEFAULT_MAX_BLOCK);
+  printf("\t-a arenas sets the number of arenas (default one per "
+         "processor)\n\n");
+}
+
+
+int main(int argc, char *argv[]) {
+  int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  double ops, base_ops = 0;
+  int threads, c;
+
+  while ((c = getopt(argc, argv, "s:t:n:b:a:h")) != -1) {
+    switch (c) {
+      case 's':
+        seed = atoi(optarg);
+        break;
+
+      case 't':
+        max_threads = atoi(optarg);
+        if (max_threads < 1 || max_threads > MAX_THREADS) {
+          printf("ERROR:  Max threads must be from 1 to %d.\n", MAX_THREADS);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'n':
+        num_operations = atoi(optarg);
+        if (num_operations < 1) {
+          printf("ERROR:  Operations must be positive.\n");
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'b':
+        max_block_size = atoi(optarg);
+        if (max_block_size < 1) {
+          printf("ERROR:  Max block size must be positive.\n");
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'a':
+        MEMORY_ARENAS = atoi(optarg);
+        if (MEMORY_ARENAS < 1 || MEMORY_ARENAS > MAX_ARENAS) {
+          printf("ERROR:  Arenas must be from 1 to %d.\n", MAX_ARENAS);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (max_threads < 1)
+    max_threads = 1;
+
+  printf("Running %d operations per thread, with blocks of up to %d "
+         "bytes.\n", num_operations, max_block_size);
+
+  for (threads = 1; ; threads *= 2) {
+    if (threads > max_threads)
+      threads = max_threads;
+
+    ops = run_test(threads);
+    if (failure) {
+      printf("Multithreaded test FAILED with %d threads.\n", threads);
+      return 1;
+    }
+
+    if (base_ops == 0)
+      base_ops = ops;
+    printf("%3d threads: %12.0f ops/sec (%.2fx)\n", threads, ops,
+           ops / base_ops);
+
+    if (threads == max_threads)
+      break;
+  }
+
+  printf("Passed multithreaded test.\n");
+  return 0;
+}
@@ -10,6 +10,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "myalloc.h"
 
@@ -20,21 +25,140 @@
 
 
 /*!
- * These variables are used to specify the size and address of the 
- * memory pool that the simple allocator works against. 
+ * These variables are used to specify the size, the growth limit and the
+ * number of arenas of the memory pool that the simple allocator works
+ * against. 
  * The memory pool is allocated within init_myalloc(),
  * and then myalloc() and free() work against this pool of
- * memory that mem points to.
+ * memory, which is the chunks of the arenas.
  */
 int MEMORY_SIZE;
-/* variable constants used to signal whether a block is free or not*/
-int FREE = 0;
-int USED = 1;
-unsigned char *mem;
+int MEMORY_LIMIT = 0;
+int MEMORY_ARENAS = 0;
 /* The Header size will be initialized in the initialize function.  */
 static int HEADER_SIZE;
-/* We have a block counter for sanity check reasons.  */
-static int block_counter = 0;
+/* Every free block has a footer at its end, see myalloc.h.  */
+#define FOOTER_SIZE ((int) sizeof(Footer))
+
+/**
+ * Free blocks are kept in segregated free lists, one per size class (see
+ * getSizeClass()).  Each power of two is split into SUB_CLASSES classes,
+ * which is enough classes for any int size.  free_map has a bit set for
+ * every class whose list is nonempty, so the next nonempty class can be
+ * found with a couple of bit scans instead of walking empty lists.
+ */
+#define SUB_CLASS_BITS 2
+#define SUB_CLASSES (1 << SUB_CLASS_BITS)
+#define NUM_CLASSES (32 * SUB_CLASSES)
+#define MAP_WORDS (NUM_CLASSES / 64)
+
+/**
+ * Everything an arena owns is only touched with its lock held, except
+ * remote_frees, a stack of blocks that other threads have freed, which
+ * is pushed onto with atomic operations and drained by the arena.
+ *
+ * The first chunk of arena 0, of MEMORY_SIZE bytes, is never unmapped;
+ * the other arenas start out with no chunks at all.  One other chunk of
+ * an arena may be kept around empty, as spare_chunk, so that an arena
+ * whose usage goes back and forth across the end of a chunk doesn't map
+ * and unmap a chunk every time.
+ *
+ * chunks is an array of the arena's chunks sorted by address, so that
+ * findChunk() is a binary search.  It is mapped on its own, apart from the
+ * pool, and doubled in size whenever it fills up.
+ */
+struct Arena{
+    pthread_mutex_t lock;
+    int id;
+    Header* free_lists[NUM_CLASSES];
+    uint64_t free_map[MAP_WORDS];
+    Chunk** chunks;
+    int num_chunks;
+    int max_chunks;
+    Chunk* first_chunk;
+    Chunk* spare_chunk;
+    /* We have a block counter for sanity check reasons.  */
+    int block_counter;
+    Header* remote_frees;
+};
+
+static Arena arenas[MAX_ARENAS];
+static int num_arenas = 0;
+
+/**
+ * pool_total is the number of bytes in the blocks of all the chunks of
+ * all the arenas, which is kept under MEMORY_LIMIT with atomic
+ * operations since the arenas grow independently.
+ */
+static long pool_total = 0;
+static long page_size;
+
+/**
+ * When the pool grows, each new chunk's mapping is at least this many
+ * bytes.  Besides its blocks, a chunk's mapping holds ALIGNMENT bytes of
+ * alignment padding and epilogue, and the Chunk itself.
+ */
+#define GROW_MAP_SIZE (64 * 1024)
+#define CHUNK_OVERHEAD (ALIGNMENT + (int) sizeof(Chunk))
+
+/**
+ * When the pool can grow, each thread keeps a cache of small freed blocks
+ * of its own arena, one stack per block size up to CACHE_BINS sizes, of
+ * at most CACHE_BLOCKS blocks each.  The blocks stay allocated in the
+ * arena, so most small allocations and frees need no lock at all.
+ *
+ * A thread's cache belongs to one generation of the allocator; when
+ * init_myalloc() starts a new one, the old cache is dropped, since its
+ * blocks went away with the old chunks.  A thread's cache is given back
+ * to its arena when the thread exits.
+ */
+#define CACHE_BINS 16
+#define CACHE_BLOCKS 32
+
+typedef struct ThreadCache{
+    Arena* arena;
+    int generation;
+    Header* bins[CACHE_BINS];
+    int counts[CACHE_BINS];
+}ThreadCache;
+
+static __thread ThreadCache thread_cache;
+static int generation = 0;
+static int cache_enabled = 0;
+static int next_arena = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * A free list isn't sorted, so findFreeBlock() only looks at this many
+ * blocks of a list for the best fit, which keeps it constant time.
+ */
+#define FIT_SCAN_LIMIT 8
+
+/**
+ * The header word of a block.  An allocated block's flags may be changed
+ * by another thread at any time, so the word is always read atomically,
+ * which costs nothing more than a plain read.
+ */
+#define HEADER_WORD(h) __atomic_load_n(&(h)->size, __ATOMIC_RELAXED)
+#define HAS_FLAG(h, f) (HEADER_WORD(h) & (f))
+
+/* The size of a block without its flags, and the links in a free block. */
+#define BLOCK_SIZE(h) ((int) (HEADER_WORD(h) & SIZE_MASK))
+#define LINKS(h) ((FreeLinks *) ((unsigned char *) (h) + HEADER_SIZE))
+
+/* The number of the arena a block belongs to. */
+#define ARENA_OF(h) ((int) (HEADER_WORD(h) >> ARENA_SHIFT))
+#define ARENA_MASK (~SIZE_MASK & ~FLAG_MASK)
+
+/* Flags that other threads may change at the same time, see myalloc.h. */
+#define SET_FLAG(h, f) __atomic_fetch_or(&(h)->size, (f), __ATOMIC_RELAXED)
+#define CLEAR_FLAG(h, f) \
+    __atomic_fetch_and(&(h)->size, ~(uint32_t) (f), __ATOMIC_RELAXED)
+
+static ThreadCache* getThreadCache();
+static void flushThreadCache(void* cache);
+static void initCacheKey();
 
 
 /*!
@@ -42,48 +166,289 @@ static int block_counter = 0;
  * It* must be called before myalloc() or myfree() 
  * will work at all.
  *
- * Note that we allocate the entire memory pool using malloc().  
- * This is so we can create different memory-pool sizes 
- * for testing.  Obviously, in a real allocator, this
- * memory pool would either be a fixed memory region, or the
- * allocator would request a memory region from the operating system
- * (see the C standard function sbrk(), for example).
+ * The memory pool is mapped from the operating system with mmap(), as
+ * the first chunk of arena 0.  If MEMORY_LIMIT is set, the pool is split
+ * into MEMORY_ARENAS arenas that threads are spread over, myalloc() adds
+ * more chunks to an arena as they are needed, up to MEMORY_LIMIT bytes in
+ * all, and myfree() gives chunks back as they become empty.
  *
  * This function is a constant time allocation as it initializes
- * one block of size MEMORY_SIZE with a header.
+ * one block covering the memory pool with a header.
  */
 void init_myalloc() {
+    int i;
+    long cpus;
+
+    HEADER_SIZE = sizeof(Header);
+    page_size = sysconf(_SC_PAGESIZE);
+    pool_total = 0;
+
+    /* a pool that can't grow has a single arena, without thread caches,
+     * so that every byte of MEMORY_SIZE can be handed out */
+    num_arenas = 1;
+    cache_enabled = MEMORY_LIMIT > 0;
+    if (cache_enabled) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_arenas = MEMORY_ARENAS > 0 ? MEMORY_ARENAS : (int) cpus;
+        if (num_arenas < 1) {
+            num_arenas = 1;
+        } else if (num_arenas > MAX_ARENAS) {
+            num_arenas = MAX_ARENAS;
+        }
+    }
+    generation++;
+    next_arena = 0;
+    pthread_once(&cache_key_once, initCacheKey);
+
+    for (i = 0; i < num_arenas; i++) {
+        memset(&arenas[i], 0, sizeof(Arena));
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        arenas[i].id = i;
+    }
 
     /*
-     * Allocate the entire memory pool, from which our simple 
+     * Map the entire memory pool, from which our simple 
      * allocator will serve allocation requests.
      */
-    mem = (unsigned char *) malloc(MEMORY_SIZE);
-    Header* head;
-    HEADER_SIZE = sizeof(Header);
-    Header start;
-    if (mem == 0) {
+    arenas[0].first_chunk = addChunk(&arenas[0], MEMORY_SIZE);
+    if (arenas[0].first_chunk == NULL) {
         fprintf(stderr, 
             "init_myalloc: could not get %d bytes from the system\n", 
             MEMORY_SIZE);
         abort();
     }
+    pool_total = arenas[0].first_chunk->pool_size;
+}
+
+/**
+ * This maps a chunk for an arena and initializes it as one big free block
+ * with a header, followed by the epilogue.  The caller accounts for the
+ * chunk in pool_total.
+ * The first block has nothing before it to coalesce with, so it is marked
+ * as if the block before it is in use.
+ * @param  arena     [the arena that gets the chunk]
+ * @param  pool_size [the number of bytes for the chunk's blocks]
+ * @return           [the new chunk, or NULL if it couldn't be mapped]
+ */
+Chunk* addChunk(Arena* arena, int pool_size) {
+    unsigned char* base;
+    Chunk* chunk;
+    Header* head, *epilogue;
+    int map_size, index;
+
+    if (pool_size > MAX_BLOCK_SIZE) {
+        pool_size = MAX_BLOCK_SIZE;
+    }
+    pool_size &= ~FLAG_MASK;
+    if (pool_size < MIN_BLOCK_SIZE) {
+        pool_size = 0;
+    }
+    map_size = pool_size + CHUNK_OVERHEAD;
+    if (arena->num_chunks == arena->max_chunks && !growChunkIndex(arena)) {
+        return NULL;
+    }
+    base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    chunk = (Chunk*)(base + ALIGNMENT + pool_size);
+    chunk->heap_start = base + ALIGNMENT - HEADER_SIZE;
+    chunk->pool_size = pool_size;
+    chunk->map_size = map_size;
+
+    /* keep the array sorted, so the new chunk goes before any chunk that
+     * was mapped at a higher address */
+    index = chunkIndex(arena, chunk->heap_start);
+    memmove(&arena->chunks[index + 1], &arena->chunks[index],
+        (arena->num_chunks - index) * sizeof(Chunk*));
+    arena->chunks[index] = chunk;
+    arena->num_chunks++;
+
+    epilogue = (Header*)(chunk->heap_start + pool_size);
+    epilogue->size = IN_USE;
+
+    /* the whole chunk starts out as one free block */
+    if (pool_size > 0) {
+        head = (Header *)chunk->heap_start;
+        head->size = (uint32_t) pool_size | PREV_IN_USE |
+            (uint32_t) arena->id << ARENA_SHIFT;
+        setFooter(head);
+        insertIntoFreeList(arena, head);
+        arena->block_counter++;
+    }
+    return chunk;
+}
+
+/**
+ * This takes a chunk out of its arena's array of chunks and unmaps it.
+ * @param arena [the arena that has the chunk]
+ * @param chunk [the chunk, whose blocks must not be on the free lists]
+ */
+void releaseChunk(Arena* arena, Chunk* chunk) {
+    int index = chunkIndex(arena, chunk->heap_start);
+
+    memmove(&arena->chunks[index], &arena->chunks[index + 1],
+        (arena->num_chunks - index - 1) * sizeof(Chunk*));
+    arena->num_chunks--;
+    __atomic_fetch_sub(&pool_total, chunk->pool_size, __ATOMIC_RELAXED);
+    munmap(chunk->heap_start - (ALIGNMENT - HEADER_SIZE), chunk->map_size);
+}
+
+/**
+ * This counts the arena's chunks whose blocks start before a pointer, with
+ * a binary search of the sorted array of chunks.
+ * @param  arena [the arena]
+ * @param  ptr   [the pointer]
+ * @return       [the number of chunks that start before ptr]
+ */
+int chunkIndex(Arena* arena, unsigned char* ptr) {
+    int low = 0, high = arena->num_chunks, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (arena->chunks[mid]->heap_start < ptr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * This finds the arena's chunk whose blocks contain a pointer, which can
+ * only be the last chunk that starts before it.
+ * @param  arena [the arena]
+ * @param  ptr   [the pointer]
+ * @return       [the chunk, or NULL if no chunk contains the pointer]
+ */
+Chunk* findChunk(Arena* arena, unsigned char* ptr) {
+    int index = chunkIndex(arena, ptr) - 1;
+    Chunk* chunk;
+
+    if (index < 0) {
+        return NULL;
+    }
+    chunk = arena->chunks[index];
+    if (ptr < chunk->heap_start + chunk->pool_size) {
+        return chunk;
+    }
+    return NULL;
+}
+
+/**
+ * This doubles the room in an arena's array of chunks, by mapping a new
+ * array and copying the chunks over.  The first array holds a page of
+ * chunks.
+ * @param  arena [the arena whose array is full]
+ * @return       [1 if the array grew, 0 if it couldn't be mapped]
+ */
+int growChunkIndex(Arena* arena) {
+    Chunk** chunks;
+    int max_chunks;
+
+    max_chunks = arena->max_chunks > 0 ? 2 * arena->max_chunks :
+        (int) (page_size / sizeof(Chunk*));
+    chunks = mmap(NULL, max_chunks * sizeof(Chunk*), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunks == MAP_FAILED) {
+        return 0;
+    }
+    if (arena->chunks != NULL) {
+        memcpy(chunks, arena->chunks, arena->num_chunks * sizeof(Chunk*));
+        munmap(arena->chunks, arena->max_chunks * sizeof(Chunk*));
+    }
+    arena->chunks = chunks;
+    arena->max_chunks = max_chunks;
+    return 1;
+}
+
+/**
+ * This finds the chunk that an epilogue ends, which is placed right after
+ * the epilogue by addChunk().
+ * @param  epilogue [the epilogue of a chunk]
+ * @return          [the chunk]
+ */
+Chunk* getEpilogueChunk(Header* epilogue) {
+    return (Chunk*)((unsigned char*)epilogue + HEADER_SIZE);
+}
+
+/**
+ * This checks whether all of a chunk is one free block.
+ * @param  chunk [the chunk]
+ * @return       [nonzero if the chunk is empty]
+ */
+int isChunkEmpty(Chunk* chunk) {
+    Header* head = (Header*)chunk->heap_start;
+
+    return chunk->pool_size > 0 && !HAS_FLAG(head, IN_USE) &&
+        BLOCK_SIZE(head) == chunk->pool_size;
+}
+
+/**
+ * This grows an arena by a chunk with room for a block of size bytes.
+ * Chunks are mapped in multiples of GROW_MAP_SIZE, and the last chunk may
+ * be smaller so the pool doesn't grow past MEMORY_LIMIT.  The chunk's
+ * bytes are reserved in pool_total before it is mapped, so arenas growing
+ * at the same time can't go past the limit together.
+ * @param  arena [the arena to grow]
+ * @param  size  [the block size that didn't fit, header included]
+ * @return      [the new chunk's free block, or NULL if the pool can't
+ * grow]
+ */
+Header* growHeap(Arena* arena, int size) {
+    long pool_size, wanted, total;
+    Chunk* chunk;
+
+    if (MEMORY_LIMIT <= 0) {
+        return NULL;
+    }
+
+    wanted = GROW_MAP_SIZE - CHUNK_OVERHEAD;
+    if (wanted < size) {
+        wanted = (size + CHUNK_OVERHEAD + page_size - 1) /
+            page_size * page_size - CHUNK_OVERHEAD;
+        if (wanted > MAX_BLOCK_SIZE) {
+            wanted = MAX_BLOCK_SIZE;
+        }
+    }
+    total = __atomic_load_n(&pool_total, __ATOMIC_RELAXED);
+    do {
+        pool_size = wanted;
+        if (pool_size > MEMORY_LIMIT - total) {
+            pool_size = (MEMORY_LIMIT - total) & ~FLAG_MASK;
+        }
+        if (pool_size < size) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&pool_total, &total,
+        total + pool_size, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    chunk = addChunk(arena, (int) pool_size);
+    if (chunk == NULL) {
+        __atomic_fetch_sub(&pool_total, pool_size, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return (Header*)chunk->heap_start;
+}
+
 /**
- * Here, we initialize the entire memory pool as one big block with 
- * a header.
- * This is done in constant time and allows use to subsequently 
- * create new blocks with an anchor header. This header 
- * can be freed, but it should always exist.
+ * This gives back the pages of a large free block to the operating
+ * system, which hands out zeroed pages if the block is used again.  The
+ * header and links at the start and the footer at the end are kept.
+ * @param block [a free block, which may or may not be on a free list]
  */
+void releasePages(Header* block) {
+    uintptr_t start = (uintptr_t)block + HEADER_SIZE + sizeof(FreeLinks);
+    uintptr_t end = (uintptr_t)block + BLOCK_SIZE(block) - FOOTER_SIZE;
 
-    head = (Header *)mem;
-    *head = start;
-    head->size = MEMORY_SIZE - HEADER_SIZE;
-    head->next_free = NULL;
-    head->prev_free = NULL;
-    head->prev_block = NULL;
-    head->inUse = 0;
-    block_counter++;
+    start = (start + page_size - 1) & ~(uintptr_t)(page_size - 1);
+    end &= ~(uintptr_t)(page_size - 1);
+    if (start < end) {
+        madvise((void*)start, end - start, MADV_DONTNEED);
+    }
 }
 
 /**
@@ -97,20 +462,37 @@ void printblockinfo() {
     int accumulativeHeader_memory = 0;
     int allocated_bytes = 0;
     int accounted_memory = 0;
-    printf("number of blocks%d\n", block_counter);
-    printf("total number of bytes%d\n", MEMORY_SIZE);
-    Header* start = (Header*)mem;
-    while (start != NULL) {
-        printf("size of header %ld\n", sizeof(Header));
-        printf("size of block %d\n", (int)start->size);
-        if (start->inUse == USED) {
-            allocated_bytes += (int)start->size;
+    int chunk_count = 0;
+    int block_count = 0;
+    int i, j;
+    Chunk* chunk;
+    Header* start;
+    for (i = 0; i < num_arenas; i++) {
+        block_count += arenas[i].block_counter;
+    }
+    printf("number of blocks%d\n", block_count);
+    printf("total number of bytes%ld\n", pool_total);
+    for (i = 0; i < num_arenas; i++) {
+        for (j = 0; j < arenas[i].num_chunks; j++) {
+            chunk = arenas[i].chunks[j];
+            chunk_count++;
+            start = chunk->pool_size > 0 ? (Header*)chunk->heap_start : NULL;
+            while (start != NULL) {
+                printf("size of header %ld\n", sizeof(Header));
+                printf("size of block %d\n",
+                    BLOCK_SIZE(start) - HEADER_SIZE);
+                if (HAS_FLAG(start, IN_USE)) {
+                    allocated_bytes += BLOCK_SIZE(start) - HEADER_SIZE;
+                }
+                printf("inUse: %d\n", (int)HAS_FLAG(start, IN_USE));
+                accumulativeHeader_memory += sizeof(Header);
+                accounted_memory += BLOCK_SIZE(start);
+                start = getNextBlock(start);
+            }
         }
-        printf("inUse: %d\n", (int)start->inUse);
-        accumulativeHeader_memory += sizeof(Header);
-        accounted_memory += ((int)start->size + sizeof(Header));
-        start = getNextBlock(start);
     }
+    printf("number of arenas %d\n", num_arenas);
+    printf("number of chunks %d\n", chunk_count);
     printf("accumulated memory overhead %d\n", 
         accumulativeHeader_memory + allocated_bytes );
     printf("allocated memory %d\n", allocated_bytes );
@@ -121,156 +503,272 @@ void printblockinfo() {
  * Attempt to allocate a chunk of memory of "size" bytes.  Return 0 if
  * allocation fails.
  *
- * This function uses a best fit strategy to find the smallest block that 
- * will * fullfill the allocation request. This block splits whenever
+ * This function uses a good fit strategy to find a small block that 
+ * will fullfill the allocation request, using the segregated free lists
+ * (see findFreeBlock()). The request plus the header is rounded up to a
+ * multiple of ALIGNMENT, so the payload returned is always aligned. This
+ * block splits whenever
  * the space allocated for a block has enough blank space left over for
- * another header
- * plus 1 byte or more. When splitting new blocks, this function adjusts
- * pointers in the header to maintain an explicit free list made up of
- * a doubly linked list of free blocks.
+ * another block of at least MIN_BLOCK_SIZE bytes. The left over space is
+ * put back on the free list for its size class.
+ *
+ * Small blocks are taken from the thread's cache when it has one of the
+ * right size, without taking any lock.  Otherwise the block comes from
+ * the thread's arena, with the arena's lock held, after the arena takes
+ * back the blocks other threads have freed.
  * @param  _size [the number of bytes we want to allocate]
  * @return       [a pointer to the allocated memory pool if success, 
  * otherwise, returns 0, aka null pointer]
  *
- * Time complexity: This function uses a best fit strategy by
- * traversing through the free list and finds the smallest block that can
- * still satisfy the allocation request.
+ * Time complexity: constant time, since findFreeBlock() only looks at
+ * a bounded number of free blocks, and splitting a block only touches the
+ * block and its right neighbor.
   */
 unsigned char *myalloc(int _size) {
-    /* define some variables. */
+    ThreadCache* cache;
+    Arena* arena;
+    Header* header;
+    int size, bin;
+
+    if (_size < 0 || _size > MAX_BLOCK_SIZE - HEADER_SIZE) {
+        return (unsigned char*) 0;
+    }
+
+    /* the block must fit the header and payload, and later on the free
+     * links and footer, and keep the next payload aligned */
+    size = (_size + HEADER_SIZE + FLAG_MASK) & ~FLAG_MASK;
+    if (size < MIN_BLOCK_SIZE) {
+        size = MIN_BLOCK_SIZE;
+    }
+
+    cache = getThreadCache();
+    arena = cache->arena;
+    bin = (size - MIN_BLOCK_SIZE) / ALIGNMENT;
+    if (cache_enabled && bin < CACHE_BINS && cache->bins[bin] != NULL) {
+        header = cache->bins[bin];
+        cache->bins[bin] = LINKS(header)->next_free;
+        cache->counts[bin]--;
+        CLEAR_FLAG(header, DEFERRED);
+        return (unsigned char*)header + HEADER_SIZE;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    drainRemoteFrees(arena);
+    header = arenaAlloc(arena, size);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (header == NULL) {
+        return (unsigned char*) 0;
+    }
+    return (unsigned char*)header + HEADER_SIZE;
+}
+
+/**
+ * This allocates a block from an arena, whose lock must be held.  The
+ * block comes from the arena's free lists, or from a new chunk if none of
+ * its free blocks is large enough, and is split if it is larger than it
+ * needs to be.
+ * @param  arena [the arena to allocate from]
+ * @param  size  [the block size, header included, a multiple of
+ * ALIGNMENT and at least MIN_BLOCK_SIZE]
+ * @return       [the allocated block, or NULL if there is no room]
+ */
+Header* arenaAlloc(Arena* arena, int size) {
     Header* header, *current;
-    Header newHeader;
-    unsigned char* returnPtr = (unsigned char*) 0;
-    int smallestGoodSize;
-    header = (Header*) mem;
-    /* finds first block not currently in use */
-    while (header->inUse == USED) {
-          header = getNextBlock(header);
-          /**
-           * we reach the end of the memory pool and haven't found a
-           * free block, meaning we run out of memory. Then we return
-           * a null (0) pointer
-           */         
-          if (header == NULL) {
-              return returnPtr;
-          }
-    }
-
-    /**
-     * state of the program here is the assumption that we found one one
-     * free block, regardless of size, thus we set the size of the 
-     * preliminary block size for allocation consideration to be the first
-     * comparison value, we will then iterate through the free list to find
-     * the most optimal block size, updating this comparison value. */
-    current = header;
-    smallestGoodSize = header->size;
-
-    /* find the smallest block that can still contain payload
-     * out of the current free blocks */
-    while (header != NULL) {
-        /* 
-         * this statement says that we will update the header-block 
-         * in consideration if there is a new block that satisfies the 
-         * allocation with less memory, or if the current block is not 
-         * enough to allocate the size of the memory we want.
-         * */
-        if ((header->size < smallestGoodSize || smallestGoodSize < _size) &&
-        header->size >= _size) {
-            smallestGoodSize = header->size;
-            current = header;
+
+    header = findFreeBlock(arena, size);
+    if (header == NULL) {
+        /* no free block is large enough, so the pool has to grow, and if
+         * it can't, we are out of memory */
+        header = growHeap(arena, size);
+        if (header == NULL) {
+            return NULL;
         }
-        header = getNextFree(header);
     }
 
-    header = current; 
-    /* now both pointers point to optimal block for allocation
-     * if in our optimization we did not find a suitable block
-     * that is too small, then we return zero. */
-    if (smallestGoodSize >= _size) {
-        header->inUse = 1;
-        returnPtr = (unsigned char*)(current+1);
-    } else {
-        /* *  
-         * immediately return NULL pointer
-         * */
-        return returnPtr;
-    }
+    removeFromFreeList(arena, header);
+
     /* conditional split block if current allocated block is larger
      * here, we split if the remaining space in our block can contain
-     * another header with a nonzero data payload size.
-     * we accomplish this by computing the end of the payload and adding a
-     * new header, then adjusting the pointers to keep track of explicit 
-     * free list 
+     * another block of the smallest size.
+     * we accomplish this by computing the end of the block and adding a
+     * new header and footer, then putting the new block on its free list.
+     * otherwise the block after this one must learn it is now in use.
      */
-    if (current->size > _size + HEADER_SIZE) {
-        current = (Header *)((unsigned char *)current + HEADER_SIZE + _size);
-        *current = newHeader;
-        current->size = header->size - HEADER_SIZE - _size;
-        current->inUse = 0;
-        current->prev_block = header;
-        current->next_free = getNextFree(current);
-        current->prev_free = getPrevFree(current);
-        if (getNextBlock(current) != NULL) {
-            getNextBlock(current)->prev_block = current;
+    if (BLOCK_SIZE(header) - size >= MIN_BLOCK_SIZE) {
+        current = (Header *)((unsigned char *)header + size);
+        current->size = (uint32_t) (BLOCK_SIZE(header) - size) |
+            PREV_IN_USE | (HEADER_WORD(header) & ARENA_MASK);
+        setFooter(current);
+        header->size = (uint32_t) size | (HEADER_WORD(header) & ~SIZE_MASK);
+        insertIntoFreeList(arena, current);
+        arena->block_counter++;
+    } else {
+        current = getNextBlock(header);
+        if (current != NULL) {
+            SET_FLAG(current, PREV_IN_USE);
         }
-        header->next_free = NULL;
-        header->size = _size;
-        block_counter++;
     }
+    SET_FLAG(header, IN_USE);
+
+    return header;
+}
+
+/**
+ * This computes the size class of a block size.  Sizes below
+ * SUB_CLASSES get a class each; larger sizes are put into groups by their
+ * highest set bit, and each group is split into SUB_CLASSES classes by the
+ * SUB_CLASS_BITS bits just below the highest bit.  So every class covers a
+ * range of sizes that is at most 1/SUB_CLASSES of its smallest size, and
+ * every size in a class is smaller than every size in the next class.
+ * @param  size [a block size]
+ * @return      [the size class, from 0 up to NUM_CLASSES - 1]
+ */
+int getSizeClass(int size) {
+    int top;
+
+    if (size < SUB_CLASSES) {
+        return size;
+    }
+    top = 31 - __builtin_clz((unsigned int) size);
+    return (top - SUB_CLASS_BITS + 1) * SUB_CLASSES +
+        ((size >> (top - SUB_CLASS_BITS)) & (SUB_CLASSES - 1));
+}
 
-    return returnPtr;
+/**
+ * Adds a free block to the front of the free list for its size class.
+ * @param arena   [the arena that has the block]
+ * @param current [the free block]
+ */
+void insertIntoFreeList(Arena* arena, Header* current) {
+    int c = getSizeClass(BLOCK_SIZE(current));
+
+    LINKS(current)->prev_free = NULL;
+    LINKS(current)->next_free = arena->free_lists[c];
+    if (arena->free_lists[c] != NULL) {
+        LINKS(arena->free_lists[c])->prev_free = current;
+    }
+    arena->free_lists[c] = current;
+    arena->free_map[c / 64] |= (uint64_t) 1 << (c % 64);
 }
 
 /**
- * This is a helper function that finds the next free block
- * by traversing down the all the blocks
- * @param  ptr [takes in the pointer to the current block]
- * @return     [return the pointer to the right adjacent free
- * block, if unavailable, return NULL]
+ * Takes a free block out of the free list for its size class.  The block's
+ * size must not have changed since it was put on the list.
+ * @param arena   [the arena that has the block]
+ * @param current [the free block]
  */
-Header* getNextFree(Header* ptr) {
-    Header* temp = getNextBlock(ptr);
-    while (temp != NULL) {
-        if (temp->inUse == FREE) {
-            return temp;
+void removeFromFreeList(Arena* arena, Header* current) {
+    int c = getSizeClass(BLOCK_SIZE(current));
+    FreeLinks* links = LINKS(current);
+
+    if (links->prev_free != NULL) {
+        LINKS(links->prev_free)->next_free = links->next_free;
+    } else {
+        arena->free_lists[c] = links->next_free;
+        if (arena->free_lists[c] == NULL) {
+            arena->free_map[c / 64] &= ~((uint64_t) 1 << (c % 64));
         }
-        temp = getNextBlock(temp);
     }
-    return NULL;
+    if (links->next_free != NULL) {
+        LINKS(links->next_free)->prev_free = links->prev_free;
+    }
 }
 
 /**
- * This is a helper function that finds the previous free block
- * by traversing up the all the blocks
- * @param  ptr [takes in the pointer to the current block]
- * @return     [return the pointer to the left adjacent free
- * block, if unavailable, return NULL]
+ * Finds a free block with room for size bytes.  The blocks in the size's
+ * own class may or may not be large enough, so the best fit among the
+ * first few of them is taken.  Failing that, every block in any larger
+ * class is large enough, so the smallest of the first few blocks in the
+ * next nonempty class is taken.
+ * @param  arena [the arena to look in]
+ * @param  size [the block size we want to allocate, header included]
+ * @return      [a free block of at least size bytes, or NULL if there is
+ * none]
  */
-Header* getPrevFree(Header* ptr) {
-    Header* temp = ptr->prev_block;
-    while (temp != NULL) {
-        if (temp->inUse == FREE) {
-            return temp;
+Header* findFreeBlock(Arena* arena, int size) {
+    int c = getSizeClass(size);
+    int word, scanned;
+    uint64_t bits;
+    Header* block, *best = NULL;
+
+    for (block = arena->free_lists[c], scanned = 0;
+         block != NULL && scanned < FIT_SCAN_LIMIT;
+         block = LINKS(block)->next_free, scanned++) {
+        if (BLOCK_SIZE(block) >= size &&
+            (best == NULL || BLOCK_SIZE(block) < BLOCK_SIZE(best))) {
+            best = block;
         }
-        temp = temp->prev_block;
     }
-    return NULL;
+    if (best != NULL) {
+        return best;
+    }
+
+    /* find the next nonempty class after c in the map */
+    c++;
+    for (word = c / 64; word < MAP_WORDS; word++) {
+        bits = arena->free_map[word];
+        if (word == c / 64 && c % 64 != 0) {
+            bits &= ~(uint64_t) 0 << (c % 64);
+        }
+        if (bits != 0) {
+            c = word * 64 + __builtin_ctzll(bits);
+            break;
+        }
+    }
+    if (word == MAP_WORDS) {
+        return NULL;
+    }
+
+    for (block = arena->free_lists[c], scanned = 0;
+         block != NULL && scanned < FIT_SCAN_LIMIT;
+         block = LINKS(block)->next_free, scanned++) {
+        if (best == NULL || BLOCK_SIZE(block) < BLOCK_SIZE(best)) {
+            best = block;
+        }
+    }
+    return best;
 }
 
 /**
  * This function computes the next block based on the location 
- * of the current header and the size of the current block's payload.
+ * of the current header and the size of the current block.
  * @param  ptr [a pointer to the current header]
  * @return     [a pointer to the next block adjacent to the right
  * if not available, return NULLptr]
  */
 Header* getNextBlock(Header* ptr) {
-    Header* next = NULL;
-    if ((unsigned char*)ptr + ptr->size + 
-        2 * HEADER_SIZE < mem + MEMORY_SIZE) {
-        next = (Header*)((unsigned char*)ptr + ptr->size + HEADER_SIZE);
+    Header* next = (Header*)((unsigned char*)ptr + BLOCK_SIZE(ptr));
+
+    /* the epilogue at the end of a chunk is the only block of size 0 */
+    if (BLOCK_SIZE(next) != 0) {
+        return next;
     }
-    return next;
+    return NULL;
+}
+
+/**
+ * This function finds the previous block using its footer, which is just
+ * before the current block's header.  The previous block must be free,
+ * which is the case when PREV_IN_USE isn't set in the current block.
+ * @param  ptr [a pointer to the current header]
+ * @return     [a pointer to the block adjacent to the left]
+ */
+Header* getPrevBlock(Header* ptr) {
+    Footer size;
+
+    size = *((Footer*)ptr - 1);
+    return (Header*)((unsigned char*)ptr - size);
+}
+
+/**
+ * This function writes the block's size, without its flags, into the
+ * footer in the last bytes of the block.
+ * @param ptr [a pointer to the current header]
+ */
+void setFooter(Header* ptr) {
+    *(Footer*)((unsigned char*)ptr + BLOCK_SIZE(ptr) - FOOTER_SIZE) =
+        (Footer) BLOCK_SIZE(ptr);
 }
 
 /*!
@@ -278,109 +776,263 @@ Header* getNextBlock(Header* ptr) {
  * by
  * myalloc().
  *
- * This function takes advantage of the doubly linked free block list
- * to first reincorporate the newly freed block into the explicit free list
- * then it adjusts the explicit free list to first coalesce the 
- * block to the right, and then coalesce the block to the left.
- * This should be linear time, as we need to compute the
- * block's place back into the free list
- * but coalescing, which is a subroutine 
- * called from this function, should be constant time.
+ * A small block of the thread's own arena goes into the thread's cache if
+ * there is room, without taking any lock.  A block of another arena is
+ * pushed onto that arena's remote frees, also without a lock, for the
+ * arena to take back the next time its lock is held.  Otherwise the block
+ * is freed into its arena with the arena's lock held (see arenaFree()).
+ * Only the checks below are done on blocks that are cached or freed
+ * remotely, and the rest are done when they reach the arena.
   */
 void myfree(unsigned char *oldptr) {
-    /* first, add current free block into explicit free list, then
-     * we have to coalesce both sides, if possible by first coalescing
-     * right side then moving the pointer to the previous left block and
-     * attempt to coalesce the right block(which was the current center
-     block)
-     */
-    if (!(oldptr >= mem && oldptr < (mem + MEMORY_SIZE))) {
+    ThreadCache* cache;
+    Arena* arena;
+    Header* current;
+    int bin;
+
+    if (oldptr == NULL) {
         fprintf(stderr, 
             "attempting to free outside of memory pool");
         abort();
     }
-    Header* current, *left, *right;
+    if ((uintptr_t) oldptr % ALIGNMENT != 0) {
+        fprintf(stderr, 
+            "attempting to free a pointer that myalloc didn't return");
+        abort();
+    }
     current = (Header*)(oldptr - HEADER_SIZE);
+    if (ARENA_OF(current) >= num_arenas) {
+        fprintf(stderr, 
+            "attempting to free outside of memory pool");
+        abort();
+    }
     
     /* This checks whether the current block we're attempting to free is 
      * already freed, if it is , then we're doing something wrong
      * and we abort */
-    if (current->inUse == FREE) {
+    if (!HAS_FLAG(current, IN_USE) || HAS_FLAG(current, DEFERRED)) {
         fprintf(stderr, 
             "block already freed");
         abort();
     }
-    current->inUse = 0;
-    /* we modify explicit free list */
-    insertIntoExplicitList(current);
+
+    arena = &arenas[ARENA_OF(current)];
+    cache = getThreadCache();
+    if (arena != cache->arena) {
+        pushRemoteFree(arena, current);
+        return;
+    }
+
+    bin = (BLOCK_SIZE(current) - MIN_BLOCK_SIZE) / ALIGNMENT;
+    if (cache_enabled && bin < CACHE_BINS &&
+        cache->counts[bin] < CACHE_BLOCKS) {
+        SET_FLAG(current, DEFERRED);
+        LINKS(current)->next_free = cache->bins[bin];
+        cache->bins[bin] = current;
+        cache->counts[bin]++;
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    drainRemoteFrees(arena);
+    arenaFree(arena, current);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * This frees a block into its arena, whose lock must be held.
+ *
+ * This function coalesces the freed block with the blocks on either side of
+ * it if they are free, first taking them off their free lists, and then puts
+ * the combined block on the free list for its size class, and tells the
+ * block after it that it is free.  If that leaves the block's whole chunk
+ * free, the chunk's memory is given back to the operating system: extra
+ * chunks are unmapped, except for one spare, and the first chunk's pages
+ * are released but stay mapped.
+ * This is constant time apart from checking that the block is in one of
+ * the arena's chunks, which is a binary search, as the neighbors are found
+ * through the block's size and the previous block's footer, the free lists
+ * are doubly linked, and a block that reaches the end of its chunk finds
+ * the chunk right after the epilogue.
+ * @param arena   [the arena the block belongs to]
+ * @param current [the block, which is allocated or deferred]
+ */
+void arenaFree(Arena* arena, Header* current) {
+    Chunk* chunk;
+    Header* left, *right;
+
+    if (findChunk(arena, (unsigned char*)current + HEADER_SIZE) == NULL) {
+        fprintf(stderr, 
+            "attempting to free outside of memory pool");
+        abort();
+    }
+
+    CLEAR_FLAG(current, IN_USE | DEFERRED);
+    setFooter(current);
     right = getNextBlock(current);
-    left = current->prev_block;
 
     /* if we can coalesce right, we do it */
-    if (right != NULL) {
-        if (right->inUse == FREE) {
-            coalesce(current, right);
-        }
+    if (right != NULL && !HAS_FLAG(right, IN_USE)) {
+        removeFromFreeList(arena, right);
+        coalesce(arena, current, right);
     }
     /* if we can coalesce left, we do it */
-    if (left != NULL) {
-        if (left->inUse == FREE) {
-            coalesce(left, current);
+    if (!HAS_FLAG(current, PREV_IN_USE)) {
+        left = getPrevBlock(current);
+        removeFromFreeList(arena, left);
+        coalesce(arena, left, current);
+        current = left;
+    }
+
+    right = getNextBlock(current);
+    if (right != NULL) {
+        CLEAR_FLAG(right, PREV_IN_USE);
+    } else {
+        /* the block ends at the epilogue, with its chunk right after it */
+        chunk = getEpilogueChunk((Header*)((unsigned char*)current +
+            BLOCK_SIZE(current)));
+        if ((unsigned char*)current == chunk->heap_start) {
+            /* the whole chunk is free; unmap it unless it is the first
+             * chunk, or there is no other empty chunk to keep as the
+             * spare */
+            if (chunk != arena->first_chunk && arena->spare_chunk != NULL &&
+                arena->spare_chunk != chunk &&
+                isChunkEmpty(arena->spare_chunk)) {
+                arena->block_counter--;
+                releaseChunk(arena, chunk);
+                return;
+            }
+            if (chunk != arena->first_chunk) {
+                arena->spare_chunk = chunk;
+            }
+            releasePages(current);
         }
     }
+    insertIntoFreeList(arena, current);
+}
+
+/**
+ * This pushes a block onto an arena's stack of remote frees.  Blocks are
+ * only ever taken off the stack all at once, so a compare-and-swap on the
+ * top of the stack is all it takes.
+ * @param arena [the arena the block belongs to]
+ * @param block [the block being freed]
+ */
+void pushRemoteFree(Arena* arena, Header* block) {
+    Header* top;
+
+    SET_FLAG(block, DEFERRED);
+    top = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        LINKS(block)->next_free = top;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &top, block,
+        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * This takes the whole stack of remote frees off an arena and frees its
+ * blocks into the arena, whose lock must be held.
+ * @param arena [the arena]
+ */
+void drainRemoteFrees(Arena* arena) {
+    Header* block, *next;
 
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    block = __atomic_exchange_n(&arena->remote_frees, NULL,
+        __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        next = LINKS(block)->next_free;
+        arenaFree(arena, block);
+        block = next;
+    }
 }
 
 /**
  * coalesces a center block with the right side block
+ * @param arena   the arena that has both blocks
  * @param current the center block
  * @param right   the right side block
  *
- * This function will adjust the pointers of the center and right block
- * to merge the two. It is constant time since two pointers have already 
- * been computed for the two blocks when we freed it.
+ * This function will grow the center block to cover the right block, and
+ * move the center block's footer to the end of the right block. Neither
+ * block may be on a free list, since the center block's size class changes.
  */
-void coalesce(Header* current, Header* right) {
-    current->next_free = right->next_free;
-    if (right->next_free != NULL) {
-        right->next_free->prev_free = current;
-    }
-    if (getNextBlock(right) != NULL) {
-        getNextBlock(right)->prev_block = current;
-    }
-    current->size += right->size + HEADER_SIZE;
-    block_counter--;
+void coalesce(Arena* arena, Header* current, Header* right) {
+    current->size += BLOCK_SIZE(right);
+    setFooter(current);
+    arena->block_counter--;
 }
 
 /**
- * this adjusts the exlplicit free list as we free a block
- * @param current pointer to the current block.
+ * This returns the calling thread's cache, setting it up for the current
+ * generation of the allocator if it isn't yet.  Threads are handed the
+ * arenas in turn.
+ * @return [the thread's cache]
  */
-void insertIntoExplicitList(Header* current) {
-    Header *left, *right;
-    /*here we recompute it as a failsafe, but it should be find if we 
-     *directly access the stored member */
-    left = getPrevFree(current);
-    right = getNextFree(current);
-
+static ThreadCache* getThreadCache() {
+    ThreadCache* cache = &thread_cache;
+    int n;
 
-    if (right != NULL) {
-        right->prev_free = current;
-        current->next_free = right;
+    if (cache->generation != generation) {
+        memset(cache, 0, sizeof(ThreadCache));
+        n = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        cache->arena = &arenas[n % num_arenas];
+        cache->generation = generation;
+        pthread_setspecific(cache_key, cache);
     }
+    return cache;
+}
 
-    if (left != NULL) {
-        left->next_free = current;
-        current->prev_free = left;
+/**
+ * This frees every block in a thread's cache into the thread's arena.  It
+ * is called when a thread exits, so the blocks it cached aren't lost.
+ * @param p [the thread's cache]
+ */
+static void flushThreadCache(void* p) {
+    ThreadCache* cache = p;
+    Header* block;
+    int bin;
+
+    if (cache->generation != generation) {
+        return;
+    }
+    pthread_mutex_lock(&cache->arena->lock);
+    for (bin = 0; bin < CACHE_BINS; bin++) {
+        while (cache->bins[bin] != NULL) {
+            block = cache->bins[bin];
+            cache->bins[bin] = LINKS(block)->next_free;
+            arenaFree(cache->arena, block);
+        }
+        cache->counts[bin] = 0;
     }
+    pthread_mutex_unlock(&cache->arena->lock);
+}
+
+/* Creates the key whose destructor flushes a thread's cache on exit. */
+static void initCacheKey() {
+    pthread_key_create(&cache_key, flushThreadCache);
 }
 
 /*!
  * Clean up the allocator state.
- * All this really has to do is free the user memory pool. This 
+ * All this really has to do is unmap the chunks of the pool. This 
  * function mostly ensures that the test program doesn't leak 
  * memory, so it's easy to check if the allocator does.
  */
 void close_myalloc() {
-    free(mem);
+    int i;
+
+    for (i = 0; i < num_arenas; i++) {
+        /* releasing the last chunk first leaves nothing to move down */
+        while (arenas[i].num_chunks > 0) {
+            releaseChunk(&arenas[i],
+                arenas[i].chunks[arenas[i].num_chunks - 1]);
+        }
+        if (arenas[i].chunks != NULL) {
+            munmap(arenas[i].chunks, arenas[i].max_chunks * sizeof(Chunk*));
+        }
+        pthread_mutex_destroy(&arenas[i].lock);
+    }
 }
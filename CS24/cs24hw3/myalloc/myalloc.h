@@ -8,30 +8,105 @@
  * All rights reserved.
  */
 
+#include <stdint.h>
+
 
 /**
  * this is the header definition for my allocation algorithm
- * we keep a size, a pointer to next and previous free to allow for
- * constant time deallocation
+ * the header is a single 32-bit word holding the size of the whole block,
+ * header included.  every block size is a multiple of ALIGNMENT, so the
+ * low bits of the size are always zero and are used for flags instead:
+ * IN_USE is set when the block is allocated, and PREV_IN_USE is set when
+ * the block just before it is allocated (or there is no block before it).
+ *
+ * blocks are laid out so that every payload starts on an ALIGNMENT byte
+ * boundary, just after its header.
+ *
+ * free blocks are kept in one of several free lists, one per size class.
+ * an allocated block needs no links, so the next_free and prev_free links
+ * of a free block are kept in its payload (see FreeLinks) instead of in
+ * the header.
  *
- * we keep a prev_block pointer to simplify some math
- * we keep a char to specify whether the block is in use.
+ * a free block also ends with a footer, a copy of the block's size, so
+ * that when a block is freed the free block before it can be found in
+ * constant time from the footer just before the block's header (a
+ * boundary tag).  allocated blocks don't need a footer, since PREV_IN_USE
+ * says there is nothing to coalesce with.
  *
- * the total size of this header with padding is 40 bytes.
+ * the header is 4 bytes, so an allocated block costs 4 bytes plus the
+ * padding up to a multiple of ALIGNMENT, and the smallest block is
+ * MIN_BLOCK_SIZE bytes, which has room for the links and the footer.
+ *
+ * the top ARENA_BITS bits of the header hold the number of the arena the
+ * block belongs to, which limits blocks to MAX_BLOCK_SIZE bytes.  the
+ * DEFERRED flag is set on a block that has been freed but is still
+ * allocated as far as its arena knows, because it is waiting in a thread
+ * cache or in the arena's list of remote frees.  flags in an allocated
+ * block can be changed by other threads than the one holding the arena's
+ * lock, so they are only changed with atomic operations.
  */
 typedef struct Header{
-    int32_t size;
-    struct Header* prev_block;
-    struct Header* next_free;
-    struct Header* prev_free;
-    char inUse;
+    uint32_t size;
 }Header;
 
+typedef uint32_t Footer;
+
+typedef struct FreeLinks{
+    Header* next_free;
+    Header* prev_free;
+}FreeLinks;
+
+#define ALIGNMENT 16
+#define IN_USE 1
+#define PREV_IN_USE 2
+#define DEFERRED 4
+#define FLAG_MASK (ALIGNMENT - 1)
+#define MIN_BLOCK_SIZE 32
+
+#define ARENA_BITS 4
+#define ARENA_SHIFT (32 - ARENA_BITS)
+#define MAX_ARENAS (1 << ARENA_BITS)
+#define SIZE_MASK (((uint32_t) 1 << ARENA_SHIFT) - ALIGNMENT)
+#define MAX_BLOCK_SIZE ((int) SIZE_MASK)
+
+/**
+ * the pool is made of one or more chunks, each mapped from the operating
+ * system with mmap().  the blocks of a chunk start just far enough into
+ * the mapping that the first payload is aligned, and run up to an
+ * epilogue, a header of size 0 that is always in use, so that walking off
+ * the end of a chunk's blocks stops there.  the Chunk itself sits just
+ * after the epilogue, so a free block that reaches the epilogue finds its
+ * chunk without a lookup.  each arena keeps its chunks in an array sorted
+ * by address, which is searched to check that a pointer is in a chunk.
+ */
+typedef struct Chunk{
+    unsigned char* heap_start;
+    int pool_size;
+    int map_size;
+}Chunk;
+
+/**
+ * an arena is a pool of chunks with its own free lists and lock, defined
+ * in myalloc.c.  each thread allocates from one arena, so threads on
+ * different arenas don't contend for a lock.
+ */
+typedef struct Arena Arena;
+
 /*! Specifies the size of the memory pool the allocator has to work with. */
 extern int MEMORY_SIZE;
 
+/*! Specifies how large the pool may grow, by adding chunks, when it runs
+ * out of memory.  If this is 0, the pool stays at MEMORY_SIZE bytes. */
+extern int MEMORY_LIMIT;
+
+/*! Specifies how many arenas to use when MEMORY_LIMIT lets the pool grow,
+ * or 0 for one per processor.  A pool that can't grow has one arena. */
+extern int MEMORY_ARENAS;
 
-/* Initializes allocator state, and memory pool state too. */
+
+/* Initializes allocator state, and memory pool state too.  This and
+close_myalloc() must not be called while other threads use the allocator;
+myalloc() and myfree() may be called from any number of threads. */
 void init_myalloc();
 
 
@@ -54,19 +129,95 @@ pointer and the size of the block that the header points to
 this function is constant time*/
 Header* getNextBlock(Header* ptr);
 
-/*Finds the next free block for use when splitting blocks during allocation
-to maintain explicit free list. This function is linear in time complexity*/
-Header* getNextFree(Header* ptr);
-
-/*computes the previous free block by a linear time search down one direction*/
-Header* getPrevFree(Header* ptr);
-
-/* This function takes the current freed header and adjusts the explicit free
-list to maintain doubly linked list. This function is constant time as
-each header stores two pointers to its neighboring free blocks*/
-void insertIntoExplicitList(Header* current);
-
-/*this function combines adjacent free blocks. It is constant time due to
-our headers having a bidirectional linked list of explicit free blocks.*/
-void coalesce(Header* current, Header* right);
-
+/* Finds the previous block from the size in its footer, which is just
+before the current block's header. This only works when the previous block
+is free, since allocated blocks have no footer, so it never needs to look
+before the start of a chunk. this function is constant time*/
+Header* getPrevBlock(Header* ptr);
+
+/* Copies a free block's size into its footer, which must be done whenever
+a block is freed or a free block's size changes. this function is constant
+time*/
+void setFooter(Header* ptr);
+
+/* Computes the size class of a block size.  Sizes below 4 each get
+their own class; larger sizes are split into classes by their highest set
+bit, and each power of two is further split into 4 sub-classes by the next
+two bits. This function is constant time*/
+int getSizeClass(int size);
+
+/* Adds a free block to the head of the free list for its size class.
+This function is constant time*/
+void insertIntoFreeList(Arena* arena, Header* current);
+
+/* Removes a free block from the free list for its size class. This function
+is constant time as the lists are doubly linked*/
+void removeFromFreeList(Arena* arena, Header* current);
+
+/* Finds a free block of at least size bytes, or returns NULL
+if there is none. Only a bounded number of blocks in any one free list are
+examined, so this function is constant time*/
+Header* findFreeBlock(Arena* arena, int size);
+
+/*this function merges a free block into the free block just before it.
+It is constant time as neither block needs to be found.*/
+void coalesce(Arena* arena, Header* current, Header* right);
+
+/* Maps a new chunk whose blocks cover pool_size bytes, rounded down to a
+multiple of ALIGNMENT, and puts its one free block on the arena's free
+lists. Returns NULL if the mapping fails. this function is linear in the
+number of chunks after the new one in the arena's array, but only runs when
+the arena grows*/
+Chunk* addChunk(Arena* arena, int pool_size);
+
+/* Takes a chunk out of the arena's array of chunks and unmaps it. None of
+its blocks may be on the free lists. this function is linear in the number
+of chunks after it in the array, but only runs when a chunk empties*/
+void releaseChunk(Arena* arena, Chunk* chunk);
+
+/* Finds the arena's chunk that a pointer is in, or returns NULL if it isn't
+in any of them. this function is a binary search, so it is logarithmic in
+the number of chunks*/
+Chunk* findChunk(Arena* arena, unsigned char* ptr);
+
+/* Returns the number of the arena's chunks whose blocks start before ptr,
+which is where a chunk starting at ptr goes in the sorted array. this
+function is logarithmic in the number of chunks*/
+int chunkIndex(Arena* arena, unsigned char* ptr);
+
+/* Doubles the room in the arena's array of chunks. Returns 0 if the new
+array can't be mapped. this function is linear in the number of chunks*/
+int growChunkIndex(Arena* arena);
+
+/* Returns the chunk that an epilogue ends, which sits right after it. this
+function is constant time*/
+Chunk* getEpilogueChunk(Header* epilogue);
+
+/* Returns nonzero if all of a chunk is one free block. this function is
+constant time*/
+int isChunkEmpty(Chunk* chunk);
+
+/* Adds a chunk large enough for a block of size bytes to the arena, if
+MEMORY_LIMIT allows it, and returns its free block, or NULL if the pool
+can't grow*/
+Header* growHeap(Arena* arena, int size);
+
+/* Gives the whole pages inside a free block back to the operating system,
+keeping the header, links and footer. this function is constant time*/
+void releasePages(Header* block);
+
+/* Allocates a block of size bytes, header included, from an arena whose
+lock is held. Returns NULL if the arena has no room and can't grow*/
+Header* arenaAlloc(Arena* arena, int size);
+
+/* Frees an allocated block back into an arena whose lock is held,
+coalescing it with its neighbors*/
+void arenaFree(Arena* arena, Header* current);
+
+/* Pushes a block freed by a thread that doesn't use the block's arena
+onto the arena's list of remote frees, without taking its lock*/
+void pushRemoteFree(Arena* arena, Header* block);
+
+/* Frees the blocks on an arena's list of remote frees into the arena,
+whose lock is held*/
+void drainRemoteFrees(Arena* arena);
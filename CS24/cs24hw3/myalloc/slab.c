@@ -0,0 +1,148 @@
+/*! \file
+ * Implementation of a slab allocator that sits in front of myalloc().
+ * Objects of one size are carved out of slabs that come from myalloc(),
+ * so that the many small, identical objects of a data structure don't each
+ * go through the general allocator and carry a header of their own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "myalloc.h"
+#include "slab.h"
+
+/**
+ * A slab is at least SLAB_MIN_SIZE bytes, and large enough for at least
+ * SLAB_MIN_OBJECTS objects, so the myalloc() header of a slab is spread
+ * over many objects.
+ */
+#define SLAB_MIN_SIZE 4096
+#define SLAB_MIN_OBJECTS 32
+
+/* The objects of a slab start after the Slab, at an aligned address. */
+#define SLAB_HEADER_SIZE \
+    (((int) sizeof(Slab) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/* Objects are at least large enough, and aligned enough, for a pointer. */
+#define OBJECT_ALIGNMENT ((int) sizeof(void*))
+
+
+/**
+ * This creates an empty slab cache.  The object size is rounded up to a
+ * multiple of the size of a pointer, since a free object holds the link
+ * to the next free object.
+ * @param  object_size [the size of the cache's objects]
+ * @return             [the cache, or NULL if it couldn't be allocated]
+ */
+SlabCache* create_slab_cache(int object_size) {
+    SlabCache* cache;
+
+    if (object_size < 1 || object_size > MAX_BLOCK_SIZE / SLAB_MIN_OBJECTS) {
+        return NULL;
+    }
+
+    cache = (SlabCache*) myalloc(sizeof(SlabCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->object_size = (object_size + OBJECT_ALIGNMENT - 1) &
+        ~(OBJECT_ALIGNMENT - 1);
+    cache->slab_size = SLAB_HEADER_SIZE +
+        SLAB_MIN_OBJECTS * cache->object_size;
+    if (cache->slab_size < SLAB_MIN_SIZE) {
+        cache->slab_size = SLAB_MIN_SIZE;
+    }
+    cache->objects_per_slab = (cache->slab_size - SLAB_HEADER_SIZE) /
+        cache->object_size;
+    cache->slabs = NULL;
+    cache->free_objects = NULL;
+    cache->next_object = NULL;
+    cache->slab_end = NULL;
+    cache->slab_count = 0;
+    cache->live_objects = 0;
+    return cache;
+}
+
+/**
+ * This allocates an object, popping it off the stack of free objects if
+ * there are any, and otherwise carving it out of the newest slab, which
+ * is allocated first if it has no objects left.
+ * @param  cache [the cache to allocate from]
+ * @return       [the object, or NULL if there is no room for a new slab]
+ *
+ * Time complexity: constant time, since no list of objects or slabs is
+ * ever searched.
+ */
+unsigned char* slab_alloc(SlabCache* cache) {
+    unsigned char* object = cache->free_objects;
+
+    if (object != NULL) {
+        cache->free_objects = *(unsigned char**) object;
+    } else {
+        if (cache->next_object == cache->slab_end && !addSlab(cache)) {
+            return NULL;
+        }
+        object = cache->next_object;
+        cache->next_object += cache->object_size;
+    }
+
+    cache->live_objects++;
+    return object;
+}
+
+/**
+ * This frees an object by pushing it onto the cache's stack of free
+ * objects.
+ * @param cache  [the cache the object came from]
+ * @param object [the object]
+ */
+void slab_free(SlabCache* cache, unsigned char* object) {
+    if (object == NULL) {
+        fprintf(stderr,
+            "slab_free: attempting to free a null object");
+        abort();
+    }
+
+    *(unsigned char**) object = cache->free_objects;
+    cache->free_objects = object;
+    cache->live_objects--;
+}
+
+/**
+ * This allocates a slab from myalloc() and links it into the cache, and
+ * makes it the slab that new objects are carved from.  This is only done
+ * once every object of the previous slab has been handed out.
+ * @param  cache [the cache that needs another slab]
+ * @return       [1 if the slab was added, 0 if myalloc() had no room]
+ */
+int addSlab(SlabCache* cache) {
+    Slab* slab = (Slab*) myalloc(cache->slab_size);
+
+    if (slab == NULL) {
+        return 0;
+    }
+
+    slab->next = cache->slabs;
+    cache->slabs = slab;
+    cache->slab_count++;
+    cache->next_object = (unsigned char*) slab + SLAB_HEADER_SIZE;
+    cache->slab_end = cache->next_object +
+        cache->objects_per_slab * cache->object_size;
+    return 1;
+}
+
+/**
+ * This frees every slab of the cache, and then the cache itself.
+ * @param cache [the cache]
+ */
+void destroy_slab_cache(SlabCache* cache) {
+    Slab* slab, *next;
+
+    for (slab = cache->slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        myfree((unsigned char*) slab);
+    }
+    myfree((unsigned char*) cache);
+}
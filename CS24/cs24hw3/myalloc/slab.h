@@ -0,0 +1,65 @@
+/*! \file
+ * Declarations for a slab allocator that sits in front of myalloc().  A
+ * slab cache hands out objects of one fixed size, which it carves out of
+ * large blocks (slabs) that it gets from myalloc(), so that allocating
+ * and freeing an object takes constant time and costs no header.
+ */
+
+#include <stdint.h>
+
+
+/**
+ * each slab is one block from myalloc(), starting with a Slab that links
+ * it to the cache's other slabs, followed by the objects, the first of
+ * which is aligned to ALIGNMENT bytes like any block from myalloc().
+ */
+typedef struct Slab{
+    struct Slab* next;
+}Slab;
+
+/**
+ * a slab cache keeps every free object of all of its slabs on one stack,
+ * linked through the first bytes of the free objects themselves, so that
+ * freeing an object doesn't need to find the slab the object came from.
+ *
+ * a new slab isn't put on the stack all at once; its objects are handed
+ * out in address order, from next_object up to slab_end, once the stack
+ * is empty.
+ *
+ * slabs are only given back to myalloc() when the cache is destroyed.  a
+ * slab cache is not thread-safe, so each thread needs its own, or the
+ * caller has to lock around it.
+ */
+typedef struct SlabCache{
+    int object_size;
+    int slab_size;
+    int objects_per_slab;
+    Slab* slabs;
+    unsigned char* free_objects;
+    unsigned char* next_object;
+    unsigned char* slab_end;
+    int slab_count;
+    int live_objects;
+}SlabCache;
+
+
+/* Creates a cache of objects of object_size bytes, or returns NULL if
+the cache itself can't be allocated. No slab is allocated until the first
+object is. */
+SlabCache* create_slab_cache(int object_size);
+
+/* Allocates an object from the cache, or returns NULL if myalloc() has no
+room for another slab. this function is constant time*/
+unsigned char* slab_alloc(SlabCache* cache);
+
+/* Frees an object that slab_alloc() returned from the same cache. this
+function is constant time*/
+void slab_free(SlabCache* cache, unsigned char* object);
+
+/* Gives all of the cache's slabs back to myalloc() and frees the cache.
+Any objects still allocated from the cache go away with it. */
+void destroy_slab_cache(SlabCache* cache);
+
+/* Allocates a new slab for the cache and makes it the one that new
+objects are carved from. Returns 0 if myalloc() has no room for it. */
+int addSlab(SlabCache* cache);
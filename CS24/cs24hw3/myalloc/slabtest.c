@@ -0,0 +1,297 @@
+/*! \file
+ * This is a tester for the slab allocator in front of myalloc().  It checks
+ * that objects from several slab caches hold their data as they are
+ * allocated and freed in random order, and then compares the slab caches
+ * with calling myalloc() for each object, both in how many objects fit in
+ * a pool and in how long allocating and freeing them takes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "myalloc.h"
+#include "slab.h"
+
+#define DEFAULT_OBJECTS 100000
+#define DEFAULT_ROUNDS 20
+#define DEFAULT_RANDOM_SEED 1
+
+// The pool the correctness and timing tests run in, and the smaller pool
+//  the capacity test fills.
+#define POOL_SIZE (64 << 20)
+#define CAPACITY_POOL_SIZE (1 << 20)
+
+// The object sizes to test; 40 is the size of a multimap tree node, and
+//  16 the size of a value node.
+int object_sizes[] = { 16, 24, 40, 100 };
+#define NUM_SIZES ((int) (sizeof(object_sizes) / sizeof(int)))
+
+
+double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// shuffle an array of pointers
+void shuffle(unsigned char **objects, int count) {
+  unsigned char *tmp;
+  int i, j;
+
+  for (i = count - 1; i > 0; i--) {
+    j = rand() % (i + 1);
+    tmp = objects[i];
+    objects[i] = objects[j];
+    objects[j] = tmp;
+  }
+}
+
+
+// check that an object still holds the byte it was filled with
+int check_object(unsigned char *object, int size, int fill) {
+  int i;
+
+  for (i = 0; i < size; i++) {
+    if (object[i] != fill)
+      return 0;
+  }
+  return 1;
+}
+
+
+// Allocates objects from caches of every size at once, fills each one
+//  with a random byte, and then repeatedly frees about half of them at
+//  random and allocates them again, checking that no object's data is
+//  ever overwritten.
+int correctness_test(int num_objects) {
+  SlabCache *caches[NUM_SIZES];
+  unsigned char **objects[NUM_SIZES];
+  int *fills[NUM_SIZES];
+  int failure = 0;
+  int s, i, round;
+
+  printf("Performing the slab correctness test.\n");
+
+  MEMORY_SIZE = POOL_SIZE;
+  init_myalloc();
+
+  for (s = 0; s < NUM_SIZES; s++) {
+    caches[s] = create_slab_cache(object_sizes[s]);
+    objects[s] = calloc(num_objects, sizeof(unsigned char *));
+    fills[s] = calloc(num_objects, sizeof(int));
+    if (caches[s] == NULL || objects[s] == NULL || fills[s] == NULL) {
+      printf("Couldn't create a cache of %d byte objects.\n",
+             object_sizes[s]);
+      abort();
+    }
+  }
+
+  for (round = 0; round < 10 && !failure; round++) {
+    for (s = 0; s < NUM_SIZES && !failure; s++) {
+      for (i = 0; i < num_objects; i++) {
+        if (objects[s][i] != NULL)
+          continue;
+
+        objects[s][i] = slab_alloc(caches[s]);
+        if (objects[s][i] == NULL) {
+          printf("Ran out of memory for %d byte objects.\n",
+                 object_sizes[s]);
+          failure = 1;
+          break;
+        }
+        fills[s][i] = rand() & 0xff;
+        memset(objects[s][i], fills[s][i], object_sizes[s]);
+      }
+
+      for (i = 0; i < num_objects && !failure; i++) {
+        if (!check_object(objects[s][i], object_sizes[s], fills[s][i])) {
+          printf("Object %d of size %d was corrupted.\n", i,
+                 object_sizes[s]);
+          failure = 1;
+        }
+        else if (rand() % 2) {
+          slab_free(caches[s], objects[s][i]);
+          objects[s][i] = NULL;
+        }
+      }
+    }
+  }
+
+  for (s = 0; s < NUM_SIZES; s++) {
+    for (i = 0; i < num_objects; i++) {
+      if (objects[s][i] != NULL)
+        slab_free(caches[s], objects[s][i]);
+    }
+    if (!failure && caches[s]->live_objects != 0) {
+      printf("Cache of %d byte objects still has %d live objects.\n",
+             object_sizes[s], caches[s]->live_objects);
+      failure = 1;
+    }
+
+    destroy_slab_cache(caches[s]);
+    free(objects[s]);
+    free(fills[s]);
+  }
+
+  if (!failure)
+    printf("Passed slab correctness test.\n");
+
+  close_myalloc();
+  return failure;
+}
+
+
+// Counts how many objects of the given size fit in a small pool, either
+//  from a slab cache or from myalloc() directly.
+int count_objects(int size, int use_slab) {
+  SlabCache *cache = NULL;
+  unsigned char *object;
+  int count = 0;
+
+  MEMORY_SIZE = CAPACITY_POOL_SIZE;
+  init_myalloc();
+
+  if (use_slab)
+    cache = create_slab_cache(size);
+
+  do {
+    object = use_slab ? slab_alloc(cache) : myalloc(size);
+    if (object != NULL)
+      count++;
+  } while (object != NULL);
+
+  close_myalloc();
+  return count;
+}
+
+
+// Times allocating num_objects objects of the given size and freeing them
+//  in a random order, over a number of rounds, either from a slab cache or
+//  from myalloc() directly.  Returns the number of seconds it took.
+double time_objects(int size, int use_slab, int num_objects, int rounds) {
+  SlabCache *cache = NULL;
+  unsigned char **objects = malloc(num_objects * sizeof(unsigned char *));
+  double start, seconds;
+  int round, i;
+
+  MEMORY_SIZE = POOL_SIZE;
+  init_myalloc();
+
+  if (use_slab)
+    cache = create_slab_cache(size);
+
+  // the frees are shuffled before the clock starts, so only the
+  //  allocator is being timed
+  seconds = 0;
+  for (round = 0; round < rounds; round++) {
+    start = get_time();
+    for (i = 0; i < num_objects; i++)
+      objects[i] = use_slab ? slab_alloc(cache) : myalloc(size);
+    seconds += get_time() - start;
+
+    shuffle(objects, num_objects);
+
+    start = get_time();
+    for (i = 0; i < num_objects; i++) {
+      if (use_slab)
+        slab_free(cache, objects[i]);
+      else
+        myfree(objects[i]);
+    }
+    seconds += get_time() - start;
+  }
+
+  if (use_slab)
+    destroy_slab_cache(cache);
+
+  close_myalloc();
+  free(objects);
+  return seconds;
+}
+
+
+// Compares slab caches with myalloc() for every object size.
+void comparison_test(int num_objects, int rounds) {
+  int s, size, slab_count, myalloc_count;
+  double slab_seconds, myalloc_seconds, ops;
+
+  printf("Comparing slab caches with myalloc(); objects that fit in a %d "
+         "byte pool,\nand nanoseconds per allocation and free of %d "
+         "objects:\n\n", CAPACITY_POOL_SIZE, num_objects);
+  printf("  size   slab objects  myalloc objects    slab ns  myalloc ns\n");
+
+  for (s = 0; s < NUM_SIZES; s++) {
+    size = object_sizes[s];
+    slab_count = count_objects(size, 1);
+    myalloc_count = count_objects(size, 0);
+    slab_seconds = time_objects(size, 1, num_objects, rounds);
+    myalloc_seconds = time_objects(size, 0, num_objects, rounds);
+
+    ops = (double) num_objects * rounds;
+    printf("  %4d   %12d  %15d  %9.1f  %10.1f\n", size, slab_count,
+           myalloc_count, slab_seconds / ops * 1e9,
+           myalloc_seconds / ops * 1e9);
+  }
+}
+
+
+void usage(char *program) {
+  printf("usage: %s [-s seed] [-n objects] [-r rounds]\n", program);
+  printf("\tRuns the slab allocator tester.\n\n");
+  printf("\t-s seed sets the tester to use a specific random seed\n\n");
+  printf("\t-n objects sets the number of objects of each size to\n");
+  printf("\tallocate (default %d)\n\n", DEFAULT_OBJECTS);
+  printf("\t-r rounds sets the number of rounds to time (default %d)\n\n",
+         DEFAULT_ROUNDS);
+}
+
+
+int main(int argc, char *argv[]) {
+  unsigned int seed = DEFAULT_RANDOM_SEED;
+  int num_objects = DEFAULT_OBJECTS;
+  int rounds = DEFAULT_ROUNDS;
+  int c;
+
+  while ((c = getopt(argc, argv, "s:n:r:h")) != -1) {
+    switch (c) {
+      case 's':
+        seed = atoi(optarg);
+        break;
+
+      case 'n':
+        num_objects = atoi(optarg);
+        if (num_objects < 1) {
+          printf("ERROR:  Objects must be positive.\n");
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'r':
+        rounds = atoi(optarg);
+        if (rounds < 1) {
+          printf("ERROR:  Rounds must be positive.\n");
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  srand(seed);
+
+  if (correctness_test(num_objects))
+    return 1;
+  printf("\n");
+
+  comparison_test(num_objects, rounds);
+  return 0;
+}
@@ -33,10 +33,17 @@ int random_int(int max) {
 }
 
 
+// The largest block the utilization test allocates, or 0 to use a quarter
+//  of the maximum memory usage.  Smaller blocks mean many more live blocks.
+int max_block_size = 0;
+
 int random_block_size(int max_value) {
 
   // blah, almost certainly not a good model of
   //  typical allocations, but workable for a crude test
+  if (max_block_size > 0)
+    return random_int(max_block_size);
+
   return random_int(max_value / 4);
 
 }
@@ -357,8 +364,10 @@ done:
 // Allocates chunks of the given size until unable to anymore, then
 // deallocates all of them - returns the number of chunks allocated.
 int uniform_chunks(int chunk_size, int memory_size) {
+  // an allocator with no overhead fits memory_size / chunk_size chunks, and
+  //  the failed allocation after them is stored too
   unsigned char ** pointers =
-    malloc(sizeof(unsigned char *) * memory_size / chunk_size);
+    malloc(sizeof(unsigned char *) * (memory_size / chunk_size + 1));
   unsigned char * p;
   int chunks = -1;
   do {
@@ -419,6 +428,76 @@ int uniform_chunk_test() {
 }
 
 
+// Tests that the pool grows past MEMORY_SIZE when MEMORY_LIMIT allows it,
+// that the data in blocks on different chunks stays intact, and that the
+// pool never grows past MEMORY_LIMIT, even after shrinking and growing
+// again.
+void growth_test() {
+  int block_size = 256;
+  int num_blocks = 2000;
+  int limit = 1 << 20;
+  unsigned char ** pointers =
+    malloc(sizeof(unsigned char *) * limit / block_size);
+  int failure = 0;
+  int chunks;
+  int i, j;
+
+  printf("Performing the pool growth test.\n");
+
+  MEMORY_SIZE = 1024;
+  MEMORY_LIMIT = limit;
+  init_myalloc();
+
+  for (int round = 0; round < 2 && !failure; round++) {
+    for (i = 0; i < num_blocks; i++) {
+      pointers[i] = myalloc(block_size);
+      if (pointers[i] == NULL) {
+        printf("Couldn't grow the pool to allocate block %d of %d.\n",
+               i + 1, num_blocks);
+        failure = 1;
+        break;
+      }
+      for (j = 0; j < block_size; j++)
+        pointers[i][j] = (unsigned char) (i + j);
+    }
+
+    for (int k = 0; k < i; k++) {
+      for (j = 0; j < block_size; j++) {
+        if (pointers[k][j] != (unsigned char) (k + j)) {
+          printf("Block %d was corrupted after the pool grew.\n", k);
+          failure = 1;
+          break;
+        }
+      }
+    }
+
+    for (int k = 0; k < i; k++)
+      myfree(pointers[k]);
+  }
+
+  // Allocating as much as possible must stop at the limit.
+  if (!failure) {
+    chunks = uniform_chunks(block_size, limit);
+    if (chunks * block_size > limit) {
+      printf("Allocated %d bytes, past the limit of %d bytes.\n",
+             chunks * block_size, limit);
+      failure = 1;
+    }
+    else if (chunks < num_blocks) {
+      printf("Only %d blocks fit under the limit.\n", chunks);
+      failure = 1;
+    }
+  }
+
+  if (!failure)
+    printf("Passed pool growth test.\n");
+
+  close_myalloc();
+  MEMORY_LIMIT = 0;
+  free(pointers);
+}
+
+
 /* This test runs a series of random allocations and deallocations,
  * to see how much overhead is required by the allocator in question
  * for a certain number of bytes to be allocated.  During the test,
@@ -482,11 +561,13 @@ void utilization_test(int max_allocation) {
 
 
 void usage(char *program) {
-  printf("usage: %s [-s seed] [-m max_allocation]\n", program);
+  printf("usage: %s [-s seed] [-m max_allocation] [-b max_block]\n", program);
   printf("\tRuns the myalloc tester.\n\n");
   printf("\t-s seed sets the tester to use a specific random seed\n\n");
   printf("\t-m max_allocation sets the maximum number of bytes that the\n");
   printf("\ttester should try to allocate during utilization tests\n\n");
+  printf("\t-b max_block sets the largest block the utilization test\n");
+  printf("\tallocates (default max_allocation / 4)\n\n");
 }
 
 
@@ -496,21 +577,31 @@ int main(int argc, char *argv[]) {
   int max_allocation = DEFAULT_MAX_ALLOCATION;
   int c;
 
-  while ((c = getopt(argc, argv, "s:m:")) != -1) {
+  while ((c = getopt(argc, argv, "s:m:b:h")) != -1) {
     switch (c) {
       case 's':    /* Random seed */
         seed = atoi(optarg);
         break;
 
-      case 'p':
+      case 'm':
         max_allocation = atoi(optarg);
-        if (max_allocation < 0)
-          printf("ERROR:  Max allocation must be nonnegative.\n");
+        if (max_allocation < 4) {
+          printf("ERROR:  Max allocation must be at least 4.\n");
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 'b':
+        max_block_size = atoi(optarg);
+        if (max_block_size < 1) {
+          printf("ERROR:  Max block size must be positive.\n");
           usage(argv[0]);
           return 1;
+        }
         break;
 
-      case 'h':
+      default:
         usage(argv[0]);
         return 1;
     }
@@ -529,6 +620,10 @@ int main(int argc, char *argv[]) {
   uniform_chunk_test();
   printf("\n");
 
+  // Do the test of growing the pool past its initial size
+  growth_test();
+  printf("\n");
+
   // Do the memory utilization test to see how efficient the allocator is
   utilization_test(max_allocation);
 
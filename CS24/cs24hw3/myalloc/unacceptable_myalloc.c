@@ -21,6 +21,7 @@
  * memory that mem points to.
  */
 int MEMORY_SIZE;
+int MEMORY_LIMIT = 0;
 unsigned char *mem;
 
 
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <getopt.h>
 
 #include "cmdline.h"
 #include "memory.h"
@@ -25,45 +27,106 @@
 #define SEED 54321098
 
 
+/* The tile size used by the tiled variant when none is specified. */
+#define DEFAULT_TILE 32
+
+/* The size at which the recursive variant stops subdividing the matrix and
+ * just runs the triple loop over the remaining submatrix.
+ */
+#define DEFAULT_RECURSIVE_BASE 16
+
+/* The smallest and largest tile sizes tried by the autotuner. */
+#define MIN_TUNE_TILE 4
+#define MAX_TUNE_TILE 256
+
+
+/* The different implementations of the all-points shortest-path computation
+ * that this program can run.
+ */
+#define VARIANT_CLASSIC 0
+#define VARIANT_TILED 1
+#define VARIANT_RECURSIVE 2
+
+
 typedef struct {
     int num_nodes;
 
     membase_t *p_mem;
+
+    /* If this is non-NULL, the weight and path matrices are stored in this
+     * plain array instead of in the simulated memory, so that the same
+     * kernels can be timed on real hardware.  The layout is identical to
+     * the layout used in the simulated memory.
+     */
+    int *native_mem;
 } shortest_path_info;
 
 
 int get_weight(shortest_path_info *info, int row, int col) {
+    if (info->native_mem != NULL)
+        return info->native_mem[row * info->num_nodes + col];
+
     return read_int(info->p_mem, row * info->num_nodes + col);
 }
 
 
 void set_weight(shortest_path_info *info, int row, int col, int weight) {
+    if (info->native_mem != NULL) {
+        info->native_mem[row * info->num_nodes + col] = weight;
+        return;
+    }
+
     write_int(info->p_mem, row * info->num_nodes + col, weight);
 }
 
 
 int get_path(shortest_path_info *info, int row, int col) {
     int nodes = info->num_nodes;
+
+    if (info->native_mem != NULL)
+        return info->native_mem[nodes * nodes + row * nodes + col];
+
     return read_int(info->p_mem, nodes * nodes + row * nodes + col);
 }
 
 
 void set_path(shortest_path_info *info, int row, int col, int node) {
     int nodes = info->num_nodes;
+
+    if (info->native_mem != NULL) {
+        info->native_mem[nodes * nodes + row * nodes + col] = node;
+        return;
+    }
+
     write_int(info->p_mem, nodes * nodes + row * nodes + col, node);
 }
 
 
-void compute_shortest_paths(shortest_path_info *info) {
+void clear_paths(shortest_path_info *info) {
     int nodes = info->num_nodes;
-    int i, j, k;
+    int i, j;
 
-    printf(" * Clearing the path-reconstruction state.\n");
     for (i = 0; i < nodes; i++)
         for (j = 0; j < nodes; j++)
             set_path(info, i, j, -1);
+}
 
-    printf(" * Computing the all-points shortest path results.\n");
+
+/* Computes the all-points shortest paths with the classic triple loop.  The
+ * progress output is only printed for the simulated memory, so that it
+ * isn't part of the native timings the other variants are compared with.
+ */
+void compute_shortest_paths(shortest_path_info *info) {
+    int nodes = info->num_nodes;
+    int verbose = (info->native_mem == NULL);
+    int i, j, k;
+
+    if (verbose)
+        printf(" * Clearing the path-reconstruction state.\n");
+    clear_paths(info);
+
+    if (verbose)
+        printf(" * Computing the all-points shortest path results.\n");
     for (k = 0; k < nodes; k++) {
         for (i = 0; i < nodes; i++) {
             for (j = 0; j < nodes; j++) {
@@ -76,58 +139,438 @@ void compute_shortest_paths(shortest_path_info *info) {
                 }
             }
         }
-        printf(".");
-        fflush(stdout);
+        if (verbose) {
+            printf(".");
+            fflush(stdout);
+        }
     }
-    printf("\n");
+    if (verbose)
+        printf("\n");
 }
 
 
+/* Relaxes every path (i, j) with i in [i_start, i_end) and j in
+ * [j_start, j_end) through every intermediate node k in [k_start, k_end).
+ * This is the inner kernel shared by the tiled and recursive variants; over
+ * the whole matrix it is exactly the classic Floyd-Warshall triple loop.
+ */
+void relax_block(shortest_path_info *info, int i_start, int i_end,
+                 int j_start, int j_end, int k_start, int k_end) {
+    int i, j, k;
 
-int main(int argc, const char **argv) {
-    membase_t *p_mem;
+    for (k = k_start; k < k_end; k++) {
+        for (i = i_start; i < i_end; i++) {
+            int weight_ik = get_weight(info, i, k);
 
-    shortest_path_info info;
-    int i, j;
+            for (j = j_start; j < j_end; j++) {
+                int weight_ikj = weight_ik + get_weight(info, k, j);
+                int weight_ij = get_weight(info, i, j);
 
-    /* Set up the simulated memory. */
-    p_mem = make_cached_memory(argc, argv,
-                               2 * NUM_NODES * NUM_NODES * sizeof(int));
+                if (weight_ikj < weight_ij) {
+                    set_weight(info, i, j, weight_ikj);
+                    set_path(info, i, j, k);
+                }
+            }
+        }
+    }
+}
 
-    /* Generate a random graph. */
 
-    printf("Generating a random graph containing %d nodes.\n", NUM_NODES);
+/* Computes the all-points shortest paths using the blocked Floyd-Warshall
+ * algorithm.  The matrix is divided into tile x tile blocks, and for each
+ * block of intermediate nodes the computation proceeds in three phases:
+ * the diagonal block, then the blocks in the same row and column as the
+ * diagonal block, and then all remaining blocks.  Each phase only depends
+ * on the results of the earlier phases, so every block update works on at
+ * most three tiles, which can be kept in the cache together.
+ */
+void compute_shortest_paths_tiled(shortest_path_info *info, int tile) {
+    int nodes = info->num_nodes;
+    int kb, ib, jb, k_end, i_end, j_end;
 
-    srand(SEED);
+    clear_paths(info);
 
-    info.num_nodes = NUM_NODES;
-    info.p_mem = p_mem;
+    for (kb = 0; kb < nodes; kb += tile) {
+        k_end = (kb + tile < nodes) ? kb + tile : nodes;
+
+        /* Phase 1:  the diagonal block depends only on itself. */
+        relax_block(info, kb, k_end, kb, k_end, kb, k_end);
+
+        /* Phase 2:  blocks in the same row or column as the diagonal block
+         * depend only on themselves and the diagonal block.
+         */
+        for (ib = 0; ib < nodes; ib += tile) {
+            if (ib == kb)
+                continue;
+
+            i_end = (ib + tile < nodes) ? ib + tile : nodes;
+            relax_block(info, kb, k_end, ib, i_end, kb, k_end);
+            relax_block(info, ib, i_end, kb, k_end, kb, k_end);
+        }
+
+        /* Phase 3:  all other blocks depend on a row block and a column
+         * block computed in phase 2.
+         */
+        for (ib = 0; ib < nodes; ib += tile) {
+            if (ib == kb)
+                continue;
+
+            i_end = (ib + tile < nodes) ? ib + tile : nodes;
+            for (jb = 0; jb < nodes; jb += tile) {
+                if (jb == kb)
+                    continue;
+
+                j_end = (jb + tile < nodes) ? jb + tile : nodes;
+                relax_block(info, ib, i_end, jb, j_end, kb, k_end);
+            }
+        }
+    }
+}
 
-    for (i = 0; i < info.num_nodes; i++) {
-        for (j = 0; j < info.num_nodes; j++) {
+
+/* This helper implements the recursive, cache-oblivious Floyd-Warshall
+ * algorithm.  It updates the size x size submatrix X starting at (i, j)
+ * using the submatrices U starting at (i, k) and V starting at (k, j).  Each
+ * matrix is split into quadrants, and the eight quadrant updates are ordered
+ * so that every update sees the same intermediate results the classic
+ * algorithm would.  Submatrices are clipped against the actual number of
+ * nodes, so the matrix doesn't have to be a power-of-2 in size.
+ */
+void recursive_fw_helper(shortest_path_info *info, int i, int j, int k,
+                         int size, int base) {
+    int nodes = info->num_nodes;
+    int half;
+
+    if (i >= nodes || j >= nodes || k >= nodes)
+        return;
+
+    if (size <= base) {
+        relax_block(info, i, (i + size < nodes) ? i + size : nodes,
+                    j, (j + size < nodes) ? j + size : nodes,
+                    k, (k + size < nodes) ? k + size : nodes);
+        return;
+    }
+
+    half = size / 2;
+
+    /* Forward pass through the first half of the intermediate nodes. */
+    recursive_fw_helper(info, i, j, k, half, base);
+    recursive_fw_helper(info, i, j + half, k, half, base);
+    recursive_fw_helper(info, i + half, j, k, half, base);
+    recursive_fw_helper(info, i + half, j + half, k, half, base);
+
+    /* Backward pass through the second half of the intermediate nodes. */
+    recursive_fw_helper(info, i + half, j + half, k + half, half, base);
+    recursive_fw_helper(info, i + half, j, k + half, half, base);
+    recursive_fw_helper(info, i, j + half, k + half, half, base);
+    recursive_fw_helper(info, i, j, k + half, half, base);
+}
+
+
+/* Computes the all-points shortest paths using the recursive cache-oblivious
+ * Floyd-Warshall algorithm.  The recursion naturally produces subproblems
+ * that fit into every level of the cache, without knowing the cache sizes.
+ */
+void compute_shortest_paths_recursive(shortest_path_info *info, int base) {
+    int size = 1;
+
+    clear_paths(info);
+
+    while (size < info->num_nodes)
+        size *= 2;
+
+    recursive_fw_helper(info, 0, 0, 0, size, base);
+}
+
+
+/* Runs the specified variant of the computation against the info. */
+void run_variant(shortest_path_info *info, int variant, int tile) {
+    if (variant == VARIANT_TILED)
+        compute_shortest_paths_tiled(info, tile);
+    else if (variant == VARIANT_RECURSIVE)
+        compute_shortest_paths_recursive(info, tile);
+    else
+        compute_shortest_paths(info);
+}
+
+
+/* Generates a random graph into the plain array of weights. */
+void generate_graph(int *graph, int nodes) {
+    int i, j;
+
+    srand(SEED);
+
+    for (i = 0; i < nodes; i++) {
+        for (j = 0; j < nodes; j++) {
             if (i != j) {
                 if (rand() % 100 < CONNECTED_PCT)
-                    set_weight(&info, i, j, 1 + rand() % 10);
+                    graph[i * nodes + j] = 1 + rand() % 10;
                 else
-                    set_weight(&info, i, j, INFINITY);
+                    graph[i * nodes + j] = INFINITY;
             }
             else {
-                set_weight(&info, i, j, 0);
+                graph[i * nodes + j] = 0;
             }
         }
     }
+}
+
 
-    /* Compute the all-points shortest path of the graph. */
+/* Loads the graph's weights into the memory referenced by the info, either
+ * simulated or native.
+ */
+void load_graph(shortest_path_info *info, int *graph) {
+    int nodes = info->num_nodes;
+    int i, j;
 
-    printf("Computing the all-points-shortest-paths of the graph.\n");
-    compute_shortest_paths(&info);
+    for (i = 0; i < nodes; i++)
+        for (j = 0; j < nodes; j++)
+            set_weight(info, i, j, graph[i * nodes + j]);
+}
+
+
+/* Checks the computed weights against the expected weights, and returns the
+ * number of mismatches found.
+ */
+int check_weights(shortest_path_info *info, int *expected) {
+    int nodes = info->num_nodes;
+    int i, j, errors = 0;
+
+    for (i = 0; i < nodes; i++) {
+        for (j = 0; j < nodes; j++) {
+            if (get_weight(info, i, j) != expected[i * nodes + j])
+                errors++;
+        }
+    }
+
+    return errors;
+}
+
+
+/* Runs a variant natively against a fresh copy of the graph, and returns the
+ * wall-clock time the computation took.  The native matrices are left with
+ * the results of the computation.
+ */
+double time_native(shortest_path_info *native, int *graph, int variant,
+                   int tile) {
+    double start;
+
+    load_graph(native, graph);
+    start = get_wall_time();
+    run_variant(native, variant, tile);
+    return get_wall_time() - start;
+}
+
+
+/* Runs a variant in the simulated memory against a fresh copy of the graph,
+ * and reports the number of accesses and misses at the top level of the
+ * simulated memory.
+ */
+void run_simulated(shortest_path_info *info, int num_caches, int *graph,
+                   int variant, int tile, uint64_t *accesses,
+                   uint64_t *misses) {
+    load_graph(info, graph);
+    info->p_mem->reset_stats(info->p_mem);
+    run_variant(info, variant, tile);
+    get_top_level_stats(info->p_mem, num_caches, accesses, misses);
+}
+
+
+/* Sweeps the tile size of the tiled variant over powers of 2, running each
+ * tile size both in the simulated memory and natively, and reports the tile
+ * size with the lowest miss rate.  The classic triple loop is run first as
+ * the baseline for the speedups.
+ */
+void autotune(shortest_path_info *info, shortest_path_info *native,
+              int num_caches, int *graph, int *expected) {
+    uint64_t accesses, misses, base_misses;
+    double seconds, base_seconds, rate, best_rate = 0;
+    int tile, best_tile = 0;
+
+    printf("Autotuning the tile size of the tiled variant.\n\n");
+
+    run_simulated(info, num_caches, graph, VARIANT_CLASSIC, 0,
+                  &accesses, &base_misses);
+    base_seconds = time_native(native, graph, VARIANT_CLASSIC, 0);
+
+    printf("\n%8s %14s %14s %10s %12s %10s %10s\n", "tile", "accesses",
+           "misses", "miss-rate", "native-sec", "miss-gain", "time-gain");
+    printf("%8s %14lu %14lu %9.2f%% %12.4f %9.2fx %9.2fx\n", "classic",
+           accesses, base_misses, 100.0 * base_misses / accesses,
+           base_seconds, 1.0, 1.0);
+
+    for (tile = MIN_TUNE_TILE;
+         tile <= MAX_TUNE_TILE && tile <= info->num_nodes; tile *= 2) {
+        run_simulated(info, num_caches, graph, VARIANT_TILED, tile,
+                      &accesses, &misses);
+        if (check_weights(info, expected) != 0) {
+            printf("ERROR:  tile size %d computed wrong results!\n", tile);
+            abort();
+        }
+        seconds = time_native(native, graph, VARIANT_TILED, tile);
+
+        rate = (double) misses / (double) accesses;
+        printf("%8d %14lu %14lu %9.2f%% %12.4f %9.2fx %9.2fx\n", tile,
+               accesses, misses, 100.0 * rate, seconds,
+               (double) base_misses / (misses ? misses : 1),
+               base_seconds / seconds);
+
+        if (best_tile == 0 || rate < best_rate) {
+            best_tile = tile;
+            best_rate = rate;
+        }
+    }
+
+    printf("\nBest tile size:  %d (miss-rate=%.2f%%)\n", best_tile,
+           100.0 * best_rate);
+}
 
-    /* Print out the results of the all-points-shortest-paths computation. */
 
-    printf("\nMemory-Access Statistics:\n\n");
-    p_mem->print_stats(p_mem);
+/* Prints the options this program takes, before the cache specifications. */
+void apsp_usage(const char *progname) {
+    printf("usage: %s [-v classic|tiled|recursive] [-t tile] [-n nodes] "
+           "[-T] [cache-spec ...]\n\n", progname);
+    printf("\t-v selects the shortest-path variant to run (default classic)\n");
+    printf("\t-t sets the tile size for the tiled variant, or the base-case\n");
+    printf("\t   size for the recursive variant; the classic variant has\n");
+    printf("\t   neither, so -t can't be used with it\n");
+    printf("\t-n sets the number of nodes in the graph (default %d)\n",
+           NUM_NODES);
+    printf("\t-T sweeps tile sizes for the tiled variant, and reports the\n");
+    printf("\t   tile size with the best miss rate\n\n");
+    usage(progname);
+}
+
+
+int main(int argc, const char **argv) {
+    membase_t *p_mem;
+
+    shortest_path_info info, native;
+    int *graph, *expected;
+    int variant = VARIANT_CLASSIC, tile = 0, tune = 0, num_caches, c;
+    uint64_t accesses, misses;
+    double seconds;
+
+    info.num_nodes = NUM_NODES;
+
+    while ((c = getopt(argc, (char * const *) argv, "v:t:n:T")) != -1) {
+        switch (c) {
+        case 'v':
+            if (strcmp(optarg, "classic") == 0)
+                variant = VARIANT_CLASSIC;
+            else if (strcmp(optarg, "tiled") == 0)
+                variant = VARIANT_TILED;
+            else if (strcmp(optarg, "recursive") == 0)
+                variant = VARIANT_RECURSIVE;
+            else {
+                printf("ERROR:  unrecognized variant \"%s\".\n", optarg);
+                apsp_usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 't':
+            tile = atoi(optarg);
+            if (tile <= 0) {
+                printf("ERROR:  tile size must be positive, got %d.\n", tile);
+                return 1;
+            }
+            break;
+
+        case 'n':
+            info.num_nodes = atoi(optarg);
+            if (info.num_nodes <= 0) {
+                printf("ERROR:  number of nodes must be positive, got %d.\n",
+                       info.num_nodes);
+                return 1;
+            }
+            break;
+
+        case 'T':
+            tune = 1;
+            break;
+
+        default:
+            apsp_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (tile != 0 && variant == VARIANT_CLASSIC && !tune) {
+        printf("ERROR:  -t needs the tiled or recursive variant.\n");
+        apsp_usage(argv[0]);
+        return 1;
+    }
+
+    if (tile == 0)
+        tile = (variant == VARIANT_RECURSIVE) ? DEFAULT_RECURSIVE_BASE
+                                              : DEFAULT_TILE;
+
+    /* Everything left on the command-line is a cache specification.  Put
+     * the program name in front of them so that make_cached_memory() sees
+     * the same arguments it would without any options.
+     */
+    num_caches = argc - optind;
+    argv[optind - 1] = argv[0];
+
+    /* Set up the simulated memory. */
+    p_mem = make_cached_memory(num_caches + 1, argv + optind - 1,
+                               2 * info.num_nodes * info.num_nodes * sizeof(int));
+
+    /* Generate a random graph. */
+
+    printf("Generating a random graph containing %d nodes.\n", info.num_nodes);
+
+    graph = malloc(info.num_nodes * info.num_nodes * sizeof(int));
+    generate_graph(graph, info.num_nodes);
+
+    info.p_mem = p_mem;
+    info.native_mem = NULL;
+
+    native.num_nodes = info.num_nodes;
+    native.p_mem = NULL;
+    native.native_mem = malloc(2 * info.num_nodes * info.num_nodes * sizeof(int));
+
+    /* Compute the expected results natively with the classic algorithm, so
+     * that the other variants can be checked against them.
+     */
+    printf("Computing the reference results natively.\n");
+    time_native(&native, graph, VARIANT_CLASSIC, 0);
+    expected = malloc(info.num_nodes * info.num_nodes * sizeof(int));
+    memcpy(expected, native.native_mem,
+           info.num_nodes * info.num_nodes * sizeof(int));
+
+    if (tune) {
+        autotune(&info, &native, num_caches, graph, expected);
+    }
+    else {
+        /* Compute the all-points shortest path of the graph. */
+
+        printf("Computing the all-points-shortest-paths of the graph.\n");
+        run_simulated(&info, num_caches, graph, variant, tile,
+                      &accesses, &misses);
+
+        seconds = time_native(&native, graph, variant, tile);
+
+        /* Print out the results of the all-points-shortest-paths
+         * computation.  The results are checked afterward, since reading
+         * them back goes through the simulated memory too.
+         */
+
+        printf("\nMemory-Access Statistics:\n\n");
+        p_mem->print_stats(p_mem);
+        printf("\nNative wall-clock time:  %.4f seconds\n", seconds);
+
+        if (check_weights(&info, expected) != 0) {
+            printf("Some shortest paths didn't match, aborting.\n");
+            abort();
+        }
+    }
     printf("\n");
 
+    free(graph);
+    free(expected);
+    free(native.native_mem);
+
     return 0;
 }
-
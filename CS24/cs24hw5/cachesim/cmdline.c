@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "cmdline.h"
 #include "memory.h"
@@ -21,7 +22,9 @@ void usage(const char *progname) {
 
 
 /* Initializes a set of caches and a memory, using the cache configuration
- * specified from command-line arguments.
+ * specified from command-line arguments.  The memory size is rounded up to
+ * a multiple of the largest block size of the caches, since caches load
+ * whole blocks and must not run past the end of the memory.
  *
  * TODO:  This function doesn't provide any way to clean up the allocated
  *        memory!  Return a pointer to a struct that referenes everything
@@ -29,7 +32,7 @@ void usage(const char *progname) {
  */
 membase_t * make_cached_memory(int argc, const char **argv,
                                uint32_t mem_size) {
-    int i;
+    int i, block_size, max_block_size;
     const char *progname;
     membase_t **p_mems;
     memory_t *p_memory;
@@ -41,6 +44,19 @@ membase_t * make_cached_memory(int argc, const char **argv,
     
     p_mems = malloc((argc + 1) * sizeof(membase_t *));
 
+    /* Block sizes are powers of 2, so a multiple of the largest one is a
+     * multiple of all of them.  Malformed specifications are reported
+     * below, when the caches are built.
+     */
+    max_block_size = 1;
+    for (i = 0; i < argc; i++) {
+        if (sscanf(argv[i], "%d", &block_size) == 1 &&
+            block_size > max_block_size)
+            max_block_size = block_size;
+    }
+    if (mem_size % max_block_size != 0)
+        mem_size += max_block_size - mem_size % max_block_size;
+
     printf("Constructing memory for simulation (in reverse order):\n");
     
     printf(" * Building memory of size %u bytes\n", mem_size);
@@ -49,7 +65,7 @@ membase_t * make_cached_memory(int argc, const char **argv,
     p_mems[argc] = (membase_t *) p_memory;
     
     for (i = argc - 1; i >= 0; i--) {
-        int block_size, num_sets, lines_per_set;
+        int num_sets, lines_per_set;
         int ct = sscanf(argv[i], "%d:%d:%d",
                         &block_size, &num_sets, &lines_per_set);
         if (ct != 3) {
@@ -95,3 +111,35 @@ membase_t * make_cached_memory(int argc, const char **argv,
     return p_mems[0];
 }
 
+
+
+/* Reports the number of accesses against the first level of a memory built
+ * by make_cached_memory(), and how many of those accesses missed.  The
+ * num_caches argument is the number of cache-specs that were used to build
+ * the memory; if it is zero then there is no cache in front of the memory,
+ * and every access is counted as a miss.
+ */
+void get_top_level_stats(membase_t *p_mem, int num_caches,
+                         uint64_t *accesses, uint64_t *misses) {
+    if (num_caches > 0) {
+        cache_t *p_cache = (cache_t *) p_mem;
+        *accesses = p_cache->num_hits + p_cache->num_misses;
+        *misses = p_cache->num_misses;
+    }
+    else {
+        *accesses = p_mem->num_reads + p_mem->num_writes;
+        *misses = *accesses;
+    }
+}
+
+
+/* Returns the current wall-clock time in seconds.  This is used to time the
+ * native (unsimulated) versions of the algorithms, so that the speedups seen
+ * in the simulator can be compared against real hardware.
+ */
+double get_wall_time() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+}
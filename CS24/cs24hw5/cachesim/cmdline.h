@@ -3,3 +3,6 @@
 void usage(const char *progname);
 membase_t * make_cached_memory(int argc, const char **argv, uint32_t mem_size);
 
+void get_top_level_stats(membase_t *p_mem, int num_caches,
+                         uint64_t *accesses, uint64_t *misses);
+double get_wall_time();
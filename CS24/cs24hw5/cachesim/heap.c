@@ -11,23 +11,30 @@
 void sift_down(float_heap *p_heap, int index);
 void sift_up(float_heap *p_heap, int index);
 void swap_values(float_heap *p_heap, int i, int j);
+uint32_t heap_address(float_heap *p_heap, int index);
+float read_value(float_heap *p_heap, int index);
+void write_value(float_heap *p_heap, int index, float value);
 
 /*
- * For heaps stored in an array, left child and right child of a particular
- * index are calculated using these functions.  The "index" value is
- * supposed to be an integer.
+ * Heap indexes are always the logical (breadth-first) positions of the nodes
+ * in a complete tree with p_heap->arity children per node; heap_address()
+ * maps them to where the values actually live in the memory.  The first
+ * child and the parent of a particular index are calculated using these
+ * functions.  The "index" value is supposed to be an integer.
  */
-#define  LEFT_CHILD(index) (2 * (index) + 1)
-#define RIGHT_CHILD(index) (2 * (index) + 2)
-
-/* Given an index, the parent index is computed as follows.
- * The "index" value is supposed to be an integer.
- */
-#define PARENT(index) (((index) - 1) / 2)
+#define FIRST_CHILD(p_heap, index) ((p_heap)->arity * (index) + 1)
+#define PARENT(p_heap, index) (((index) - 1) / (p_heap)->arity)
 
 
 /* Initialize a heap data structure. */
 void init_heap(float_heap *p_heap, membase_t *memory, int max_values) {
+    init_heap_layout(p_heap, memory, max_values, HEAP_BINARY, 0);
+}
+
+
+/* Initialize a heap data structure with a specific layout. */
+void init_heap_layout(float_heap *p_heap, membase_t *memory, int max_values,
+                      int layout, int param) {
     assert(p_heap != NULL);
     assert(memory != NULL);
 
@@ -35,6 +42,68 @@ void init_heap(float_heap *p_heap, membase_t *memory, int max_values) {
 
     p_heap->num_values = 0;
     p_heap->max_values = max_values;
+
+    p_heap->layout = layout;
+    p_heap->arity = 2;
+    p_heap->page_bits = 0;
+
+    if (layout == HEAP_DARY) {
+        assert(param >= 2);
+        p_heap->arity = param;
+    }
+    else if (layout == HEAP_BHEAP) {
+        /* A page needs room for at least a node and its two children, in
+         * addition to the unused first slot.
+         */
+        assert(param >= 4);
+        p_heap->page_bits = log_2(param);
+    }
+    else {
+        assert(layout == HEAP_BINARY);
+    }
+}
+
+
+/* Returns the number of bytes of memory a heap with the specified layout
+ * needs in order to hold max_values values.
+ */
+uint32_t heap_memory_size(int layout, int param, int max_values) {
+    float_heap heap;
+    membase_t dummy;
+    uint32_t last, max_address, full_level_end;
+
+    assert(max_values > 0);
+
+    init_heap_layout(&heap, &dummy, max_values, layout, param);
+
+    /* For the implicit layouts, the last value in the heap always has the
+     * largest address.  In a B-heap, the last level of the heap may only
+     * partially fill the last row of pages, while the level above it spans
+     * every page in that row, so its last node can have a larger address.
+     */
+    last = max_values - 1;
+    max_address = heap_address(&heap, last);
+
+    full_level_end = 1;
+    while (2 * full_level_end <= last + 1)
+        full_level_end *= 2;
+
+    if (full_level_end >= 2 &&
+        heap_address(&heap, full_level_end - 2) > max_address) {
+        max_address = heap_address(&heap, full_level_end - 2);
+    }
+
+    /* Round up to whole pages or sibling groups, so that the memory also
+     * ends on a block boundary when they are matched to the block size.
+     */
+    if (layout == HEAP_BHEAP) {
+        max_address |= (1u << heap.page_bits) - 1;
+    }
+    else if (layout == HEAP_DARY) {
+        max_address += heap.arity - 1 - max_address % heap.arity;
+    }
+
+    return (max_address + 1) * sizeof(float);
 }
 
 
@@ -48,7 +117,7 @@ float get_first_value(float_heap *p_heap) {
     assert(p_heap->num_values > 0);
 
     /* Smallest value is at the root - index 0. */
-    result = read_float(p_heap->memory, 0);
+    result = read_value(p_heap, 0);
 
     /* Decrease the count of how many values are in the heap.  NOTE that if
      * there was more than one value in the heap, the last value is still at
@@ -59,8 +128,8 @@ float get_first_value(float_heap *p_heap) {
     p_heap->num_values--;
     if (p_heap->num_values != 0) {
         /* Move the last value in the heap to the root. */
-        float f = read_float(p_heap->memory, p_heap->num_values);
-        write_float(p_heap->memory, 0, f);
+        float f = read_value(p_heap, p_heap->num_values);
+        write_value(p_heap, 0, f);
 
         /* Sift down the new value to position it properly in the heap. */
         sift_down(p_heap, 0);
@@ -83,7 +152,7 @@ void add_value(float_heap *p_heap, float newval) {
     /* Add the new value to the end of the heap, then sift up. */
 
     index = p_heap->num_values;
-    write_float(p_heap->memory, index, newval);
+    write_value(p_heap, index, newval);
     p_heap->num_values++;
 
     /* If the new value isn't at the root, sift up. */
@@ -101,71 +170,55 @@ void add_value(float_heap *p_heap, float newval) {
  * Given a heap and an index, sift_down checks to see if the value at that
  * index needs to be "sifted downward" in the heap, to preserve the heap
  * properties.  Specifically, a value needs to be moved down in the heap if
- * it is greater than either of its children's values.  (This is the "order"
+ * it is greater than any of its children's values.  (This is the "order"
  * property.)  In order to preserve the "shape" property of heaps, the value
- * is swapped with the *smaller* of its two child values.
+ * is swapped with the *smallest* of its child values.
  *
- * If a value only has a left child, then only the left child is examined
- * for the swap.
+ * Nodes at the bottom of the heap may only have some of their children, so
+ * only the children that are actually in the heap are examined for the swap.
  *
- * If a value has both left and right children, it is possible that one
- * child may be larger than the value, while the other is smaller than the
- * value.  Since we swap with the smallest child value, we preserve the
- * heap properties even in that situation.
+ * It is possible that some children may be larger than the value, while
+ * others are smaller than the value.  Since we swap with the smallest child
+ * value, we preserve the heap properties even in that situation.
  */
 void sift_down(float_heap *p_heap, int index) {
     assert(p_heap != NULL);
     assert(index < p_heap->num_values);
 
-    int left_child = LEFT_CHILD(index);
-    int right_child = RIGHT_CHILD(index);
-    float index_val = read_float(p_heap->memory, index);
+    int first_child = FIRST_CHILD(p_heap, index);
+    int end_child = first_child + p_heap->arity;
+    float index_val = read_value(p_heap, index);
+    float min_val;
+    int child, min_child;
 
-    if (left_child >= p_heap->num_values) {
-        /* If the left child's index is past the end of the heap
+    if (first_child >= p_heap->num_values) {
+        /* If the first child's index is past the end of the heap
          * then this value has no children.  We're done.
          */
         return;
     }
 
-    if (right_child >= p_heap->num_values) {
-        /* Only have a left child. */
-
-        if (read_float(p_heap->memory, left_child) < index_val) {
-            /* Left child value is smaller.  Swap this value and the
-             * left child value.
-             */
-            swap_values(p_heap, index, left_child);
-
-            /* Don't need to call sift_down again, because if this
-             * node only has a left child, we are at the bottom of
-             * the heap.
-             */
+    if (end_child > p_heap->num_values)
+        end_child = p_heap->num_values;
+
+    /* Find the smallest of this value's children. */
+    min_child = first_child;
+    min_val = read_value(p_heap, first_child);
+    for (child = first_child + 1; child < end_child; child++) {
+        float child_val = read_value(p_heap, child);
+        if (child_val < min_val) {
+            min_val = child_val;
+            min_child = child;
         }
     }
-    else {
-        /* This value has a left and right child. */
-
-        float left_val = read_float(p_heap->memory, left_child);
-        float right_val = read_float(p_heap->memory, right_child);
-        int swap_child;
-
-        if (left_val < index_val || right_val < index_val) {
-            /* Need to swap this node with one of its children.  Pick
-             * the smaller of the two children, since this is a min-heap
-             * and that will preserve the heap properties.
-             */
-            if (left_val < right_val)
-                swap_child = left_child;
-            else
-                swap_child = right_child;
-
-            /* Do the swap, then call sift_down again, in case we aren't
-             * at the bottom of the heap yet.
-             */
-            swap_values(p_heap, index, swap_child);
-            sift_down(p_heap, swap_child);
-        }
+
+    if (min_val < index_val) {
+        /* Need to swap this node with its smallest child, since this is a
+         * min-heap and that will preserve the heap properties.  Then call
+         * sift_down again, in case we aren't at the bottom of the heap yet.
+         */
+        swap_values(p_heap, index, min_child);
+        sift_down(p_heap, min_child);
     }
 }
 
@@ -178,7 +231,7 @@ void sift_down(float_heap *p_heap, int index) {
  * is not affected by sifting a value up.)
  */
 void sift_up(float_heap *p_heap, int index) {
-    int parent_index = PARENT(index);
+    int parent_index = PARENT(p_heap, index);
 
     /* If the index to sift up is the root, we are done. */
     if (index == 0)
@@ -190,8 +243,7 @@ void sift_up(float_heap *p_heap, int index) {
     /* If the specified value is smaller than its parent value then
      * we have to swap the value and its parent.
      */
-    if (read_float(p_heap->memory, index) <
-        read_float(p_heap->memory, parent_index)) {
+    if (read_value(p_heap, index) < read_value(p_heap, parent_index)) {
         /* Swap the value with its parent value. */
         swap_values(p_heap, index, parent_index);
 
@@ -214,10 +266,68 @@ void swap_values(float_heap *p_heap, int i, int j) {
     assert(j >= 0 && j < p_heap->num_values);
     assert(i != j);
 
-    i_val = read_float(p_heap->memory, i);
-    j_val = read_float(p_heap->memory, j);
+    i_val = read_value(p_heap, i);
+    j_val = read_value(p_heap, j);
+
+    write_value(p_heap, i, j_val);
+    write_value(p_heap, j, i_val);
+}
+
+
+/*
+ * Maps a logical heap index to the index of the float in the memory that
+ * holds its value, according to the heap's layout.
+ *
+ * For a B-heap, each page holds 2^page_bits float slots.  Slot 0 of each
+ * page is left unused so that the page's subtree can be indexed like a
+ * 1-based binary heap within the page, and so that pages stay aligned to
+ * their size.  A page holds page_bits levels of the heap, so the nodes at
+ * depth d of the heap are in the pages at page-level d / page_bits, at depth
+ * d % page_bits within their page.  Pages are numbered breadth-first across
+ * the page-levels, just like the nodes of an ordinary implicit heap.
+ */
+uint32_t heap_address(float_heap *p_heap, int index) {
+    uint32_t depth, pos, page_level, page_depth, page, slot;
+    uint64_t pages_above;
+
+    if (p_heap->layout == HEAP_DARY) {
+        /* Offset by arity - 1 so each sibling group starts on a multiple of
+         * the arity.
+         */
+        return index + p_heap->arity - 1;
+    }
+
+    if (p_heap->layout != HEAP_BHEAP)
+        return index;
+
+    /* Find the depth of the node, and its position within that depth. */
+    depth = 0;
+    while ((2u << depth) <= (uint32_t) index + 1)
+        depth++;
+    pos = index + 1 - (1u << depth);
+
+    page_level = depth / p_heap->page_bits;
+    page_depth = depth % p_heap->page_bits;
+
+    /* Number of pages in all the page-levels above this one. */
+    pages_above = ((1ull << (page_level * p_heap->page_bits)) - 1) /
+                  ((1ull << p_heap->page_bits) - 1);
+
+    page = pages_above + (pos >> page_depth);
+    slot = (1u << page_depth) | (pos & ((1u << page_depth) - 1));
+
+    return (page << p_heap->page_bits) | slot;
+}
+
+
+/* Reads the value at a logical index in the heap. */
+float read_value(float_heap *p_heap, int index) {
+    return read_float(p_heap->memory, heap_address(p_heap, index));
+}
+
 
-    write_float(p_heap->memory, i, j_val);
-    write_float(p_heap->memory, j, i_val);
+/* Writes the value at a logical index in the heap. */
+void write_value(float_heap *p_heap, int index, float value) {
+    write_float(p_heap->memory, heap_address(p_heap, index), value);
 }
 
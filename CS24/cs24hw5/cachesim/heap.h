@@ -5,6 +5,25 @@
 #include "membase.h"
 
 
+/* The layouts that a heap can store its values in.
+ *
+ *  - HEAP_BINARY is the classic implicit binary heap, where the children of
+ *    index i are at 2i + 1 and 2i + 2.
+ *
+ *  - HEAP_DARY is an implicit d-ary heap.  The array is offset by d - 1
+ *    entries so that each group of d siblings starts on a multiple of d; when
+ *    d floats fill a cache block, a node's children are all in one block.
+ *
+ *  - HEAP_BHEAP is a binary heap whose nodes are grouped into pages, each
+ *    page holding a complete subtree that fits in one cache block.  Sifting a
+ *    value through several levels of the heap then only touches one block per
+ *    page of levels, instead of one block per level.
+ */
+#define HEAP_BINARY 0
+#define HEAP_DARY   1
+#define HEAP_BHEAP  2
+
+
 /* A simple heap data structure, for storing floats. */
 typedef struct {
     /* Number of values currently in the heap. */
@@ -13,6 +32,15 @@ typedef struct {
     /* The maximum number of values to be stored in the heap. */
     int max_values;
 
+    /* The layout used to store the values; one of the HEAP_* constants. */
+    int layout;
+
+    /* The number of children of each node. */
+    int arity;
+
+    /* For HEAP_BHEAP, log_2 of the number of value slots in each page. */
+    int page_bits;
+
     /* The values in the heap. */
     membase_t *memory;
 } float_heap;
@@ -21,6 +49,19 @@ typedef struct {
 /* Initialize a heap data structure. */
 void init_heap(float_heap *p_heap, membase_t *memory, int max_values);
 
+/* Initialize a heap data structure with a specific layout.  For HEAP_DARY,
+ * param is the number of children of each node; for HEAP_BHEAP, it is the
+ * number of floats in each page, which must be a power of 2 (normally the
+ * number of floats in a cache block).  It is ignored for HEAP_BINARY.
+ */
+void init_heap_layout(float_heap *p_heap, membase_t *memory, int max_values,
+                      int layout, int param);
+
+/* Returns the number of bytes of memory a heap with the specified layout
+ * needs in order to hold max_values values.
+ */
+uint32_t heap_memory_size(int layout, int param, int max_values);
+
 /* Returns the first (i.e. smallest) value in the heap. */
 float get_first_value(float_heap *p_heap);
 
@@ -28,4 +69,3 @@ float get_first_value(float_heap *p_heap);
 void add_value(float_heap *p_heap, float newval);
 
 #endif /* __HEAP_H__ */
-
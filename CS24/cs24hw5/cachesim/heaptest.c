@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <getopt.h>
 
 #include "cmdline.h"
 #include "heap.h"
@@ -33,47 +35,39 @@ int compare_float_ptrs(const void *v1, const void *v2) {
 }
 
 
-int main(int argc, const char **argv) {
-    float *inputs;
-    int i, error;
-
-    membase_t *p_mem;
-
+/* Uses a heap with the specified layout to sort the inputs, checks the
+ * results against the sorted inputs, and prints the memory statistics for
+ * the heap operations.
+ */
+void test_heap(membase_t *p_mem, int num_caches, float *inputs,
+               float *sorted, int layout, int param) {
+    const char *layout_str[] = { "binary", "d-ary", "B-heap" };
     float_heap heap;
+    uint64_t accesses, misses;
+    int i, error;
 
-    /* Set up the simulated memory. */
-    p_mem = make_cached_memory(argc, argv, NUM_ELEMS * sizeof(int));
-    
-    /* Generate random floats to sort. */
-
-    printf("Generating %d random floats to sort.\n", NUM_ELEMS);
-
-    inputs = malloc(NUM_ELEMS * sizeof(float));
-
-    srand48(SEED);
-    for (i = 0; i < NUM_ELEMS; i++)
-        inputs[i] = (float) drand48();
-
-    /* Use the heap to sort the sequence of floats. */
+    if (layout == HEAP_BINARY)
+        printf("Sorting numbers using a binary heap.\n");
+    else if (layout == HEAP_DARY)
+        printf("Sorting numbers using a %d-ary heap.\n", param);
+    else
+        printf("Sorting numbers using a B-heap with %d floats per page.\n",
+               param);
 
-    printf("Sorting numbers using the heap.\n");
+    p_mem->reset_stats(p_mem);
 
-    init_heap(&heap, p_mem, NUM_ELEMS);
+    init_heap_layout(&heap, p_mem, NUM_ELEMS, layout, param);
     for (i = 0; i < NUM_ELEMS; i++)
         add_value(&heap, inputs[i]);
 
-    /* Sort the inputs so that we can check the heap's results. */
-
     printf("Checking the results against the sorted inputs.\n");
 
-    qsort(inputs, NUM_ELEMS, sizeof(float), compare_float_ptrs);
-
     error = 0;
     for (i = 0; i < NUM_ELEMS; i++) {
         float val = get_first_value(&heap);
-        if (val != inputs[i]) {
+        if (val != sorted[i]) {
             printf("ERROR:  heap and sorted array don't match at "
-                   "index %d!  heap = %f, val = %f\n", i, val, inputs[i]);
+                   "index %d!  heap = %f, val = %f\n", i, val, sorted[i]);
             error = 1;
         }
     }
@@ -85,10 +79,134 @@ int main(int argc, const char **argv) {
 
     /* Print out the results of the heap sort. */
 
-    printf("\nMemory-Access Statistics:\n\n");
+    printf("\nMemory-Access Statistics (%s heap):\n\n", layout_str[layout]);
     p_mem->print_stats(p_mem);
-    printf("\n");
 
-    return 0;
+    get_top_level_stats(p_mem, num_caches, &accesses, &misses);
+    printf("   misses per heap operation=%.3f\n\n",
+           (double) misses / (2.0 * NUM_ELEMS));
+}
+
+
+/* Prints the options this program takes, before the cache specifications. */
+void heap_usage(const char *progname) {
+    printf("usage: %s [-l binary|dary|bheap|all] [-d arity] "
+           "[cache-spec ...]\n\n", progname);
+    printf("\t-l selects the heap layout to test (default binary); \"all\"\n");
+    printf("\t   tests every layout under the same cache specification\n");
+    printf("\t-d sets the arity of the d-ary heap (default is as many floats\n");
+    printf("\t   as fit in a block of the first cache, or 4 if no cache)\n\n");
+    usage(progname);
 }
 
+
+int main(int argc, const char **argv) {
+    float *inputs, *sorted;
+    int i, c, num_caches, block_size, block_floats;
+    int layout = HEAP_BINARY, arity = 0, test_all = 0;
+    uint32_t mem_size, size;
+
+    membase_t *p_mem;
+
+    while ((c = getopt(argc, (char * const *) argv, "l:d:")) != -1) {
+        switch (c) {
+        case 'l':
+            if (strcmp(optarg, "binary") == 0)
+                layout = HEAP_BINARY;
+            else if (strcmp(optarg, "dary") == 0)
+                layout = HEAP_DARY;
+            else if (strcmp(optarg, "bheap") == 0)
+                layout = HEAP_BHEAP;
+            else if (strcmp(optarg, "all") == 0)
+                test_all = 1;
+            else {
+                printf("ERROR:  unrecognized heap layout \"%s\".\n", optarg);
+                heap_usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'd':
+            arity = atoi(optarg);
+            if (arity < 2) {
+                printf("ERROR:  arity must be at least 2, got %d.\n", arity);
+                return 1;
+            }
+            break;
+
+        default:
+            heap_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* Everything left on the command-line is a cache specification.  Put
+     * the program name in front of them so that make_cached_memory() sees
+     * the same arguments it would without any options.
+     */
+    num_caches = argc - optind;
+    argv[optind - 1] = argv[0];
+
+    /* The B-heap pages and the d-ary sibling groups are matched to the block
+     * size of the first cache.  The block size is the first number in the
+     * first cache specification.
+     */
+    block_size = 16;
+    if (num_caches > 0 && sscanf(argv[optind], "%d", &block_size) != 1)
+        block_size = 16;
+
+    block_floats = block_size / sizeof(float);
+    if (block_floats < 4)
+        block_floats = 4;
+
+    if (arity == 0)
+        arity = block_floats;
+
+    /* Set up the simulated memory, big enough for any of the layouts. */
+    mem_size = NUM_ELEMS * sizeof(int);
+    size = heap_memory_size(HEAP_DARY, arity, NUM_ELEMS);
+    if (size > mem_size)
+        mem_size = size;
+    size = heap_memory_size(HEAP_BHEAP, block_floats, NUM_ELEMS);
+    if (size > mem_size)
+        mem_size = size;
+
+    /* make_cached_memory() rounds this up to a whole block of every cache. */
+    p_mem = make_cached_memory(num_caches + 1, argv + optind - 1, mem_size);
+
+    /* Generate random floats to sort. */
+
+    printf("Generating %d random floats to sort.\n", NUM_ELEMS);
+
+    inputs = malloc(NUM_ELEMS * sizeof(float));
+    sorted = malloc(NUM_ELEMS * sizeof(float));
+
+    srand48(SEED);
+    for (i = 0; i < NUM_ELEMS; i++)
+        inputs[i] = (float) drand48();
+
+    /* Sort the inputs so that we can check the heap's results. */
+
+    memcpy(sorted, inputs, NUM_ELEMS * sizeof(float));
+    qsort(sorted, NUM_ELEMS, sizeof(float), compare_float_ptrs);
+
+    /* Use the heap to sort the sequence of floats. */
+
+    if (test_all) {
+        test_heap(p_mem, num_caches, inputs, sorted, HEAP_BINARY, 0);
+        test_heap(p_mem, num_caches, inputs, sorted, HEAP_DARY, 4);
+        test_heap(p_mem, num_caches, inputs, sorted, HEAP_DARY, 8);
+        if (arity != 4 && arity != 8)
+            test_heap(p_mem, num_caches, inputs, sorted, HEAP_DARY, arity);
+        test_heap(p_mem, num_caches, inputs, sorted, HEAP_BHEAP, block_floats);
+    }
+    else {
+        test_heap(p_mem, num_caches, inputs, sorted, layout,
+                  (layout == HEAP_BHEAP) ? block_floats : arity);
+    }
+
+    free(inputs);
+    free(sorted);
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "cmdline.h"
+#include "simmm.h"
+#include "memory.h"
+#include "cache.h"
+
+
+/* The ways keys can be generated, the same as in ../multimap/mmperf.c. */
+#define MODE_RAND 0
+#define MODE_INCR 1
+#define MODE_DECR 2
+
+/* The default workload is the last random test of mmperf, scaled down so
+ * that simulating it only takes a few seconds per layout.
+ */
+#define DEFAULT_PAIRS 300000
+#define DEFAULT_PROBES 100000
+#define DEFAULT_MAX_KEY 100000
+#define DEFAULT_MAX_VAL 50
+
+
+const char *layout_names[] = { "bst", "avl", "bptree", "frozen" };
+
+
+/* Generates the pairs to add and the pairs to probe for, the same way
+ * mmperf does with the same seed, so that the number of probes found in
+ * the map can be compared against the real implementations.
+ */
+void generate_pairs(int *keys, int *vals, int num_pairs, int keygen_mode,
+                    int max_key, int max_val) {
+    int i, key = 0;
+
+    for (i = 0; i < num_pairs; i++) {
+        if (keygen_mode == MODE_RAND)
+            key = rand() % max_key;
+        else if (keygen_mode == MODE_INCR)
+            key = (i == 0) ? 0 : (key + 1) % (max_key + 1);
+        else
+            key = (i == 0) ? max_key : (key + max_key) % (max_key + 1);
+
+        keys[i] = key;
+        vals[i] = rand() % max_val;
+    }
+}
+
+
+/* Builds a multimap with the specified layout, then probes it and prints
+ * the memory statistics for the probes alone.  Returns the number of probes
+ * that were found in the map.
+ */
+int test_layout(membase_t *p_mem, uint32_t mem_size, int num_caches,
+                int layout, const int *keys, const int *vals, int num_pairs,
+                const int *probe_keys, const int *probe_vals,
+                int num_probes) {
+    sim_multimap mm;
+    uint64_t accesses, misses;
+    double start, seconds;
+    int i, hits;
+
+    printf("Adding %d pairs to a multimap with the %s layout.\n",
+           num_pairs, layout_names[layout]);
+
+    init_sim_multimap(&mm, p_mem, mem_size, layout);
+    for (i = 0; i < num_pairs; i++)
+        sim_mm_add_value(&mm, keys[i], vals[i]);
+    sim_mm_finish(&mm);
+
+    printf("Probing the multimap with %d pairs.\n", num_probes);
+
+    /* Only the probes are measured; building the map warms up the caches
+     * with whatever the last additions touched.
+     */
+    p_mem->reset_stats(p_mem);
+
+    start = get_wall_time();
+    for (i = 0, hits = 0; i < num_probes; i++) {
+        if (sim_mm_contains_pair(&mm, probe_keys[i], probe_vals[i]))
+            hits++;
+    }
+    seconds = get_wall_time() - start;
+
+    printf("\nMemory-Access Statistics (%s multimap):\n\n",
+           layout_names[layout]);
+    p_mem->print_stats(p_mem);
+
+    get_top_level_stats(p_mem, num_caches, &accesses, &misses);
+    printf("   %d of %d probes found in the multimap\n", hits, num_probes);
+    printf("   misses per probe=%.3f\n", (double) misses / num_probes);
+    printf("   simulated in %.2f seconds\n\n", seconds);
+
+    clear_sim_multimap(&mm);
+    return hits;
+}
+
+
+/* Prints the options this program takes, before the cache specifications. */
+void mmsim_usage(const char *progname) {
+    printf("usage: %s [-l bst|avl|bptree|frozen|all] [-m rand|incr|decr]\n"
+           "\t[-n pairs] [-p probes] [-k max_key] [-v max_val] "
+           "[cache-spec ...]\n\n", progname);
+    printf("\t-l selects the multimap layout to test (default all)\n");
+    printf("\t-m selects how keys are generated, like mmperf (default "
+           "rand)\n");
+    printf("\t-n and -p set the number of pairs to add and to probe for\n");
+    printf("\t   (defaults %d and %d)\n", DEFAULT_PAIRS, DEFAULT_PROBES);
+    printf("\t-k and -v set the range of keys and values (defaults %d and "
+           "%d)\n\n", DEFAULT_MAX_KEY, DEFAULT_MAX_VAL);
+    usage(progname);
+}
+
+
+int main(int argc, const char **argv) {
+    membase_t *p_mem;
+    int num_caches, opt, layout = -1, keygen_mode = MODE_RAND;
+    int num_pairs = DEFAULT_PAIRS, num_probes = DEFAULT_PROBES;
+    int max_key = DEFAULT_MAX_KEY, max_val = DEFAULT_MAX_VAL;
+    int *keys, *vals, *probe_keys, *probe_vals;
+    int hits, first_hits = -1, i;
+    uint32_t mem_size, size;
+
+    while ((opt = getopt(argc, (char * const *) argv, "l:m:n:p:k:v:")) != -1) {
+        switch (opt) {
+        case 'l':
+            for (i = 0; i < SIMMM_NUM_LAYOUTS; i++) {
+                if (strcmp(optarg, layout_names[i]) == 0)
+                    break;
+            }
+
+            if (i < SIMMM_NUM_LAYOUTS) {
+                layout = i;
+            }
+            else if (strcmp(optarg, "all") == 0) {
+                layout = -1;
+            }
+            else {
+                printf("ERROR:  unrecognized multimap layout \"%s\".\n",
+                       optarg);
+                mmsim_usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'm':
+            if (strcmp(optarg, "rand") == 0)
+                keygen_mode = MODE_RAND;
+            else if (strcmp(optarg, "incr") == 0)
+                keygen_mode = MODE_INCR;
+            else if (strcmp(optarg, "decr") == 0)
+                keygen_mode = MODE_DECR;
+            else {
+                printf("ERROR:  unrecognized key mode \"%s\".\n", optarg);
+                mmsim_usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'n':
+            num_pairs = atoi(optarg);
+            break;
+
+        case 'p':
+            num_probes = atoi(optarg);
+            break;
+
+        case 'k':
+            max_key = atoi(optarg);
+            break;
+
+        case 'v':
+            max_val = atoi(optarg);
+            break;
+
+        default:
+            mmsim_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_pairs < 1 || num_probes < 1 || max_key < 1 || max_val < 1) {
+        printf("ERROR:  counts and ranges must all be positive.\n");
+        return 1;
+    }
+
+    /* Everything left on the command-line is a cache specification.  Put
+     * the program name in front of them so that make_cached_memory() sees
+     * the same arguments it would without any options.
+     */
+    num_caches = argc - optind;
+    argv[optind - 1] = argv[0];
+
+    /* Set up the simulated memory, big enough for any of the layouts.
+     * make_cached_memory() rounds it up to a whole block of every cache.
+     */
+    mem_size = 0;
+    for (i = 0; i < SIMMM_NUM_LAYOUTS; i++) {
+        size = sim_mm_memory_size(i, num_pairs, max_key);
+        if ((layout == -1 || layout == i) && size > mem_size)
+            mem_size = size;
+    }
+
+    p_mem = make_cached_memory(num_caches + 1, argv + optind - 1, mem_size);
+
+    /* Generate the pairs to add and to probe for. */
+
+    keys = malloc(num_pairs * sizeof(int));
+    vals = malloc(num_pairs * sizeof(int));
+    probe_keys = malloc(num_probes * sizeof(int));
+    probe_vals = malloc(num_probes * sizeof(int));
+    if (keys == NULL || vals == NULL || probe_keys == NULL ||
+        probe_vals == NULL) {
+        printf("%s\n", "failed to allocate pairs");
+        return 1;
+    }
+
+    srand(11);
+    generate_pairs(keys, vals, num_pairs, keygen_mode, max_key, max_val);
+    generate_pairs(probe_keys, probe_vals, num_probes, MODE_RAND,
+                   max_key, max_val);
+
+    /* Every layout holds the same pairs, so they must all find the same
+     * probes.
+     */
+    for (i = 0; i < SIMMM_NUM_LAYOUTS; i++) {
+        if (layout != -1 && layout != i)
+            continue;
+
+        hits = test_layout(p_mem, mem_size, num_caches, i, keys, vals,
+                           num_pairs, probe_keys, probe_vals, num_probes);
+        if (first_hits == -1) {
+            first_hits = hits;
+        }
+        else if (hits != first_hits) {
+            printf("ERROR:  %s layout found %d probes, but the first layout "
+                   "found %d!\n", layout_names[i], hits, first_hits);
+            abort();
+        }
+    }
+
+    free(keys);
+    free(vals);
+    free(probe_keys);
+    free(probe_vals);
+
+    return 0;
+}
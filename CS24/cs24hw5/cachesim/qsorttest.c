@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <getopt.h>
 
 #include "memory.h"
 #include "cache.h"
@@ -17,39 +19,103 @@
 #define SEED 54321098
 
 
+/* Ranges at or below this size are finished off with an insertion sort by
+ * the introsort and the MSD radix sort.
+ */
+#define INSERTION_CUTOFF 16
+
+/* Radix sorts process this many bits of the key in each pass. */
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+/* The multiway mergesort first sorts runs of this many values, which should
+ * fit comfortably into the cache, and then merges MERGE_WAYS runs at a time.
+ */
+#define MERGE_RUN_SIZE 1024
+#define MERGE_WAYS 16
+
+
+/* The sorting algorithms this program can run. */
+#define SORT_QUICKSORT 0
+#define SORT_INTROSORT 1
+#define SORT_LSD_RADIX 2
+#define SORT_MSD_RADIX 3
+#define SORT_MERGESORT 4
+#define NUM_SORTS 5
+
+const char *sort_names[] = {
+    "quicksort", "introsort", "lsd", "msd", "merge"
+};
+
+
+/* An array of integers that the sorting algorithms operate on.  The values
+ * are stored in the simulated memory, unless native is non-NULL, in which
+ * case they are stored in that plain array so that the same algorithm can
+ * be timed on real hardware.  Algorithms that need scratch space use the
+ * num_values entries following the values themselves.
+ */
+typedef struct {
+    membase_t *p_mem;
+
+    int32_t *native;
+
+    int num_values;
+} int_array;
+
+
+/* Reads an integer from the array. */
+int get_value(int_array *arr, int i) {
+    if (arr->native != NULL)
+        return arr->native[i];
+
+    return read_int(arr->p_mem, i);
+}
+
+
+/* Writes an integer to the array. */
+void set_value(int_array *arr, int i, int value) {
+    if (arr->native != NULL) {
+        arr->native[i] = value;
+        return;
+    }
+
+    write_int(arr->p_mem, i, value);
+}
+
+
 /* This helper handles the task of swapping two integers in the simulated
  * memory.
  */
-void swap_values(membase_t *p_mem, int i, int j) {
-    int i_val = read_int(p_mem, i);
-    int j_val = read_int(p_mem, j);
+void swap_values(int_array *arr, int i, int j) {
+    int i_val = get_value(arr, i);
+    int j_val = get_value(arr, j);
 
-    write_int(p_mem, i, j_val);
-    write_int(p_mem, j, i_val);
+    set_value(arr, i, j_val);
+    set_value(arr, j, i_val);
 }
 
 
 /* This function partitions a range of values between the start and end
  * indexes, inclusive, and then returns the index of the pivot value.
  */
-int partition(membase_t *p_mem, int start, int end) {
+int partition(int_array *arr, int start, int end) {
     int pivot_idx, pivot, swap_idx, i;
 
     assert(end > start);
 
     pivot_idx = (start + end) / 2;
-    pivot = read_int(p_mem, pivot_idx);
-    swap_values(p_mem, pivot_idx, end);
+    pivot = get_value(arr, pivot_idx);
+    swap_values(arr, pivot_idx, end);
 
     swap_idx = start;
     for (i = start; i < end; i++) {
-        if (read_int(p_mem, i) < pivot) {
-            swap_values(p_mem, i, swap_idx);
+        if (get_value(arr, i) < pivot) {
+            swap_values(arr, i, swap_idx);
             swap_idx++;
         }
     }
 
-    swap_values(p_mem, swap_idx, end);
+    swap_values(arr, swap_idx, end);
 
     return swap_idx;
 }
@@ -60,15 +126,354 @@ int partition(membase_t *p_mem, int start, int end) {
  * operation, and the array is sorted in-place.  The start and end indexes
  * are inclusive.
  */
-void quicksort(membase_t *p_mem, int start, int end) {
+void quicksort(int_array *arr, int start, int end) {
     int pivot_idx;
 
     if (end <= start)
         return;
 
-    pivot_idx = partition(p_mem, start, end);
-    quicksort(p_mem, start, pivot_idx - 1);
-    quicksort(p_mem, pivot_idx + 1, end);
+    pivot_idx = partition(arr, start, end);
+    quicksort(arr, start, pivot_idx - 1);
+    quicksort(arr, pivot_idx + 1, end);
+}
+
+
+/* Sorts the values between the start and end indexes, inclusive, with an
+ * insertion sort.  This is used to finish off small ranges.
+ */
+void insertion_sort(int_array *arr, int start, int end) {
+    int i, j, value;
+
+    for (i = start + 1; i <= end; i++) {
+        value = get_value(arr, i);
+        for (j = i - 1; j >= start; j--) {
+            int prev = get_value(arr, j);
+            if (prev <= value)
+                break;
+
+            set_value(arr, j + 1, prev);
+        }
+        set_value(arr, j + 1, value);
+    }
+}
+
+
+/* Sifts a value down the max-heap stored in the range starting at the start
+ * index, which currently holds the specified number of values.  This is used
+ * by heapsort().
+ */
+void heap_sift_down(int_array *arr, int start, int index, int count) {
+    int value = get_value(arr, start + index);
+
+    while (2 * index + 1 < count) {
+        int child = 2 * index + 1;
+        int child_val = get_value(arr, start + child);
+
+        if (child + 1 < count) {
+            int right_val = get_value(arr, start + child + 1);
+            if (right_val > child_val) {
+                child++;
+                child_val = right_val;
+            }
+        }
+
+        if (child_val <= value)
+            break;
+
+        set_value(arr, start + index, child_val);
+        index = child;
+    }
+
+    set_value(arr, start + index, value);
+}
+
+
+/* Sorts the values between the start and end indexes, inclusive, with a
+ * heapsort.  Introsort falls back to this when quicksort recurses too deeply.
+ */
+void heapsort(int_array *arr, int start, int end) {
+    int count = end - start + 1;
+    int i;
+
+    for (i = count / 2 - 1; i >= 0; i--)
+        heap_sift_down(arr, start, i, count);
+
+    for (i = count - 1; i > 0; i--) {
+        swap_values(arr, start, start + i);
+        heap_sift_down(arr, start, 0, i);
+    }
+}
+
+
+/* This helper implements introsort on the range between the start and end
+ * indexes, inclusive.  It is a quicksort with a median-of-three pivot and a
+ * Hoare-style partition, which switches to heapsort once depth_limit levels
+ * of recursion have been used up, and which leaves small ranges for
+ * insertion sort.  The recursion always descends into the smaller partition,
+ * and loops on the larger one.
+ */
+void introsort_helper(int_array *arr, int start, int end, int depth_limit) {
+    while (end - start + 1 > INSERTION_CUTOFF) {
+        int mid, pivot, i, j;
+
+        if (depth_limit == 0) {
+            heapsort(arr, start, end);
+            return;
+        }
+        depth_limit--;
+
+        /* Order the first, middle and last values, and use the median. */
+        mid = start + (end - start) / 2;
+        if (get_value(arr, mid) < get_value(arr, start))
+            swap_values(arr, mid, start);
+        if (get_value(arr, end) < get_value(arr, start))
+            swap_values(arr, end, start);
+        if (get_value(arr, end) < get_value(arr, mid))
+            swap_values(arr, end, mid);
+        pivot = get_value(arr, mid);
+
+        i = start;
+        j = end;
+        while (i <= j) {
+            while (get_value(arr, i) < pivot)
+                i++;
+            while (get_value(arr, j) > pivot)
+                j--;
+            if (i <= j) {
+                if (i != j)
+                    swap_values(arr, i, j);
+                i++;
+                j--;
+            }
+        }
+
+        if (j - start < end - i) {
+            introsort_helper(arr, start, j, depth_limit);
+            start = i;
+        }
+        else {
+            introsort_helper(arr, i, end, depth_limit);
+            end = j;
+        }
+    }
+
+    insertion_sort(arr, start, end);
+}
+
+
+/* Sorts the values between the start and end indexes, inclusive, using
+ * introsort.
+ */
+void introsort(int_array *arr, int start, int end) {
+    int depth_limit = 0, n;
+
+    for (n = end - start + 1; n > 1; n /= 2)
+        depth_limit += 2;
+
+    introsort_helper(arr, start, end, depth_limit);
+}
+
+
+/* Returns the radix digit of a value for the pass at the specified shift.
+ * The sign bit is flipped so that negative values sort before positive
+ * values.
+ */
+int radix_digit(int value, int shift) {
+    return (((uint32_t) value ^ 0x80000000u) >> shift) & (RADIX_SIZE - 1);
+}
+
+
+/* Sorts the array using an LSD radix sort.  Each pass scatters the values
+ * from one half of the memory into the other half by the next digit, so the
+ * sort needs num_values entries of scratch space after the values.  There is
+ * an even number of passes, so the sorted values end up back where they
+ * started.  The digit counts are small, and are kept in a plain array as if
+ * they were in registers.
+ */
+void lsd_radix_sort(int_array *arr) {
+    int counts[RADIX_SIZE];
+    int n = arr->num_values;
+    int shift, i, src, dst, total;
+
+    src = 0;
+    dst = n;
+    for (shift = 0; shift < 32; shift += RADIX_BITS) {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < n; i++)
+            counts[radix_digit(get_value(arr, src + i), shift)]++;
+
+        /* Turn the counts into the starting position of each digit. */
+        for (i = 0, total = 0; i < RADIX_SIZE; i++) {
+            int count = counts[i];
+            counts[i] = total;
+            total += count;
+        }
+
+        for (i = 0; i < n; i++) {
+            int value = get_value(arr, src + i);
+            set_value(arr, dst + counts[radix_digit(value, shift)]++, value);
+        }
+
+        src = dst;
+        dst = n - dst;
+    }
+}
+
+
+/* This helper implements an in-place MSD radix sort (American flag sort) on
+ * the range between the start and end indexes, inclusive.  The values are
+ * counted by the digit at the specified shift, permuted into their buckets
+ * by following cycles, and then each bucket is sorted by the next digit.
+ */
+void msd_radix_helper(int_array *arr, int start, int end, int shift) {
+    int counts[RADIX_SIZE], next[RADIX_SIZE], bucket_end[RADIX_SIZE];
+    int i, digit, pos;
+
+    if (end - start + 1 <= INSERTION_CUTOFF) {
+        insertion_sort(arr, start, end);
+        return;
+    }
+
+    memset(counts, 0, sizeof(counts));
+    for (i = start; i <= end; i++)
+        counts[radix_digit(get_value(arr, i), shift)]++;
+
+    for (digit = 0, pos = start; digit < RADIX_SIZE; digit++) {
+        next[digit] = pos;
+        pos += counts[digit];
+        bucket_end[digit] = pos;
+    }
+
+    /* Move every value into its bucket.  Each swap puts at least one value
+     * into its final bucket.
+     */
+    for (digit = 0; digit < RADIX_SIZE; digit++) {
+        while (next[digit] < bucket_end[digit]) {
+            int value = get_value(arr, next[digit]);
+            int d = radix_digit(value, shift);
+
+            while (d != digit) {
+                int displaced = get_value(arr, next[d]);
+                set_value(arr, next[d]++, value);
+                value = displaced;
+                d = radix_digit(value, shift);
+            }
+
+            set_value(arr, next[digit]++, value);
+        }
+    }
+
+    if (shift == 0)
+        return;
+
+    for (digit = 0, pos = start; digit < RADIX_SIZE; digit++) {
+        if (counts[digit] > 1)
+            msd_radix_helper(arr, pos, pos + counts[digit] - 1,
+                             shift - RADIX_BITS);
+        pos += counts[digit];
+    }
+}
+
+
+/* Sorts the array using an in-place MSD radix sort. */
+void msd_radix_sort(int_array *arr) {
+    msd_radix_helper(arr, 0, arr->num_values - 1, 32 - RADIX_BITS);
+}
+
+
+/* Sorts the array using a block-wise multiway mergesort.  First, runs of
+ * MERGE_RUN_SIZE values are sorted in place with introsort, so that each run
+ * is sorted while it sits in the cache.  Then each pass merges MERGE_WAYS
+ * runs at a time from one half of the memory into the other half, so the
+ * values are streamed through the cache sequentially, and the number of
+ * passes over the data is log_{MERGE_WAYS}(n / MERGE_RUN_SIZE).  Only the
+ * current head of each run being merged is kept outside the memory.
+ */
+void multiway_mergesort(int_array *arr) {
+    int n = arr->num_values;
+    int run, start, src, dst, i;
+    int pos[MERGE_WAYS], run_end[MERGE_WAYS], head[MERGE_WAYS];
+
+    for (start = 0; start < n; start += MERGE_RUN_SIZE) {
+        int end = start + MERGE_RUN_SIZE - 1;
+        introsort(arr, start, (end < n) ? end : n - 1);
+    }
+
+    src = 0;
+    dst = n;
+    for (run = MERGE_RUN_SIZE; run < n; run *= MERGE_WAYS) {
+        for (start = 0; start < n; start += run * MERGE_WAYS) {
+            int ways = 0, out = dst + start;
+
+            /* Set up the heads of the runs being merged. */
+            for (i = 0; i < MERGE_WAYS && start + i * run < n; i++) {
+                pos[i] = start + i * run;
+                run_end[i] = (pos[i] + run < n) ? pos[i] + run : n;
+                head[i] = get_value(arr, src + pos[i]);
+                ways++;
+            }
+
+            while (ways > 0) {
+                int min = 0;
+                for (i = 1; i < ways; i++) {
+                    if (head[i] < head[min])
+                        min = i;
+                }
+
+                set_value(arr, out++, head[min]);
+                pos[min]++;
+
+                if (pos[min] < run_end[min]) {
+                    head[min] = get_value(arr, src + pos[min]);
+                }
+                else {
+                    /* This run is exhausted; replace it with the last one. */
+                    ways--;
+                    pos[min] = pos[ways];
+                    run_end[min] = run_end[ways];
+                    head[min] = head[ways];
+                }
+            }
+        }
+
+        src = dst;
+        dst = n - dst;
+    }
+
+    /* If the last pass left the values in the scratch half, copy them back. */
+    if (src != 0) {
+        for (i = 0; i < n; i++)
+            set_value(arr, i, get_value(arr, src + i));
+    }
+}
+
+
+/* Runs the specified sorting algorithm on the array. */
+void run_sort(int_array *arr, int sort) {
+    switch (sort) {
+    case SORT_QUICKSORT:
+        quicksort(arr, 0, arr->num_values - 1);
+        break;
+
+    case SORT_INTROSORT:
+        introsort(arr, 0, arr->num_values - 1);
+        break;
+
+    case SORT_LSD_RADIX:
+        lsd_radix_sort(arr);
+        break;
+
+    case SORT_MSD_RADIX:
+        msd_radix_sort(arr);
+        break;
+
+    case SORT_MERGESORT:
+        multiway_mergesort(arr);
+        break;
+
+    default:
+        assert(0);
+    }
 }
 
 
@@ -83,63 +488,184 @@ int compare_int_ptrs(const void *v1, const void *v2) {
 }
 
 
+/* Counts how many values in the array don't match the sorted values. */
+int check_sorted(int_array *arr, int *sorted) {
+    int i, errors = 0;
+
+    for (i = 0; i < arr->num_values; i++) {
+        int val = get_value(arr, i);
+        if (val != sorted[i]) {
+            if (errors == 0) {
+                printf("ERROR:  sorted arrays don't match at index %d!  "
+                       "data[i] = %d, verify[i] = %d\n", i, val, sorted[i]);
+            }
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
+
+/* Runs one sorting algorithm against the inputs, both in the simulated
+ * memory and natively, and prints the misses per element and the native
+ * wall-clock time.
+ */
+void test_sort(int_array *arr, int_array *native, int num_caches,
+               int *inputs, int *sorted, int sort) {
+    uint64_t accesses, misses;
+    double start, seconds;
+    int i, n = arr->num_values;
+
+    printf("Sorting the array of integers with %s.\n", sort_names[sort]);
+
+    /* Store the inputs into the memory simulator, then only count the
+     * accesses made by the sort itself.
+     */
+    for (i = 0; i < n; i++)
+        set_value(arr, i, inputs[i]);
+
+    arr->p_mem->reset_stats(arr->p_mem);
+    run_sort(arr, sort);
+    get_top_level_stats(arr->p_mem, num_caches, &accesses, &misses);
+
+    /* The results are checked after the statistics are printed, since
+     * reading them back goes through the simulated memory too.
+     */
+    printf("\nMemory-Access Statistics (%s):\n\n", sort_names[sort]);
+    arr->p_mem->print_stats(arr->p_mem);
+
+    if (check_sorted(arr, sorted) != 0) {
+        printf("Some values didn't match, aborting.\n");
+        abort();
+    }
+
+    /* Now time the same algorithm natively. */
+    memcpy(native->native, inputs, n * sizeof(int));
+    start = get_wall_time();
+    run_sort(native, sort);
+    seconds = get_wall_time() - start;
+
+    if (check_sorted(native, sorted) != 0) {
+        printf("Some values didn't match in the native sort, aborting.\n");
+        abort();
+    }
+
+    printf("   misses per element=%.4f  native wall-clock time=%.4f "
+           "seconds\n\n", (double) misses / (double) n, seconds);
+}
+
+
+/* Prints the options this program takes, before the cache specifications. */
+void sort_usage(const char *progname) {
+    int i;
+
+    printf("usage: %s [-s sort|all] [-n count] [cache-spec ...]\n\n",
+           progname);
+    printf("\t-s selects the sorting algorithm (default quicksort), one of:\n");
+    printf("\t  ");
+    for (i = 0; i < NUM_SORTS; i++)
+        printf(" %s", sort_names[i]);
+    printf("\n");
+    printf("\t-n sets the number of integers to sort (default %d)\n\n",
+           NUM_ELEMS);
+    usage(progname);
+}
+
+
 int main(int argc, const char **argv) {
-    int *inputs;
-    int i, error;
+    int *inputs, *sorted;
+    int i, c, num_caches, num_elems = NUM_ELEMS, sort = SORT_QUICKSORT;
+    int test_all = 0;
     membase_t *p_mem;
+    int_array arr, native;
+
+    while ((c = getopt(argc, (char * const *) argv, "s:n:")) != -1) {
+        switch (c) {
+        case 's':
+            if (strcmp(optarg, "all") == 0) {
+                test_all = 1;
+                break;
+            }
+
+            for (sort = 0; sort < NUM_SORTS; sort++) {
+                if (strcmp(optarg, sort_names[sort]) == 0)
+                    break;
+            }
+            if (sort == NUM_SORTS) {
+                printf("ERROR:  unrecognized sort \"%s\".\n", optarg);
+                sort_usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'n':
+            num_elems = atoi(optarg);
+            if (num_elems <= 0) {
+                printf("ERROR:  count must be positive, got %d.\n", num_elems);
+                return 1;
+            }
+            break;
+
+        default:
+            sort_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* Everything left on the command-line is a cache specification.  Put
+     * the program name in front of them so that make_cached_memory() sees
+     * the same arguments it would without any options.
+     */
+    num_caches = argc - optind;
+    argv[optind - 1] = argv[0];
+
+    /* Set up the simulated memory, with scratch space after the values;
+     * make_cached_memory() rounds it up to a whole block of every cache.
+     */
+    p_mem = make_cached_memory(num_caches + 1, argv + optind - 1,
+                               2 * num_elems * sizeof(int));
 
-    /* Set up the simulated memory. */
-    p_mem = make_cached_memory(argc, argv, NUM_ELEMS * sizeof(int));
+    arr.p_mem = p_mem;
+    arr.native = NULL;
+    arr.num_values = num_elems;
 
-    /* Generate random floats to sort. */
+    native.p_mem = NULL;
+    native.native = malloc(2 * num_elems * sizeof(int));
+    native.num_values = num_elems;
 
-    printf("Generating %d random ints to sort.\n", NUM_ELEMS);
+    /* Generate random ints to sort. */
 
-    inputs = malloc(NUM_ELEMS * sizeof(float));
+    printf("Generating %d random ints to sort.\n", num_elems);
+
+    inputs = malloc(num_elems * sizeof(int));
+    sorted = malloc(num_elems * sizeof(int));
 
     srand(SEED);
 
     /* Generate the inputs, then store them into the memory simulator in a
-     * separate loop, so that the inputs we use don't change if the random
+     * separate step, so that the inputs we use don't change if the random
      * replacement policy is currently in effect.
      */
-    for (i = 0; i < NUM_ELEMS; i++)
+    for (i = 0; i < num_elems; i++)
         inputs[i] = rand();
-    
-    for (i = 0; i < NUM_ELEMS; i++)
-        write_int(p_mem, i, inputs[i]);
-
-    /* Quicksort the array of integers. */
-
-    printf("Quicksorting the array of integers.\n");
-    quicksort(p_mem, 0, NUM_ELEMS - 1);
 
-    /* Sort the inputs so that we can check the heap's results. */
+    /* Sort the inputs so that we can check the results. */
 
-    printf("Checking the results against the sorted inputs.\n");
+    memcpy(sorted, inputs, num_elems * sizeof(int));
+    qsort(sorted, num_elems, sizeof(int), compare_int_ptrs);
 
-    qsort(inputs, NUM_ELEMS, sizeof(float), compare_int_ptrs);
-
-    error = 0;
-    for (i = 0; i < NUM_ELEMS; i++) {
-        int val = read_int(p_mem, i);
-        if (val != inputs[i]) {
-            printf("ERROR:  sorted arrays don't match at index %d!  "
-                   "data[i] = %d, verify[i] = %d\n", i, val, inputs[i]);
-            error = 1;
-        }
+    if (test_all) {
+        for (sort = 0; sort < NUM_SORTS; sort++)
+            test_sort(&arr, &native, num_caches, inputs, sorted, sort);
     }
-
-    if (error) {
-        printf("Some values didn't match, aborting.\n");
-        abort();
+    else {
+        test_sort(&arr, &native, num_caches, inputs, sorted, sort);
     }
 
-    /* Print out the results of the quicksort. */
-
-    printf("\nMemory-Access Statistics:\n\n");
-    p_mem->print_stats(p_mem);
-    printf("\n");
+    free(inputs);
+    free(sorted);
+    free(native.native);
 
     return 0;
 }
@@ -0,0 +1,97 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "simheap.h"
+
+
+/* Initialize a heap over the first mem_size bytes of the memory. */
+void init_sim_heap(sim_heap *p_heap, membase_t *memory, uint32_t mem_size) {
+    assert(p_heap != NULL);
+    assert(memory != NULL);
+    assert(mem_size > SIM_HEAP_START);
+
+    p_heap->memory = memory;
+    p_heap->next = SIM_HEAP_START;
+    p_heap->end = mem_size;
+}
+
+
+/* Allocates a block of the specified size from the heap. */
+addr_t sim_alloc(sim_heap *p_heap, uint32_t size, uint32_t align) {
+    addr_t address;
+
+    assert(p_heap != NULL);
+    assert(align >= 4 && (align & (align - 1)) == 0);
+
+    address = (p_heap->next + align - 1) & ~(align - 1);
+    if (address < p_heap->next || size > p_heap->end - address) {
+        /* Simple error handling for running out of simulated memory. */
+        printf("size requested %u\n", size);
+        printf("%s\n", "simulated heap is out of memory");
+        exit(1);
+    }
+
+    p_heap->next = address + size;
+    return address;
+}
+
+
+/* Moves a block to a new, larger block. */
+addr_t sim_realloc(sim_heap *p_heap, addr_t old, uint32_t old_size,
+                   uint32_t new_size, uint32_t align) {
+    addr_t address;
+
+    assert(new_size >= old_size);
+
+    address = sim_alloc(p_heap, new_size, align);
+    if (old != SIM_NULL)
+        sim_move(p_heap, address, old, old_size);
+
+    return address;
+}
+
+
+/* Reads the 32-bit int at a 4-byte aligned address. */
+int32_t sim_read(sim_heap *p_heap, addr_t address) {
+    assert(address % 4 == 0);
+    assert(address >= SIM_HEAP_START && address < p_heap->next);
+
+    return read_int(p_heap->memory, address / 4);
+}
+
+
+/* Writes the 32-bit int at a 4-byte aligned address. */
+void sim_write(sim_heap *p_heap, addr_t address, int32_t value) {
+    assert(address % 4 == 0);
+    assert(address >= SIM_HEAP_START && address < p_heap->next);
+
+    write_int(p_heap->memory, address / 4, value);
+}
+
+
+/* Copies size bytes from src to dest, which may overlap. */
+void sim_move(sim_heap *p_heap, addr_t dest, addr_t src, uint32_t size) {
+    uint32_t i;
+
+    assert(size % 4 == 0);
+
+    if (dest < src) {
+        for (i = 0; i < size; i += 4)
+            sim_write(p_heap, dest + i, sim_read(p_heap, src + i));
+    }
+    else if (dest > src) {
+        for (i = size; i > 0; i -= 4)
+            sim_write(p_heap, dest + i - 4, sim_read(p_heap, src + i - 4));
+    }
+}
+
+
+/* Sets size bytes starting at the address to zero. */
+void sim_zero(sim_heap *p_heap, addr_t address, uint32_t size) {
+    uint32_t i;
+
+    assert(size % 4 == 0);
+
+    for (i = 0; i < size; i += 4)
+        sim_write(p_heap, address + i, 0);
+}
@@ -0,0 +1,62 @@
+#ifndef __SIMHEAP_H__
+#define __SIMHEAP_H__
+
+
+#include "membase.h"
+
+
+/* The simulated heap never hands out the first SIM_HEAP_START bytes of the
+ * memory, so that address 0 can stand in for a null pointer.
+ */
+#define SIM_NULL 0
+#define SIM_HEAP_START 64
+
+
+/* A simple heap that carves blocks out of a simulated memory, so that data
+ * structures can be laid out in the memory the same way malloc() would lay
+ * them out in the real memory, and then be accessed through the caches.
+ *
+ * Blocks are handed out in address order and never reused; like the arenas
+ * of the multimap implementations, everything is released at once by
+ * initializing the heap again.
+ */
+typedef struct {
+    /* The memory that the heap allocates from. */
+    membase_t *memory;
+
+    /* The address of the next byte that hasn't been allocated yet. */
+    addr_t next;
+
+    /* The end of the memory; the heap can't grow past this. */
+    addr_t end;
+} sim_heap;
+
+
+/* Initialize a heap over the first mem_size bytes of the memory. */
+void init_sim_heap(sim_heap *p_heap, membase_t *memory, uint32_t mem_size);
+
+/* Allocates a block of the specified size from the heap.  The alignment
+ * must be a power of 2 of at least 4.  Like malloc(), the contents of the
+ * new block are whatever was left in the memory.
+ */
+addr_t sim_alloc(sim_heap *p_heap, uint32_t size, uint32_t align);
+
+/* Moves a block to a new, larger block, the way realloc() does when it
+ * can't grow a block in place.  The old block is not reused.
+ */
+addr_t sim_realloc(sim_heap *p_heap, addr_t old, uint32_t old_size,
+                   uint32_t new_size, uint32_t align);
+
+/* Reads and writes the 32-bit int at a 4-byte aligned address. */
+int32_t sim_read(sim_heap *p_heap, addr_t address);
+void sim_write(sim_heap *p_heap, addr_t address, int32_t value);
+
+/* Copies size bytes from src to dest, which may overlap, like memmove().
+ * Both addresses and the size must be multiples of 4.
+ */
+void sim_move(sim_heap *p_heap, addr_t dest, addr_t src, uint32_t size);
+
+/* Sets size bytes starting at the address to zero, like bzero(). */
+void sim_zero(sim_heap *p_heap, addr_t address, uint32_t size);
+
+#endif /* __SIMHEAP_H__ */
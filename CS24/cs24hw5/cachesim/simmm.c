@@ -0,0 +1,1135 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simmm.h"
+#include "../multimap/mm_layout.h"
+
+
+/*
+ * These are declarations of local functions that are used internally by the
+ * simulated multimaps, but are not visible outside this module.
+ */
+
+addr_t bst_find_node(sim_multimap *mm, int key, int create_if_not_found);
+void bst_add_value(sim_multimap *mm, int key, int value);
+int bst_contains_pair(sim_multimap *mm, int key, int value);
+
+addr_t avl_node(sim_multimap *mm, int32_t index);
+int32_t avl_add_node(sim_multimap *mm, int key);
+int32_t avl_height(sim_multimap *mm, int32_t index);
+void avl_update_height(sim_multimap *mm, int32_t index);
+int32_t avl_rotate(sim_multimap *mm, int32_t index, int to_left);
+int32_t avl_rebalance(sim_multimap *mm, int32_t index);
+int32_t avl_insert(sim_multimap *mm, int32_t index, int key,
+                   int32_t *new_index);
+int32_t avl_find_node(sim_multimap *mm, int key);
+int32_t pool_alloc(sim_multimap *mm, int32_t num_spaces);
+void pool_free(sim_multimap *mm, int32_t offset, int32_t num_spaces);
+addr_t pool_address(sim_multimap *mm, int32_t offset);
+uint32_t value_hash(int value, int32_t num_slots);
+void value_set_insert(sim_multimap *mm, int32_t set, int32_t num_slots,
+                      int value);
+void build_value_set(sim_multimap *mm, addr_t node);
+void avl_add_value(sim_multimap *mm, int key, int value);
+int avl_contains_pair(sim_multimap *mm, int key, int value);
+
+addr_t grow_pool(sim_multimap *mm, addr_t pool, uint32_t elem_size,
+                 int32_t num_elems, int32_t *max_elems);
+addr_t bpt_internal(sim_multimap *mm, int32_t index);
+addr_t bpt_leaf(sim_multimap *mm, int32_t index);
+addr_t bpt_list(sim_multimap *mm, int32_t index);
+int32_t bpt_alloc_internal(sim_multimap *mm);
+int32_t bpt_alloc_leaf(sim_multimap *mm);
+int32_t bpt_alloc_list(sim_multimap *mm);
+int bpt_find_child(sim_multimap *mm, addr_t node, int key);
+int bpt_find_in_leaf(sim_multimap *mm, addr_t leaf, int key);
+int bpt_lower_bound(sim_multimap *mm, addr_t leaf, int key);
+void bpt_leaf_insert(sim_multimap *mm, addr_t leaf, int key, int32_t list);
+int bpt_insert(sim_multimap *mm, int32_t index, int level, int key,
+               int32_t *list, int *split_key, int32_t *split_index);
+void bpt_add_value(sim_multimap *mm, int key, int value);
+int bpt_contains_pair(sim_multimap *mm, int key, int value);
+
+int compare_pairs(const void *a, const void *b);
+int32_t assign_eytzinger(int32_t *pos_key, int32_t n, int32_t i, int32_t k);
+void frozen_add_value(sim_multimap *mm, int key, int value);
+void frozen_build(sim_multimap *mm);
+int frozen_contains_pair(sim_multimap *mm, int key, int value);
+
+
+/* Shorthands for reading and writing the int at an address in the
+ * multimap's simulated memory.
+ */
+#define GET(mm, address) sim_read(&(mm)->heap, (address))
+#define SET(mm, address, value) sim_write(&(mm)->heap, (address), (value))
+
+/* Both malloc() and the multimap arenas hand out 16-byte aligned blocks. */
+#define MALLOC_ALIGN 16
+
+#define NULL_INDEX -1
+
+
+/*
+ * The layout of mm_impl.c on a 64-bit machine.  A tree node is an int key
+ * followed by four pointers, and a value node is an int value followed by
+ * a pointer, each padded so that the pointers are 8-byte aligned.  The
+ * sizes of these, and of the other multimaps' nodes, are in mm_layout.h,
+ * which the multimaps check their structs against.
+ */
+#define BST_KEY          0
+#define BST_VALUES       8
+#define BST_VALUES_TAIL 16
+#define BST_LEFT        24
+#define BST_RIGHT       32
+
+#define VALUE_VALUE      0
+#define VALUE_NEXT       8
+
+
+/*
+ * The layout of opt_mm_impl.c.  The values and value_set fields are 64-bit
+ * offsets into the value pool; since the simulated memory is much smaller
+ * than that, only their low words are used, and a NULL_OFFSET is -1 there.
+ */
+#define AVL_KEY          0
+#define AVL_HEIGHT       4
+#define AVL_NUM_VALUES   8
+#define AVL_NUM_SPACES  12
+#define AVL_VALUES      16
+#define AVL_VALUE_SET   24
+#define AVL_LEFT        32
+#define AVL_RIGHT       36
+
+#define NULL_OFFSET -1
+#define EMPTY_SLOT INT_MIN
+#define MIN_BLOCK_SPACES 2
+#define FIRST_POOL_SPACES 1024
+
+
+/*
+ * The layout of bptree_mm_impl.c.  Internal nodes and leaves are both 128
+ * bytes, and both keep their keys at the start and their number of keys
+ * just after the last key.  A value-list is a pointer to its values,
+ * followed by its number of values and of spaces.
+ */
+#define BPT_KEYS          0
+#define BPT_NUM_KEYS     60
+#define BPT_CHILDREN     64
+#define BPT_LISTS        64
+#define BPT_NEXT_LEAF   124
+
+#define LIST_VALUES       0
+#define LIST_NUM_VALUES   8
+#define LIST_NUM_SPACES  12
+
+#define FIRST_POOL_ELEMS 16
+
+
+/*
+ * The layout of a frozen opt_mm_impl.c.  The key array starts on a cache
+ * line, and the start of each key's values is a 64-bit index.
+ */
+#define FROZEN_ALIGN 64
+#define START_BYTES 8
+
+
+/* Initialize an empty multimap with the specified layout. */
+void init_sim_multimap(sim_multimap *mm, membase_t *memory,
+                       uint32_t mem_size, int layout) {
+    int i;
+
+    assert(mm != NULL);
+    assert(layout >= 0 && layout < SIMMM_NUM_LAYOUTS);
+
+    memset(mm, 0, sizeof(sim_multimap));
+    mm->layout = layout;
+    init_sim_heap(&mm->heap, memory, mem_size);
+
+    if (layout == SIMMM_BST) {
+        mm->root = SIM_NULL;
+    }
+    else {
+        mm->root = NULL_INDEX;
+        mm->value_pool = SIM_NULL;
+        for (i = 0; i < SIMMM_BLOCK_CLASSES; i++)
+            mm->free_blocks[i] = NULL_OFFSET;
+    }
+}
+
+
+/* Releases the memory that a multimap uses outside the simulated memory. */
+void clear_sim_multimap(sim_multimap *mm) {
+    assert(mm != NULL);
+
+    free(mm->pending_keys);
+    free(mm->pending_values);
+    mm->pending_keys = NULL;
+    mm->pending_values = NULL;
+    mm->num_pending = 0;
+    mm->max_pending = 0;
+}
+
+
+/* Returns the number of bytes of memory that is sure to be enough for a
+ * multimap with the specified layout.  These are rough upper bounds, which
+ * include every block that is given up when a pool or array is moved.
+ */
+uint32_t sim_mm_memory_size(int layout, int num_pairs, int max_key) {
+    uint64_t keys = (num_pairs < max_key + 1) ? num_pairs : max_key + 1;
+    uint64_t pairs = num_pairs, size;
+
+    if (layout == SIMMM_BST) {
+        size = keys * 48 + pairs * BST_VALUE_BYTES;
+    }
+    else if (layout == SIMMM_AVL) {
+        /* The node pool grows by a factor of 4, and every value block and
+         * hash set is given up for one twice its size as it grows.
+         */
+        size = keys * 8 * AVL_NODE_BYTES + pairs * 192 + keys * 32;
+    }
+    else if (layout == SIMMM_BPTREE) {
+        size = keys * 64 + keys * 2 * VALUE_LIST_BYTES + pairs * 48;
+    }
+    else {
+        assert(layout == SIMMM_FROZEN);
+        size = keys * (4 + START_BYTES) + pairs * 4;
+    }
+
+    size += SIM_HEAP_START + 64 * 1024;
+    if (size > UINT32_MAX - 4095) {
+        printf("%s\n", "multimap is too large for the simulated memory");
+        exit(1);
+    }
+
+    return (uint32_t) size;
+}
+
+
+/* Adds the specified (key, value) pair to the multimap. */
+void sim_mm_add_value(sim_multimap *mm, int key, int value) {
+    assert(mm != NULL);
+
+    if (mm->layout == SIMMM_BST)
+        bst_add_value(mm, key, value);
+    else if (mm->layout == SIMMM_AVL)
+        avl_add_value(mm, key, value);
+    else if (mm->layout == SIMMM_BPTREE)
+        bpt_add_value(mm, key, value);
+    else
+        frozen_add_value(mm, key, value);
+}
+
+
+/* Finishes building the multimap after the last pair has been added. */
+void sim_mm_finish(sim_multimap *mm) {
+    assert(mm != NULL);
+
+    if (mm->layout == SIMMM_FROZEN)
+        frozen_build(mm);
+}
+
+
+/* Returns nonzero if the multimap contains the specified (key, value) pair,
+ * zero otherwise.
+ */
+int sim_mm_contains_pair(sim_multimap *mm, int key, int value) {
+    assert(mm != NULL);
+
+    if (mm->layout == SIMMM_BST)
+        return bst_contains_pair(mm, key, value);
+    else if (mm->layout == SIMMM_AVL)
+        return avl_contains_pair(mm, key, value);
+    else if (mm->layout == SIMMM_BPTREE)
+        return bpt_contains_pair(mm, key, value);
+    else
+        return frozen_contains_pair(mm, key, value);
+}
+
+
+/*==================*/
+/* BINARY TREE      */
+/*==================*/
+
+
+/* Searches for the node with the specified key, the way find_mm_node() in
+ * mm_impl.c does, and adds a node for it at the bottom of the tree if
+ * there is none and create_if_not_found is nonzero.
+ */
+addr_t bst_find_node(sim_multimap *mm, int key, int create_if_not_found) {
+    addr_t node = mm->root, parent = SIM_NULL, new_node;
+    int parent_key = 0;
+
+    while (node != SIM_NULL) {
+        parent_key = GET(mm, node + BST_KEY);
+        if (parent_key == key)
+            return node;
+
+        parent = node;
+        if (parent_key > key)
+            node = GET(mm, node + BST_LEFT);
+        else
+            node = GET(mm, node + BST_RIGHT);
+    }
+
+    if (!create_if_not_found)
+        return SIM_NULL;
+
+    new_node = sim_alloc(&mm->heap, BST_NODE_BYTES, MALLOC_ALIGN);
+    SET(mm, new_node + BST_KEY, key);
+    SET(mm, new_node + BST_VALUES, SIM_NULL);
+    SET(mm, new_node + BST_VALUES_TAIL, SIM_NULL);
+    SET(mm, new_node + BST_LEFT, SIM_NULL);
+    SET(mm, new_node + BST_RIGHT, SIM_NULL);
+
+    if (parent == SIM_NULL)
+        mm->root = new_node;
+    else if (parent_key > key)
+        SET(mm, parent + BST_LEFT, new_node);
+    else
+        SET(mm, parent + BST_RIGHT, new_node);
+
+    return new_node;
+}
+
+
+/* Appends a value node to the end of the key's list of values. */
+void bst_add_value(sim_multimap *mm, int key, int value) {
+    addr_t node = bst_find_node(mm, key, 1), tail, new_value;
+
+    new_value = sim_alloc(&mm->heap, BST_VALUE_BYTES, MALLOC_ALIGN);
+    SET(mm, new_value + VALUE_VALUE, value);
+    SET(mm, new_value + VALUE_NEXT, SIM_NULL);
+
+    tail = GET(mm, node + BST_VALUES_TAIL);
+    if (tail == SIM_NULL)
+        SET(mm, node + BST_VALUES, new_value);
+    else
+        SET(mm, tail + VALUE_NEXT, new_value);
+    SET(mm, node + BST_VALUES_TAIL, new_value);
+}
+
+
+/* Finds the key's node, then walks its list of values. */
+int bst_contains_pair(sim_multimap *mm, int key, int value) {
+    addr_t node = bst_find_node(mm, key, 0), curr;
+
+    if (node == SIM_NULL)
+        return 0;
+
+    for (curr = GET(mm, node + BST_VALUES); curr != SIM_NULL;
+         curr = GET(mm, curr + VALUE_NEXT)) {
+        if (GET(mm, curr + VALUE_VALUE) == value)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*==================*/
+/* AVL TREE         */
+/*==================*/
+
+
+/* Returns the address of the node at the index of the node pool. */
+addr_t avl_node(sim_multimap *mm, int32_t index) {
+    assert(index >= 0 && index < mm->num_nodes);
+    return mm->nodes + (addr_t) index * AVL_NODE_BYTES;
+}
+
+
+/* Adds an empty node for the key to the node pool, quadrupling the pool
+ * when it is full, and returns the node's index.
+ */
+int32_t avl_add_node(sim_multimap *mm, int key) {
+    addr_t node;
+
+    if (mm->num_nodes == mm->max_nodes) {
+        int32_t new_max = (mm->max_nodes == 0) ? 1 : mm->max_nodes * 4;
+
+        mm->nodes = sim_realloc(&mm->heap, mm->nodes,
+                                mm->num_nodes * AVL_NODE_BYTES,
+                                new_max * AVL_NODE_BYTES, MALLOC_ALIGN);
+        mm->max_nodes = new_max;
+    }
+
+    node = mm->nodes + (addr_t) mm->num_nodes * AVL_NODE_BYTES;
+    mm->num_nodes++;
+
+    SET(mm, node + AVL_KEY, key);
+    SET(mm, node + AVL_HEIGHT, 1);
+    SET(mm, node + AVL_NUM_VALUES, 0);
+    SET(mm, node + AVL_NUM_SPACES, 0);
+    SET(mm, node + AVL_VALUES, NULL_OFFSET);
+    SET(mm, node + AVL_VALUE_SET, NULL_OFFSET);
+    SET(mm, node + AVL_LEFT, NULL_INDEX);
+    SET(mm, node + AVL_RIGHT, NULL_INDEX);
+    return mm->num_nodes - 1;
+}
+
+
+/* Returns the height of the subtree at the index, or 0 for no subtree. */
+int32_t avl_height(sim_multimap *mm, int32_t index) {
+    if (index == NULL_INDEX)
+        return 0;
+
+    return GET(mm, avl_node(mm, index) + AVL_HEIGHT);
+}
+
+
+/* Recomputes a node's height from the heights of its children. */
+void avl_update_height(sim_multimap *mm, int32_t index) {
+    addr_t node = avl_node(mm, index);
+    int32_t left = avl_height(mm, GET(mm, node + AVL_LEFT));
+    int32_t right = avl_height(mm, GET(mm, node + AVL_RIGHT));
+
+    SET(mm, node + AVL_HEIGHT, 1 + (left > right ? left : right));
+}
+
+
+/* Rotates the subtree at the index to the left or to the right, and returns
+ * the index of the new root of the subtree.
+ */
+int32_t avl_rotate(sim_multimap *mm, int32_t index, int to_left) {
+    addr_t node = avl_node(mm, index);
+    int down = to_left ? AVL_RIGHT : AVL_LEFT;
+    int up = to_left ? AVL_LEFT : AVL_RIGHT;
+    int32_t pivot = GET(mm, node + down);
+
+    SET(mm, node + down, GET(mm, avl_node(mm, pivot) + up));
+    SET(mm, avl_node(mm, pivot) + up, index);
+
+    avl_update_height(mm, index);
+    avl_update_height(mm, pivot);
+    return pivot;
+}
+
+
+/* Restores the AVL property at a node after an insertion below it. */
+int32_t avl_rebalance(sim_multimap *mm, int32_t index) {
+    addr_t node = avl_node(mm, index);
+    int32_t left, right, balance;
+
+    avl_update_height(mm, index);
+    left = GET(mm, node + AVL_LEFT);
+    right = GET(mm, node + AVL_RIGHT);
+    balance = avl_height(mm, left) - avl_height(mm, right);
+
+    if (balance > 1) {
+        if (avl_height(mm, GET(mm, avl_node(mm, left) + AVL_LEFT)) <
+            avl_height(mm, GET(mm, avl_node(mm, left) + AVL_RIGHT))) {
+            SET(mm, node + AVL_LEFT, avl_rotate(mm, left, 1));
+        }
+        return avl_rotate(mm, index, 0);
+    }
+    else if (balance < -1) {
+        if (avl_height(mm, GET(mm, avl_node(mm, right) + AVL_RIGHT)) <
+            avl_height(mm, GET(mm, avl_node(mm, right) + AVL_LEFT))) {
+            SET(mm, node + AVL_RIGHT, avl_rotate(mm, right, 0));
+        }
+        return avl_rotate(mm, index, 1);
+    }
+
+    return index;
+}
+
+
+/* Inserts a new node for the key into the subtree at the index, and
+ * returns the index of the root of the subtree after rebalancing.  Nodes
+ * are referred to by index, since adding a node may move the pool.
+ */
+int32_t avl_insert(sim_multimap *mm, int32_t index, int key,
+                   int32_t *new_index) {
+    int child_field;
+    int32_t child;
+
+    if (index == NULL_INDEX) {
+        *new_index = avl_add_node(mm, key);
+        return *new_index;
+    }
+
+    child_field = (GET(mm, avl_node(mm, index) + AVL_KEY) > key) ?
+                  AVL_LEFT : AVL_RIGHT;
+    child = avl_insert(mm, GET(mm, avl_node(mm, index) + child_field), key,
+                       new_index);
+    SET(mm, avl_node(mm, index) + child_field, child);
+
+    return avl_rebalance(mm, index);
+}
+
+
+/* Returns the index of the node with the specified key, or NULL_INDEX. */
+int32_t avl_find_node(sim_multimap *mm, int key) {
+    int32_t index = mm->root;
+    int node_key;
+
+    while (index != NULL_INDEX) {
+        addr_t node = avl_node(mm, index);
+
+        node_key = GET(mm, node + AVL_KEY);
+        if (node_key == key)
+            return index;
+
+        if (node_key > key)
+            index = GET(mm, node + AVL_LEFT);
+        else
+            index = GET(mm, node + AVL_RIGHT);
+    }
+
+    return NULL_INDEX;
+}
+
+
+/* Returns the address of an offset in the value pool. */
+addr_t pool_address(sim_multimap *mm, int32_t offset) {
+    assert(offset >= 0 && offset < mm->pool_used);
+    return mm->value_pool + (addr_t) offset * 4;
+}
+
+
+/* Hands out a block of the value pool, reusing a freed block of the same
+ * size first, or else taking it from the end of the pool and doubling the
+ * pool when it fills up.  num_spaces must be a power of 2.
+ */
+int32_t pool_alloc(sim_multimap *mm, int32_t num_spaces) {
+    int c = __builtin_ctz(num_spaces);
+    int32_t offset = mm->free_blocks[c];
+
+    assert(num_spaces >= MIN_BLOCK_SPACES && c < SIMMM_BLOCK_CLASSES);
+    assert((num_spaces & (num_spaces - 1)) == 0);
+
+    if (offset != NULL_OFFSET) {
+        mm->free_blocks[c] = GET(mm, pool_address(mm, offset));
+        return offset;
+    }
+
+    if (mm->pool_used + num_spaces > mm->pool_size) {
+        int32_t new_size = (mm->pool_size == 0) ?
+                           FIRST_POOL_SPACES : mm->pool_size * 2;
+
+        while (new_size < mm->pool_used + num_spaces)
+            new_size *= 2;
+
+        mm->value_pool = sim_realloc(&mm->heap, mm->value_pool,
+                                     mm->pool_used * 4, new_size * 4,
+                                     MALLOC_ALIGN);
+        mm->pool_size = new_size;
+    }
+
+    offset = mm->pool_used;
+    mm->pool_used += num_spaces;
+    return offset;
+}
+
+
+/* Returns a block to the free list for blocks of its size. */
+void pool_free(sim_multimap *mm, int32_t offset, int32_t num_spaces) {
+    int c = __builtin_ctz(num_spaces);
+
+    SET(mm, pool_address(mm, offset), mm->free_blocks[c]);
+    mm->free_blocks[c] = offset;
+}
+
+
+/* Hashes a value to its home slot in a value hash set, like opt_mm_impl.c
+ * does, from the high bits of the product.
+ */
+uint32_t value_hash(int value, int32_t num_slots) {
+    return ((uint32_t) value * VALUE_HASH_MULTIPLIER) >>
+        VALUE_HASH_SHIFT(num_slots);
+}
+
+
+/* Adds a value to the hash set at the offset, unless it is already there. */
+void value_set_insert(sim_multimap *mm, int32_t set, int32_t num_slots,
+                      int value) {
+    uint32_t slot = value_hash(value, num_slots);
+    int slot_value;
+
+    while ((slot_value = GET(mm, pool_address(mm, set + slot))) !=
+           EMPTY_SLOT) {
+        if (slot_value == value)
+            return;
+        slot = (slot + 1) & (num_slots - 1);
+    }
+    SET(mm, pool_address(mm, set + slot), value);
+}
+
+
+/* Builds the hash set of a node's values, with twice as many slots as the
+ * node's values array has spaces.
+ */
+void build_value_set(sim_multimap *mm, addr_t node) {
+    int32_t num_slots = 2 * GET(mm, node + AVL_NUM_SPACES);
+    int32_t num_values, values, set, i;
+
+    set = pool_alloc(mm, num_slots);
+    SET(mm, node + AVL_VALUE_SET, set);
+
+    for (i = 0; i < num_slots; i++)
+        SET(mm, pool_address(mm, set + i), EMPTY_SLOT);
+
+    num_values = GET(mm, node + AVL_NUM_VALUES);
+    values = GET(mm, node + AVL_VALUES);
+    for (i = 0; i < num_values; i++) {
+        int value = GET(mm, pool_address(mm, values + i));
+        if (value != EMPTY_SLOT)
+            value_set_insert(mm, set, num_slots, value);
+    }
+}
+
+
+/* Appends a value to the key's values array, the way append_values() in
+ * opt_mm_impl.c does for a single value.
+ */
+void avl_add_value(sim_multimap *mm, int key, int value) {
+    int32_t index = avl_find_node(mm, key), new_index;
+    int32_t num_values, num_spaces, values, set;
+    addr_t node;
+
+    if (index == NULL_INDEX) {
+        mm->root = avl_insert(mm, mm->root, key, &new_index);
+        index = new_index;
+    }
+
+    node = avl_node(mm, index);
+    num_values = GET(mm, node + AVL_NUM_VALUES);
+    num_spaces = GET(mm, node + AVL_NUM_SPACES);
+    values = GET(mm, node + AVL_VALUES);
+    set = GET(mm, node + AVL_VALUE_SET);
+
+    if (num_values == num_spaces) {
+        /* Move the values to a block twice as large.  The hash set is
+         * sized from the array, so it is rebuilt when the array grows.
+         */
+        int32_t new_spaces = (num_spaces == 0) ?
+                             MIN_BLOCK_SPACES : num_spaces * 2;
+        int32_t new_values = pool_alloc(mm, new_spaces);
+
+        if (values != NULL_OFFSET) {
+            sim_move(&mm->heap, pool_address(mm, new_values),
+                     pool_address(mm, values), num_values * 4);
+            pool_free(mm, values, num_spaces);
+        }
+
+        if (set != NULL_OFFSET) {
+            pool_free(mm, set, 2 * num_spaces);
+            set = NULL_OFFSET;
+            SET(mm, node + AVL_VALUE_SET, NULL_OFFSET);
+        }
+
+        values = new_values;
+        num_spaces = new_spaces;
+        SET(mm, node + AVL_VALUES, values);
+        SET(mm, node + AVL_NUM_SPACES, num_spaces);
+    }
+
+    SET(mm, pool_address(mm, values + num_values), value);
+    num_values++;
+    SET(mm, node + AVL_NUM_VALUES, num_values);
+
+    if (set != NULL_OFFSET) {
+        if (value != EMPTY_SLOT)
+            value_set_insert(mm, set, 2 * num_spaces, value);
+    }
+    else if (num_values > VALUE_SET_THRESHOLD) {
+        build_value_set(mm, node);
+    }
+}
+
+
+/* Finds the key's node, then checks its hash set of values if it has one,
+ * or else scans its values array.
+ */
+int avl_contains_pair(sim_multimap *mm, int key, int value) {
+    int32_t index = avl_find_node(mm, key);
+    int32_t num_values, values, set, i;
+    addr_t node;
+
+    if (index == NULL_INDEX)
+        return 0;
+
+    node = avl_node(mm, index);
+    set = GET(mm, node + AVL_VALUE_SET);
+
+    if (set != NULL_OFFSET && value != EMPTY_SLOT) {
+        int32_t num_slots = 2 * GET(mm, node + AVL_NUM_SPACES);
+        uint32_t slot = value_hash(value, num_slots);
+        int slot_value;
+
+        while ((slot_value = GET(mm, pool_address(mm, set + slot))) !=
+               EMPTY_SLOT) {
+            if (slot_value == value)
+                return 1;
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        return 0;
+    }
+
+    num_values = GET(mm, node + AVL_NUM_VALUES);
+    values = GET(mm, node + AVL_VALUES);
+    for (i = 0; i < num_values; i++) {
+        if (GET(mm, pool_address(mm, values + i)) == value)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*==================*/
+/* B+-TREE          */
+/*==================*/
+
+
+/* Moves one of the node pools to a new block twice as large, aligned to the
+ * node size, and returns the new pool.
+ */
+addr_t grow_pool(sim_multimap *mm, addr_t pool, uint32_t elem_size,
+                 int32_t num_elems, int32_t *max_elems) {
+    int32_t new_max = (*max_elems == 0) ? FIRST_POOL_ELEMS : *max_elems * 2;
+
+    pool = sim_realloc(&mm->heap, pool, num_elems * elem_size,
+                       new_max * elem_size, NODE_BYTES);
+    *max_elems = new_max;
+    return pool;
+}
+
+
+/* Return the addresses of the elements of the pools. */
+addr_t bpt_internal(sim_multimap *mm, int32_t index) {
+    assert(index >= 0 && index < mm->num_internals);
+    return mm->internals + (addr_t) index * NODE_BYTES;
+}
+
+addr_t bpt_leaf(sim_multimap *mm, int32_t index) {
+    assert(index >= 0 && index < mm->num_leaves);
+    return mm->leaves + (addr_t) index * NODE_BYTES;
+}
+
+addr_t bpt_list(sim_multimap *mm, int32_t index) {
+    assert(index >= 0 && index < mm->num_lists);
+    return mm->lists + (addr_t) index * VALUE_LIST_BYTES;
+}
+
+
+/* Allocates an empty internal node, and returns its index. */
+int32_t bpt_alloc_internal(sim_multimap *mm) {
+    if (mm->num_internals == mm->max_internals) {
+        mm->internals = grow_pool(mm, mm->internals, NODE_BYTES,
+                                  mm->num_internals, &mm->max_internals);
+    }
+
+    mm->num_internals++;
+    sim_zero(&mm->heap, bpt_internal(mm, mm->num_internals - 1),
+             NODE_BYTES);
+    return mm->num_internals - 1;
+}
+
+
+/* Allocates an empty leaf node, and returns its index. */
+int32_t bpt_alloc_leaf(sim_multimap *mm) {
+    addr_t leaf;
+
+    if (mm->num_leaves == mm->max_leaves) {
+        mm->leaves = grow_pool(mm, mm->leaves, NODE_BYTES,
+                               mm->num_leaves, &mm->max_leaves);
+    }
+
+    mm->num_leaves++;
+    leaf = bpt_leaf(mm, mm->num_leaves - 1);
+    sim_zero(&mm->heap, leaf, NODE_BYTES);
+    SET(mm, leaf + BPT_NEXT_LEAF, NULL_INDEX);
+    return mm->num_leaves - 1;
+}
+
+
+/* Allocates an empty value-list, and returns its index. */
+int32_t bpt_alloc_list(sim_multimap *mm) {
+    if (mm->num_lists == mm->max_lists) {
+        mm->lists = grow_pool(mm, mm->lists, VALUE_LIST_BYTES,
+                              mm->num_lists, &mm->max_lists);
+    }
+
+    mm->num_lists++;
+    sim_zero(&mm->heap, bpt_list(mm, mm->num_lists - 1), VALUE_LIST_BYTES);
+    return mm->num_lists - 1;
+}
+
+
+/* Returns which child of an internal node the key belongs in.  The real
+ * implementation compares all of the keys at once with SIMD instructions;
+ * they are all in the first cache line of the node either way.
+ */
+int bpt_find_child(sim_multimap *mm, addr_t node, int key) {
+    int num_keys = GET(mm, node + BPT_NUM_KEYS), i;
+
+    for (i = 0; i < num_keys && GET(mm, node + BPT_KEYS + 4 * i) <= key; i++)
+        ;
+    return i;
+}
+
+
+/* Returns the position of the key in a leaf, or -1 if it isn't there. */
+int bpt_find_in_leaf(sim_multimap *mm, addr_t leaf, int key) {
+    int num_keys = GET(mm, leaf + BPT_NUM_KEYS), i;
+
+    for (i = 0; i < num_keys; i++) {
+        if (GET(mm, leaf + BPT_KEYS + 4 * i) == key)
+            return i;
+    }
+    return -1;
+}
+
+
+/* Returns the position of the first key in the leaf that is not less than
+ * the key.
+ */
+int bpt_lower_bound(sim_multimap *mm, addr_t leaf, int key) {
+    int num_keys = GET(mm, leaf + BPT_NUM_KEYS), i;
+
+    for (i = 0; i < num_keys && GET(mm, leaf + BPT_KEYS + 4 * i) < key; i++)
+        ;
+    return i;
+}
+
+
+/* Inserts a key and its value-list into a leaf that has room for it. */
+void bpt_leaf_insert(sim_multimap *mm, addr_t leaf, int key, int32_t list) {
+    int num_keys = GET(mm, leaf + BPT_NUM_KEYS);
+    int pos = bpt_lower_bound(mm, leaf, key);
+
+    sim_move(&mm->heap, leaf + BPT_KEYS + 4 * (pos + 1),
+             leaf + BPT_KEYS + 4 * pos, 4 * (num_keys - pos));
+    sim_move(&mm->heap, leaf + BPT_LISTS + 4 * (pos + 1),
+             leaf + BPT_LISTS + 4 * pos, 4 * (num_keys - pos));
+    SET(mm, leaf + BPT_KEYS + 4 * pos, key);
+    SET(mm, leaf + BPT_LISTS + 4 * pos, list);
+    SET(mm, leaf + BPT_NUM_KEYS, num_keys + 1);
+}
+
+
+/* Inserts the key into the subtree rooted at the specified node, the way
+ * bpt_insert() in bptree_mm_impl.c does, splitting nodes as needed.
+ * Returns nonzero if the node was split, in which case the new right half
+ * and the separator key are reported through split_index and split_key.
+ */
+int bpt_insert(sim_multimap *mm, int32_t index, int level, int key,
+               int32_t *list, int *split_key, int32_t *split_index) {
+    int32_t keys[INTERNAL_KEYS + 1], children[INTERNAL_KEYS + 2];
+    int pos, half, child_key, num_keys, i;
+    int32_t child_index;
+    addr_t node, right;
+
+    if (level == 0) {
+        node = bpt_leaf(mm, index);
+        pos = bpt_find_in_leaf(mm, node, key);
+        if (pos >= 0) {
+            *list = GET(mm, node + BPT_LISTS + 4 * pos);
+            return 0;
+        }
+
+        *list = bpt_alloc_list(mm);
+
+        if (GET(mm, node + BPT_NUM_KEYS) < LEAF_KEYS) {
+            bpt_leaf_insert(mm, node, key, *list);
+            return 0;
+        }
+
+        /* Move the upper half of the full leaf into a new leaf that follows
+         * it in the leaf chain, then add the key to the half it belongs in.
+         */
+        *split_index = bpt_alloc_leaf(mm);
+        node = bpt_leaf(mm, index);
+        right = bpt_leaf(mm, *split_index);
+
+        half = (LEAF_KEYS + 1) / 2;
+        sim_move(&mm->heap, right + BPT_KEYS, node + BPT_KEYS + 4 * half,
+                 4 * (LEAF_KEYS - half));
+        sim_move(&mm->heap, right + BPT_LISTS, node + BPT_LISTS + 4 * half,
+                 4 * (LEAF_KEYS - half));
+        SET(mm, right + BPT_NUM_KEYS, LEAF_KEYS - half);
+        SET(mm, node + BPT_NUM_KEYS, half);
+
+        SET(mm, right + BPT_NEXT_LEAF, GET(mm, node + BPT_NEXT_LEAF));
+        SET(mm, node + BPT_NEXT_LEAF, *split_index);
+
+        *split_key = GET(mm, right + BPT_KEYS);
+        bpt_leaf_insert(mm, (key >= *split_key) ? right : node, key, *list);
+        return 1;
+    }
+
+    pos = bpt_find_child(mm, bpt_internal(mm, index), key);
+    if (!bpt_insert(mm, GET(mm, bpt_internal(mm, index) + BPT_CHILDREN +
+                                4 * pos),
+                    level - 1, key, list, &child_key, &child_index)) {
+        return 0;
+    }
+
+    /* The child was split, so add the new child just after it. */
+    node = bpt_internal(mm, index);
+    num_keys = GET(mm, node + BPT_NUM_KEYS);
+    if (num_keys < INTERNAL_KEYS) {
+        sim_move(&mm->heap, node + BPT_KEYS + 4 * (pos + 1),
+                 node + BPT_KEYS + 4 * pos, 4 * (num_keys - pos));
+        sim_move(&mm->heap, node + BPT_CHILDREN + 4 * (pos + 2),
+                 node + BPT_CHILDREN + 4 * (pos + 1), 4 * (num_keys - pos));
+        SET(mm, node + BPT_KEYS + 4 * pos, child_key);
+        SET(mm, node + BPT_CHILDREN + 4 * (pos + 1), child_index);
+        SET(mm, node + BPT_NUM_KEYS, num_keys + 1);
+        return 0;
+    }
+
+    /* This node is full too.  Keep the lower half of the combined keys and
+     * children here, move the upper half to a new node, and push the
+     * middle key up to the parent.
+     */
+    *split_index = bpt_alloc_internal(mm);
+    node = bpt_internal(mm, index);
+    right = bpt_internal(mm, *split_index);
+
+    for (i = 0; i < INTERNAL_KEYS; i++)
+        keys[i + (i >= pos)] = GET(mm, node + BPT_KEYS + 4 * i);
+    keys[pos] = child_key;
+
+    for (i = 0; i <= INTERNAL_KEYS; i++)
+        children[i + (i > pos)] = GET(mm, node + BPT_CHILDREN + 4 * i);
+    children[pos + 1] = child_index;
+
+    half = (INTERNAL_KEYS + 1) / 2;
+    SET(mm, node + BPT_NUM_KEYS, half);
+    for (i = 0; i < half; i++)
+        SET(mm, node + BPT_KEYS + 4 * i, keys[i]);
+    for (i = 0; i <= half; i++)
+        SET(mm, node + BPT_CHILDREN + 4 * i, children[i]);
+
+    num_keys = INTERNAL_KEYS - half;
+    SET(mm, right + BPT_NUM_KEYS, num_keys);
+    for (i = 0; i < num_keys; i++)
+        SET(mm, right + BPT_KEYS + 4 * i, keys[half + 1 + i]);
+    for (i = 0; i <= num_keys; i++)
+        SET(mm, right + BPT_CHILDREN + 4 * i, children[half + 1 + i]);
+
+    *split_key = keys[half];
+    return 1;
+}
+
+
+/* Adds the pair to the tree, growing a new root when the root splits, and
+ * appends the value to the key's value-list, doubling it when full.
+ */
+void bpt_add_value(sim_multimap *mm, int key, int value) {
+    int32_t list, split_index, old_root, num_values, num_spaces;
+    addr_t vl, values;
+    int split_key;
+
+    if (mm->root == NULL_INDEX) {
+        mm->root = bpt_alloc_leaf(mm);
+        mm->height = 0;
+    }
+
+    if (bpt_insert(mm, mm->root, mm->height, key, &list,
+                   &split_key, &split_index)) {
+        old_root = mm->root;
+        mm->root = bpt_alloc_internal(mm);
+        SET(mm, bpt_internal(mm, mm->root) + BPT_NUM_KEYS, 1);
+        SET(mm, bpt_internal(mm, mm->root) + BPT_KEYS, split_key);
+        SET(mm, bpt_internal(mm, mm->root) + BPT_CHILDREN, old_root);
+        SET(mm, bpt_internal(mm, mm->root) + BPT_CHILDREN + 4, split_index);
+        mm->height++;
+    }
+
+    vl = bpt_list(mm, list);
+    values = GET(mm, vl + LIST_VALUES);
+    num_values = GET(mm, vl + LIST_NUM_VALUES);
+    num_spaces = GET(mm, vl + LIST_NUM_SPACES);
+
+    if (num_values == num_spaces) {
+        int32_t new_spaces = (num_spaces == 0) ? 1 : num_spaces * 2;
+
+        values = sim_realloc(&mm->heap, values, num_values * 4,
+                             new_spaces * 4, MALLOC_ALIGN);
+        SET(mm, vl + LIST_VALUES, values);
+        SET(mm, vl + LIST_NUM_SPACES, new_spaces);
+    }
+
+    SET(mm, values + 4 * num_values, value);
+    SET(mm, vl + LIST_NUM_VALUES, num_values + 1);
+}
+
+
+/* Descends from the root to the key's leaf, then scans its value-list. */
+int bpt_contains_pair(sim_multimap *mm, int key, int value) {
+    int32_t index = mm->root, num_values, i;
+    addr_t node, vl, values;
+    int level, pos;
+
+    if (index == NULL_INDEX)
+        return 0;
+
+    for (level = mm->height; level > 0; level--) {
+        node = bpt_internal(mm, index);
+        pos = bpt_find_child(mm, node, key);
+        index = GET(mm, node + BPT_CHILDREN + 4 * pos);
+    }
+
+    node = bpt_leaf(mm, index);
+    pos = bpt_find_in_leaf(mm, node, key);
+    if (pos < 0)
+        return 0;
+
+    vl = bpt_list(mm, GET(mm, node + BPT_LISTS + 4 * pos));
+    values = GET(mm, vl + LIST_VALUES);
+    num_values = GET(mm, vl + LIST_NUM_VALUES);
+    for (i = 0; i < num_values; i++) {
+        if (GET(mm, values + 4 * i) == value)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*==================*/
+/* FROZEN MAP       */
+/*==================*/
+
+
+/* Orders (key, value) pairs stored as two adjacent ints by key, then by
+ * value.
+ */
+int compare_pairs(const void *a, const void *b) {
+    const int *p = a, *q = b;
+
+    if (p[0] != q[0])
+        return (p[0] < q[0]) ? -1 : 1;
+    if (p[1] != q[1])
+        return (p[1] < q[1]) ? -1 : 1;
+    return 0;
+}
+
+
+/* Fills in the Eytzinger positions of the sorted keys, so that pos_key[k]
+ * is the index of the key at position k.  Returns the next key index.
+ */
+int32_t assign_eytzinger(int32_t *pos_key, int32_t n, int32_t i, int32_t k) {
+    if (k <= n) {
+        i = assign_eytzinger(pos_key, n, i, 2 * k);
+        pos_key[k] = i++;
+        i = assign_eytzinger(pos_key, n, i, 2 * k + 1);
+    }
+    return i;
+}
+
+
+/* Collects a pair until the frozen map is built. */
+void frozen_add_value(sim_multimap *mm, int key, int value) {
+    if (mm->num_pending == mm->max_pending) {
+        mm->max_pending = (mm->max_pending == 0) ? 1024 : mm->max_pending * 2;
+        mm->pending_keys = realloc(mm->pending_keys,
+                                   mm->max_pending * sizeof(int));
+        mm->pending_values = realloc(mm->pending_values,
+                                     mm->max_pending * sizeof(int));
+        if (mm->pending_keys == NULL || mm->pending_values == NULL) {
+            /* Simple error handling for out of memory cases. */
+            printf("%s\n", "failed to realloc pending pairs");
+            exit(1);
+        }
+    }
+
+    mm->pending_keys[mm->num_pending] = key;
+    mm->pending_values[mm->num_pending] = value;
+    mm->num_pending++;
+}
+
+
+/* Lays out the collected pairs the way mm_freeze() does:  the distinct keys
+ * in Eytzinger order, 1-based, and each key's values sorted, stored in the
+ * order of their keys' positions.
+ */
+void frozen_build(sim_multimap *mm) {
+    int32_t n = mm->num_pending, num_keys = 0, i, j, k, total;
+    int32_t *first, *pos_key;
+    int *pairs;
+
+    pairs = malloc(2 * (n + 1) * sizeof(int));
+    first = malloc((n + 2) * sizeof(int32_t));
+    pos_key = malloc((n + 2) * sizeof(int32_t));
+    if (pairs == NULL || first == NULL || pos_key == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate frozen multimap");
+        exit(1);
+    }
+
+    for (i = 0; i < n; i++) {
+        pairs[2 * i] = mm->pending_keys[i];
+        pairs[2 * i + 1] = mm->pending_values[i];
+    }
+    qsort(pairs, n, 2 * sizeof(int), compare_pairs);
+
+    /* first[j] is the index of the first pair of the j-th distinct key. */
+    for (i = 0; i < n; i++) {
+        if (i == 0 || pairs[2 * i] != pairs[2 * i - 2])
+            first[num_keys++] = i;
+    }
+    first[num_keys] = n;
+
+    assign_eytzinger(pos_key, num_keys, 0, 1);
+
+    mm->num_keys = num_keys;
+    mm->frozen_keys = sim_alloc(&mm->heap, (num_keys + 1) * 4, FROZEN_ALIGN);
+    mm->frozen_starts = sim_alloc(&mm->heap, (num_keys + 2) * START_BYTES,
+                                  MALLOC_ALIGN);
+    mm->frozen_values = sim_alloc(&mm->heap, (n + 1) * 4, MALLOC_ALIGN);
+
+    SET(mm, mm->frozen_keys, 0);
+    total = 0;
+    for (k = 1; k <= num_keys; k++) {
+        j = pos_key[k];
+        SET(mm, mm->frozen_keys + 4 * k, pairs[2 * first[j]]);
+        SET(mm, mm->frozen_starts + START_BYTES * k, total);
+        for (i = first[j]; i < first[j + 1]; i++)
+            SET(mm, mm->frozen_values + 4 * total++, pairs[2 * i + 1]);
+    }
+    SET(mm, mm->frozen_starts + START_BYTES * (num_keys + 1), total);
+
+    free(pairs);
+    free(first);
+    free(pos_key);
+    clear_sim_multimap(mm);
+}
+
+
+/* Searches the Eytzinger array for the key with the same branchless descent
+ * as frozen_lower_bound(), then binary searches the key's sorted values.
+ * The real implementation also prefetches several levels ahead, which the
+ * simulated caches don't model.
+ */
+int frozen_contains_pair(sim_multimap *mm, int key, int value) {
+    int32_t n = mm->num_keys, k = 1, start, len, half;
+    addr_t base;
+
+    assert(mm->pending_keys == NULL);
+
+    while (k <= n)
+        k = 2 * k + (GET(mm, mm->frozen_keys + 4 * k) < key);
+    k >>= __builtin_ffs(~k);
+
+    if (k == 0 || GET(mm, mm->frozen_keys + 4 * k) != key)
+        return 0;
+
+    start = GET(mm, mm->frozen_starts + START_BYTES * k);
+    len = GET(mm, mm->frozen_starts + START_BYTES * (k + 1)) - start;
+    base = mm->frozen_values + 4 * start;
+
+    while (len > 1) {
+        half = len / 2;
+        if (GET(mm, base + 4 * (half - 1)) < value)
+            base += 4 * half;
+        len -= half;
+    }
+
+    return len == 1 && GET(mm, base) == value;
+}
@@ -0,0 +1,131 @@
+#ifndef __SIMMM_H__
+#define __SIMMM_H__
+
+
+#include "membase.h"
+#include "simheap.h"
+
+
+/* The multimap layouts that can be simulated.  Each one stores its nodes and
+ * values in the simulated memory with the same sizes, offsets, alignments
+ * and allocation order as one of the implementations in ../multimap, and
+ * probes them along the same path, so that the caches see the same blocks
+ * being touched that the real implementation would touch.
+ *
+ *  - SIMMM_BST mirrors mm_impl.c:  an unbalanced binary search tree of
+ *    40-byte nodes, each with a linked list of 16-byte value nodes, all
+ *    allocated in order from an arena.
+ *
+ *  - SIMMM_AVL mirrors opt_mm_impl.c:  an AVL tree of 40-byte nodes in a
+ *    pool that is doubled as it fills, referring to each other by index,
+ *    with each key's values in a dense array in a separate value pool, and
+ *    a hash set of the values once a key has more than 16 of them.
+ *
+ *  - SIMMM_BPTREE mirrors bptree_mm_impl.c:  a B+-tree of 128-byte nodes
+ *    holding 15 keys each, with each key's values in an array that is
+ *    reallocated to twice its size as it fills.
+ *
+ *  - SIMMM_FROZEN mirrors opt_mm_impl.c after mm_freeze():  the keys in
+ *    Eytzinger order in one array, and each key's values sorted in another.
+ *    Pairs are collected outside the simulated memory until
+ *    sim_mm_finish() lays out the whole map at once.
+ */
+#define SIMMM_BST    0
+#define SIMMM_AVL    1
+#define SIMMM_BPTREE 2
+#define SIMMM_FROZEN 3
+
+#define SIMMM_NUM_LAYOUTS 4
+
+/* The number of free lists of value-pool blocks in the AVL layout. */
+#define SIMMM_BLOCK_CLASSES 32
+
+
+/* A multimap stored in simulated memory.  The fields here play the part of
+ * the real implementation's struct multimap, which is small enough that it
+ * stays in the caches, so it is kept outside the simulated memory.
+ */
+typedef struct {
+    /* The layout of the multimap; one of the SIMMM_* constants. */
+    int layout;
+
+    /* All nodes and values are allocated from this heap. */
+    sim_heap heap;
+
+    /* The root of the tree.  For SIMMM_BST this is an address, and for
+     * SIMMM_AVL and SIMMM_BPTREE it is an index into a node pool.
+     */
+    int32_t root;
+
+    /* SIMMM_AVL:  the node pool, and the value pool and its free lists. */
+    addr_t nodes;
+    int32_t num_nodes;
+    int32_t max_nodes;
+
+    addr_t value_pool;
+    int32_t pool_used;
+    int32_t pool_size;
+    int32_t free_blocks[SIMMM_BLOCK_CLASSES];
+
+    /* SIMMM_BPTREE:  the pools of internal nodes, leaves and value-lists,
+     * and the number of internal levels above the leaves.
+     */
+    addr_t internals;
+    int32_t num_internals;
+    int32_t max_internals;
+
+    addr_t leaves;
+    int32_t num_leaves;
+    int32_t max_leaves;
+
+    addr_t lists;
+    int32_t num_lists;
+    int32_t max_lists;
+
+    int32_t height;
+
+    /* SIMMM_FROZEN:  the pairs collected so far, and then the arrays that
+     * sim_mm_finish() lays out.
+     */
+    int *pending_keys;
+    int *pending_values;
+    int32_t num_pending;
+    int32_t max_pending;
+
+    addr_t frozen_keys;
+    addr_t frozen_starts;
+    addr_t frozen_values;
+    int32_t num_keys;
+} sim_multimap;
+
+
+/* Initialize an empty multimap with the specified layout, which allocates
+ * from the first mem_size bytes of the memory.  Anything already in that
+ * part of the memory is discarded.
+ */
+void init_sim_multimap(sim_multimap *mm, membase_t *memory,
+                       uint32_t mem_size, int layout);
+
+/* Releases the memory that a multimap uses outside the simulated memory. */
+void clear_sim_multimap(sim_multimap *mm);
+
+/* Returns the number of bytes of memory that is sure to be enough for a
+ * multimap with the specified layout to hold num_pairs pairs, whose keys
+ * are in the range [0, max_key].
+ */
+uint32_t sim_mm_memory_size(int layout, int num_pairs, int max_key);
+
+/* Adds the specified (key, value) pair to the multimap. */
+void sim_mm_add_value(sim_multimap *mm, int key, int value);
+
+/* Finishes building the multimap after the last pair has been added.  This
+ * only does anything for SIMMM_FROZEN, but may be called for any layout.
+ */
+void sim_mm_finish(sim_multimap *mm);
+
+/* Returns nonzero if the multimap contains the specified (key, value) pair,
+ * zero otherwise.
+ */
+int sim_mm_contains_pair(sim_multimap *mm, int key, int value);
+
+#endif /* __SIMMM_H__ */
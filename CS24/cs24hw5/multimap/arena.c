@@ -0,0 +1,89 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+
+/* The sizes of the first chunk of an arena, and the largest chunks that the
+ * doubling will produce.  Larger allocations get a chunk of their own size.
+ */
+#define FIRST_CHUNK_SIZE (64 * 1024)
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+/* The size of a chunk header, rounded up so that memory after it is aligned. */
+#define CHUNK_HEADER_SIZE \
+    ((sizeof(arena_chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+
+/* Initializes an empty arena. */
+void init_arena(arena *a) {
+    a->chunks = NULL;
+    a->next = NULL;
+    a->end = NULL;
+    a->chunk_size = FIRST_CHUNK_SIZE;
+}
+
+
+/**
+ * Allocates memory from the arena.  Almost always this just bumps the
+ * arena's next pointer; only when the current chunk runs out is a new chunk
+ * allocated.  The rest of the old chunk is left unused.
+ * @param  a    the arena to allocate from
+ * @param  size the number of bytes to allocate
+ * @return      the allocated memory, aligned to ARENA_ALIGN bytes
+ */
+void * arena_alloc(arena *a, size_t size) {
+    void *result;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (a->next == NULL || (size_t) (a->end - a->next) < size) {
+        size_t chunk_size = a->chunk_size;
+        arena_chunk *chunk;
+
+        if (chunk_size < size)
+            chunk_size = size;
+
+        chunk = malloc(CHUNK_HEADER_SIZE + chunk_size);
+        if (chunk == NULL) {
+            /* Simple error handling for out of memory cases. */
+            printf("size requested %lu\n", CHUNK_HEADER_SIZE + chunk_size);
+            printf("%s\n", "failed to allocate arena chunk");
+            exit(1);
+        }
+
+        chunk->prev = a->chunks;
+        chunk->size = chunk_size;
+        a->chunks = chunk;
+        a->next = (char *) chunk + CHUNK_HEADER_SIZE;
+        a->end = a->next + chunk_size;
+
+        if (a->chunk_size < MAX_CHUNK_SIZE)
+            a->chunk_size *= 2;
+    }
+
+    result = a->next;
+    a->next += size;
+    assert(a->next <= a->end);
+    return result;
+}
+
+
+/* Releases all memory allocated from the arena, one chunk at a time. */
+void clear_arena(arena *a) {
+    arena_chunk *chunk = a->chunks;
+
+    while (chunk != NULL) {
+        arena_chunk *prev = chunk->prev;
+#ifdef DEBUG_ZERO
+        /* Clear out what we are about to free, to expose issues quickly. */
+        bzero(chunk, CHUNK_HEADER_SIZE + chunk->size);
+#endif
+        free(chunk);
+        chunk = prev;
+    }
+
+    init_arena(a);
+}
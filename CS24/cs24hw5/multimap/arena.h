@@ -0,0 +1,53 @@
+/* This file declares a simple arena allocator for multimap storage.  Memory
+ * is handed out from large chunks by bumping a pointer, and is never freed
+ * piece by piece; instead, clearing the arena releases all of its chunks at
+ * once.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+/* A chunk of arena memory.  The memory handed out follows the header. */
+typedef struct arena_chunk {
+    /* The chunk allocated before this one, or NULL. */
+    struct arena_chunk *prev;
+
+    /* The number of bytes of memory in the chunk, after the header. */
+    size_t size;
+} arena_chunk;
+
+
+/* An arena, which is usually embedded in the structure that owns it. */
+typedef struct arena {
+    /* The most recently allocated chunk, which memory is handed out from. */
+    arena_chunk *chunks;
+
+    /* The next free byte of the current chunk, and the end of the chunk. */
+    char *next;
+    char *end;
+
+    /* The size of the next chunk to allocate.  Chunks double in size, up to
+     * a limit, so that small arenas stay small and large ones need few
+     * chunks.
+     */
+    size_t chunk_size;
+} arena;
+
+
+/* Initializes an empty arena. */
+void init_arena(arena *a);
+
+/* Allocates the specified number of bytes from the arena, aligned to
+ * ARENA_ALIGN bytes.  Exits if memory can't be allocated.
+ */
+void * arena_alloc(arena *a, size_t size);
+
+/* Releases all memory allocated from the arena, leaving it empty. */
+void clear_arena(arena *a);
+
+#define ARENA_ALIGN 16
+
+#endif
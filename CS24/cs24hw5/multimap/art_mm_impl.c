@@ -0,0 +1,685 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "multimap.h"
+
+
+/*============================================================================
+ * TYPES
+ *
+ *   These types are defined in the implementation file so that they can
+ *   be kept hidden to code outside this source file.  This is not for any
+ *   security reason, but rather just so we can enforce that our testing
+ *   programs are generic and don't have any access to implementation details.
+ *
+ *   This implementation stores the keys in an adaptive radix tree.  Each key
+ *   is treated as a string of 4 bytes, most significant first, with the sign
+ *   bit flipped so that byte strings sort in the same order as the keys.
+ *   Each inner node branches on one byte of the key, and comes in one of
+ *   four sizes depending on how many children it has, so that sparse nodes
+ *   stay small and dense nodes can be indexed directly by the byte.  A
+ *   lookup visits at most one node per key byte, and never compares keys
+ *   until it reaches a leaf.
+ *
+ *   Two tricks keep the tree short.  A node stores the bytes that every key
+ *   below it shares (path compression), so that chains of nodes with one
+ *   child are never built.  And a key that is the only one in its subtree
+ *   is stored as a leaf right where its path splits off from other keys
+ *   (lazy expansion), so leaves hold their whole key.
+ *============================================================================*/
+
+/* The number of bytes in a key. */
+#define KEY_BYTES 4
+
+/* The kinds of inner nodes, by the most children they can have. */
+#define NODE4 0
+#define NODE16 1
+#define NODE48 2
+#define NODE256 3
+
+/* Children are pointers to inner nodes or to leaves.  Both are allocated
+ * with malloc(), so the lowest bit of their addresses is always 0, and
+ * pointers to leaves are marked by setting it.
+ */
+#define IS_LEAF(p) (((uintptr_t) (p)) & 1)
+#define LEAF_REF(leaf) ((art_node *) (((uintptr_t) (leaf)) | 1))
+#define REF_LEAF(p) ((art_leaf *) (((uintptr_t) (p)) & ~(uintptr_t) 1))
+
+
+/* The header shared by all inner nodes. */
+typedef struct art_node {
+    /* NODE4, NODE16, NODE48 or NODE256. */
+    uint8_t type;
+
+    /* The number of bytes in the compressed prefix of the node. */
+    uint8_t prefix_len;
+
+    /* The number of children of the node. */
+    uint16_t num_children;
+
+    /* The key bytes that every key below this node shares, starting at the
+     * node's depth.  Since a node must still branch on a key byte after its
+     * prefix, at most KEY_BYTES - 1 of these are used.
+     */
+    uint8_t prefix[KEY_BYTES];
+} art_node;
+
+
+/* A node with up to 4 children, whose key bytes are kept sorted. */
+typedef struct art_node4 {
+    art_node n;
+    uint8_t keys[4];
+    art_node *children[4];
+} art_node4;
+
+
+/* A node with up to 16 children, whose key bytes are kept sorted and
+ * searched with a single SIMD comparison.
+ */
+typedef struct art_node16 {
+    art_node n;
+    uint8_t keys[16];
+    art_node *children[16];
+} art_node16;
+
+
+/* A node with up to 48 children.  Each key byte indexes child_index, which
+ * holds 1 more than the position of the child in children, or 0 if the node
+ * has no child for that byte.
+ */
+typedef struct art_node48 {
+    art_node n;
+    uint8_t child_index[256];
+    art_node *children[48];
+} art_node48;
+
+
+/* A node with up to 256 children, indexed directly by the key byte. */
+typedef struct art_node256 {
+    art_node n;
+    art_node *children[256];
+} art_node256;
+
+
+/* A leaf holds one key and its values, in the order they were added.  The
+ * values are stored in the leaf itself, so the leaf is reallocated to make
+ * room as values are added, and the values of a key are found without
+ * following another pointer.
+ */
+typedef struct art_leaf {
+    int key;
+    int32_t num_values;
+    int32_t num_spaces;
+    int values[];
+} art_leaf;
+
+
+/* The entry-point of the multimap data structure. */
+struct multimap {
+    /* The root of the tree, which may be a leaf, or NULL if the multimap is
+     * empty.
+     */
+    art_node *root;
+};
+
+
+/*============================================================================
+ * HELPER FUNCTION DECLARATIONS
+ *
+ *   Declarations of helper functions that are local to this module.  Again,
+ *   these are not visible outside of this module.
+ *============================================================================*/
+
+uint8_t key_byte(int key, int depth);
+
+art_node * alloc_node(uint8_t type);
+art_leaf * alloc_leaf(int key, int32_t num_spaces);
+void free_node(art_node *node);
+
+art_node ** find_child(art_node *node, uint8_t byte);
+art_node ** add_child(art_node **ref, uint8_t byte, art_node *child);
+art_node ** grow_node(art_node **ref);
+
+int prefix_mismatch(const art_node *node, int key, int depth);
+art_node ** art_insert(art_node **ref, int key, int depth);
+art_leaf * find_leaf(multimap *mm, int key);
+
+void art_traverse(art_node *node, void (*f)(int key, int value));
+
+
+/*============================================================================
+ * FUNCTION IMPLEMENTATIONS
+ *============================================================================*/
+
+/* Returns the key byte at the specified depth, where depth 0 is the most
+ * significant byte.  The sign bit is flipped, so that negative keys come
+ * before positive ones.
+ */
+uint8_t key_byte(int key, int depth) {
+    uint32_t k = ((uint32_t) key) ^ 0x80000000u;
+
+    return (uint8_t) (k >> (8 * (KEY_BYTES - 1 - depth)));
+}
+
+
+/* Allocates an empty inner node of the specified type. */
+art_node * alloc_node(uint8_t type) {
+    static const size_t sizes[] = {
+        sizeof(art_node4), sizeof(art_node16),
+        sizeof(art_node48), sizeof(art_node256)
+    };
+    art_node *node = calloc(1, sizes[type]);
+
+    if (node == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate tree node");
+        exit(1);
+    }
+
+    node->type = type;
+    return node;
+}
+
+
+/* Allocates a leaf for the key, with room for the specified number of
+ * values.
+ */
+art_leaf * alloc_leaf(int key, int32_t num_spaces) {
+    art_leaf *leaf = malloc(sizeof(art_leaf) + num_spaces * sizeof(int));
+
+    if (leaf == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate leaf");
+        exit(1);
+    }
+
+    leaf->key = key;
+    leaf->num_values = 0;
+    leaf->num_spaces = num_spaces;
+    return leaf;
+}
+
+
+/* Frees the subtree rooted at the specified node or leaf. */
+void free_node(art_node *node) {
+    int i;
+
+    if (node == NULL)
+        return;
+
+    if (IS_LEAF(node)) {
+        free(REF_LEAF(node));
+        return;
+    }
+
+    switch (node->type) {
+    case NODE4:
+        for (i = 0; i < node->num_children; i++)
+            free_node(((art_node4 *) node)->children[i]);
+        break;
+
+    case NODE16:
+        for (i = 0; i < node->num_children; i++)
+            free_node(((art_node16 *) node)->children[i]);
+        break;
+
+    case NODE48:
+        for (i = 0; i < node->num_children; i++)
+            free_node(((art_node48 *) node)->children[i]);
+        break;
+
+    case NODE256:
+        for (i = 0; i < 256; i++)
+            free_node(((art_node256 *) node)->children[i]);
+        break;
+    }
+
+    free(node);
+}
+
+
+/**
+ * Returns the slot of the node's child for the key byte, or NULL if the
+ * node has no such child.  A Node16 compares all of its key bytes at once
+ * with SSE2, and uses the first match within its children.
+ * @param  node the inner node to search
+ * @param  byte the key byte to search for
+ * @return      the slot holding the child, or NULL
+ */
+art_node ** find_child(art_node *node, uint8_t byte) {
+    int i;
+
+    switch (node->type) {
+    case NODE4: {
+        art_node4 *n4 = (art_node4 *) node;
+
+        for (i = 0; i < node->num_children; i++) {
+            if (n4->keys[i] == byte)
+                return &n4->children[i];
+        }
+        return NULL;
+    }
+
+    case NODE16: {
+        art_node16 *n16 = (art_node16 *) node;
+#ifdef __SSE2__
+        __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char) byte),
+            _mm_loadu_si128((const __m128i *) n16->keys));
+        unsigned int mask = _mm_movemask_epi8(cmp) &
+                            ((1u << node->num_children) - 1);
+
+        return mask ? &n16->children[__builtin_ctz(mask)] : NULL;
+#else
+        for (i = 0; i < node->num_children; i++) {
+            if (n16->keys[i] == byte)
+                return &n16->children[i];
+        }
+        return NULL;
+#endif
+    }
+
+    case NODE48: {
+        art_node48 *n48 = (art_node48 *) node;
+
+        i = n48->child_index[byte];
+        return i ? &n48->children[i - 1] : NULL;
+    }
+
+    default: {
+        art_node256 *n256 = (art_node256 *) node;
+
+        return n256->children[byte] ? &n256->children[byte] : NULL;
+    }
+    }
+}
+
+
+/**
+ * Replaces a full node with one of the next larger type, holding the same
+ * prefix and children, and frees the old node.
+ * @param  ref the slot holding the node, which is updated to the new node
+ * @return     the slot, for convenience
+ */
+art_node ** grow_node(art_node **ref) {
+    art_node *node = *ref, *bigger;
+    int i;
+
+    switch (node->type) {
+    case NODE4: {
+        art_node4 *n4 = (art_node4 *) node;
+        art_node16 *n16;
+
+        bigger = alloc_node(NODE16);
+        n16 = (art_node16 *) bigger;
+        memcpy(n16->keys, n4->keys, node->num_children);
+        memcpy(n16->children, n4->children,
+               node->num_children * sizeof(art_node *));
+        break;
+    }
+
+    case NODE16: {
+        art_node16 *n16 = (art_node16 *) node;
+        art_node48 *n48;
+
+        bigger = alloc_node(NODE48);
+        n48 = (art_node48 *) bigger;
+        for (i = 0; i < node->num_children; i++) {
+            n48->child_index[n16->keys[i]] = i + 1;
+            n48->children[i] = n16->children[i];
+        }
+        break;
+    }
+
+    default: {
+        art_node48 *n48 = (art_node48 *) node;
+        art_node256 *n256;
+
+        assert(node->type == NODE48);
+        bigger = alloc_node(NODE256);
+        n256 = (art_node256 *) bigger;
+        for (i = 0; i < 256; i++) {
+            if (n48->child_index[i])
+                n256->children[i] = n48->children[n48->child_index[i] - 1];
+        }
+        break;
+    }
+    }
+
+    bigger->prefix_len = node->prefix_len;
+    bigger->num_children = node->num_children;
+    memcpy(bigger->prefix, node->prefix, KEY_BYTES);
+
+    free(node);
+    *ref = bigger;
+    return ref;
+}
+
+
+/**
+ * Adds a child to the node for a key byte that it has no child for yet,
+ * growing the node first if it is full.  Node4 and Node16 keep their key
+ * bytes sorted, so that traversals visit the children in key order.
+ * @param  ref   the slot holding the node, which is updated if it grows
+ * @param  byte  the key byte of the new child
+ * @param  child the new child
+ * @return       the slot that now holds the child
+ */
+art_node ** add_child(art_node **ref, uint8_t byte, art_node *child) {
+    art_node *node = *ref;
+    int i, n = node->num_children;
+
+    if ((node->type == NODE4 && n == 4) || (node->type == NODE16 && n == 16) ||
+        (node->type == NODE48 && n == 48)) {
+        node = *grow_node(ref);
+    }
+
+    node->num_children++;
+
+    switch (node->type) {
+    case NODE4:
+    case NODE16: {
+        uint8_t *keys;
+        art_node **children;
+
+        if (node->type == NODE4) {
+            keys = ((art_node4 *) node)->keys;
+            children = ((art_node4 *) node)->children;
+        }
+        else {
+            keys = ((art_node16 *) node)->keys;
+            children = ((art_node16 *) node)->children;
+        }
+
+        for (i = 0; i < n && keys[i] < byte; i++)
+            ;
+        memmove(keys + i + 1, keys + i, n - i);
+        memmove(children + i + 1, children + i, (n - i) * sizeof(art_node *));
+        keys[i] = byte;
+        children[i] = child;
+        return &children[i];
+    }
+
+    case NODE48: {
+        art_node48 *n48 = (art_node48 *) node;
+
+        n48->child_index[byte] = n + 1;
+        n48->children[n] = child;
+        return &n48->children[n];
+    }
+
+    default: {
+        art_node256 *n256 = (art_node256 *) node;
+
+        n256->children[byte] = child;
+        return &n256->children[byte];
+    }
+    }
+}
+
+
+/* Returns the number of bytes of the node's prefix that match the key from
+ * the specified depth.
+ */
+int prefix_mismatch(const art_node *node, int key, int depth) {
+    int i;
+
+    for (i = 0; i < node->prefix_len; i++) {
+        if (node->prefix[i] != key_byte(key, depth + i))
+            break;
+    }
+    return i;
+}
+
+
+/**
+ * Finds the leaf for the key in the subtree held by the slot, adding an
+ * empty leaf for it if there is none.  A new key that runs into a leaf for
+ * another key, or into a node whose prefix it doesn't share, replaces it
+ * with a Node4 whose prefix is the bytes they do share, holding both.
+ * @param  ref   the slot holding the subtree, which may be updated
+ * @param  key   the key to find or add
+ * @param  depth the number of key bytes consumed above the slot
+ * @return       the slot that holds the key's leaf
+ */
+art_node ** art_insert(art_node **ref, int key, int depth) {
+    art_node *node = *ref, *split;
+    art_node **child;
+    int p;
+
+    while (1) {
+        if (node == NULL) {
+            *ref = LEAF_REF(alloc_leaf(key, 1));
+            return ref;
+        }
+
+        if (IS_LEAF(node)) {
+            int other = REF_LEAF(node)->key;
+
+            if (other == key)
+                return ref;
+
+            /* Split the leaf's slot into a node for the shared bytes. */
+            split = alloc_node(NODE4);
+            for (p = 0; key_byte(key, depth + p) == key_byte(other, depth + p);
+                 p++) {
+                split->prefix[p] = key_byte(key, depth + p);
+            }
+            split->prefix_len = p;
+            *ref = split;
+            add_child(ref, key_byte(other, depth + p), node);
+            return add_child(ref, key_byte(key, depth + p),
+                             LEAF_REF(alloc_leaf(key, 1)));
+        }
+
+        p = prefix_mismatch(node, key, depth);
+        if (p < node->prefix_len) {
+            /* The key leaves the node's prefix after p bytes, so put a new
+             * node above it for just those bytes, and shorten its prefix.
+             */
+            split = alloc_node(NODE4);
+            split->prefix_len = p;
+            memcpy(split->prefix, node->prefix, p);
+            *ref = split;
+            add_child(ref, node->prefix[p], node);
+
+            node->prefix_len -= p + 1;
+            memmove(node->prefix, node->prefix + p + 1, node->prefix_len);
+
+            return add_child(ref, key_byte(key, depth + p),
+                             LEAF_REF(alloc_leaf(key, 1)));
+        }
+
+        depth += node->prefix_len;
+        child = find_child(node, key_byte(key, depth));
+        if (child == NULL) {
+            return add_child(ref, key_byte(key, depth),
+                             LEAF_REF(alloc_leaf(key, 1)));
+        }
+
+        ref = child;
+        node = *ref;
+        depth++;
+    }
+}
+
+
+/* This helper function searches for the leaf of the specified key,
+ * returning NULL if the key isn't in the multimap.
+ */
+art_leaf * find_leaf(multimap *mm, int key) {
+    art_node *node = mm->root;
+    art_node **child;
+    int depth = 0;
+
+    while (node != NULL) {
+        if (IS_LEAF(node)) {
+            art_leaf *leaf = REF_LEAF(node);
+            return (leaf->key == key) ? leaf : NULL;
+        }
+
+        if (node->prefix_len > 0) {
+            if (prefix_mismatch(node, key, depth) < node->prefix_len)
+                return NULL;
+            depth += node->prefix_len;
+        }
+
+        child = find_child(node, key_byte(key, depth));
+        if (child == NULL)
+            return NULL;
+
+        node = *child;
+        depth++;
+    }
+
+    return NULL;
+}
+
+
+/* Initialize a multimap data structure. */
+multimap * init_multimap() {
+    multimap *mm = malloc(sizeof(multimap));
+
+    if (mm == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate multimap");
+        exit(1);
+    }
+
+    mm->root = NULL;
+    return mm;
+}
+
+
+/* Release all dynamically allocated memory associated with the multimap
+ * data structure.
+ */
+void clear_multimap(multimap *mm) {
+    assert(mm != NULL);
+
+    free_node(mm->root);
+    mm->root = NULL;
+}
+
+
+/**
+ * Adds the specified (key, value) pair to the multimap.  The key's leaf is
+ * found or added, and reallocated at twice its size when it is full, which
+ * updates the slot of its parent that points to it.
+ * @param mm    pointer to the multimap
+ * @param key   key where the following value will be added
+ * @param value value to be added at key
+ */
+void mm_add_value(multimap *mm, int key, int value) {
+    art_node **ref;
+    art_leaf *leaf;
+
+    assert(mm != NULL);
+
+    ref = art_insert(&mm->root, key, 0);
+    leaf = REF_LEAF(*ref);
+
+    if (leaf->num_values == leaf->num_spaces) {
+        int32_t new_spaces = 2 * leaf->num_spaces;
+
+        leaf = realloc(leaf, sizeof(art_leaf) + new_spaces * sizeof(int));
+        if (leaf == NULL) {
+            /* Simple error handling for out of memory cases. */
+            printf("%s\n", "failed to realloc leaf");
+            exit(1);
+        }
+        leaf->num_spaces = new_spaces;
+        *ref = LEAF_REF(leaf);
+    }
+
+    leaf->values[leaf->num_values++] = value;
+}
+
+
+/* Returns nonzero if the multimap contains the specified key-value, zero
+ * otherwise.
+ */
+int mm_contains_key(multimap *mm, int key) {
+    return find_leaf(mm, key) != NULL;
+}
+
+
+/* Returns nonzero if the multimap contains the specified (key, value) pair,
+ * zero otherwise.
+ */
+int mm_contains_pair(multimap *mm, int key, int value) {
+    art_leaf *leaf;
+    int32_t i;
+
+    leaf = find_leaf(mm, key);
+    if (leaf == NULL)
+        return 0;
+
+    for (i = 0; i < leaf->num_values; i++) {
+        if (leaf->values[i] == value)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* This helper function is used by mm_traverse() to traverse the subtree
+ * rooted at a node or leaf.  Every node's children are visited in the order
+ * of their key bytes, which is key order.
+ */
+void art_traverse(art_node *node, void (*f)(int key, int value)) {
+    int i;
+
+    if (IS_LEAF(node)) {
+        art_leaf *leaf = REF_LEAF(node);
+
+        for (i = 0; i < leaf->num_values; i++)
+            f(leaf->key, leaf->values[i]);
+        return;
+    }
+
+    switch (node->type) {
+    case NODE4:
+        for (i = 0; i < node->num_children; i++)
+            art_traverse(((art_node4 *) node)->children[i], f);
+        break;
+
+    case NODE16:
+        for (i = 0; i < node->num_children; i++)
+            art_traverse(((art_node16 *) node)->children[i], f);
+        break;
+
+    case NODE48: {
+        art_node48 *n48 = (art_node48 *) node;
+
+        for (i = 0; i < 256; i++) {
+            if (n48->child_index[i])
+                art_traverse(n48->children[n48->child_index[i] - 1], f);
+        }
+        break;
+    }
+
+    case NODE256:
+        for (i = 0; i < 256; i++) {
+            if (((art_node256 *) node)->children[i] != NULL)
+                art_traverse(((art_node256 *) node)->children[i], f);
+        }
+        break;
+    }
+}
+
+
+/* Performs an in-order traversal of the multimap, passing each (key, value)
+ * pair to the specified function.
+ */
+void mm_traverse(multimap *mm, void (*f)(int key, int value)) {
+    if (mm->root != NULL)
+        art_traverse(mm->root, f);
+}
@@ -0,0 +1,579 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "multimap.h"
+#include "mm_layout.h"
+#define NULL_INDEX -1
+
+
+/*============================================================================
+ * TYPES
+ *
+ *   These types are defined in the implementation file so that they can
+ *   be kept hidden to code outside this source file.  This is not for any
+ *   security reason, but rather just so we can enforce that our testing
+ *   programs are generic and don't have any access to implementation details.
+ *
+ *   This implementation stores the keys in a B+-tree whose nodes are exactly
+ *   two cache lines (128 bytes) in size.  Each node holds a sorted array of
+ *   keys that can be searched with a few SIMD comparisons, so a single
+ *   lookup touches one node per level, and the tree is about a quarter as
+ *   tall as a binary tree over the same keys.  All (key, value) pairs are
+ *   reached through the leaves, which are linked together in key order.
+ *============================================================================*/
+
+/* NODE_BYTES, the size of every tree node, is also the alignment of the
+ * node pools.  It and the maximum numbers of keys in an internal node and
+ * in a leaf node, INTERNAL_KEYS and LEAF_KEYS, are in mm_layout.h.
+ */
+
+
+/* An internal node of the B+-tree.  Child i holds keys k with
+ * keys[i - 1] <= k < keys[i].  The keys are first so that they are aligned
+ * for the SIMD search; the unused key slot is covered by num_keys.
+ */
+typedef struct bpt_internal {
+    int32_t keys[INTERNAL_KEYS];
+
+    /* The number of keys in the node; the node has num_keys + 1 children. */
+    int32_t num_keys;
+
+    /* Indexes of the children.  These are leaves if the node is on the
+     * lowest internal level of the tree, and internal nodes otherwise.
+     */
+    int32_t children[INTERNAL_KEYS + 1];
+} bpt_internal;
+
+
+/* A leaf node of the B+-tree, holding up to LEAF_KEYS keys in sorted order,
+ * along with the value-list of each key.
+ */
+typedef struct bpt_leaf {
+    int32_t keys[LEAF_KEYS];
+
+    /* The number of keys in the leaf. */
+    int32_t num_keys;
+
+    /* Indexes of the value-lists of the keys in the leaf. */
+    int32_t lists[LEAF_KEYS];
+
+    /* The index of the next leaf in key order, or NULL_INDEX. */
+    int32_t next_leaf;
+} bpt_leaf;
+
+
+/* The values associated with one key, in the order they were added. */
+typedef struct value_list {
+    int *values;
+    int32_t num_values;
+    int32_t num_spaces;
+} value_list;
+
+
+/* The cache simulator's copy of this multimap relies on these sizes. */
+_Static_assert(sizeof(bpt_internal) == NODE_BYTES,
+               "internal nodes must be NODE_BYTES in size");
+_Static_assert(sizeof(bpt_leaf) == NODE_BYTES,
+               "leaf nodes must be NODE_BYTES in size");
+_Static_assert(sizeof(void *) != 8 || sizeof(value_list) == VALUE_LIST_BYTES,
+               "value-lists must be VALUE_LIST_BYTES in size");
+
+
+/* The entry-point of the multimap data structure. */
+struct multimap {
+    /* The pools that the internal nodes, leaves and value-lists are stored
+     * in.  Everything refers to everything else by index into these pools,
+     * so they can be grown freely.
+     */
+    bpt_internal *internals;
+    int32_t num_internals;
+    int32_t max_internals;
+
+    bpt_leaf *leaves;
+    int32_t num_leaves;
+    int32_t max_leaves;
+
+    value_list *lists;
+    int32_t num_lists;
+    int32_t max_lists;
+
+    /* The index of the root node, or NULL_INDEX if the map is empty. */
+    int32_t root;
+
+    /* The number of internal levels above the leaves.  When this is 0, the
+     * root is a leaf.
+     */
+    int32_t height;
+};
+
+
+/*============================================================================
+ * HELPER FUNCTION DECLARATIONS
+ *
+ *   Declarations of helper functions that are local to this module.  Again,
+ *   these are not visible outside of this module.
+ *============================================================================*/
+
+void * grow_pool(void *pool, size_t elem_size, int32_t num_elems,
+                 int32_t *max_elems);
+
+int32_t alloc_internal(multimap *mm);
+int32_t alloc_leaf(multimap *mm);
+int32_t alloc_value_list(multimap *mm);
+
+int find_child(const bpt_internal *node, int key);
+int find_in_leaf(const bpt_leaf *leaf, int key);
+int leaf_lower_bound(const bpt_leaf *leaf, int key);
+
+value_list * find_value_list(multimap *mm, int key);
+int bpt_insert(multimap *mm, int32_t index, int level, int key,
+               int32_t *list, int *split_key, int32_t *split_index);
+
+
+/*============================================================================
+ * FUNCTION IMPLEMENTATIONS
+ *============================================================================*/
+
+/**
+ * Grows one of the node pools, preserving its contents.  The pools are
+ * aligned to the node size so that every node starts on a cache line, which
+ * realloc() doesn't guarantee, so the contents are copied over by hand.
+ * @param  pool      the current pool, or NULL
+ * @param  elem_size the size of each element of the pool
+ * @param  num_elems the number of elements in use
+ * @param  max_elems the capacity of the pool, updated to the new capacity
+ * @return           the new pool
+ */
+void * grow_pool(void *pool, size_t elem_size, int32_t num_elems,
+                 int32_t *max_elems) {
+    int32_t new_max = (*max_elems == 0) ? 16 : *max_elems * 2;
+    void *newzone;
+
+    if (posix_memalign(&newzone, NODE_BYTES, new_max * elem_size) != 0) {
+        /* Simple error handling for out of memory cases. */
+        printf("size requested %lu\n", new_max * elem_size);
+        printf("%s\n", "failed to grow node pool");
+        exit(1);
+    }
+
+    if (pool != NULL) {
+        memcpy(newzone, pool, num_elems * elem_size);
+        free(pool);
+    }
+
+    *max_elems = new_max;
+    return newzone;
+}
+
+
+/* Allocates an empty internal node, and returns its index. */
+int32_t alloc_internal(multimap *mm) {
+    if (mm->num_internals == mm->max_internals) {
+        mm->internals = grow_pool(mm->internals, sizeof(bpt_internal),
+                                  mm->num_internals, &mm->max_internals);
+    }
+
+    bzero(mm->internals + mm->num_internals, sizeof(bpt_internal));
+    return mm->num_internals++;
+}
+
+
+/* Allocates an empty leaf node, and returns its index. */
+int32_t alloc_leaf(multimap *mm) {
+    bpt_leaf *leaf;
+
+    if (mm->num_leaves == mm->max_leaves) {
+        mm->leaves = grow_pool(mm->leaves, sizeof(bpt_leaf),
+                               mm->num_leaves, &mm->max_leaves);
+    }
+
+    leaf = mm->leaves + mm->num_leaves;
+    bzero(leaf, sizeof(bpt_leaf));
+    leaf->next_leaf = NULL_INDEX;
+    return mm->num_leaves++;
+}
+
+
+/* Allocates an empty value-list, and returns its index. */
+int32_t alloc_value_list(multimap *mm) {
+    if (mm->num_lists == mm->max_lists) {
+        mm->lists = grow_pool(mm->lists, sizeof(value_list),
+                              mm->num_lists, &mm->max_lists);
+    }
+
+    bzero(mm->lists + mm->num_lists, sizeof(value_list));
+    return mm->num_lists++;
+}
+
+
+/**
+ * Returns which child of an internal node the key belongs in, which is the
+ * number of keys in the node that are less than or equal to the key.  With
+ * SSE2, all 15 keys are compared against the key with four comparisons, and
+ * the results are counted from the comparison masks.
+ */
+int find_child(const bpt_internal *node, int key) {
+#ifdef __SSE2__
+    __m128i k = _mm_set1_epi32(key);
+    unsigned int gt_mask, valid = (1u << node->num_keys) - 1;
+    const __m128i *keys = (const __m128i *) node->keys;
+
+    /* Bit i of gt_mask is set if keys[i] > key. */
+    gt_mask = _mm_movemask_ps(_mm_castsi128_ps(
+                  _mm_cmpgt_epi32(_mm_load_si128(keys), k)));
+    gt_mask |= _mm_movemask_ps(_mm_castsi128_ps(
+                  _mm_cmpgt_epi32(_mm_load_si128(keys + 1), k))) << 4;
+    gt_mask |= _mm_movemask_ps(_mm_castsi128_ps(
+                  _mm_cmpgt_epi32(_mm_load_si128(keys + 2), k))) << 8;
+    gt_mask |= _mm_movemask_ps(_mm_castsi128_ps(
+                  _mm_cmpgt_epi32(_mm_load_si128(keys + 3), k))) << 12;
+
+    return __builtin_popcount(~gt_mask & valid);
+#else
+    int i;
+
+    for (i = 0; i < node->num_keys && node->keys[i] <= key; i++)
+        ;
+    return i;
+#endif
+}
+
+
+/**
+ * Returns the position of the key in a leaf node, or -1 if the leaf doesn't
+ * contain the key.
+ */
+int find_in_leaf(const bpt_leaf *leaf, int key) {
+#ifdef __SSE2__
+    __m128i k = _mm_set1_epi32(key);
+    unsigned int eq_mask, valid = (1u << leaf->num_keys) - 1;
+    const __m128i *keys = (const __m128i *) leaf->keys;
+
+    eq_mask = _mm_movemask_ps(_mm_castsi128_ps(
+                  _mm_cmpeq_epi32(_mm_load_si128(keys), k)));
+    eq_mask |= _mm_movemask_ps(_mm_castsi128_ps(
+                  _mm_cmpeq_epi32(_mm_load_si128(keys + 1), k))) << 4;
+    eq_mask |= _mm_movemask_ps(_mm_castsi128_ps(
+                  _mm_cmpeq_epi32(_mm_load_si128(keys + 2), k))) << 8;
+    eq_mask |= _mm_movemask_ps(_mm_castsi128_ps(
+                  _mm_cmpeq_epi32(_mm_load_si128(keys + 3), k))) << 12;
+    eq_mask &= valid;
+
+    return eq_mask ? __builtin_ctz(eq_mask) : -1;
+#else
+    int i;
+
+    for (i = 0; i < leaf->num_keys; i++) {
+        if (leaf->keys[i] == key)
+            return i;
+    }
+    return -1;
+#endif
+}
+
+
+/* Returns the position of the first key in the leaf that is not less than
+ * the key, i.e. where the key would be inserted.
+ */
+int leaf_lower_bound(const bpt_leaf *leaf, int key) {
+    int i;
+
+    for (i = 0; i < leaf->num_keys && leaf->keys[i] < key; i++)
+        ;
+    return i;
+}
+
+
+/* This helper function searches for the value-list of the specified key,
+ * returning NULL if the key isn't in the multimap.
+ */
+value_list * find_value_list(multimap *mm, int key) {
+    int32_t index = mm->root;
+    int level, pos;
+
+    if (index == NULL_INDEX)
+        return NULL;
+
+    for (level = mm->height; level > 0; level--) {
+        const bpt_internal *node = mm->internals + index;
+        index = node->children[find_child(node, key)];
+    }
+
+    pos = find_in_leaf(mm->leaves + index, key);
+    if (pos < 0)
+        return NULL;
+
+    return mm->lists + mm->leaves[index].lists[pos];
+}
+
+
+/**
+ * Inserts the key into the subtree rooted at the specified node, if it isn't
+ * already there, and reports the key's value-list.  If the node has to be
+ * split to make room, the new right half is returned through split_index,
+ * and the smallest key reachable through it through split_key.  Nodes are
+ * always referred to by index, since the pools may be moved by allocations.
+ * @param  mm          the pointer to the multimap
+ * @param  index       index of the root of the subtree
+ * @param  level       the level of the node; 0 for a leaf
+ * @param  key         the key to insert
+ * @param  list        set to the index of the key's value-list
+ * @param  split_key   set to the separator key if the node was split
+ * @param  split_index set to the new right node if the node was split
+ * @return             nonzero if the node was split
+ */
+int bpt_insert(multimap *mm, int32_t index, int level, int key,
+               int32_t *list, int *split_key, int32_t *split_index) {
+    int pos, child_split, child_key, half;
+    int32_t child_index;
+
+    if (level == 0) {
+        bpt_leaf *leaf = mm->leaves + index, *right;
+
+        pos = find_in_leaf(leaf, key);
+        if (pos >= 0) {
+            *list = leaf->lists[pos];
+            return 0;
+        }
+
+        *list = alloc_value_list(mm);
+
+        if (leaf->num_keys < LEAF_KEYS) {
+            pos = leaf_lower_bound(leaf, key);
+            memmove(leaf->keys + pos + 1, leaf->keys + pos,
+                    (leaf->num_keys - pos) * sizeof(int32_t));
+            memmove(leaf->lists + pos + 1, leaf->lists + pos,
+                    (leaf->num_keys - pos) * sizeof(int32_t));
+            leaf->keys[pos] = key;
+            leaf->lists[pos] = *list;
+            leaf->num_keys++;
+            return 0;
+        }
+
+        /* The leaf is full, so move its upper half into a new leaf that
+         * follows it in the leaf chain, and then add the key to whichever
+         * half it belongs in.
+         */
+        *split_index = alloc_leaf(mm);
+        leaf = mm->leaves + index;
+        right = mm->leaves + *split_index;
+
+        half = (LEAF_KEYS + 1) / 2;
+        right->num_keys = LEAF_KEYS - half;
+        memcpy(right->keys, leaf->keys + half,
+               right->num_keys * sizeof(int32_t));
+        memcpy(right->lists, leaf->lists + half,
+               right->num_keys * sizeof(int32_t));
+        leaf->num_keys = half;
+
+        right->next_leaf = leaf->next_leaf;
+        leaf->next_leaf = *split_index;
+
+        if (key >= right->keys[0])
+            leaf = right;
+
+        pos = leaf_lower_bound(leaf, key);
+        memmove(leaf->keys + pos + 1, leaf->keys + pos,
+                (leaf->num_keys - pos) * sizeof(int32_t));
+        memmove(leaf->lists + pos + 1, leaf->lists + pos,
+                (leaf->num_keys - pos) * sizeof(int32_t));
+        leaf->keys[pos] = key;
+        leaf->lists[pos] = *list;
+        leaf->num_keys++;
+
+        *split_key = right->keys[0];
+        return 1;
+    }
+
+    pos = find_child(mm->internals + index, key);
+    child_split = bpt_insert(mm, mm->internals[index].children[pos],
+                             level - 1, key, list, &child_key, &child_index);
+    if (!child_split)
+        return 0;
+
+    /* The child was split, so add the new child just after it. */
+    if (mm->internals[index].num_keys < INTERNAL_KEYS) {
+        bpt_internal *node = mm->internals + index;
+
+        memmove(node->keys + pos + 1, node->keys + pos,
+                (node->num_keys - pos) * sizeof(int32_t));
+        memmove(node->children + pos + 2, node->children + pos + 1,
+                (node->num_keys - pos) * sizeof(int32_t));
+        node->keys[pos] = child_key;
+        node->children[pos + 1] = child_index;
+        node->num_keys++;
+        return 0;
+    }
+    else {
+        /* This node is full too.  Build the combined list of keys and
+         * children, then keep the lower half here, move the upper half to a
+         * new node, and push the middle key up to the parent.
+         */
+        int32_t keys[INTERNAL_KEYS + 1], children[INTERNAL_KEYS + 2];
+        bpt_internal *node, *right;
+        int n = INTERNAL_KEYS + 1;
+
+        *split_index = alloc_internal(mm);
+        node = mm->internals + index;
+        right = mm->internals + *split_index;
+
+        memcpy(keys, node->keys, pos * sizeof(int32_t));
+        keys[pos] = child_key;
+        memcpy(keys + pos + 1, node->keys + pos,
+               (INTERNAL_KEYS - pos) * sizeof(int32_t));
+
+        memcpy(children, node->children, (pos + 1) * sizeof(int32_t));
+        children[pos + 1] = child_index;
+        memcpy(children + pos + 2, node->children + pos + 1,
+               (INTERNAL_KEYS - pos) * sizeof(int32_t));
+
+        half = n / 2;
+        node->num_keys = half;
+        memcpy(node->keys, keys, half * sizeof(int32_t));
+        memcpy(node->children, children, (half + 1) * sizeof(int32_t));
+
+        right->num_keys = n - half - 1;
+        memcpy(right->keys, keys + half + 1,
+               right->num_keys * sizeof(int32_t));
+        memcpy(right->children, children + half + 1,
+               (right->num_keys + 1) * sizeof(int32_t));
+
+        *split_key = keys[half];
+        return 1;
+    }
+}
+
+
+/* Initialize a multimap data structure. */
+multimap * init_multimap() {
+    multimap *mm = malloc(sizeof(multimap));
+    bzero(mm, sizeof(multimap));
+    mm->root = NULL_INDEX;
+    return mm;
+}
+
+
+/* Release all dynamically allocated memory associated with the multimap
+ * data structure.
+ */
+void clear_multimap(multimap *mm) {
+    int32_t i;
+
+    assert(mm != NULL);
+
+    for (i = 0; i < mm->num_lists; i++)
+        free(mm->lists[i].values);
+
+    free(mm->internals);
+    free(mm->leaves);
+    free(mm->lists);
+
+    bzero(mm, sizeof(multimap));
+    mm->root = NULL_INDEX;
+}
+
+
+/* Adds the specified (key, value) pair to the multimap. */
+void mm_add_value(multimap *mm, int key, int value) {
+    int32_t list, split_index, old_root;
+    int split_key;
+    value_list *vl;
+
+    assert(mm != NULL);
+
+    if (mm->root == NULL_INDEX) {
+        mm->root = alloc_leaf(mm);
+        mm->height = 0;
+    }
+
+    if (bpt_insert(mm, mm->root, mm->height, key, &list,
+                   &split_key, &split_index)) {
+        /* The root was split, so the tree grows a new root. */
+        old_root = mm->root;
+        mm->root = alloc_internal(mm);
+        mm->internals[mm->root].num_keys = 1;
+        mm->internals[mm->root].keys[0] = split_key;
+        mm->internals[mm->root].children[0] = old_root;
+        mm->internals[mm->root].children[1] = split_index;
+        mm->height++;
+    }
+
+    /* Append the value to the key's value-list, doubling it when full. */
+    vl = mm->lists + list;
+    if (vl->num_values == vl->num_spaces) {
+        int32_t new_spaces = (vl->num_spaces == 0) ? 1 : vl->num_spaces * 2;
+        int *newzone = realloc(vl->values, new_spaces * sizeof(int));
+        if (newzone == NULL) {
+            /* Simple error handling for out of memory cases. */
+            printf("%s\n", "failed to realloc value list");
+            exit(1);
+        }
+        vl->values = newzone;
+        vl->num_spaces = new_spaces;
+    }
+    vl->values[vl->num_values++] = value;
+}
+
+
+/* Returns nonzero if the multimap contains the specified key-value, zero
+ * otherwise.
+ */
+int mm_contains_key(multimap *mm, int key) {
+    return find_value_list(mm, key) != NULL;
+}
+
+
+/* Returns nonzero if the multimap contains the specified (key, value) pair,
+ * zero otherwise.
+ */
+int mm_contains_pair(multimap *mm, int key, int value) {
+    value_list *vl;
+    int32_t i;
+
+    vl = find_value_list(mm, key);
+    if (vl == NULL)
+        return 0;
+
+    for (i = 0; i < vl->num_values; i++) {
+        if (vl->values[i] == value)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* Performs an in-order traversal of the multimap, passing each (key, value)
+ * pair to the specified function.  Since the leaves are linked in key order,
+ * this is just a sequential scan along the leaf chain, starting from the
+ * leftmost leaf.
+ */
+void mm_traverse(multimap *mm, void (*f)(int key, int value)) {
+    int32_t index = mm->root, i, j;
+    int level;
+
+    if (index == NULL_INDEX)
+        return;
+
+    for (level = mm->height; level > 0; level--)
+        index = mm->internals[index].children[0];
+
+    while (index != NULL_INDEX) {
+        bpt_leaf *leaf = mm->leaves + index;
+
+        for (i = 0; i < leaf->num_keys; i++) {
+            value_list *vl = mm->lists + leaf->lists[i];
+            for (j = 0; j < vl->num_values; j++)
+                f(leaf->keys[i], vl->values[j]);
+        }
+
+        index = leaf->next_leaf;
+    }
+}
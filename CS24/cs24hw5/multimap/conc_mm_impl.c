@@ -0,0 +1,365 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "multimap.h"
+#include "arena.h"
+
+/* The most levels a skiplist node can have.  With a promotion probability
+ * of 1/4, this comfortably covers 2^32 keys.
+ */
+#define MAX_LEVEL 16
+
+/* The number of values that the first value chunk of a key has room for.
+ * Each later chunk is twice as large as the one before it.
+ */
+#define FIRST_CHUNK_SPACES 4
+
+/* Shorthands for the atomic accesses that publish data from the writer to
+ * concurrent readers.
+ */
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+
+/*============================================================================
+ * TYPES
+ *
+ *   These types are defined in the implementation file so that they can
+ *   be kept hidden to code outside this source file.  This is not for any
+ *   security reason, but rather just so we can enforce that our testing
+ *   programs are generic and don't have any access to implementation details.
+ *
+ *   This implementation is safe to share between threads.  Any number of
+ *   threads may probe and traverse the multimap while other threads add
+ *   values to it.  Adds are serialized by a mutex, but readers never take a
+ *   lock or write to shared memory:  the writer fully initializes anything
+ *   new before publishing it with a release store, and readers follow links
+ *   with acquire loads.  Since pairs are never removed, nothing a reader can
+ *   see is ever freed while the multimap is in use.
+ *============================================================================*/
+
+/* A chunk of the values associated with a key.  Chunks are only ever
+ * appended to, so a reader can safely scan the first num_values values of a
+ * chunk while the writer adds more values after them.
+ */
+typedef struct value_chunk {
+    /* The next chunk of values, or NULL if this is the last chunk. */
+    struct value_chunk *next;
+
+    /* The number of values in this chunk, which is only increased after the
+     * new value is stored, and the number of values the chunk has room for.
+     */
+    int32_t num_values;
+    int32_t num_spaces;
+
+    int values[];
+} value_chunk;
+
+
+/* Represents a key and its associated values in the multimap.  Nodes are
+ * kept in a skiplist, so each node has a randomly chosen number of forward
+ * links, one per level of the list that it is part of.
+ */
+typedef struct multimap_node {
+    /* The key-value that this multimap node represents. */
+    int key;
+
+    /* The number of levels of the skiplist that this node is part of. */
+    int32_t level;
+
+    /* The chunks of values associated with this key, in the order they were
+     * added.  Only the writer uses last_chunk.
+     */
+    value_chunk *first_chunk;
+    value_chunk *last_chunk;
+
+    /* The next node at each level of the skiplist. */
+    struct multimap_node *next[];
+} multimap_node;
+
+
+/* The entry-point of the multimap data structure. */
+struct multimap {
+    /* The first node at each level of the skiplist, or NULL if the level is
+     * empty.
+     */
+    multimap_node *head[MAX_LEVEL];
+
+    /* The number of levels that are in use. */
+    int32_t level;
+
+    /* The state of the random number generator used to choose the levels of
+     * new nodes.  Only the writer uses this.
+     */
+    uint32_t random_state;
+
+    /* Serializes the threads that add values to the multimap. */
+    pthread_mutex_t write_lock;
+
+    /* All nodes and value chunks are allocated from this arena by the
+     * writer.  Nothing is freed until the whole multimap is cleared.
+     */
+    arena arena;
+};
+
+
+/*============================================================================
+ * HELPER FUNCTION DECLARATIONS
+ *
+ *   Declarations of helper functions that are local to this module.  Again,
+ *   these are not visible outside of this module.
+ *============================================================================*/
+
+multimap_node * find_mm_node(multimap *mm, int key,
+    multimap_node **preds[MAX_LEVEL]);
+multimap_node * alloc_mm_node(multimap *mm, int key);
+value_chunk * alloc_value_chunk(multimap *mm, int32_t num_spaces);
+int32_t random_level(multimap *mm);
+
+void append_value(multimap *mm, multimap_node *node, int value);
+
+
+/*============================================================================
+ * FUNCTION IMPLEMENTATIONS
+ *============================================================================*/
+
+/**
+ * This helper function searches for the multimap node that contains the
+ * specified key, and returns NULL if there is no such node.  The search keeps
+ * track of the link array of the last node before the key at each level,
+ * starting with the multimap's head links, so that the head needs no special
+ * cases.
+ * @param  mm    the pointer to the multimap
+ * @param  key   the key to search for
+ * @param  preds if not NULL, set to the link that would point to a new node
+ *               for the key at each level
+ * @return       the node with the key, or NULL if there is none
+ */
+multimap_node * find_mm_node(multimap *mm, int key,
+    multimap_node **preds[MAX_LEVEL]) {
+    multimap_node **links = mm->head;
+    multimap_node *next = NULL;
+    int32_t i;
+
+    for (i = LOAD_ACQUIRE(&mm->level) - 1; i >= 0; i--) {
+        while ((next = LOAD_ACQUIRE(&links[i])) != NULL && next->key < key)
+            links = next->next;
+
+        if (preds != NULL)
+            preds[i] = &links[i];
+    }
+
+    if (next != NULL && next->key == key)
+        return next;
+
+    return NULL;
+}
+
+
+/* Chooses the number of levels for a new node, promoting it to each further
+ * level with probability 1/4.
+ */
+int32_t random_level(multimap *mm) {
+    uint32_t r = mm->random_state;
+    int32_t level = 1;
+
+    /* xorshift32 */
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    mm->random_state = r;
+
+    while ((r & 3) == 0 && level < MAX_LEVEL) {
+        level++;
+        r >>= 2;
+    }
+    return level;
+}
+
+
+/* Allocates an empty chunk with room for the specified number of values. */
+value_chunk * alloc_value_chunk(multimap *mm, int32_t num_spaces) {
+    value_chunk *chunk = arena_alloc(&mm->arena,
+        sizeof(value_chunk) + num_spaces * sizeof(int));
+
+    chunk->next = NULL;
+    chunk->num_values = 0;
+    chunk->num_spaces = num_spaces;
+    return chunk;
+}
+
+
+/* Allocates a node for the key, with a random number of levels and an empty
+ * first chunk of values.  The node isn't linked into the skiplist yet.
+ */
+multimap_node * alloc_mm_node(multimap *mm, int key) {
+    int32_t level = random_level(mm);
+    multimap_node *node = arena_alloc(&mm->arena,
+        sizeof(multimap_node) + level * sizeof(multimap_node *));
+
+    node->key = key;
+    node->level = level;
+    node->first_chunk = alloc_value_chunk(mm, FIRST_CHUNK_SPACES);
+    node->last_chunk = node->first_chunk;
+    return node;
+}
+
+
+/**
+ * Appends a value to a node's chunks, starting a chunk twice as large when
+ * the last one is full.  The value is stored before the count or link that
+ * makes it visible to readers.  Must be called with the write lock held.
+ * @param mm    pointer to the multimap
+ * @param node  the node to add the value to
+ * @param value the value to add
+ */
+void append_value(multimap *mm, multimap_node *node, int value) {
+    value_chunk *chunk = node->last_chunk;
+
+    if (chunk->num_values == chunk->num_spaces) {
+        value_chunk *new_chunk = alloc_value_chunk(mm, 2 * chunk->num_spaces);
+
+        new_chunk->values[0] = value;
+        new_chunk->num_values = 1;
+        STORE_RELEASE(&chunk->next, new_chunk);
+        node->last_chunk = new_chunk;
+        return;
+    }
+
+    chunk->values[chunk->num_values] = value;
+    STORE_RELEASE(&chunk->num_values, chunk->num_values + 1);
+}
+
+
+/* Initialize a multimap data structure. */
+multimap * init_multimap() {
+    multimap *mm = malloc(sizeof(multimap));
+
+    if (mm == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate multimap");
+        exit(1);
+    }
+
+    memset(mm->head, 0, sizeof(mm->head));
+    mm->level = 1;
+    mm->random_state = 2463534242u;
+    pthread_mutex_init(&mm->write_lock, NULL);
+    init_arena(&mm->arena);
+    return mm;
+}
+
+
+/* Release all dynamically allocated memory associated with the multimap
+ * data structure.  No other thread may be using the multimap.
+ */
+void clear_multimap(multimap *mm) {
+    assert(mm != NULL);
+
+    clear_arena(&mm->arena);
+    memset(mm->head, 0, sizeof(mm->head));
+    mm->level = 1;
+}
+
+
+/**
+ * Adds the specified (key, value) pair to the multimap.  A new key's node
+ * gets its first value and all of its forward links before it is linked into
+ * the skiplist, bottom level first, so that a reader that finds the node at
+ * any level can also follow it down to the bottom level.
+ * @param mm    pointer to the multimap
+ * @param key   key where the following value will be added
+ * @param value value to be added at key
+ */
+void mm_add_value(multimap *mm, int key, int value) {
+    multimap_node **preds[MAX_LEVEL];
+    multimap_node *node;
+    int32_t i;
+
+    assert(mm != NULL);
+
+    pthread_mutex_lock(&mm->write_lock);
+
+    node = find_mm_node(mm, key, preds);
+    if (node != NULL) {
+        append_value(mm, node, value);
+        pthread_mutex_unlock(&mm->write_lock);
+        return;
+    }
+
+    node = alloc_mm_node(mm, key);
+    append_value(mm, node, value);
+
+    /* Levels above the current top of the list start from the head. */
+    for (i = mm->level; i < node->level; i++)
+        preds[i] = &mm->head[i];
+
+    for (i = 0; i < node->level; i++)
+        node->next[i] = *preds[i];
+
+    for (i = 0; i < node->level; i++)
+        STORE_RELEASE(preds[i], node);
+
+    if (node->level > mm->level)
+        STORE_RELEASE(&mm->level, node->level);
+
+    pthread_mutex_unlock(&mm->write_lock);
+}
+
+
+/* Returns nonzero if the multimap contains the specified key-value, zero
+ * otherwise.
+ */
+int mm_contains_key(multimap *mm, int key) {
+    return find_mm_node(mm, key, NULL) != NULL;
+}
+
+
+/* Returns nonzero if the multimap contains the specified (key, value) pair,
+ * zero otherwise.
+ */
+int mm_contains_pair(multimap *mm, int key, int value) {
+    multimap_node *node;
+    value_chunk *chunk;
+    int32_t i, num_values;
+
+    node = find_mm_node(mm, key, NULL);
+    if (node == NULL)
+        return 0;
+
+    for (chunk = node->first_chunk; chunk != NULL;
+         chunk = LOAD_ACQUIRE(&chunk->next)) {
+        num_values = LOAD_ACQUIRE(&chunk->num_values);
+        for (i = 0; i < num_values; i++) {
+            if (chunk->values[i] == value)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Performs an in-order traversal of the multimap, passing each (key, value)
+ * pair to the specified function.  Pairs added during the traversal may or
+ * may not be seen.
+ */
+void mm_traverse(multimap *mm, void (*f)(int key, int value)) {
+    multimap_node *node;
+    value_chunk *chunk;
+    int32_t i, num_values;
+
+    for (node = LOAD_ACQUIRE(&mm->head[0]); node != NULL;
+         node = LOAD_ACQUIRE(&node->next[0])) {
+        for (chunk = node->first_chunk; chunk != NULL;
+             chunk = LOAD_ACQUIRE(&chunk->next)) {
+            num_values = LOAD_ACQUIRE(&chunk->num_values);
+            for (i = 0; i < num_values; i++)
+                f(node->key, chunk->values[i]);
+        }
+    }
+}
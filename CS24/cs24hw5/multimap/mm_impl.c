@@ -4,6 +4,8 @@
 #include <string.h>
 
 #include "multimap.h"
+#include "mm_layout.h"
+#include "arena.h"
 
 
 /*============================================================================
@@ -47,10 +49,25 @@ typedef struct multimap_node {
     struct multimap_node *right_child;
 } multimap_node;
 
+/* The cache simulator's copy of this multimap relies on these sizes, which
+ * only hold on a 64-bit machine.
+ */
+_Static_assert(sizeof(void *) != 8 ||
+               sizeof(multimap_node) == BST_NODE_BYTES,
+               "tree nodes must be BST_NODE_BYTES in size");
+_Static_assert(sizeof(void *) != 8 ||
+               sizeof(multimap_value) == BST_VALUE_BYTES,
+               "value nodes must be BST_VALUE_BYTES in size");
+
 
 /* The entry-point of the multimap data structure. */
 struct multimap {
     multimap_node *root;
+
+    /* All nodes and values of the multimap are allocated from this arena,
+     * so that clearing the multimap only needs to free the arena's chunks.
+     */
+    arena arena;
 };
 
 
@@ -61,24 +78,21 @@ struct multimap {
  *   these are not visible outside of this module.
  *============================================================================*/
 
-multimap_node * alloc_mm_node();
+multimap_node * alloc_mm_node(multimap *mm);
 
-multimap_node * find_mm_node(multimap_node *root, int key,
+multimap_node * find_mm_node(multimap *mm, int key,
                              int create_if_not_found);
 
-void free_multimap_values(multimap_value *values);
-void free_multimap_node(multimap_node *node);
-
 
 /*============================================================================
  * FUNCTION IMPLEMENTATIONS
  *============================================================================*/
 
-/* Allocates a multimap node, and zeros out its contents so that we know what
- * the initial value of everything will be.
+/* Allocates a multimap node from the multimap's arena, and zeros out its
+ * contents so that we know what the initial value of everything will be.
  */
-multimap_node * alloc_mm_node() {
-    multimap_node *node = malloc(sizeof(multimap_node));
+multimap_node * alloc_mm_node(multimap *mm) {
+    multimap_node *node = arena_alloc(&mm->arena, sizeof(multimap_node));
     bzero(node, sizeof(multimap_node));
 
     return node;
@@ -91,14 +105,15 @@ multimap_node * alloc_mm_node() {
  * The one exception is the root - if the root is NULL then the function will
  * return a new root node.
  */
-multimap_node * find_mm_node(multimap_node *root, int key,
+multimap_node * find_mm_node(multimap *mm, int key,
                              int create_if_not_found) {
+    multimap_node *root = mm->root;
     multimap_node *node;
 
     /* If the entire multimap is empty, the root will be NULL. */
     if (root == NULL) {
         if (create_if_not_found) {
-            root = alloc_mm_node();
+            root = alloc_mm_node(mm);
             root->key = key;
         }
         return root;
@@ -113,7 +128,7 @@ multimap_node * find_mm_node(multimap_node *root, int key,
         if (node->key > key) {   /* Follow left child */
             if (node->left_child == NULL && create_if_not_found) {
                 /* No left child, but caller wants us to create a new node. */
-                multimap_node *new = alloc_mm_node();
+                multimap_node *new = alloc_mm_node(mm);
                 new->key = key;
 
                 node->left_child = new;
@@ -123,7 +138,7 @@ multimap_node * find_mm_node(multimap_node *root, int key,
         else {                   /* Follow right child */
             if (node->right_child == NULL && create_if_not_found) {
                 /* No right child, but caller wants us to create a new node. */
-                multimap_node *new = alloc_mm_node();
+                multimap_node *new = alloc_mm_node(mm);
                 new->key = key;
 
                 node->right_child = new;
@@ -139,56 +154,22 @@ multimap_node * find_mm_node(multimap_node *root, int key,
 }
 
 
-/* This helper function frees all values in a multimap node's value-list. */
-void free_multimap_values(multimap_value *values) {
-    while (values != NULL) {
-        multimap_value *next = values->next;
-#ifdef DEBUG_ZERO
-        /* Clear out what we are about to free, to expose issues quickly. */
-        bzero(values, sizeof(multimap_value));
-#endif
-        free(values);
-        values = next;
-    }
-}
-
-
-/* This helper function frees a multimap node, including its children and
- * value-list.
- */
-void free_multimap_node(multimap_node *node) {
-    if (node == NULL)
-        return;
-
-    /* Free the children first. */
-    free_multimap_node(node->left_child);
-    free_multimap_node(node->right_child);
-
-    /* Free the list of values. */
-    free_multimap_values(node->values);
-
-#ifdef DEBUG_ZERO
-    /* Clear out what we are about to free, to expose issues quickly. */
-    bzero(node, sizeof(multimap_node));
-#endif
-    free(node);
-}
-
-
 /* Initialize a multimap data structure. */
 multimap * init_multimap() {
     multimap *mm = malloc(sizeof(multimap));
     mm->root = NULL;
+    init_arena(&mm->arena);
     return mm;
 }
 
 
 /* Release all dynamically allocated memory associated with the multimap
- * data structure.
+ * data structure.  Since every node and value came from the arena, this
+ * frees a few large chunks rather than walking the whole tree.
  */
 void clear_multimap(multimap *mm) {
     assert(mm != NULL);
-    free_multimap_node(mm->root);
+    clear_arena(&mm->arena);
     mm->root = NULL;
 }
 
@@ -201,7 +182,7 @@ void mm_add_value(multimap *mm, int key, int value) {
     assert(mm != NULL);
 
     /* Look up the node with the specified key.  Create if not found. */
-    node = find_mm_node(mm->root, key, /* create */ 1);
+    node = find_mm_node(mm, key, /* create */ 1);
     if (mm->root == NULL)
         mm->root = node;
 
@@ -210,7 +191,7 @@ void mm_add_value(multimap *mm, int key, int value) {
 
     /* Add the new value to the multimap node. */
 
-    new_value = malloc(sizeof(multimap_value));
+    new_value = arena_alloc(&mm->arena, sizeof(multimap_value));
     new_value->value = value;
     new_value->next = NULL;
 
@@ -227,7 +208,7 @@ void mm_add_value(multimap *mm, int key, int value) {
  * otherwise.
  */
 int mm_contains_key(multimap *mm, int key) {
-    return find_mm_node(mm->root, key, /* create */ 0) != NULL;
+    return find_mm_node(mm, key, /* create */ 0) != NULL;
 }
 
 
@@ -238,7 +219,7 @@ int mm_contains_pair(multimap *mm, int key, int value) {
     multimap_node *node;
     multimap_value *curr;
 
-    node = find_mm_node(mm->root, key, /* create */ 0);
+    node = find_mm_node(mm, key, /* create */ 0);
     if (node == NULL)
         return 0;
 
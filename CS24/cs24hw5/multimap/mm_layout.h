@@ -0,0 +1,41 @@
+/* This file defines the layout constants of the multimap implementations
+ * that the cache simulator's copies of them, in cachesim/simmm.c, must agree
+ * with.  Each implementation checks its own struct sizes against these, so
+ * a change to a struct that isn't made here too fails to compile.
+ */
+
+#ifndef MM_LAYOUT_H
+#define MM_LAYOUT_H
+
+
+/* mm_impl.c, on a 64-bit machine: a tree node is an int key followed by
+ * four pointers, and a value node is an int value followed by a pointer.
+ */
+#define BST_NODE_BYTES 40
+#define BST_VALUE_BYTES 16
+
+
+/* opt_mm_impl.c: the size of a tree node, and the number of values a key
+ * has before its values are also indexed by a hash set.
+ */
+#define AVL_NODE_BYTES 40
+#define VALUE_SET_THRESHOLD 16
+
+/* A value's home slot in a hash set of num_slots slots, a power of 2, is
+ * the high log2(num_slots) bits of the value times VALUE_HASH_MULTIPLIER.
+ */
+#define VALUE_HASH_MULTIPLIER 2654435769u
+#define VALUE_HASH_SHIFT(num_slots) (32 - __builtin_ctz(num_slots))
+
+
+/* bptree_mm_impl.c: the size of every tree node, the maximum number of keys
+ * in an internal node and in a leaf node, and the size of a value-list on a
+ * 64-bit machine.
+ */
+#define NODE_BYTES 128
+#define INTERNAL_KEYS 15
+#define LEAF_KEYS 15
+#define VALUE_LIST_BYTES 16
+
+
+#endif
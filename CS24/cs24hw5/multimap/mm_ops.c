@@ -0,0 +1,20 @@
+#include "mm_ops.h"
+
+/* This file is compiled once per multimap implementation, with MM_OPS_NAME
+ * set to the name of the table to define (such as opt_mm_ops), and
+ * MM_OPS_LABEL set to the implementation's short name as a string.
+ */
+
+#if !defined(MM_OPS_NAME) || !defined(MM_OPS_LABEL)
+#error "MM_OPS_NAME and MM_OPS_LABEL must be defined"
+#endif
+
+const mm_ops MM_OPS_NAME = {
+    MM_OPS_LABEL,
+    init_multimap,
+    clear_multimap,
+    mm_add_value,
+    mm_contains_key,
+    mm_contains_pair,
+    mm_traverse
+};
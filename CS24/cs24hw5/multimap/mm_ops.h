@@ -0,0 +1,36 @@
+/* This file declares a table of the basic multimap operations, so that one
+ * program can use several multimap implementations at once.  Each
+ * implementation is linked into its own relocatable object along with a
+ * table built from mm_ops.c, and every symbol except the table is then made
+ * local to the object, so that the implementations' functions don't clash.
+ * See the mmbench rules in the Makefile.
+ */
+
+#ifndef MM_OPS_H
+#define MM_OPS_H
+
+#include "multimap.h"
+
+
+typedef struct mm_ops {
+    /* A short name for the implementation. */
+    const char *name;
+
+    /* The operations declared in multimap.h. */
+    multimap * (*init_multimap)();
+    void (*clear_multimap)(multimap *mm);
+    void (*mm_add_value)(multimap *mm, int key, int value);
+    int (*mm_contains_key)(multimap *mm, int key);
+    int (*mm_contains_pair)(multimap *mm, int key, int value);
+    void (*mm_traverse)(multimap *mm, void (*f)(int key, int value));
+} mm_ops;
+
+
+/* The tables of the implementations that can be linked into a program. */
+extern const mm_ops basic_mm_ops;    /* mm_impl.c */
+extern const mm_ops opt_mm_ops;      /* opt_mm_impl.c */
+extern const mm_ops bptree_mm_ops;   /* bptree_mm_impl.c */
+extern const mm_ops conc_mm_ops;     /* conc_mm_impl.c */
+extern const mm_ops art_mm_ops;      /* art_mm_impl.c */
+
+#endif
@@ -0,0 +1,476 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "mm_ops.h"
+
+
+/* This program compares multimap implementations on the same workloads.
+ * Every implementation is linked into this one program, and is used through
+ * its table of operations (see mm_ops.h).  For each implementation and
+ * workload, the program inserts pairs, then probes for pairs, and prints one
+ * CSV line with the insert and probe throughput, the median and 99th
+ * percentile probe latency, and how much the peak resident set size grew
+ * while the multimap was built and probed.
+ *
+ * Each run happens in its own child process, so that the peak RSS belongs
+ * to that run alone.  The workloads are generated from a fixed seed, so every
+ * implementation sees exactly the same pairs and probes, and should report
+ * the same number of hits.
+ */
+
+
+/* The implementations that can be benchmarked. */
+const mm_ops *all_backends[] = {
+    &basic_mm_ops, &opt_mm_ops, &bptree_mm_ops, &conc_mm_ops, &art_mm_ops,
+    NULL
+};
+#define DEFAULT_BACKENDS "basic,opt,bptree,conc,art"
+
+
+/* The kinds of key distributions that workloads can use. */
+typedef enum workload_kind {
+    WORKLOAD_UNIFORM,      /* every key equally likely */
+    WORKLOAD_ZIPF,         /* a few keys very popular, by Zipf's law */
+    WORKLOAD_CLUSTERED,    /* keys bunched around scattered centers */
+    WORKLOAD_SORTED,       /* increasing keys, with some random ones */
+    NUM_WORKLOADS
+} workload_kind;
+
+const char *workload_names[] = { "uniform", "zipf", "clustered", "sorted" };
+#define DEFAULT_WORKLOADS "uniform,zipf,clustered,sorted"
+
+/* The exponent of the Zipf distribution. */
+#define ZIPF_EXPONENT 0.99
+
+/* The number of clusters, and how far keys spread from their center. */
+#define NUM_CLUSTERS 64
+#define CLUSTER_SPREAD 256
+
+/* The percentage of keys in the sorted workload that are random instead. */
+#define SORTED_NOISE_PERCENT 5
+
+
+/* The parameters of a benchmark run. */
+typedef struct bench_params {
+    int num_pairs;
+    int num_probes;
+    int max_key;
+    int max_val;
+    uint64_t seed;
+} bench_params;
+
+
+/* The pairs to insert and probe for in one workload. */
+typedef struct workload {
+    int *keys, *vals;
+    int *probe_keys, *probe_vals;
+} workload;
+
+
+/* The state of a key generator. */
+typedef struct keygen {
+    workload_kind kind;
+    int max_key;
+
+    /* For the Zipf distribution, the cumulative probability of each rank,
+     * and the key that each rank maps to, so that popular keys are spread
+     * through the key space.
+     */
+    double *zipf_cdf;
+    int *zipf_keys;
+
+    /* For the clustered distribution, the center of each cluster. */
+    int centers[NUM_CLUSTERS];
+} keygen;
+
+
+/*============================================================================
+ * WORKLOAD GENERATION
+ *============================================================================*/
+
+/* A small, fast random number generator (xorshift64*), so that workloads
+ * don't depend on the C library's rand().
+ */
+uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ull;
+}
+
+
+/* Returns a random integer in [0, n). */
+int random_below(uint64_t *state, int n) {
+    return (int) ((next_random(state) >> 11) % (uint64_t) n);
+}
+
+
+/* Returns a random double in [0, 1). */
+double random_unit(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+void * checked_malloc(size_t size) {
+    void *p = malloc(size);
+
+    if (p == NULL) {
+        fprintf(stderr, "failed to allocate %lu bytes\n", (unsigned long) size);
+        exit(1);
+    }
+    return p;
+}
+
+
+void init_keygen(keygen *g, workload_kind kind, int max_key,
+                 uint64_t *state) {
+    int i;
+
+    g->kind = kind;
+    g->max_key = max_key;
+    g->zipf_cdf = NULL;
+    g->zipf_keys = NULL;
+
+    if (kind == WORKLOAD_ZIPF) {
+        double total = 0.0;
+
+        g->zipf_cdf = checked_malloc(max_key * sizeof(double));
+        g->zipf_keys = checked_malloc(max_key * sizeof(int));
+
+        for (i = 0; i < max_key; i++) {
+            total += 1.0 / pow(i + 1, ZIPF_EXPONENT);
+            g->zipf_cdf[i] = total;
+            g->zipf_keys[i] = i;
+        }
+        for (i = 0; i < max_key; i++)
+            g->zipf_cdf[i] /= total;
+
+        /* Shuffle which key has which rank. */
+        for (i = max_key - 1; i > 0; i--) {
+            int j = random_below(state, i + 1);
+            int tmp = g->zipf_keys[i];
+
+            g->zipf_keys[i] = g->zipf_keys[j];
+            g->zipf_keys[j] = tmp;
+        }
+    }
+    else if (kind == WORKLOAD_CLUSTERED) {
+        for (i = 0; i < NUM_CLUSTERS; i++)
+            g->centers[i] = random_below(state, max_key);
+    }
+}
+
+
+void free_keygen(keygen *g) {
+    free(g->zipf_cdf);
+    free(g->zipf_keys);
+}
+
+
+/* Generates the i-th of n keys of the generator's distribution.  Only the
+ * sorted distribution depends on i.
+ */
+int next_key(keygen *g, int i, int n, uint64_t *state) {
+    int lo, hi, spread;
+
+    switch (g->kind) {
+    case WORKLOAD_ZIPF:
+        /* Find the first rank whose cumulative probability covers a random
+         * number.
+         */
+        {
+            double u = random_unit(state);
+
+            lo = 0;
+            hi = g->max_key - 1;
+            while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+
+                if (g->zipf_cdf[mid] < u)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return g->zipf_keys[lo];
+        }
+
+    case WORKLOAD_CLUSTERED:
+        /* The sum of two uniform offsets bunches keys toward the center. */
+        spread = random_below(state, CLUSTER_SPREAD) +
+                 random_below(state, CLUSTER_SPREAD) - CLUSTER_SPREAD;
+        return g->centers[random_below(state, NUM_CLUSTERS)] + spread;
+
+    case WORKLOAD_SORTED:
+        if (random_below(state, 100) < SORTED_NOISE_PERCENT)
+            return random_below(state, g->max_key);
+        return (int) ((int64_t) i * g->max_key / n);
+
+    default:
+        return random_below(state, g->max_key);
+    }
+}
+
+
+/* Generates the pairs to insert, and the probes, of a workload.  Probes use
+ * the same key distribution as the inserted pairs, but random positions for
+ * the sorted workload, since lookups don't arrive in order.  The caller
+ * frees the key generator with free_keygen() once it is done measuring
+ * memory, so that freeing it doesn't leave the RSS below its peak.
+ */
+void generate_workload(workload *w, keygen *g, workload_kind kind,
+                       const bench_params *params) {
+    uint64_t state = params->seed * 0x9E3779B97F4A7C15ull + kind + 1;
+    int i;
+
+    w->keys = checked_malloc(params->num_pairs * sizeof(int));
+    w->vals = checked_malloc(params->num_pairs * sizeof(int));
+    w->probe_keys = checked_malloc(params->num_probes * sizeof(int));
+    w->probe_vals = checked_malloc(params->num_probes * sizeof(int));
+
+    init_keygen(g, kind, params->max_key, &state);
+
+    for (i = 0; i < params->num_pairs; i++) {
+        w->keys[i] = next_key(g, i, params->num_pairs, &state);
+        w->vals[i] = random_below(&state, params->max_val);
+    }
+
+    for (i = 0; i < params->num_probes; i++) {
+        w->probe_keys[i] = next_key(g,
+            random_below(&state, params->num_probes), params->num_probes,
+            &state);
+        w->probe_vals[i] = random_below(&state, params->max_val);
+    }
+}
+
+
+/*============================================================================
+ * MEASUREMENT
+ *============================================================================*/
+
+/* Returns the current time in nanoseconds. */
+int64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Runs one workload against one implementation, and prints the results as
+ * a CSV line.  Probes are run twice:  once back to back for the throughput,
+ * and once with each probe timed on its own for the latency percentiles,
+ * since timing every probe slows the probes down.
+ *
+ * The memory reported is how much the peak RSS grew from just before the
+ * multimap was created to just after the throughput probes, so that it
+ * leaves out the workload, and the latencies array is only allocated after
+ * the second reading.
+ * @param ops    the implementation to benchmark
+ * @param kind   the workload to run
+ * @param params the sizes of the workload
+ */
+void run_benchmark(const mm_ops *ops, workload_kind kind,
+                   const bench_params *params) {
+    workload w;
+    keygen g;
+    multimap *mm;
+    struct rusage usage;
+    int64_t start, insert_ns, probe_ns, *latencies;
+    long base_rss;
+    int i, hits = 0, latency_hits = 0;
+
+    generate_workload(&w, &g, kind, params);
+
+    getrusage(RUSAGE_SELF, &usage);
+    base_rss = usage.ru_maxrss;
+
+    mm = ops->init_multimap();
+
+    start = now_ns();
+    for (i = 0; i < params->num_pairs; i++)
+        ops->mm_add_value(mm, w.keys[i], w.vals[i]);
+    insert_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < params->num_probes; i++)
+        hits += ops->mm_contains_pair(mm, w.probe_keys[i], w.probe_vals[i]);
+    probe_ns = now_ns() - start;
+
+    getrusage(RUSAGE_SELF, &usage);
+    free_keygen(&g);
+    latencies = checked_malloc(params->num_probes * sizeof(int64_t));
+
+    for (i = 0; i < params->num_probes; i++) {
+        start = now_ns();
+        latency_hits += ops->mm_contains_pair(mm, w.probe_keys[i],
+                                              w.probe_vals[i]);
+        latencies[i] = now_ns() - start;
+    }
+    assert(latency_hits == hits);
+    qsort(latencies, params->num_probes, sizeof(int64_t), compare_int64);
+
+    printf("%s,%s,%d,%d,%.3f,%.3f,%lld,%lld,%d,%ld\n",
+           ops->name, workload_names[kind], params->num_pairs,
+           params->num_probes,
+           params->num_pairs * 1000.0 / (insert_ns > 0 ? insert_ns : 1),
+           params->num_probes * 1000.0 / (probe_ns > 0 ? probe_ns : 1),
+           (long long) latencies[params->num_probes / 2],
+           (long long) latencies[(int64_t) params->num_probes * 99 / 100],
+           hits, usage.ru_maxrss - base_rss);
+
+    ops->clear_multimap(mm);
+    free(mm);
+    free(latencies);
+}
+
+
+/* Runs a benchmark in a child process.  Returns nonzero on success. */
+int run_in_child(const mm_ops *ops, workload_kind kind,
+                 const bench_params *params) {
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 0;
+    }
+
+    if (pid == 0) {
+        run_benchmark(ops, kind, params);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s on %s workload failed\n", ops->name,
+                workload_names[kind]);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*============================================================================
+ * COMMAND LINE
+ *============================================================================*/
+
+void usage(const char *program) {
+    const mm_ops **ops;
+    int i;
+
+    fprintf(stderr, "usage: %s [-n pairs] [-p probes] [-k max_key]"
+            " [-v max_val] [-s seed]\n\t[-b backend,...] [-w workload,...]\n",
+            program);
+    fprintf(stderr, "\nbackends: ");
+    for (ops = all_backends; *ops != NULL; ops++)
+        fprintf(stderr, "%s ", (*ops)->name);
+    fprintf(stderr, "(default all)\nworkloads: ");
+    for (i = 0; i < NUM_WORKLOADS; i++)
+        fprintf(stderr, "%s ", workload_names[i]);
+    fprintf(stderr, "(default all)\n");
+}
+
+
+/* Parses a positive integer option, or exits with the usage message. */
+int parse_count(const char *program, const char *arg) {
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || n < 1 || n > 1000000000) {
+        usage(program);
+        exit(1);
+    }
+    return (int) n;
+}
+
+
+int main(int argc, char **argv) {
+    bench_params params = { 1000000, 1000000, 100000, 50, 11 };
+    const char *backends = DEFAULT_BACKENDS;
+    const char *workloads = DEFAULT_WORKLOADS;
+    char *names, *name, *save;
+    const mm_ops *selected[8];
+    int selected_workloads[NUM_WORKLOADS];
+    int num_selected = 0, num_workloads = 0, failures = 0;
+    int opt, i, j;
+
+    while ((opt = getopt(argc, argv, "n:p:k:v:s:b:w:")) != -1) {
+        switch (opt) {
+        case 'n': params.num_pairs = parse_count(argv[0], optarg); break;
+        case 'p': params.num_probes = parse_count(argv[0], optarg); break;
+        case 'k': params.max_key = parse_count(argv[0], optarg); break;
+        case 'v': params.max_val = parse_count(argv[0], optarg); break;
+        case 's': params.seed = parse_count(argv[0], optarg); break;
+        case 'b': backends = optarg; break;
+        case 'w': workloads = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    names = strdup(backends);
+    for (name = strtok_r(names, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        for (i = 0; all_backends[i] != NULL; i++) {
+            if (strcmp(all_backends[i]->name, name) == 0)
+                break;
+        }
+        if (all_backends[i] == NULL || num_selected == 8) {
+            fprintf(stderr, "unknown backend %s\n", name);
+            usage(argv[0]);
+            return 1;
+        }
+        selected[num_selected++] = all_backends[i];
+    }
+    free(names);
+
+    names = strdup(workloads);
+    for (name = strtok_r(names, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        for (i = 0; i < NUM_WORKLOADS; i++) {
+            if (strcmp(workload_names[i], name) == 0)
+                break;
+        }
+        if (i == NUM_WORKLOADS || num_workloads == NUM_WORKLOADS) {
+            fprintf(stderr, "unknown workload %s\n", name);
+            usage(argv[0]);
+            return 1;
+        }
+        selected_workloads[num_workloads++] = i;
+    }
+    free(names);
+
+    printf("backend,workload,pairs,probes,insert_mops,probe_mops,"
+           "probe_p50_ns,probe_p99_ns,hits,mm_rss_kb\n");
+
+    for (j = 0; j < num_workloads; j++) {
+        for (i = 0; i < num_selected; i++) {
+            if (!run_in_child(selected[i], selected_workloads[j], &params))
+                failures++;
+        }
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "multimap.h"
+
+
+/* This program tests a thread-safe multimap by probing it from several
+ * threads while other threads add pairs to it.  Each writer adds the pairs
+ * for its own keys in order, and counts how many it has added; readers only
+ * probe for pairs that have already been counted, so every probe has a known
+ * answer even while the multimap is changing.
+ */
+
+
+#define NUM_WRITERS 2
+#define NUM_READERS 4
+
+/* The number of keys added by each writer, and values added to each key. */
+#define KEYS_PER_WRITER 20000
+#define VALUES_PER_KEY 3
+
+
+int failures = 0;
+
+/* The number of keys each writer has finished adding. */
+int keys_added[NUM_WRITERS];
+
+/* Set once every writer is done. */
+int writers_done;
+
+multimap *mm;
+
+
+/* The i-th key of a writer.  Writers' keys interleave, so that writers add
+ * nodes next to each other in the multimap.
+ */
+int writer_key(int writer, int i) {
+    /* Scramble the order of the keys so that they aren't added in order. */
+    return ((i * 7919) % KEYS_PER_WRITER) * NUM_WRITERS + writer;
+}
+
+
+void * writer_main(void *arg) {
+    int writer = (int) (long) arg;
+    int i, j;
+
+    for (i = 0; i < KEYS_PER_WRITER; i++) {
+        for (j = 0; j < VALUES_PER_KEY; j++)
+            mm_add_value(mm, writer_key(writer, i), 2 * j);
+
+        __atomic_store_n(&keys_added[writer], i + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+
+void * reader_main(void *arg) {
+    unsigned int seed = (unsigned int) (long) arg;
+    int writer, added, key, value, errors = 0;
+
+    while (!__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE)) {
+        writer = rand_r(&seed) % NUM_WRITERS;
+        added = __atomic_load_n(&keys_added[writer], __ATOMIC_ACQUIRE);
+        if (added == 0)
+            continue;
+
+        key = writer_key(writer, rand_r(&seed) % added);
+        value = rand_r(&seed) % (2 * VALUES_PER_KEY);
+
+        /* Even values were added, odd values never are. */
+        if (!mm_contains_key(mm, key) ||
+            !mm_contains_pair(mm, key, value) != (value % 2 != 0)) {
+            errors++;
+        }
+    }
+
+    return (void *) (long) errors;
+}
+
+
+int prev_key;
+int num_pairs;
+
+void check_order(int key, int value) {
+    if (key < prev_key)
+        failures++;
+    prev_key = key;
+    num_pairs++;
+}
+
+
+int main() {
+    pthread_t writers[NUM_WRITERS], readers[NUM_READERS];
+    void *errors;
+    long i;
+
+    mm = init_multimap();
+
+    printf("Probing the multimap from %d threads while %d threads add"
+           " %d pairs.\n", NUM_READERS, NUM_WRITERS,
+           NUM_WRITERS * KEYS_PER_WRITER * VALUES_PER_KEY);
+
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_create(&readers[i], NULL, reader_main, (void *) (i + 1));
+    for (i = 0; i < NUM_WRITERS; i++)
+        pthread_create(&writers[i], NULL, writer_main, (void *) i);
+
+    for (i = 0; i < NUM_WRITERS; i++)
+        pthread_join(writers[i], NULL);
+    __atomic_store_n(&writers_done, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < NUM_READERS; i++) {
+        pthread_join(readers[i], &errors);
+        if (errors != NULL) {
+            printf(" * reader %ld got %ld wrong answers:  FAIL\n",
+                i, (long) errors);
+            failures++;
+        }
+    }
+
+    printf("\nChecking traversal order.\n");
+    prev_key = -1;
+    num_pairs = 0;
+    mm_traverse(mm, check_order);
+    if (num_pairs != NUM_WRITERS * KEYS_PER_WRITER * VALUES_PER_KEY) {
+        printf(" * traversal saw %d pairs:  FAIL\n", num_pairs);
+        failures++;
+    }
+
+    clear_multimap(mm);
+    free(mm);
+
+    printf("\nFinal results:  %d failures\n", failures);
+
+    return 0;
+}
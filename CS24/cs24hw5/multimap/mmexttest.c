@@ -0,0 +1,721 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "multimap.h"
+
+
+/* This program tests the extended multimap operations, which are only
+ * provided by the optimized implementation.  Every multimap built with the
+ * extended operations is checked against one built with mm_add_value().
+ */
+
+
+int failures = 0;
+
+
+/* The number of pairs, and the range of keys, used by the bulk tests. */
+#define NUM_PAIRS 20000
+#define KEY_RANGE 3000
+
+
+/* The pairs seen by the most recent call to collect_pairs(). */
+int *traversed_keys, *traversed_vals;
+int num_traversed;
+
+void record_pair(int key, int value) {
+    traversed_keys[num_traversed] = key;
+    traversed_vals[num_traversed] = value;
+    num_traversed++;
+}
+
+/* Traverses the multimap into the arrays, and returns the number of pairs. */
+int collect_pairs(multimap *mm, int *keys, int *vals) {
+    traversed_keys = keys;
+    traversed_vals = vals;
+    num_traversed = 0;
+    mm_traverse(mm, record_pair);
+    return num_traversed;
+}
+
+
+int compare_ints(const void *a, const void *b) {
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Sorts the values of each key of traversed pairs. */
+void sort_values(int *keys, int *vals, int n) {
+    int start, end;
+
+    for (start = 0; start < n; start = end) {
+        for (end = start + 1; end < n && keys[end] == keys[start]; end++)
+            ;
+        qsort(vals + start, end - start, sizeof(int), compare_ints);
+    }
+}
+
+
+/* Checks that two multimaps hold the same pairs, in the same order, or just
+ * for the same keys if same_order is zero.  The actual multimap's cursor must
+ * also return the same pairs as its traversal.
+ */
+void check_pairs(const char *name, multimap *expected, multimap *actual,
+                 int same_order) {
+    static int exp_keys[2 * NUM_PAIRS], exp_vals[2 * NUM_PAIRS];
+    static int act_keys[2 * NUM_PAIRS], act_vals[2 * NUM_PAIRS];
+    mm_cursor *cursor;
+    int num_expected, num_actual, i, key, value, ok = 1;
+
+    num_expected = collect_pairs(expected, exp_keys, exp_vals);
+    num_actual = collect_pairs(actual, act_keys, act_vals);
+
+    if (num_expected != num_actual)
+        ok = 0;
+
+    cursor = mm_open_cursor(actual);
+    for (i = 0; ok && mm_cursor_next(cursor, &key, &value); i++) {
+        if (i >= num_actual || key != act_keys[i] || value != act_vals[i])
+            ok = 0;
+    }
+    if (i != num_actual)
+        ok = 0;
+    mm_close_cursor(cursor);
+
+    if (!same_order) {
+        sort_values(exp_keys, exp_vals, num_expected);
+        sort_values(act_keys, act_vals, num_actual);
+    }
+
+    for (i = 0; ok && i < num_expected; i++) {
+        if (exp_keys[i] != act_keys[i] || exp_vals[i] != act_vals[i])
+            ok = 0;
+    }
+
+    /* Probe keys and pairs that are both present and absent. */
+    for (i = -KEY_RANGE / 10 - 5; ok && i < KEY_RANGE + 5; i++) {
+        if (!mm_contains_key(expected, i) != !mm_contains_key(actual, i))
+            ok = 0;
+        if (!mm_contains_pair(expected, i, i % 100) !=
+            !mm_contains_pair(actual, i, i % 100))
+            ok = 0;
+    }
+
+    printf(" * %s:  %s\n", name, ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+}
+
+
+void check_same(const char *name, multimap *expected, multimap *actual) {
+    check_pairs(name, expected, actual, 1);
+}
+
+
+/* Builds a reference multimap by adding each pair individually. */
+multimap * build_reference(const int *keys, const int *vals, int n) {
+    multimap *mm = init_multimap();
+    int i;
+
+    for (i = 0; i < n; i++)
+        mm_add_value(mm, keys[i], vals[i]);
+    return mm;
+}
+
+
+void free_mm(multimap *mm) {
+    clear_multimap(mm);
+    free(mm);
+}
+
+
+void test_bulk_add(int *keys, int *vals) {
+    multimap *expected, *actual;
+    int half = NUM_PAIRS / 2;
+    int i;
+
+    printf("\nTesting bulk insertion.\n");
+
+    expected = build_reference(keys, vals, NUM_PAIRS);
+
+    actual = init_multimap();
+    mm_add_values(actual, keys, vals, NUM_PAIRS);
+    check_same("mm_add_values into an empty multimap", expected, actual);
+    free_mm(actual);
+
+    actual = init_multimap();
+    for (i = 0; i < half; i++)
+        mm_add_value(actual, keys[i], vals[i]);
+    mm_add_values(actual, keys + half, vals + half, NUM_PAIRS - half);
+    check_same("mm_add_values into a populated multimap", expected, actual);
+    free_mm(actual);
+
+    actual = init_multimap();
+    mm_build_from_sorted(actual, keys, vals, NUM_PAIRS);
+    check_same("mm_build_from_sorted with unsorted input", expected, actual);
+    free_mm(actual);
+
+    actual = init_multimap();
+    mm_add_values(actual, keys, vals, 0);
+    mm_add_values(actual, keys, vals, 1);
+    free_mm(expected);
+    expected = build_reference(keys, vals, 1);
+    check_same("mm_add_values with tiny inputs", expected, actual);
+    free_mm(actual);
+    free_mm(expected);
+
+    /* Sort the keys alone, so that the values are paired up differently. */
+    qsort(keys, NUM_PAIRS, sizeof(int), compare_ints);
+    expected = build_reference(keys, vals, NUM_PAIRS);
+
+    actual = init_multimap();
+    mm_build_from_sorted(actual, keys, vals, NUM_PAIRS);
+    check_same("mm_build_from_sorted with sorted input", expected, actual);
+
+    /* The balanced tree must still accept individual insertions. */
+    for (i = 0; i < 100; i++) {
+        mm_add_value(expected, KEY_RANGE + i, i);
+        mm_add_value(actual, KEY_RANGE + i, i);
+    }
+    check_same("mm_add_value after mm_build_from_sorted", expected, actual);
+    free_mm(actual);
+    free_mm(expected);
+}
+
+
+/* Reports a failed check of the range test, and counts the failure. */
+void range_failure(const char *what, int lo, int hi) {
+    printf(" * %s [%d, %d):  FAIL\n", what, lo, hi);
+    failures++;
+}
+
+
+/* Tests range scans and cursors against the multimap's own traversal.  If
+ * frozen is nonzero, the multimap is frozen first.
+ */
+void test_ranges(int *keys, int *vals, int frozen) {
+    static int all_keys[NUM_PAIRS], all_vals[NUM_PAIRS];
+    static int range_keys[NUM_PAIRS], range_vals[NUM_PAIRS];
+    int bounds[] = {
+        -KEY_RANGE, KEY_RANGE * 2,  /* lo, hi */
+        0, 1,
+        17, 18,
+        -7, 250,
+        1000, 1000,
+        1200, 900,
+        KEY_RANGE - 10, KEY_RANGE * 2,
+        KEY_RANGE * 2, KEY_RANGE * 3,
+        -KEY_RANGE * 3, -KEY_RANGE * 2
+    };
+    int num_bounds = sizeof(bounds) / sizeof(bounds[0]);
+    multimap *mm;
+    mm_cursor *cursor;
+    int num_pairs, first, end, found, key, value, i, j;
+
+    printf("\nTesting range scans and cursors%s.\n",
+        frozen ? " of a frozen multimap" : "");
+
+    mm = build_reference(keys, vals, NUM_PAIRS);
+    if (frozen)
+        mm_freeze(mm);
+    num_pairs = collect_pairs(mm, all_keys, all_vals);
+
+    for (i = 0; i < num_bounds; i += 2) {
+        int lo = bounds[i], hi = bounds[i + 1];
+
+        /* The expected pairs are a contiguous run of the full traversal. */
+        for (first = 0; first < num_pairs && all_keys[first] < lo; first++)
+            ;
+        for (end = first; end < num_pairs && all_keys[end] < hi; end++)
+            ;
+        if (hi <= lo)
+            end = first;
+
+        traversed_keys = range_keys;
+        traversed_vals = range_vals;
+        num_traversed = 0;
+        mm_range(mm, lo, hi, record_pair);
+
+        if (num_traversed != end - first) {
+            range_failure("mm_range", lo, hi);
+        }
+        else {
+            for (j = 0; j < num_traversed; j++) {
+                if (range_keys[j] != all_keys[first + j] ||
+                    range_vals[j] != all_vals[first + j]) {
+                    range_failure("mm_range", lo, hi);
+                    break;
+                }
+            }
+        }
+
+        if (mm_lower_bound(mm, lo, &found) != (first < num_pairs) ||
+            (first < num_pairs && found != all_keys[first])) {
+            range_failure("mm_lower_bound", lo, hi);
+        }
+
+        /* A seek must resume at the same place, and run to the end. */
+        cursor = mm_open_cursor(mm);
+        mm_cursor_seek(cursor, lo);
+        for (j = first; mm_cursor_next(cursor, &key, &value); j++) {
+            if (j >= num_pairs || key != all_keys[j] || value != all_vals[j])
+                break;
+        }
+        if (j != num_pairs || mm_cursor_next(cursor, &key, &value))
+            range_failure("mm_cursor_seek", lo, hi);
+        mm_close_cursor(cursor);
+    }
+
+    cursor = mm_open_cursor(mm);
+    for (j = 0; mm_cursor_next(cursor, &key, &value); j++) {
+        if (j >= num_pairs || key != all_keys[j] || value != all_vals[j])
+            break;
+    }
+    printf(" * cursor visits every pair in order:  %s\n",
+        j == num_pairs ? "PASS" : "FAIL");
+    if (j != num_pairs)
+        failures++;
+    mm_close_cursor(cursor);
+
+    free_mm(mm);
+
+    /* Every operation must cope with an empty multimap. */
+    mm = init_multimap();
+    if (frozen)
+        mm_freeze(mm);
+    cursor = mm_open_cursor(mm);
+    num_traversed = 0;
+    mm_range(mm, -KEY_RANGE, KEY_RANGE, record_pair);
+    mm_cursor_seek(cursor, 0);
+    if (num_traversed != 0 || mm_lower_bound(mm, 0, &found) ||
+        mm_cursor_next(cursor, &key, &value)) {
+        range_failure("empty multimap", -KEY_RANGE, KEY_RANGE);
+    }
+    mm_close_cursor(cursor);
+    free_mm(mm);
+}
+
+
+void test_batch_probes(int *keys, int *vals) {
+    static int probe_keys[NUM_PAIRS], probe_vals[NUM_PAIRS];
+    static int answers[NUM_PAIRS];
+    int sizes[] = { 0, 1, 5, 16, 17, 1000, NUM_PAIRS };
+    int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    multimap *mm;
+    int i, j, ok;
+
+    printf("\nTesting batched probes.\n");
+
+    /* Probe for pairs that are present, and for absent keys and values.  The
+     * multimap has many distinct keys, so that it is large enough for the
+     * probes to be interleaved, and some keys with many values.
+     */
+    mm = init_multimap();
+    for (i = 0; i < NUM_PAIRS; i++)
+        mm_add_value(mm, 2 * i - NUM_PAIRS / 2, vals[i]);
+    mm_add_values(mm, keys, vals, NUM_PAIRS);
+
+    for (i = 0; i < NUM_PAIRS; i++) {
+        probe_keys[i] = rand() % (2 * NUM_PAIRS + 200) - NUM_PAIRS / 2 - 100;
+        probe_vals[i] = rand() % 120;
+    }
+
+    for (i = 0; i < num_sizes; i++) {
+        mm_contains_pairs(mm, probe_keys, probe_vals, sizes[i], answers);
+
+        ok = 1;
+        for (j = 0; j < sizes[i]; j++) {
+            if (!answers[j] != !mm_contains_pair(mm, probe_keys[j],
+                                                 probe_vals[j]))
+                ok = 0;
+        }
+
+        printf(" * batch of %d probes:  %s\n", sizes[i], ok ? "PASS" : "FAIL");
+        if (!ok)
+            failures++;
+    }
+    free_mm(mm);
+
+    mm = init_multimap();
+    mm_contains_pairs(mm, probe_keys, probe_vals, 100, answers);
+    for (i = 0, ok = 1; i < 100; i++) {
+        if (answers[i])
+            ok = 0;
+    }
+    printf(" * batch against an empty multimap:  %s\n", ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+    free_mm(mm);
+}
+
+
+/* Reports the result of a check of the image test. */
+void check_image_result(const char *name, int ok) {
+    printf(" * %s:  %s\n", name, ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+}
+
+
+void test_images(int *keys, int *vals) {
+    char path[] = "/tmp/mmexttest.XXXXXX";
+    multimap *mm, *mapped;
+    FILE *file;
+    int fd, i;
+
+    printf("\nTesting saved and mapped images.\n");
+
+    fd = mkstemp(path);
+    if (fd == -1) {
+        printf(" * couldn't create a temporary file:  FAIL\n");
+        failures++;
+        return;
+    }
+    close(fd);
+
+    /* Include keys with enough values to have hash sets. */
+    mm = build_reference(keys, vals, NUM_PAIRS);
+    for (i = 0; i < 1000; i++)
+        mm_add_value(mm, i % 3, i);
+
+    check_image_result("mm_save", mm_save(mm, path) == 0);
+    mapped = mm_open_mapped(path);
+    check_image_result("mm_open_mapped", mapped != NULL);
+    if (mapped != NULL) {
+        check_same("mapped image matches the multimap", mm, mapped);
+
+        /* The image is already packed, so compacting it does nothing. */
+        mm_compact(mapped);
+        check_same("compacting a mapped image", mm, mapped);
+
+        /* Clearing unmaps the image, leaving an ordinary empty multimap. */
+        clear_multimap(mapped);
+        mm_add_value(mapped, 1, 2);
+        check_image_result("adding after clearing a mapped image",
+                           mm_contains_pair(mapped, 1, 2));
+        free_mm(mapped);
+    }
+    free_mm(mm);
+
+    mm = init_multimap();
+    check_image_result("mm_save of an empty multimap", mm_save(mm, path) == 0);
+    mapped = mm_open_mapped(path);
+    check_image_result("mm_open_mapped of an empty multimap", mapped != NULL);
+    if (mapped != NULL) {
+        check_same("mapped empty image matches", mm, mapped);
+        free_mm(mapped);
+    }
+    free_mm(mm);
+
+    file = fopen(path, "w");
+    fprintf(file, "This is not a multimap image.\n");
+    fclose(file);
+    check_image_result("mm_open_mapped rejects other files",
+                       mm_open_mapped(path) == NULL);
+
+    unlink(path);
+    check_image_result("mm_open_mapped of a missing file",
+                       mm_open_mapped(path) == NULL);
+}
+
+
+/* Adds values to a few keys of both multimaps, so that some keys have many
+ * values, spread over a wide range with duplicates and extreme values.
+ */
+void add_many_values(multimap *mm1, multimap *mm2) {
+    int extremes[] = { INT_MIN, INT_MAX, 0, -1, INT_MIN + 1 };
+    int i, key, value;
+
+    for (i = 0; i < 5000; i++) {
+        key = i % 4;
+        if (key == 0)
+            value = i / 3;                  /* small gaps and duplicates */
+        else if (key == 1)
+            value = rand() - RAND_MAX / 2;  /* wide range */
+        else if (key == 2)
+            value = extremes[i % 5];
+        else
+            value = 1000 * (i % 64);        /* one gap size */
+
+        mm_add_value(mm1, key, value);
+        mm_add_value(mm2, key, value);
+    }
+}
+
+
+void test_compact(int *keys, int *vals) {
+    char path[] = "/tmp/mmexttest.XXXXXX";
+    multimap *expected, *actual, *mapped;
+    int i, j, ok, fd;
+
+    printf("\nTesting compacted values.\n");
+
+    expected = build_reference(keys, vals, NUM_PAIRS);
+    actual = build_reference(keys, vals, NUM_PAIRS);
+    add_many_values(expected, actual);
+
+    mm_compact(actual);
+    check_pairs("compacted multimap has the same pairs", expected, actual, 0);
+
+    /* Probe the keys with many values across their whole range. */
+    ok = 1;
+    for (i = 0; i < 4; i++) {
+        for (j = -100000; j < 100000; j += 37) {
+            if (!mm_contains_pair(expected, i, j) !=
+                !mm_contains_pair(actual, i, j))
+                ok = 0;
+        }
+        if (!mm_contains_pair(actual, 2, INT_MIN) ||
+            !mm_contains_pair(actual, 2, INT_MAX) ||
+            mm_contains_pair(actual, 2, INT_MAX - 1))
+            ok = 0;
+    }
+    printf(" * probes of compacted keys:  %s\n", ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+
+    fd = mkstemp(path);
+    if (fd != -1) {
+        close(fd);
+        mapped = (mm_save(actual, path) == 0) ? mm_open_mapped(path) : NULL;
+        if (mapped != NULL) {
+            check_pairs("mapped image of a compacted multimap", expected,
+                        mapped, 0);
+            free_mm(mapped);
+        }
+        else {
+            printf(" * mapped image of a compacted multimap:  FAIL\n");
+            failures++;
+        }
+        unlink(path);
+    }
+
+    /* Adding to compacted keys unpacks them again. */
+    add_many_values(expected, actual);
+    for (i = 0; i < 100; i++) {
+        mm_add_value(expected, keys[i], i);
+        mm_add_value(actual, keys[i], i);
+    }
+    check_pairs("adding after compaction", expected, actual, 0);
+
+    mm_compact(actual);
+    mm_compact(actual);
+    check_pairs("compacting twice", expected, actual, 0);
+
+    free_mm(actual);
+    free_mm(expected);
+}
+
+
+void test_freeze(int *keys, int *vals) {
+    static int probe_keys[NUM_PAIRS], probe_vals[NUM_PAIRS];
+    static int answers[NUM_PAIRS];
+    char path[] = "/tmp/mmexttest.XXXXXX";
+    multimap *expected, *actual, *mapped;
+    int i, j, n, ok, fd;
+
+    printf("\nTesting frozen multimaps.\n");
+
+    expected = build_reference(keys, vals, NUM_PAIRS);
+    actual = build_reference(keys, vals, NUM_PAIRS);
+    add_many_values(expected, actual);
+
+    mm_freeze(actual);
+    check_pairs("frozen multimap has the same pairs", expected, actual, 0);
+
+    ok = 1;
+    for (i = 0; i < 4; i++) {
+        for (j = -100000; j < 100000; j += 37) {
+            if (!mm_contains_pair(expected, i, j) !=
+                !mm_contains_pair(actual, i, j))
+                ok = 0;
+        }
+    }
+    if (!mm_contains_pair(actual, 2, INT_MIN) ||
+        !mm_contains_pair(actual, 2, INT_MAX) ||
+        mm_contains_pair(actual, 2, INT_MAX - 1) ||
+        mm_contains_key(actual, INT_MIN) || mm_contains_key(actual, INT_MAX))
+        ok = 0;
+
+    for (i = 0; i < NUM_PAIRS; i++) {
+        probe_keys[i] = rand() % (KEY_RANGE + 200) - KEY_RANGE / 10 - 100;
+        probe_vals[i] = rand() % 120;
+    }
+    mm_contains_pairs(actual, probe_keys, probe_vals, NUM_PAIRS, answers);
+    for (i = 0; i < NUM_PAIRS; i++) {
+        if (!answers[i] != !mm_contains_pair(expected, probe_keys[i],
+                                             probe_vals[i]))
+            ok = 0;
+    }
+    printf(" * probes of a frozen multimap:  %s\n", ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+
+    /* Freezing and compacting a frozen multimap change nothing, and it
+     * can't be saved.
+     */
+    mm_freeze(actual);
+    mm_compact(actual);
+    check_pairs("freezing twice", expected, actual, 0);
+    ok = mm_save(actual, "/tmp/mmexttest.frozen") == -1;
+    printf(" * saving a frozen multimap fails:  %s\n", ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+    free_mm(actual);
+
+    /* Compacted and mapped multimaps can be frozen too. */
+    free_mm(expected);
+    expected = build_reference(keys, vals, NUM_PAIRS);
+    actual = build_reference(keys, vals, NUM_PAIRS);
+    add_many_values(expected, actual);
+    mm_compact(actual);
+    mm_freeze(actual);
+    check_pairs("freezing a compacted multimap", expected, actual, 0);
+
+    fd = mkstemp(path);
+    if (fd != -1) {
+        close(fd);
+        free_mm(actual);
+        actual = build_reference(keys, vals, NUM_PAIRS);
+        mm_compact(actual);
+        mapped = (mm_save(actual, path) == 0) ? mm_open_mapped(path) : NULL;
+        unlink(path);
+        if (mapped != NULL) {
+            mm_freeze(mapped);
+            check_pairs("freezing a mapped multimap", actual, mapped, 0);
+            free_mm(mapped);
+        }
+        else {
+            printf(" * freezing a mapped multimap:  FAIL\n");
+            failures++;
+        }
+    }
+    free_mm(actual);
+    free_mm(expected);
+
+    /* Check every size of small tree, full or not, with keys that are absent
+     * on both sides of every present key.
+     */
+    ok = 1;
+    for (n = 0; n <= 70; n++) {
+        actual = init_multimap();
+        for (i = 0; i < n; i++)
+            mm_add_value(actual, 2 * i, i);
+        mm_freeze(actual);
+
+        for (i = -2; i <= 2 * n + 1; i++) {
+            int present = i >= 0 && i < 2 * n && i % 2 == 0;
+
+            if (!mm_contains_key(actual, i) != !present ||
+                !mm_contains_pair(actual, i, i / 2) != !present ||
+                mm_contains_pair(actual, i, i / 2 + 1))
+                ok = 0;
+        }
+        free_mm(actual);
+    }
+    printf(" * frozen multimaps of 0 to 70 keys:  %s\n", ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+}
+
+
+void test_pair_filter(int *keys, int *vals) {
+    static int probe_keys[NUM_PAIRS], probe_vals[NUM_PAIRS];
+    static int answers[NUM_PAIRS];
+    multimap *expected, *actual;
+    int i, ok;
+
+    printf("\nTesting pair filters.\n");
+
+    /* The filter starts out sized for FILTER_MIN_PAIRS, so these adds make
+     * it grow several times.
+     */
+    expected = init_multimap();
+    actual = init_multimap();
+    mm_set_pair_filter(actual, 0.01);
+    for (i = 0; i < NUM_PAIRS; i++) {
+        mm_add_value(expected, 2 * i - NUM_PAIRS / 2, vals[i]);
+        mm_add_value(actual, 2 * i - NUM_PAIRS / 2, vals[i]);
+    }
+    mm_add_values(expected, keys, vals, NUM_PAIRS / 2);
+    mm_add_values(actual, keys, vals, NUM_PAIRS / 2);
+    add_many_values(expected, actual);
+    check_pairs("filtered multimap has the same pairs", expected, actual, 0);
+
+    for (i = 0; i < NUM_PAIRS; i++) {
+        probe_keys[i] = rand() % (2 * NUM_PAIRS + 200) - NUM_PAIRS / 2 - 100;
+        probe_vals[i] = rand() % 120;
+    }
+
+    ok = 1;
+    mm_contains_pairs(actual, probe_keys, probe_vals, NUM_PAIRS, answers);
+    for (i = 0; i < NUM_PAIRS; i++) {
+        int present = mm_contains_pair(expected, probe_keys[i], probe_vals[i]);
+
+        if (!answers[i] != !present ||
+            !mm_contains_pair(actual, probe_keys[i], probe_vals[i]) != !present)
+            ok = 0;
+    }
+    printf(" * probes through the filter:  %s\n", ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+
+    /* Filters must also cover compacted and frozen values, whether they are
+     * set up before or after.
+     */
+    mm_compact(actual);
+    mm_set_pair_filter(actual, 0.001);
+    check_pairs("filter of a compacted multimap", expected, actual, 0);
+    mm_freeze(actual);
+    check_pairs("filter of a frozen multimap", expected, actual, 0);
+    mm_set_pair_filter(actual, 0.05);
+    check_pairs("new filter of a frozen multimap", expected, actual, 0);
+    mm_set_pair_filter(actual, 0);
+    check_pairs("removing the filter", expected, actual, 0);
+
+    /* Clearing the multimap removes its filter too. */
+    mm_set_pair_filter(actual, 0.01);
+    clear_multimap(actual);
+    for (i = 0; i < 100; i++)
+        mm_add_value(actual, keys[i], vals[i]);
+    ok = 1;
+    for (i = 0; i < 100; i++) {
+        if (!mm_contains_pair(actual, keys[i], vals[i]))
+            ok = 0;
+    }
+    printf(" * adding after clearing a filtered multimap:  %s\n",
+        ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+
+    free_mm(actual);
+    free_mm(expected);
+}
+
+
+int main() {
+    static int keys[NUM_PAIRS], vals[NUM_PAIRS];
+    int i;
+
+    srand(11);
+    for (i = 0; i < NUM_PAIRS; i++) {
+        /* Include negative keys to check that they sort first. */
+        keys[i] = rand() % KEY_RANGE - KEY_RANGE / 10;
+        vals[i] = rand() % 100;
+    }
+
+    test_bulk_add(keys, vals);
+    test_ranges(keys, vals, 0);
+    test_ranges(keys, vals, 1);
+    test_batch_probes(keys, vals);
+    test_images(keys, vals);
+    test_compact(keys, vals);
+    test_freeze(keys, vals);
+    test_pair_filter(keys, vals);
+
+    printf("\nFinal results:  %d failures\n", failures);
+
+    return 0;
+}
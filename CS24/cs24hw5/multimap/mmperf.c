@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -24,6 +26,49 @@
  */
 #define EXCLUDE_SLOW_TESTS 0
 
+/* In the multithreaded test, when the multimap is built with MM_CONCURRENT
+ * (that is, from conc_mm_impl.c), the first thread also adds a pair to the
+ * multimap after every WRITE_INTERVAL probes.  Other implementations are only
+ * safe to share between threads that don't modify them, so for those the
+ * test only probes.
+ */
+#define WRITE_INTERVAL 1000
+
+/* When the multimap is built with MM_BATCH_PROBES (that is, from
+ * opt_mm_impl.c), probe_multimap() generates this many probes at a time and
+ * passes them to mm_contains_pairs() as one batch.
+ */
+#define PROBE_BATCH 256
+
+#ifdef MM_PAIR_FILTER
+/* When the multimap is built with MM_PAIR_FILTER (that is, from
+ * opt_mm_impl.c), the --filter option sets up a pair filter with this false
+ * positive rate before each test populates its multimap.
+ */
+double pair_filter_rate = 0.0;
+#endif
+
+
+/* The work done by one thread of the multithreaded test. */
+typedef struct probe_thread {
+    pthread_t thread;
+    multimap *mm;
+
+    /* The seed of the thread's own random number generator. */
+    unsigned int seed;
+
+    int num_probes;
+    int max_key;
+    int max_val;
+
+    /* Nonzero if this thread should also add pairs to the multimap. */
+    int writer;
+
+    /* The number of probes found in the multimap, and of pairs added. */
+    int total_hits;
+    int total_writes;
+} probe_thread;
+
 
 /* Populate the multimap with a specific number of key/value pairs.  The keys
  * can be generated in one of three ways, either randomly, incrementing, or
@@ -85,7 +130,13 @@ void populate_multimap(multimap *mm, int num_pairs, int keygen_mode,
  * found in the map.
  */
 int probe_multimap(multimap *mm, int num_probes, int max_key, int max_val) {
-    int i, key, value, in_map, total;
+    int i, in_map, total;
+#ifdef MM_BATCH_PROBES
+    int keys[PROBE_BATCH], vals[PROBE_BATCH], answers[PROBE_BATCH];
+    int j, batch;
+#else
+    int key, value;
+#endif
 
     assert(mm != NULL);
     assert(num_probes > 0);
@@ -97,6 +148,32 @@ int probe_multimap(multimap *mm, int num_probes, int max_key, int max_val) {
     printf("Keys in range [0, %d), values in range [0, %d).\n",
            max_key, max_val);
 
+#ifdef MM_BATCH_PROBES
+    /* Probe the multimap with batches of (key, value) pairs.  The pairs are
+     * generated in the same order as below, so the results are the same.
+     */
+    for (i = 0, total = 0; i < num_probes; i += batch) {
+        batch = (num_probes - i < PROBE_BATCH) ? num_probes - i : PROBE_BATCH;
+
+        for (j = 0; j < batch; j++) {
+            keys[j] = rand() % max_key;
+            vals[j] = rand() % max_val;
+        }
+
+        mm_contains_pairs(mm, keys, vals, batch, answers);
+
+        for (j = 0; j < batch; j++) {
+            in_map = answers[j];
+            if (in_map)
+                total++;
+
+#if VERBOSE
+            printf("Probing:  (%d, %d) is%s in the multimap.\n", keys[j],
+                   vals[j], in_map ? "" : " NOT");
+#endif
+        }
+    }
+#else
     /* Probe the multimap with a bunch of (key, value) pairs. */
     for (i = 0, total = 0; i < num_probes; i++) {
         key = rand() % max_key;
@@ -111,6 +188,7 @@ int probe_multimap(multimap *mm, int num_probes, int max_key, int max_val) {
                in_map ? "" : " NOT");
 #endif
     }
+#endif
 
     return total;
 }
@@ -142,6 +220,11 @@ void test_multimap_perf(int num_pairs, int num_probes, int keygen_mode,
     /* Initialize the multimap data structure. */
     mm = init_multimap();
 
+#ifdef MM_PAIR_FILTER
+    if (pair_filter_rate > 0.0)
+        mm_set_pair_filter(mm, pair_filter_rate);
+#endif
+
     populate_multimap(mm, num_pairs, keygen_mode, max_key, max_val);
 
     clock_get_realtime(&ts);
@@ -166,9 +249,188 @@ void test_multimap_perf(int num_pairs, int num_probes, int keygen_mode,
 }
 
 
-int main() {
+/* The body of each thread of the multithreaded test.  Each thread uses its
+ * own random number generator, since rand() isn't safe to share.
+ */
+void * probe_thread_main(void *arg) {
+    probe_thread *t = (probe_thread *) arg;
+    int i, key, value;
+
+    t->total_hits = 0;
+    t->total_writes = 0;
+
+    for (i = 0; i < t->num_probes; i++) {
+        key = rand_r(&t->seed) % t->max_key;
+        value = rand_r(&t->seed) % t->max_val;
+
+        if (t->writer && i % WRITE_INTERVAL == 0) {
+            mm_add_value(t->mm, key, value);
+            t->total_writes++;
+        }
+
+        if (mm_contains_pair(t->mm, key, value))
+            t->total_hits++;
+    }
+
+    return NULL;
+}
+
+
+/* Populates a multimap, and then probes it from 1, 2, 4, ... and finally
+ * max_threads threads at once.  Every thread performs the same number of
+ * probes, so perfect scaling keeps the wall-clock time constant, and the
+ * throughput relative to a single thread is reported as the speedup.
+ */
+void test_threaded_perf(int max_threads, int num_pairs,
+                        int probes_per_thread, int max_key, int max_val) {
+    multimap *mm;
+    probe_thread *threads;
+    struct timespec ts;
+    long long int start_us, end_us;
+    double probes_per_us, base_probes_per_us = 0.0;
+    int num_threads, i, total_hits, total_writes;
+
+    printf("Testing multithreaded multimap performance:  %d pairs, %d probes"
+           " per thread.\n", num_pairs, probes_per_thread);
+#ifdef MM_CONCURRENT
+    printf("The first thread also adds a pair every %d probes.\n",
+           WRITE_INTERVAL);
+#endif
+
+    threads = malloc(max_threads * sizeof(probe_thread));
+    if (threads == NULL) {
+        printf("failed to allocate threads\n");
+        exit(1);
+    }
+
+    mm = init_multimap();
+    populate_multimap(mm, num_pairs, MODE_RAND, max_key, max_val);
+    printf("\n threads   Mprobes/s   speedup   hits\n");
+
+    num_threads = 1;
+    while (1) {
+        for (i = 0; i < num_threads; i++) {
+            threads[i].mm = mm;
+            threads[i].seed = 11 + i;
+            threads[i].num_probes = probes_per_thread;
+            threads[i].max_key = max_key;
+            threads[i].max_val = max_val;
+#ifdef MM_CONCURRENT
+            threads[i].writer = (i == 0);
+#else
+            threads[i].writer = 0;
+#endif
+        }
+
+        clock_get_realtime(&ts);
+        start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        for (i = 0; i < num_threads; i++) {
+            if (pthread_create(&threads[i].thread, NULL, probe_thread_main,
+                               &threads[i]) != 0) {
+                printf("failed to create thread\n");
+                exit(1);
+            }
+        }
+
+        total_hits = 0;
+        total_writes = 0;
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i].thread, NULL);
+            total_hits += threads[i].total_hits;
+            total_writes += threads[i].total_writes;
+        }
+
+        clock_get_realtime(&ts);
+        end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        probes_per_us = (double) num_threads * probes_per_thread /
+                        (double) (end_us - start_us);
+        if (num_threads == 1)
+            base_probes_per_us = probes_per_us;
+
+        printf(" %7d   %9.2f   %6.2fx   %.1f%%", num_threads, probes_per_us,
+               probes_per_us / base_probes_per_us, (double) total_hits *
+               100.0 / ((double) num_threads * probes_per_thread));
+        if (total_writes > 0)
+            printf("   (%d pairs added)", total_writes);
+        printf("\n");
+
+        if (num_threads == max_threads)
+            break;
+        num_threads = (2 * num_threads < max_threads) ?
+                      2 * num_threads : max_threads;
+    }
+    printf("\n");
+
+    clear_multimap(mm);
+    free(threads);
+}
+
+
+void usage(const char *program) {
+#ifdef MM_PAIR_FILTER
+    printf("usage: %s [--threads N] [--filter RATE]\n", program);
+#else
+    printf("usage: %s [--threads N]\n", program);
+#endif
+    printf("\t--threads N    measure probe throughput from 1 up to N"
+           " threads,\n\t               instead of running the usual"
+           " tests\n");
+#ifdef MM_PAIR_FILTER
+    printf("\t--filter RATE  put a pair filter with the false positive"
+           " rate RATE,\n\t               such as 0.01, in front of the"
+           " multimap\n");
+#endif
+}
+
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        { "threads", required_argument, NULL, 't' },
+#ifdef MM_PAIR_FILTER
+        { "filter", required_argument, NULL, 'f' },
+#endif
+        { NULL, 0, NULL, 0 }
+    };
+    int max_threads = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:f:", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            if (max_threads < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+#ifdef MM_PAIR_FILTER
+        case 'f':
+            pair_filter_rate = atof(optarg);
+            if (pair_filter_rate <= 0.0 || pair_filter_rate >= 1.0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+#endif
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
     srand(11);
 
+    if (max_threads > 0) {
+        test_threaded_perf(max_threads, 1000000, SCALE * 100000,
+                           100000, 50);
+        return 0;
+    }
+
     printf("This program measures multimap read performance by doing the"
            " following, for\n");
     printf("various kinds of usage patterns:\n\n");
@@ -7,6 +7,10 @@
 int failures = 0;
 
 
+/* The number of values added to a single key by the many-values test. */
+#define MANY_VALUES 1000
+
+
 int test_values[] = {
     1, 10,  /* key, value */
     2, 20,
@@ -122,6 +126,24 @@ int main() {
     clear_multimap(mm);
     free(mm);
 
+    printf("\nProbing a key with many values.\n");
+    mm = init_multimap();
+    for (i = 0; i < MANY_VALUES; i++)
+        mm_add_value(mm, 7, 2 * i);
+
+    for (i = 0; i < 2 * MANY_VALUES; i++) {
+        int answer = (i % 2 == 0);
+        int probe = mm_contains_pair(mm, 7, i);
+
+        if ((probe && !answer) || (!probe && answer)) {
+            printf(" * (7, %d) should%s be present:  FAIL\n",
+                i, answer ? "" : " NOT");
+            failures++;
+        }
+    }
+    clear_multimap(mm);
+    free(mm);
+
     printf("\nFinal results:  %d failures\n", failures);
 
     return 0;
@@ -9,9 +9,14 @@
 #ifndef MULTIMAP_H
 #define MULTIMAP_H
 
+#include <stddef.h>
+
 
 typedef struct multimap multimap;
 
+/* A cursor over the pairs of a multimap, in key order. */
+typedef struct mm_cursor mm_cursor;
+
 
 /* Allocate and initialize a multimap data structure. */
 multimap * init_multimap();
@@ -39,5 +44,104 @@ int mm_contains_pair(multimap *mm, int key, int value);
  */
 void mm_traverse(multimap *mm, void (*f)(int key, int value));
 
-#endif
 
+/*============================================================================
+ * EXTENDED OPERATIONS
+ *
+ *   The operations below are only provided by the optimized implementation
+ *   (opt_mm_impl.c), and are exercised by mmexttest.
+ *============================================================================*/
+
+/* Adds the n (keys[i], vals[i]) pairs to the multimap.  The pairs are
+ * grouped by key with a radix sort first, so each distinct key is only
+ * looked up once; values for a key are added in the order they appear.
+ */
+void mm_add_values(multimap *mm, const int *keys, const int *vals, size_t n);
+
+/* Like mm_add_values(), but for pairs that are already sorted by key.  If
+ * the multimap is empty, it is built directly as a perfectly balanced tree
+ * in O(n) time.  Unsorted input is accepted, but is sorted first.
+ */
+void mm_build_from_sorted(multimap *mm, const int *keys, const int *vals,
+    size_t n);
+
+/* Probes the multimap for the n (keys[i], vals[i]) pairs, and sets out[i] to
+ * nonzero if the pair is in the multimap, or zero otherwise.  This gives the
+ * same answers as calling mm_contains_pair() for each pair, but overlaps the
+ * probes' cache misses, so it is much faster for large batches.
+ */
+void mm_contains_pairs(multimap *mm, const int *keys, const int *vals,
+    size_t n, int *out);
+
+/* Finds the smallest key in the multimap that is at least the specified key.
+ * Returns nonzero and stores the key into *found if there is one, or returns
+ * zero if every key is smaller.
+ */
+int mm_lower_bound(multimap *mm, int key, int *found);
+
+/* Passes each (key, value) pair with lo <= key < hi to the specified
+ * function, in key order.  Only the parts of the tree that hold keys in the
+ * range are visited.
+ */
+void mm_range(multimap *mm, int lo, int hi, void (*f)(int key, int value));
+
+/* Allocates a cursor positioned at the first pair of the multimap.  Adding
+ * values to the multimap invalidates its cursors.
+ */
+mm_cursor * mm_open_cursor(multimap *mm);
+
+/* Positions the cursor at the first pair whose key is at least the specified
+ * key.
+ */
+void mm_cursor_seek(mm_cursor *cursor, int key);
+
+/* Stores the pair at the cursor into *key and *value and advances the
+ * cursor.  Returns nonzero if there was such a pair, or zero at the end.
+ */
+int mm_cursor_next(mm_cursor *cursor, int *key, int *value);
+
+/* Releases a cursor. */
+void mm_close_cursor(mm_cursor *cursor);
+
+/* Compacts the multimap's memory.  The values of each key with many values
+ * are sorted and stored as bit-packed differences, which are decoded as
+ * needed by probes and traversals.  Values can still be added to the
+ * multimap afterward, but a compacted key that gets more values is unpacked
+ * again until the next compaction.  Compacting a frozen multimap, or one
+ * opened with mm_open_mapped(), does nothing, since their values already
+ * take just the space they need.
+ */
+void mm_compact(multimap *mm);
+
+/* Writes an image of the multimap to the specified file, which can later be
+ * opened with mm_open_mapped().  Returns 0 on success, or -1 if the file
+ * couldn't be written.
+ */
+int mm_save(multimap *mm, const char *path);
+
+/* Opens an image written by mm_save() as a read-only multimap, by mapping
+ * the file into memory.  Lookups are served straight from the mapped file,
+ * which is shared by every process that opens it.  Adding values to the
+ * multimap is an error; clear_multimap() unmaps the image.  Returns NULL if
+ * the file can't be opened or isn't a valid image.
+ */
+multimap * mm_open_mapped(const char *path);
+
+/* Freezes the multimap into an immutable form that is faster to probe.  The
+ * keys are stored in one array in breadth-first (Eytzinger) order, so that a
+ * lookup descends it without branching on the comparisons, and the values of
+ * all keys go into one array, each key's values sorted.  Traversals, ranges
+ * and cursors still work, but return each key's values in sorted order.
+ * Adding values to a frozen multimap is an error, and it can't be saved.
+ */
+void mm_freeze(multimap *mm);
+
+/* Sets up a Bloom filter of the multimap's pairs with the specified false
+ * positive rate, such as 0.01, or removes it if the rate is 0.  The filter
+ * is checked first by mm_contains_pair() and mm_contains_pairs(), so that
+ * most probes for absent pairs never search the multimap, and is kept up to
+ * date as pairs are added.  clear_multimap() removes the filter.
+ */
+void mm_set_pair_filter(multimap *mm, double rate);
+
+#endif
@@ -3,10 +3,62 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "multimap.h"
+#include "mm_layout.h"
 #define NULL_INDEX -1
 
+/* Marks a missing block of the value pool, such as a node's hash set of
+ * values before the node has enough values to need one.
+ */
+#define NULL_OFFSET -1
+
+/* Blocks of the value pool are powers of 2 in size, from MIN_BLOCK_SPACES
+ * values up to 2^(NUM_BLOCK_CLASSES - 1) values.  A free block holds the
+ * offset of the next free block of its size, so it needs room for an
+ * int64_t.
+ */
+#define MIN_BLOCK_SPACES 2
+#define NUM_BLOCK_CLASSES 32
+
+/* Once a key has more than VALUE_SET_THRESHOLD values, defined in
+ * mm_layout.h, its values are also indexed by an open-addressing hash set,
+ * so that pair probes don't scan every value.
+ */
+
+/* mm_compact() packs the values of keys with more than VALUE_SET_THRESHOLD
+ * values into blocks of PACK_BLOCK values.  A node whose values are packed
+ * has PACKED_VALUES in place of the offset of its value set.
+ */
+#define PACK_BLOCK 128
+#define PACKED_VALUES -2
+
+/* Marks an empty slot in a value hash set.  Since this can't be stored in
+ * the set, probes for this value always scan the value array instead.
+ */
+#define EMPTY_SLOT INT_MIN
+
+/* The pair filter is a blocked Bloom filter.  Each pair sets one bit in each
+ * of the FILTER_BLOCK_WORDS words of one block, so a probe reads a single
+ * block, which never straddles a cache line.  The filter is sized for at
+ * least FILTER_MIN_PAIRS pairs, and at most FILTER_MAX_BITS bits per pair.
+ */
+#define FILTER_BLOCK_WORDS 8
+#define FILTER_BLOCK_BITS (32 * FILTER_BLOCK_WORDS)
+#define FILTER_MIN_PAIRS 1024
+#define FILTER_MAX_BITS 64.0
+#define FILTER_ALIGN 64
+
 
 /*============================================================================
  * TYPES
@@ -17,23 +69,43 @@
  *   programs are generic and don't have any access to implementation details.
  *============================================================================*/
 
- /* Represents a value that is associated with a given key in the multimap. */
-typedef struct multimap_value {
-    int value;
-    struct multimap_value *next;
-} multimap_value;
-
-
 /* Represents a key and its associated values in the multimap, as well as
  * pointers to the left and right child nodes in the multimap. */
 typedef struct multimap_node {
     /* The key-value that this multimap node represents. */
     int key;
-    int64_t num_values;
-    int64_t num_spaces;
 
-    /* A linked list of the values associated with this key in the multimap. */
-    multimap_value *values;
+    /* The height of the subtree rooted at this node, where a leaf has a
+     * height of 1.  The tree is kept balanced as an AVL tree, so the heights
+     * of the two children of any node differ by at most 1.
+     */
+    int32_t height;
+
+    /* The number of values associated with this key, and the number of
+     * values that the values array has room for.  The array is doubled when
+     * it fills up, so num_spaces is always 0 or a power of 2.
+     */
+    int32_t num_values;
+    int32_t num_spaces;
+
+    /* A dense array of the values associated with this key in the multimap,
+     * in the order they were added.  Like the children below, this is not a
+     * pointer but the offset of the array in the multimap's value pool, so
+     * that the whole multimap can be saved and mapped back into memory at a
+     * different address.
+     */
+    int64_t values;
+
+    /* The offset in the value pool of an open-addressing hash set of the
+     * distinct values in the values array, with 2 * num_spaces slots, or
+     * NULL_OFFSET while the key has VALUE_SET_THRESHOLD or fewer values.
+     *
+     * After mm_compact(), a key with many values instead has PACKED_VALUES
+     * here.  Its values are then sorted and packed as described above
+     * pack_values(), values is the offset of the packed values, and
+     * num_spaces is their size in the value pool.
+     */
+    int64_t value_set;
 
     /* The left child of the multimap node.  This will reference nodes that
      * hold keys that are strictly less than this node's key.
@@ -41,9 +113,7 @@ typedef struct multimap_node {
      * to store not a pointer to the child, but an index to the location
      * of the child in the array.
      */
-    
-
-    int64_t left_child;
+    int32_t left_child;
 
     /* The right child of the multimap node.  This will reference nodes that
      * hold keys that are strictly greater than this node's key.
@@ -51,9 +121,13 @@ typedef struct multimap_node {
      * to store not a pointer to the child, but an index to the location
      * of the child in the array.
      */
-    int64_t right_child;
+    int32_t right_child;
 } multimap_node;
 
+/* The cache simulator's copy of this multimap relies on this size. */
+_Static_assert(sizeof(multimap_node) == AVL_NODE_BYTES,
+               "tree nodes must be AVL_NODE_BYTES in size");
+
 
 /* The entry-point of the multimap data structure. */
 struct multimap {
@@ -73,6 +147,135 @@ struct multimap {
      * index of any new nodes we wish to add. 
      */
     int64_t num_nodes;
+
+    /* The index of the node at the root of the tree.  Rebalancing the tree
+     * moves other nodes to the root, so this isn't always the first node
+     * in the pool.
+     */
+    int32_t root_index;
+
+    /* The pool that holds the values arrays and value sets of all nodes,
+     * its size, and how much of it has been handed out, all in values.
+     */
+    int *value_pool;
+    int64_t pool_size;
+    int64_t pool_used;
+
+    /* The offset of the first free block of each size in the value pool, or
+     * NULL_OFFSET if there is none.  Blocks are freed when a node's values
+     * outgrow them, and are reused for other nodes' values.
+     */
+    int64_t free_blocks[NUM_BLOCK_CLASSES];
+
+    /* For a multimap opened with mm_open_mapped(), the mapped image that
+     * holds its nodes and values, and the size of the image.  Otherwise,
+     * image is NULL.
+     */
+    void *image;
+    size_t image_size;
+
+    /* For a multimap frozen by mm_freeze(), the keys in Eytzinger order:
+     * frozen_keys[1] is the middle key, and the children of the key at
+     * position k are at positions 2k and 2k + 1, up to num_nodes.  The values
+     * of the key at position k are frozen_values[frozen_starts[k]] up to
+     * frozen_values[frozen_starts[k + 1]], in sorted order.  Otherwise,
+     * frozen_keys is NULL.  A frozen multimap has no node or value pool.
+     */
+    int *frozen_keys;
+    int64_t *frozen_starts;
+    int *frozen_values;
+
+    /* The Bloom filter of the multimap's pairs set up by mm_set_pair_filter(),
+     * or NULL if there is none.  It has filter_blocks blocks, and is sized
+     * for filter_capacity pairs at a false positive rate of filter_rate.  It
+     * holds filter_pairs pairs, and once that is more than its capacity, it
+     * is rebuilt twice as large.
+     */
+    uint32_t *filter;
+    int64_t filter_blocks;
+    int64_t filter_capacity;
+    int64_t filter_pairs;
+    double filter_rate;
+};
+
+
+/* The header of a multimap image written by mm_save().  The image is the
+ * header, then the node pool, then the value pool, each starting on an
+ * IMAGE_ALIGN boundary.  Nodes refer to each other and to their values by
+ * index and offset, so the image can be used wherever it is mapped.
+ */
+typedef struct mm_image_header {
+    /* IMAGE_MAGIC, and sizeof(multimap_node) in the program that wrote the
+     * image, to catch images from incompatible builds.
+     */
+    char magic[8];
+    int32_t node_size;
+
+    int32_t root_index;
+    int64_t num_nodes;
+    int64_t num_pool_values;
+
+    /* The offsets of the node pool and the value pool in the image. */
+    int64_t nodes_start;
+    int64_t values_start;
+} mm_image_header;
+
+/* The magic changes whenever the layout of the pools does, including the
+ * slots value_hash() picks, since images store the value hash sets as is.
+ */
+#define IMAGE_MAGIC "MMIMGV2"
+#define IMAGE_ALIGN 64
+
+
+/* The number of probes that mm_contains_pairs() keeps in flight at once. */
+#define PROBE_GROUP 16
+
+/* Trees with fewer nodes than this mostly stay in the cache, so interleaving
+ * their descents costs more in bookkeeping than it saves in cache misses.
+ */
+#define MIN_INTERLEAVED_NODES 4096
+
+
+/* The most nodes a cursor's stack may hold.  An AVL tree with height h has
+ * at least fib(h + 2) - 1 nodes, so no tree indexed by an int32_t is taller.
+ */
+#define MAX_CURSOR_DEPTH 48
+
+
+/* The frozen key array is aligned to a cache line, so that the 16 keys four
+ * levels below any key share one cache line, and lookups prefetch that line
+ * FROZEN_PREFETCH_LEVELS levels ahead.
+ */
+#define FROZEN_ALIGN 64
+#define FROZEN_PREFETCH_LEVELS 4
+
+
+/* A cursor over the pairs of the multimap.  The stack holds the nodes still
+ * to be visited whose left subtrees are done, with the cursor's current node
+ * on top, so that it is just the path that an in-order traversal would have
+ * on its call stack.
+ */
+struct mm_cursor {
+    multimap *mm;
+
+    /* The pending nodes, and how many of them there are. */
+    int32_t stack[MAX_CURSOR_DEPTH];
+    int32_t depth;
+
+    /* The next value to return from the node on top of the stack. */
+    int32_t value_pos;
+
+    /* The last block of packed values that the cursor decoded, the node it
+     * belongs to, and its number within the node's values.
+     */
+    int block[PACK_BLOCK];
+    int32_t block_node;
+    int32_t block_num;
+
+    /* For a frozen multimap, the position of the current key in the frozen
+     * key array, or 0 at the end.  The stack isn't used.
+     */
+    int64_t frozen_pos;
 };
 
 
@@ -83,139 +286,290 @@ struct multimap {
  *   these are not visible outside of this module.
  *============================================================================*/
 
-multimap_node * alloc_mm_node();
-
 multimap_node * find_mm_node(multimap *mm, int key,
  int create_if_not_found);
 
-void free_multimap_values(multimap_value *values);
-void free_multimap_node(multimap_node *node, multimap* mm);
 void resize_multimap_pool(multimap* mm);
+void check_writable(multimap *mm);
 /* This is a helper function that initializes new nodes */
-multimap_node* add_node(multimap *mm, multimap_node *node, int key);
+int32_t add_node(multimap *mm, int key);
 
+/* These helpers keep the tree balanced as an AVL tree. */
+int32_t node_height(multimap *mm, int32_t index);
+void update_height(multimap *mm, int32_t index);
+int32_t rotate_left(multimap *mm, int32_t index);
+int32_t rotate_right(multimap *mm, int32_t index);
+int32_t rebalance(multimap *mm, int32_t index);
+int32_t avl_insert(multimap *mm, int32_t index, int key, int32_t *new_index);
 
-/*============================================================================
- * FUNCTION IMPLEMENTATIONS
- *============================================================================*/
+/* These helpers hand out and take back blocks of the value pool. */
+int block_class(int64_t num_spaces);
+int64_t pool_alloc(multimap *mm, int64_t num_spaces);
+void pool_free(multimap *mm, int64_t offset, int64_t num_spaces);
 
-/* Allocates a multimap node, and zeros out its contents so that we know what
- * the initial value of everything will be.
- */
-multimap_node * alloc_mm_node() {
-    multimap_node *node = malloc(sizeof(multimap_node));
-    bzero(node, sizeof(multimap_node));
+/* These helpers maintain the hash sets of values for keys with many values. */
+uint32_t value_hash(int value, int32_t num_slots);
+void value_set_insert(int *value_set, int32_t num_slots, int value);
+int value_set_contains(int *value_set, int32_t num_slots, int value);
+void build_value_set(multimap *mm, multimap_node *node);
+void append_values(multimap *mm, multimap_node *node, const int *vals,
+    int32_t count);
 
-    return node;
-}
+/* These helpers implement bulk insertion of many pairs at once. */
+void radix_sort_pairs(int *keys, int *vals, size_t n);
+void add_sorted_pairs(multimap *mm, const int *keys, const int *vals,
+    size_t n);
+void build_sorted_tree(multimap *mm, const int *keys, const int *vals,
+    size_t n);
+int32_t link_balanced(multimap *mm, int32_t lo, int32_t hi);
 
+/* These helpers implement compact storage of values. */
+int compare_values(const void *a, const void *b);
+int32_t pack_values(const int *sorted, int32_t num_values, int *out);
+int32_t unpack_block(const int *packed, int32_t num_values, int32_t block,
+    int *out);
+int packed_contains(const int *packed, int32_t num_values, int value);
+void unpack_node(multimap *mm, multimap_node *node);
+void emit_values(multimap *mm, multimap_node *node,
+    void (*f)(int key, int value));
+
+/* This helper checks a node's values for a pair probe. */
+int node_contains_value(multimap *mm, multimap_node *node, int value);
+void prefetch_values(multimap *mm, multimap_node *node, int value);
+
+/* These helpers read and write multimap images. */
+int64_t image_align(int64_t offset);
+int write_padding(FILE *file, int64_t from, int64_t to);
+int check_image(const mm_image_header *header, size_t image_size);
+
+/* These helpers implement range scans and cursors. */
+void mm_range_helper(multimap *mm, int32_t index, int lo, int hi,
+    void (*f)(int key, int value));
+void push_left_path(mm_cursor *cursor, int32_t index);
+
+/* These helpers maintain and check the pair filter. */
+uint64_t pair_hash(int key, int value);
+uint32_t * filter_block(multimap *mm, uint64_t hash);
+void filter_insert(multimap *mm, int key, int value);
+int filter_contains(multimap *mm, int key, int value);
+double filter_bits_per_pair(double rate);
+int64_t count_pairs(multimap *mm);
+void build_filter(multimap *mm, int64_t capacity);
+void filter_add_pairs(multimap *mm, const int *keys, const int *vals,
+    size_t n);
+size_t skip_filtered_probes(multimap *mm, const int *keys, const int *vals,
+    size_t n, size_t next_probe, int *out);
+
+/* These helpers build and search a frozen multimap. */
+void collect_in_order(multimap *mm, int32_t index, int32_t *order,
+    int64_t *count);
+int64_t assign_eytzinger(int64_t *pos_node, const int32_t *order, int64_t n,
+    int64_t i, int64_t k);
+int64_t frozen_lower_bound(multimap *mm, int key);
+int64_t frozen_first(multimap *mm, int64_t k);
+int64_t frozen_next(multimap *mm, int64_t k);
+int frozen_contains_pair(multimap *mm, int key, int value);
+void frozen_emit_values(multimap *mm, int64_t k,
+    void (*f)(int key, int value));
+void frozen_traverse_helper(multimap *mm, int64_t k,
+    void (*f)(int key, int value));
+
+
+/*============================================================================
+ * FUNCTION IMPLEMENTATIONS
+ *============================================================================*/
 
 /* This helper function searches for the multimap node that contains the
  * specified key.  If such a node doesn't exist, the function can initialize
  * a new node and add this into the structure, or it will simply return NULL.
- * The one exception is the root - if the root is NULL then the function will
- * return a new root node.
  *
- * Note, in the optimized version of this function, we instead traverse
- * allocate space for any new nodes with a helper function that
- * extends the block of memory dedicated to the array. 
+ * Note, in the optimized version of this function, we allocate space for
+ * any new nodes with a helper function that extends the block of memory
+ * dedicated to the array.  New nodes are inserted with avl_insert(), which
+ * rebalances the tree on the way back up, so that the tree stays
+ * logarithmic in height even when keys are added in sorted order.
  */
 multimap_node * find_mm_node(multimap *mm, int key,
  int create_if_not_found) {
-    multimap_node *node;
+    int32_t index = mm->root_index;
+    int32_t new_index;
 
-    /* If the entire multimap is empty, the root will be NULL. */
-    if (mm->root == NULL) {
-        if (create_if_not_found) {
-            mm->root = alloc_mm_node();
-            mm->root->key = key;
-            /* Initialize child nodes and other book keeping 
-             * parameters
-             */
-            mm->size = 1;
-            mm->num_nodes = 1;
-            mm->root->left_child = NULL_INDEX;
-            mm->root->right_child = NULL_INDEX;
-        }
-        return mm->root;
-    }
-
-    /* Now we know the multimap has at least a root node, so start there. */
-    node = mm->root;
-    while (1) {
-        if (node->key == key) {
-            break;
-        }
-
-        if (node->key > key) {   /* Follow left child */
-        if (node->left_child == NULL_INDEX && create_if_not_found) {
-            /* No left child, but caller wants us to create a new node. */
-            node = add_node(mm, node, key);
-            /* Adjust current node. */
-            node->left_child = mm->num_nodes;
-            /* Increment node count. */
-            mm->num_nodes++;
-        }
-        if (node->left_child == NULL_INDEX) {
-            node = NULL;
-        } else {
-            /* Otherwise this op will point to a valid location. */
-            node = mm->root + node->left_child;
-        }
-    }
-        else {                   /* Follow right child */
-    if (node->right_child == NULL_INDEX && create_if_not_found) {
-        /* No right child, but caller wants us to create a new node. */
-        node = add_node(mm, node, key);
-        /* Adjust current node. */
-        node->right_child = mm->num_nodes;
-        /* Increment node count. */
-        mm->num_nodes++;
-    }
-    if (node->right_child == NULL_INDEX) {
-        node = NULL;
+    /* Search the tree first, since most lookups don't add a node. */
+    while (index != NULL_INDEX) {
+        multimap_node *node = mm->root + index;
+
+        if (node->key == key)
+            return node;
+
+        if (node->key > key)    /* Follow left child */
+            index = node->left_child;
+        else                    /* Follow right child */
+            index = node->right_child;
+    }
+
+    if (!create_if_not_found)
+        return NULL;
+
+    /* The key isn't in the tree, so insert a new node for it.  This may
+     * move the pool, so only look up the new node's address afterward.
+     */
+    mm->root_index = avl_insert(mm, mm->root_index, key, &new_index);
+    return mm->root + new_index;
+}
+
+
+/**
+ * Helper function that inserts a new node for the key into the subtree
+ * rooted at the specified index, and rebalances the subtree on the way
+ * back up.  Since the pool may be moved by the insertion, nodes are always
+ * referred to by index, never by pointer, across the recursive calls.
+ * @param  mm        the pointer to the multimap
+ * @param  index     index of the root of the subtree, or NULL_INDEX
+ * @param  key       the key value we are adding
+ * @param  new_index set to the index of the newly added node
+ * @return           index of the root of the subtree after rebalancing
+ */
+int32_t avl_insert(multimap *mm, int32_t index, int key, int32_t *new_index) {
+    int32_t child;
+
+    if (index == NULL_INDEX) {
+        *new_index = add_node(mm, key);
+        return *new_index;
+    }
+
+    if (mm->root[index].key > key) {
+        child = avl_insert(mm, mm->root[index].left_child, key, new_index);
+        mm->root[index].left_child = child;
     } else {
-        /* Otherwise this op will point to a valid location. */
-        node = mm->root + node->right_child;
+        child = avl_insert(mm, mm->root[index].right_child, key, new_index);
+        mm->root[index].right_child = child;
     }
+
+    return rebalance(mm, index);
+}
+
+
+/* Returns the height of the subtree at the index, or 0 for no subtree. */
+int32_t node_height(multimap *mm, int32_t index) {
+    if (index == NULL_INDEX)
+        return 0;
+
+    return mm->root[index].height;
+}
+
+
+/* Recomputes a node's height from the heights of its children. */
+void update_height(multimap *mm, int32_t index) {
+    multimap_node *node = mm->root + index;
+    int32_t left = node_height(mm, node->left_child);
+    int32_t right = node_height(mm, node->right_child);
+
+    node->height = 1 + (left > right ? left : right);
 }
-if (node == NULL) {
-    break;
+
+
+/**
+ * Rotates the subtree at the index to the left, so that its right child
+ * becomes the root of the subtree.
+ * @return index of the new root of the subtree
+ */
+int32_t rotate_left(multimap *mm, int32_t index) {
+    multimap_node *node = mm->root + index;
+    int32_t pivot = node->right_child;
+
+    node->right_child = mm->root[pivot].left_child;
+    mm->root[pivot].left_child = index;
+
+    update_height(mm, index);
+    update_height(mm, pivot);
+    return pivot;
 }
+
+
+/**
+ * Rotates the subtree at the index to the right, so that its left child
+ * becomes the root of the subtree.
+ * @return index of the new root of the subtree
+ */
+int32_t rotate_right(multimap *mm, int32_t index) {
+    multimap_node *node = mm->root + index;
+    int32_t pivot = node->left_child;
+
+    node->left_child = mm->root[pivot].right_child;
+    mm->root[pivot].right_child = index;
+
+    update_height(mm, index);
+    update_height(mm, pivot);
+    return pivot;
 }
-return node;
+
+
+/**
+ * Restores the AVL property at a node whose subtrees may differ in height
+ * by 2 after an insertion, using a single or double rotation.
+ * @return index of the root of the subtree after rebalancing
+ */
+int32_t rebalance(multimap *mm, int32_t index) {
+    multimap_node *node = mm->root + index;
+    int32_t balance;
+
+    update_height(mm, index);
+    balance = node_height(mm, node->left_child) -
+              node_height(mm, node->right_child);
+
+    if (balance > 1) {
+        /* Left-heavy.  If the left child leans right, straighten it out
+         * first so that a single right rotation fixes the subtree.
+         */
+        if (node_height(mm, mm->root[node->left_child].left_child) <
+            node_height(mm, mm->root[node->left_child].right_child)) {
+            node->left_child = rotate_left(mm, node->left_child);
+        }
+        return rotate_right(mm, index);
+    }
+
+    if (balance < -1) {
+        /* Right-heavy, the mirror image of the case above. */
+        if (node_height(mm, mm->root[node->right_child].right_child) <
+            node_height(mm, mm->root[node->right_child].left_child)) {
+            node->right_child = rotate_right(mm, node->right_child);
+        }
+        return rotate_left(mm, index);
+    }
+
+    return index;
 }
 
+
 /**
  * Helper function that adds a new node to the slab and initialize
  * everything to the proper values. This function also adjusts the size
  * of the pool / slab in the memory suppose we need more space.
  * @param  mm   the pointer to the multimap
- * @param  node pointer to the current node we're considering
  * @param  key  the key value we are adding
- * @return      pointer to the new location of the node if we realloc
+ * @return      index of the new node in the pool
  */
-multimap_node* add_node(multimap *mm, multimap_node *node, int key) {
+int32_t add_node(multimap *mm, int key) {
     /**
      * If we don't have enough space in our current array,
      * invoke the resize function and extend the array.
-     * Also readjust the node pointer to the current node
-     * since realloc may copy contents to a new memory region
+     * Callers must look nodes up again by index afterward,
+     * since realloc may copy contents to a new memory region.
      */
-    if ( mm->num_nodes >= mm->size) {
-        int64_t index = node - mm->root;
+    if (mm->num_nodes >= mm->size) {
         resize_multimap_pool(mm);
-        node = mm->root + index;
     }
     multimap_node *new = mm->root + mm->num_nodes;
     /* Initialize values. */
     new->key = key;
+    new->height = 1;
     new->num_values = 0;
     new->num_spaces = 0;
+    new->values = NULL_OFFSET;
+    new->value_set = NULL_OFFSET;
     new->left_child = NULL_INDEX;
     new->right_child = NULL_INDEX;
-    return node;
-
+    return mm->num_nodes++;
 }
 
 /**
@@ -226,17 +580,18 @@ multimap_node* add_node(multimap *mm, multimap_node *node, int key) {
  */
 void resize_multimap_pool(multimap* mm) {
     /* Attempts to realloc by either extending or copying to a new region */
+    int64_t new_size = (mm->size == 0) ? 1 : mm->size * 4;
     multimap_node* newzone = (multimap_node *) realloc(mm->root, 
-        mm->size * 4 * sizeof(multimap_node));
+        new_size * sizeof(multimap_node));
     /* If extend successful, assume memory copied, adjust pointers and 
      * associated book keeping values.
      */
     if (newzone != NULL) {
         mm->root = newzone;
-        mm->size *= 4;
+        mm->size = new_size;
     } else {
         /* Error handling for out of memory scenario. */
-        printf("size requested %lu\n", mm->size * 4 *
+        printf("size requested %lu\n", new_size *
          sizeof(multimap_node));
         printf("%s\n", "failed to realloc array");
         exit(1);
@@ -244,192 +599,1959 @@ void resize_multimap_pool(multimap* mm) {
 }
 
 
-/* This helper function frees all values in a multimap node's value-list. */
-void free_multimap_values(multimap_value *values) {
-    free(values);
+/* Exits with an error if the multimap is a read-only mapped image. */
+void check_writable(multimap *mm) {
+    if (mm->image != NULL) {
+        printf("%s\n", "cannot add values to a mapped multimap");
+        exit(1);
+    }
+    if (mm->frozen_keys != NULL) {
+        printf("%s\n", "cannot add values to a frozen multimap");
+        exit(1);
+    }
 }
 
 
-/* This helper function frees a multimap node, including its children and
- * value-list.
+/* Returns the index of the free list for blocks of the specified size,
+ * which must be a power of 2.
  */
-void free_multimap_node(multimap_node *node, multimap* mm) {
-    int i;
-    /* Since now our tree is in a continuous pool, we simply free
-     * values one by one.
-     */
-    for (i = 0; i < mm->num_nodes; ++i) {
-        free_multimap_values(mm->root[i].values);
+int block_class(int64_t num_spaces) {
+    int c = 0;
+
+    while (((int64_t) 1 << c) < num_spaces)
+        c++;
+
+    assert(((int64_t) 1 << c) == num_spaces && c < NUM_BLOCK_CLASSES);
+    return c;
+}
+
+
+/**
+ * Hands out a block of the value pool with room for the specified number of
+ * values, which must be a power of 2 of at least MIN_BLOCK_SPACES.  Freed
+ * blocks of the same size are reused first; otherwise the block is taken
+ * from the end of the pool, which is doubled when it fills up.  Since this
+ * may move the pool, callers must only compute addresses in the pool after
+ * allocating.
+ * @param  mm         the pointer to the multimap
+ * @param  num_spaces the size of the block, in values
+ * @return            the offset of the block in the value pool
+ */
+int64_t pool_alloc(multimap *mm, int64_t num_spaces) {
+    int c = block_class(num_spaces);
+    int64_t offset = mm->free_blocks[c];
+
+    assert(num_spaces >= MIN_BLOCK_SPACES);
+
+    if (offset != NULL_OFFSET) {
+        memcpy(&mm->free_blocks[c], mm->value_pool + offset, sizeof(int64_t));
+        return offset;
+    }
+
+    if (mm->pool_used + num_spaces > mm->pool_size) {
+        int64_t new_size = (mm->pool_size == 0) ? 1024 : mm->pool_size * 2;
+        int *newzone;
+
+        while (new_size < mm->pool_used + num_spaces)
+            new_size *= 2;
+
+        newzone = (int *) realloc(mm->value_pool, new_size * sizeof(int));
+        if (newzone == NULL) {
+            /* Error handling for out of memory scenario. */
+            printf("size requested %lu\n", new_size * sizeof(int));
+            printf("%s\n", "failed to realloc value pool");
+            exit(1);
+        }
+        mm->value_pool = newzone;
+        mm->pool_size = new_size;
     }
+
+    offset = mm->pool_used;
+    mm->pool_used += num_spaces;
+    return offset;
 }
 
 
-/* Initialize a multimap data structure. */
-multimap * init_multimap() {
-    multimap *mm = malloc(sizeof(multimap));
-    mm->root = NULL;
-    return mm;
+/* Returns a block to the free list for blocks of its size. */
+void pool_free(multimap *mm, int64_t offset, int64_t num_spaces) {
+    int c = block_class(num_spaces);
+
+    memcpy(mm->value_pool + offset, &mm->free_blocks[c], sizeof(int64_t));
+    mm->free_blocks[c] = offset;
 }
 
 
-/* Release all dynamically allocated memory associated with the multimap
- * data structure.
+/* Hashes a value to its home slot in a value hash set.  num_slots must be a
+ * power of 2, and at least 2.
  */
-void clear_multimap(multimap *mm) {
-    assert(mm != NULL);
-    free_multimap_node(mm->root, mm);
-    free(mm->root);
-    mm->root = NULL;
+uint32_t value_hash(int value, int32_t num_slots) {
+    /* Fibonacci hashing spreads clustered values across the set.  It takes
+     * the high bits of the product, which depend on every bit of the value;
+     * the low bits would only depend on the value's low bits, so values
+     * with a power-of-2 stride would all land in the same slot.  The shift
+     * keeps log2(num_slots) bits; num_slots is 2 * num_spaces of the node
+     * that owns the set, so the shift needs no space of its own.
+     */
+    return ((uint32_t) value * VALUE_HASH_MULTIPLIER) >>
+        VALUE_HASH_SHIFT(num_slots);
+}
+
+
+/* Adds a value to a value hash set, unless it is already in the set.  The
+ * set is never more than half full, so there is always an empty slot.
+ */
+void value_set_insert(int *value_set, int32_t num_slots, int value) {
+    uint32_t slot = value_hash(value, num_slots);
 
+    assert(value != EMPTY_SLOT);
+
+    while (value_set[slot] != EMPTY_SLOT) {
+        if (value_set[slot] == value)
+            return;
+        slot = (slot + 1) & (num_slots - 1);
+    }
+    value_set[slot] = value;
+}
+
+
+/* Returns nonzero if the value is in the value hash set. */
+int value_set_contains(int *value_set, int32_t num_slots, int value) {
+    uint32_t slot = value_hash(value, num_slots);
+
+    while (value_set[slot] != EMPTY_SLOT) {
+        if (value_set[slot] == value)
+            return 1;
+        slot = (slot + 1) & (num_slots - 1);
+    }
+    return 0;
 }
 
 
-/* Adds the specified (key, value) pair to the multimap. */
 /**
- * In the updated mm_add_value function, we take a different approach to 
- * allocating space for the values associated with each value.
- * where as before each node pointed to a linked list of values, now each
- * node points to a continuous block of values array. Though the individual
- * value structs are now in an array one by one, we still maintain the
- * pointers and the traversal of the linked list functionalities inside the
- * array so that we may still traverse this implementation with
- * preexisting algorithms without the need for extensive modification.
- * @param mm    pointer to the multimap
- * @param key   key where the following value will be added
- * @param value value to be added at key
+ * Builds the hash set of a node's values, sized to twice the capacity of its
+ * values array so that the set stays at most half full until the array is
+ * grown again.  The node must not have a hash set yet.
+ * @param mm   the pointer to the multimap
+ * @param node the node whose values should be indexed
  */
-void mm_add_value(multimap *mm, int key, int value) {
-    multimap_node *node;
-    multimap_value *new_value;
+void build_value_set(multimap *mm, multimap_node *node) {
+    int32_t num_slots = 2 * node->num_spaces;
+    int32_t i;
+    int *values, *value_set;
 
-    assert(mm != NULL);
+    assert(node->value_set == NULL_OFFSET);
+    node->value_set = pool_alloc(mm, num_slots);
+    values = mm->value_pool + node->values;
+    value_set = mm->value_pool + node->value_set;
 
-    /* Look up the node with the specified key.  Create if not found. */
-    node = find_mm_node(mm, key, /* create */ 1);
-    if (mm->root == NULL) {
-        mm->root = node;
+    for (i = 0; i < num_slots; i++)
+        value_set[i] = EMPTY_SLOT;
+
+    for (i = 0; i < node->num_values; i++) {
+        if (values[i] != EMPTY_SLOT)
+            value_set_insert(value_set, num_slots, values[i]);
     }
+}
 
-    assert(node != NULL);
-    assert(node->key == key);
 
-    /* Add the new value to the multimap node. */
-    if (node->num_values == 0) {
-        /* allocate 1 node here, this is the base case
-         * Here we also take care of some initialize work
-         */
-        new_value = malloc(sizeof(multimap_value));
-        new_value->value = value;
-        new_value->next = NULL;
-
-        node->values = new_value;
-        node->num_values++;
-        node->num_spaces++;
-    } else if(node->num_values < node->num_spaces) {
-        /* This is the case where there are spaces left in our array,
-         * so we simply create new values in the continuous chunk of free
-         * space we already have.
-         */
+/**
+ * Appends values to a node's values array, moving the array to a block of
+ * the value pool of the next large enough power of 2 if it is full, and
+ * keeps the node's hash set of values up to date.
+ * @param mm    the pointer to the multimap
+ * @param node  the node to add the values to
+ * @param vals  the values to add, which must not be in the value pool
+ * @param count the number of values to add
+ */
+void append_values(multimap *mm, multimap_node *node, const int *vals,
+    int32_t count) {
+    int32_t needed;
+    int32_t i;
 
-        /* Get one past the last pointer to obtain new value location. */
-        new_value = (node->values + node->num_values);
-        new_value->value = value;
-        new_value->next = NULL;
-        /* Update current tail*/
-        multimap_value* tempend = node->values + node->num_values - 1;
-        tempend->next = new_value;
-        node->num_values++;
+    if (node->value_set == PACKED_VALUES)
+        unpack_node(mm, node);
 
-    } else if (node->num_values == node->num_spaces) {
+    needed = node->num_values + count;
+    if (needed > node->num_spaces) {
         /* This is the case where we need to resize the storage space.
-         * Attempts to double the block by reallocating. 
+         * Moves the values to a block at least twice as large.
          */
-        multimap_value* newzone = (multimap_value *) realloc(node->values, 
-            node->num_spaces * 2 * sizeof(multimap_value));
-        /* Realloc successful. */
-        if(newzone != NULL) {
-            /* Allocation successful, the data is assume to be copied over
-             * Then we need to adjust pointers.
-             */
-            int i;
-            node->values = newzone;
-            for (i = 0; i < node->num_values; ++i) {
-                (node->values + i)->next = node->values + 1 + i;
-            }
-            /* Done adjusting values, must now insert new node. */
-            new_value = node->values + node->num_values; 
-            new_value->value = value;
-            new_value->next = NULL;
-            
-            node->num_values++;
-            /* Adjust book keeping values. */
-            node->num_spaces *= 2;
-        } else {
-            /* Simple error handling for out of memory cases. */
-            printf("%s\n", "failed to realloc linked list");
-            exit(1);
+        int32_t new_spaces = (node->num_spaces == 0) ?
+            MIN_BLOCK_SPACES : node->num_spaces;
+        int64_t new_values;
+
+        while (new_spaces < needed)
+            new_spaces *= 2;
+
+        new_values = pool_alloc(mm, new_spaces);
+        if (node->values != NULL_OFFSET) {
+            memcpy(mm->value_pool + new_values, mm->value_pool + node->values,
+                node->num_values * sizeof(int));
+            pool_free(mm, node->values, node->num_spaces);
+        }
+
+        /* The hash set is sized from the array, so it is rebuilt whenever
+         * the array grows.
+         */
+        if (node->value_set != NULL_OFFSET) {
+            pool_free(mm, node->value_set, 2 * node->num_spaces);
+            node->value_set = NULL_OFFSET;
+        }
+
+        node->values = new_values;
+        node->num_spaces = new_spaces;
+    }
+
+    memcpy(mm->value_pool + node->values + node->num_values, vals,
+        count * sizeof(int));
+    node->num_values = needed;
+
+    if (node->value_set != NULL_OFFSET) {
+        for (i = 0; i < count; i++) {
+            if (vals[i] != EMPTY_SLOT)
+                value_set_insert(mm->value_pool + node->value_set,
+                    2 * node->num_spaces, vals[i]);
         }
     }
+    else if (node->num_values > VALUE_SET_THRESHOLD) {
+        build_value_set(mm, node);
+    }
 }
 
 
-/* Returns nonzero if the multimap contains the specified key-value, zero
- * otherwise.
- */
-int mm_contains_key(multimap *mm, int key) {
-    return find_mm_node(mm, key, /* create */ 0) != NULL;
+/* Compares two values for qsort(). */
+int compare_values(const void *a, const void *b) {
+    int x = *(const int *) a, y = *(const int *) b;
+
+    return (x > y) - (x < y);
 }
 
 
-/* Returns nonzero if the multimap contains the specified (key, value) pair,
- * zero otherwise.
+/**
+ * Packs sorted values into blocks of PACK_BLOCK values.  Each block stores
+ * the differences between consecutive values, which are small when a key
+ * has many values, with just enough bits per difference for the largest
+ * one.  The packed values are laid out as:
+ *
+ *   - the first value of each block, for finding the block of a value
+ *   - the start of each block's words, and the end of the last block
+ *   - the blocks of bit-packed differences
+ *
+ * A block with w bits per difference takes 4 * w words.  Difference j of a
+ * block goes into lane j % 4 of the block, and the words of the four lanes
+ * are interleaved, so that unpack_block() can decode four differences per
+ * step with SSE2.  The first difference of each block is 0, and the last
+ * block is padded with differences of 0.
+ * @param  sorted     the values to pack, in nondecreasing order
+ * @param  num_values the number of values
+ * @param  out        where to pack the values, which must have room for
+ *                    (2 + PACK_BLOCK) ints per block, plus 1
+ * @return            the number of ints of out that were used
  */
-int mm_contains_pair(multimap *mm, int key, int value) {
-    multimap_node *node;
-    multimap_value *curr;
+int32_t pack_values(const int *sorted, int32_t num_values, int *out) {
+    int32_t num_blocks = (num_values + PACK_BLOCK - 1) / PACK_BLOCK;
+    int *firsts = out;
+    int *starts = out + num_blocks;
+    uint32_t *words = (uint32_t *) (out + 2 * num_blocks + 1);
+    uint32_t deltas[PACK_BLOCK];
+    int32_t b, j, start = 0;
 
-    node = find_mm_node(mm, key, /* create */ 0);
-    if (node == NULL)
-        return 0;
+    for (b = 0; b < num_blocks; b++) {
+        const int *block = sorted + b * PACK_BLOCK;
+        int32_t count = num_values - b * PACK_BLOCK;
+        uint32_t all_bits = 0;
+        int width = 0;
 
-    curr = node->values;
-    while (curr != NULL) {
-        if (curr->value == value)
-            return 1;
+        if (count > PACK_BLOCK)
+            count = PACK_BLOCK;
+
+        for (j = 0; j < PACK_BLOCK; j++) {
+            if (j == 0 || j >= count)
+                deltas[j] = 0;
+            else
+                deltas[j] = (uint32_t) block[j] - (uint32_t) block[j - 1];
+            all_bits |= deltas[j];
+        }
+
+        while (width < 32 && (all_bits >> width) != 0)
+            width++;
+
+        firsts[b] = block[0];
+        starts[b] = start;
+        memset(words + start, 0, 4 * width * sizeof(uint32_t));
+
+        for (j = 0; width > 0 && j < PACK_BLOCK; j++) {
+            int32_t bit = (j / 4) * width;
+            int32_t word = start + (bit / 32) * 4 + j % 4;
+            int offset = bit % 32;
+
+            words[word] |= deltas[j] << offset;
+            if (offset + width > 32)
+                words[word + 4] |= deltas[j] >> (32 - offset);
+        }
 
-        curr = curr->next;
+        start += 4 * width;
     }
 
-    return 0;
+    starts[num_blocks] = start;
+    return 2 * num_blocks + 1 + start;
 }
 
 
-/* This helper function is used by mm_traverse() to traverse every pair within
- * the multimap.
+/**
+ * Decodes one block of values packed by pack_values().  The differences are
+ * unpacked four at a time, one per lane, and turned back into values with a
+ * running sum.
+ * @param  packed     the packed values
+ * @param  num_values the number of packed values
+ * @param  block      the number of the block to decode
+ * @param  out        where to store the block's values, which must have room
+ *                    for PACK_BLOCK values even for a partial block
+ * @return            the number of values in the block
  */
-void mm_traverse_helper(multimap_node *node, void (*f)(int key, int value),
-    multimap_node *root) {
-    multimap_value *curr;
+int32_t unpack_block(const int *packed, int32_t num_values, int32_t block,
+    int *out) {
+    int32_t num_blocks = (num_values + PACK_BLOCK - 1) / PACK_BLOCK;
+    const int *starts = packed + num_blocks;
+    const uint32_t *words = (const uint32_t *) (packed + 2 * num_blocks + 1) +
+                            starts[block];
+    int width = (starts[block + 1] - starts[block]) / 4;
+    int32_t count = num_values - block * PACK_BLOCK;
+    int32_t k;
+    int shift = 0;
 
-    if (node->left_child != NULL_INDEX) {
-        mm_traverse_helper(root + node->left_child, f, root);
-    }
-    curr = node->values;
-    while (curr != NULL) {
-        f(node->key, curr->value);
-        curr = curr->next;
+    if (count > PACK_BLOCK)
+        count = PACK_BLOCK;
+
+    if (width == 0) {
+        for (k = 0; k < count; k++)
+            out[k] = packed[block];
+        return count;
     }
 
-    if (node->right_child != NULL_INDEX) {
-        mm_traverse_helper(root + node->right_child, f, root);
+#ifdef __SSE2__
+    {
+        const __m128i *in = (const __m128i *) words;
+        __m128i mask = _mm_set1_epi32(width == 32 ? -1 :
+                                      (int) ((1u << width) - 1));
+        __m128i sum = _mm_set1_epi32(packed[block]);
+        __m128i cur = _mm_loadu_si128(in);
+        __m128i next, v;
+
+        for (k = 0; k < PACK_BLOCK / 4; k++) {
+            v = _mm_srl_epi32(cur, _mm_cvtsi32_si128(shift));
+            if (shift + width >= 32) {
+                /* The lanes' next differences start in the next words, and
+                 * these ones may continue into them.
+                 */
+                if (k + 1 < PACK_BLOCK / 4) {
+                    next = _mm_loadu_si128(++in);
+                    if (shift + width > 32) {
+                        v = _mm_or_si128(v, _mm_sll_epi32(next,
+                            _mm_cvtsi32_si128(32 - shift)));
+                    }
+                    cur = next;
+                }
+                shift += width - 32;
+            }
+            else {
+                shift += width;
+            }
+            v = _mm_and_si128(v, mask);
+
+            /* Sum the four differences, and add the previous value. */
+            v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi32(v, sum);
+            _mm_storeu_si128((__m128i *) (out + 4 * k), v);
+            sum = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+        }
     }
-}
+#else
+    {
+        uint32_t mask = (width == 32) ? ~0u : (1u << width) - 1;
+        uint32_t sum = (uint32_t) packed[block];
+        int32_t lane, word = 0;
 
+        for (k = 0; k < PACK_BLOCK / 4; k++) {
+            for (lane = 0; lane < 4; lane++) {
+                uint32_t delta = words[word + lane] >> shift;
 
-/* Performs an in-order traversal of the multimap, passing each (key, value)
+                if (shift + width > 32)
+                    delta |= words[word + 4 + lane] << (32 - shift);
+                sum += delta & mask;
+                out[4 * k + lane] = (int) sum;
+            }
+            shift += width;
+            if (shift >= 32) {
+                shift -= 32;
+                word += 4;
+            }
+        }
+    }
+#endif
+
+    return count;
+}
+
+
+/* Returns nonzero if the packed values include the specified value.  Only
+ * the one block that could hold the value is decoded.
+ */
+int packed_contains(const int *packed, int32_t num_values, int value) {
+    int32_t num_blocks = (num_values + PACK_BLOCK - 1) / PACK_BLOCK;
+    int32_t lo = 0, hi = num_blocks, count, j;
+    int block[PACK_BLOCK];
+
+    /* Find the last block whose first value is at most the value. */
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+
+        if (packed[mid] <= value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return 0;
+
+    count = unpack_block(packed, num_values, lo - 1, block);
+    for (j = 0; j < count && block[j] <= value; j++) {
+        if (block[j] == value)
+            return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Turns a node's packed values back into an ordinary values array, so that
+ * more values can be added to it.  The space of the packed values isn't
+ * reused until the multimap is compacted again.
+ * @param mm   the pointer to the multimap
+ * @param node the node whose values are packed
+ */
+void unpack_node(multimap *mm, multimap_node *node) {
+    int32_t num_values = node->num_values;
+    int32_t num_blocks = (num_values + PACK_BLOCK - 1) / PACK_BLOCK;
+    int *values = malloc(num_blocks * PACK_BLOCK * sizeof(int));
+    int32_t b;
+
+    if (values == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate unpacked values");
+        exit(1);
+    }
+
+    for (b = 0; b < num_blocks; b++) {
+        unpack_block(mm->value_pool + node->values, num_values, b,
+            values + b * PACK_BLOCK);
+    }
+
+    node->num_values = 0;
+    node->num_spaces = 0;
+    node->values = NULL_OFFSET;
+    node->value_set = NULL_OFFSET;
+    append_values(mm, node, values, num_values);
+    free(values);
+}
+
+
+/* Passes each of a node's values to the function, decoding packed values a
+ * block at a time.
+ */
+void emit_values(multimap *mm, multimap_node *node,
+    void (*f)(int key, int value)) {
+    int *values = mm->value_pool + node->values;
+    int block[PACK_BLOCK];
+    int32_t b, i, count;
+
+    if (node->value_set != PACKED_VALUES) {
+        for (i = 0; i < node->num_values; i++)
+            f(node->key, values[i]);
+        return;
+    }
+
+    for (b = 0; b * PACK_BLOCK < node->num_values; b++) {
+        count = unpack_block(values, node->num_values, b, block);
+        for (i = 0; i < count; i++)
+            f(node->key, block[i]);
+    }
+}
+
+
+/**
+ * Sorts the pairs by key with an LSD radix sort, one byte per pass.  The
+ * sort is stable, so the values of each key stay in their original order.
+ * Passes where every key has the same digit are skipped.
+ * @param keys the keys of the pairs, sorted in place
+ * @param vals the values of the pairs, moved along with their keys
+ * @param n    the number of pairs
+ */
+void radix_sort_pairs(int *keys, int *vals, size_t n) {
+    int *src_keys = keys, *src_vals = vals;
+    int *dst_keys, *dst_vals, *tmp;
+    size_t counts[256];
+    size_t i, offset, count;
+    int shift;
+
+    if (n < 2)
+        return;
+
+    dst_keys = malloc(n * sizeof(int));
+    dst_vals = malloc(n * sizeof(int));
+    if (dst_keys == NULL || dst_vals == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate radix sort buffers");
+        exit(1);
+    }
+
+    for (shift = 0; shift < 32; shift += 8) {
+        /* Flipping the sign bit makes negative keys sort first. */
+#define KEY_DIGIT(k) (((((uint32_t) (k)) ^ 0x80000000u) >> shift) & 0xFF)
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < n; i++)
+            counts[KEY_DIGIT(src_keys[i])]++;
+
+        if (counts[KEY_DIGIT(src_keys[0])] == n)
+            continue;
+
+        for (i = 0, offset = 0; i < 256; i++) {
+            count = counts[i];
+            counts[i] = offset;
+            offset += count;
+        }
+
+        for (i = 0; i < n; i++) {
+            size_t dst = counts[KEY_DIGIT(src_keys[i])]++;
+            dst_keys[dst] = src_keys[i];
+            dst_vals[dst] = src_vals[i];
+        }
+#undef KEY_DIGIT
+
+        tmp = src_keys; src_keys = dst_keys; dst_keys = tmp;
+        tmp = src_vals; src_vals = dst_vals; dst_vals = tmp;
+    }
+
+    /* After an odd number of passes the sorted pairs are in the buffers. */
+    if (src_keys != keys) {
+        memcpy(keys, src_keys, n * sizeof(int));
+        memcpy(vals, src_vals, n * sizeof(int));
+        dst_keys = src_keys;
+        dst_vals = src_vals;
+    }
+
+    free(dst_keys);
+    free(dst_vals);
+}
+
+
+/**
+ * Adds pairs that are sorted by key to the multimap.  An empty multimap is
+ * built directly as a balanced tree; otherwise each run of pairs with the
+ * same key costs a single lookup and a single append.
+ */
+void add_sorted_pairs(multimap *mm, const int *keys, const int *vals,
+    size_t n) {
+    size_t start, end;
+
+    if (mm->num_nodes == 0) {
+        build_sorted_tree(mm, keys, vals, n);
+        return;
+    }
+
+    for (start = 0; start < n; start = end) {
+        multimap_node *node = find_mm_node(mm, keys[start], /* create */ 1);
+
+        for (end = start + 1; end < n && keys[end] == keys[start]; end++)
+            ;
+        append_values(mm, node, vals + start, end - start);
+    }
+}
+
+
+/**
+ * Builds an empty multimap from pairs that are sorted by key.  The pool is
+ * allocated once with exactly one node per distinct key, in key order, and
+ * the nodes are then linked into a perfectly balanced tree.
+ */
+void build_sorted_tree(multimap *mm, const int *keys, const int *vals,
+    size_t n) {
+    size_t start, end;
+    int64_t num_keys = 0;
+
+    assert(mm->num_nodes == 0);
+
+    if (n == 0)
+        return;
+
+    for (start = 0; start < n; start++) {
+        if (start == 0 || keys[start] != keys[start - 1])
+            num_keys++;
+    }
+
+    /* Size the pool exactly, so that add_node() never needs to grow it. */
+    mm->root = (multimap_node *) realloc(mm->root,
+        num_keys * sizeof(multimap_node));
+    if (mm->root == NULL) {
+        /* Error handling for out of memory scenario. */
+        printf("size requested %lu\n", num_keys * sizeof(multimap_node));
+        printf("%s\n", "failed to realloc array");
+        exit(1);
+    }
+    mm->size = num_keys;
+
+    for (start = 0; start < n; start = end) {
+        int32_t index = add_node(mm, keys[start]);
+
+        for (end = start + 1; end < n && keys[end] == keys[start]; end++)
+            ;
+        append_values(mm, mm->root + index, vals + start, end - start);
+    }
+
+    mm->root_index = link_balanced(mm, 0, num_keys - 1);
+}
+
+
+/**
+ * Links the nodes in the index range [lo, hi] of the pool, which are in key
+ * order, into a perfectly balanced subtree by making the middle node the
+ * root of the subtree.  Since the subtree heights differ by at most 1, the
+ * result is also a valid AVL tree.
+ * @return index of the root of the subtree, or NULL_INDEX if it is empty
+ */
+int32_t link_balanced(multimap *mm, int32_t lo, int32_t hi) {
+    int32_t mid;
+
+    if (lo > hi)
+        return NULL_INDEX;
+
+    mid = lo + (hi - lo) / 2;
+    mm->root[mid].left_child = link_balanced(mm, lo, mid - 1);
+    mm->root[mid].right_child = link_balanced(mm, mid + 1, hi);
+    update_height(mm, mid);
+    return mid;
+}
+
+
+/* Initialize a multimap data structure. */
+multimap * init_multimap() {
+    multimap *mm = malloc(sizeof(multimap));
+    int c;
+
+    mm->root = NULL;
+    mm->size = 0;
+    mm->num_nodes = 0;
+    mm->root_index = NULL_INDEX;
+    mm->value_pool = NULL;
+    mm->pool_size = 0;
+    mm->pool_used = 0;
+    for (c = 0; c < NUM_BLOCK_CLASSES; c++)
+        mm->free_blocks[c] = NULL_OFFSET;
+    mm->image = NULL;
+    mm->image_size = 0;
+    mm->frozen_keys = NULL;
+    mm->frozen_starts = NULL;
+    mm->frozen_values = NULL;
+    mm->filter = NULL;
+    mm->filter_blocks = 0;
+    mm->filter_capacity = 0;
+    mm->filter_pairs = 0;
+    mm->filter_rate = 0.0;
+    return mm;
+}
+
+
+/* Release all dynamically allocated memory associated with the multimap
+ * data structure.
+ */
+void clear_multimap(multimap *mm) {
+    int c;
+
+    assert(mm != NULL);
+
+    /* Since the nodes and values are each in one pool, or a mapped multimap
+     * is all in its image, there is only one or two things to free.
+     */
+    if (mm->image != NULL) {
+        munmap(mm->image, mm->image_size);
+        mm->image = NULL;
+        mm->image_size = 0;
+    }
+    else {
+        free(mm->root);
+        free(mm->value_pool);
+    }
+
+    free(mm->frozen_keys);
+    free(mm->frozen_starts);
+    free(mm->frozen_values);
+    mm->frozen_keys = NULL;
+    mm->frozen_starts = NULL;
+    mm->frozen_values = NULL;
+
+    free(mm->filter);
+    mm->filter = NULL;
+    mm->filter_blocks = 0;
+    mm->filter_capacity = 0;
+    mm->filter_pairs = 0;
+
+    mm->root = NULL;
+    mm->size = 0;
+    mm->num_nodes = 0;
+    mm->root_index = NULL_INDEX;
+    mm->value_pool = NULL;
+    mm->pool_size = 0;
+    mm->pool_used = 0;
+    for (c = 0; c < NUM_BLOCK_CLASSES; c++)
+        mm->free_blocks[c] = NULL_OFFSET;
+}
+
+
+/* Adds the specified (key, value) pair to the multimap. */
+/**
+ * In the updated mm_add_value function, we take a different approach to
+ * storing the values associated with each key.  Whereas before each node
+ * pointed to a linked list of values, now each node refers to a dense array
+ * of plain values in the value pool that is doubled whenever it fills up.
+ * Once a key has more than VALUE_SET_THRESHOLD values, the values are also
+ * indexed by a hash set, which is rebuilt at twice the size whenever the
+ * array is doubled.
+ * @param mm    pointer to the multimap
+ * @param key   key where the following value will be added
+ * @param value value to be added at key
+ */
+void mm_add_value(multimap *mm, int key, int value) {
+    multimap_node *node;
+
+    assert(mm != NULL);
+    check_writable(mm);
+
+    /* Look up the node with the specified key.  Create if not found. */
+    node = find_mm_node(mm, key, /* create */ 1);
+
+    assert(node != NULL);
+    assert(node->key == key);
+
+    append_values(mm, node, &value, 1);
+    filter_add_pairs(mm, &key, &value, 1);
+}
+
+
+/* Returns nonzero if the multimap contains the specified key-value, zero
+ * otherwise.
+ */
+int mm_contains_key(multimap *mm, int key) {
+    if (mm->frozen_keys != NULL) {
+        int64_t k = frozen_lower_bound(mm, key);
+        return k != 0 && mm->frozen_keys[k] == key;
+    }
+
+    return find_mm_node(mm, key, /* create */ 0) != NULL;
+}
+
+
+/* Returns nonzero if the multimap contains the specified (key, value) pair,
+ * zero otherwise.
+ */
+int mm_contains_pair(multimap *mm, int key, int value) {
+    multimap_node *node;
+
+    if (mm->filter != NULL && !filter_contains(mm, key, value))
+        return 0;
+
+    if (mm->frozen_keys != NULL)
+        return frozen_contains_pair(mm, key, value);
+
+    node = find_mm_node(mm, key, /* create */ 0);
+    if (node == NULL)
+        return 0;
+
+    return node_contains_value(mm, node, value);
+}
+
+
+/* Returns nonzero if the node's key has the specified value. */
+int node_contains_value(multimap *mm, multimap_node *node, int value) {
+    int *values = mm->value_pool + node->values;
+    int32_t i;
+
+    if (node->value_set == PACKED_VALUES)
+        return packed_contains(values, node->num_values, value);
+
+    if (node->value_set != NULL_OFFSET && value != EMPTY_SLOT) {
+        return value_set_contains(mm->value_pool + node->value_set,
+            2 * node->num_spaces, value);
+    }
+
+    for (i = 0; i < node->num_values; i++) {
+        if (values[i] == value)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* Prefetches the part of a node's values that node_contains_value() will
+ * look at first.
+ */
+void prefetch_values(multimap *mm, multimap_node *node, int value) {
+    if (node->value_set >= 0 && value != EMPTY_SLOT) {
+        __builtin_prefetch(mm->value_pool + node->value_set +
+            value_hash(value, 2 * node->num_spaces));
+    }
+    else {
+        __builtin_prefetch(mm->value_pool + node->values);
+    }
+}
+
+
+/* This helper function is used by mm_traverse() to traverse every pair within
+ * the multimap.
+ */
+void mm_traverse_helper(multimap *mm, multimap_node *node,
+    void (*f)(int key, int value)) {
+    if (node->left_child != NULL_INDEX) {
+        mm_traverse_helper(mm, mm->root + node->left_child, f);
+    }
+
+    emit_values(mm, node, f);
+
+    if (node->right_child != NULL_INDEX) {
+        mm_traverse_helper(mm, mm->root + node->right_child, f);
+    }
+}
+
+
+/* Performs an in-order traversal of the multimap, passing each (key, value)
  * pair to the specified function.
  */
 void mm_traverse(multimap *mm, void (*f)(int key, int value)) {
-    mm_traverse_helper(mm->root, f, mm->root);
+    if (mm->frozen_keys != NULL)
+        frozen_traverse_helper(mm, 1, f);
+    else if (mm->root_index != NULL_INDEX)
+        mm_traverse_helper(mm, mm->root + mm->root_index, f);
+}
+
+
+/**
+ * Adds many pairs at once.  The pairs are copied and radix sorted by key so
+ * that each distinct key is looked up only once, and an empty multimap is
+ * built as a balanced tree directly from the sorted pairs.
+ * @param mm   pointer to the multimap
+ * @param keys the keys of the pairs to add
+ * @param vals the values of the pairs to add
+ * @param n    the number of pairs
+ */
+void mm_add_values(multimap *mm, const int *keys, const int *vals, size_t n) {
+    int *sorted_keys, *sorted_vals;
+
+    assert(mm != NULL);
+    check_writable(mm);
+
+    if (n == 0)
+        return;
+
+    sorted_keys = malloc(n * sizeof(int));
+    sorted_vals = malloc(n * sizeof(int));
+    if (sorted_keys == NULL || sorted_vals == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate pair buffers");
+        exit(1);
+    }
+    memcpy(sorted_keys, keys, n * sizeof(int));
+    memcpy(sorted_vals, vals, n * sizeof(int));
+
+    radix_sort_pairs(sorted_keys, sorted_vals, n);
+    add_sorted_pairs(mm, sorted_keys, sorted_vals, n);
+    filter_add_pairs(mm, sorted_keys, sorted_vals, n);
+
+    free(sorted_keys);
+    free(sorted_vals);
+}
+
+
+/**
+ * Adds many pairs that are already sorted by key.  The input is checked in
+ * a single pass, and falls back to mm_add_values() if it isn't sorted.
+ * @param mm   pointer to the multimap
+ * @param keys the keys of the pairs to add, in nondecreasing order
+ * @param vals the values of the pairs to add
+ * @param n    the number of pairs
+ */
+void mm_build_from_sorted(multimap *mm, const int *keys, const int *vals,
+    size_t n) {
+    size_t i;
+
+    assert(mm != NULL);
+    check_writable(mm);
+
+    for (i = 1; i < n; i++) {
+        if (keys[i] < keys[i - 1]) {
+            mm_add_values(mm, keys, vals, n);
+            return;
+        }
+    }
+
+    add_sorted_pairs(mm, keys, vals, n);
+    filter_add_pairs(mm, keys, vals, n);
+}
+
+
+/* Finds the smallest key that is at least the specified key. */
+int mm_lower_bound(multimap *mm, int key, int *found) {
+    int32_t index = mm->root_index;
+    int32_t best = NULL_INDEX;
+
+    if (mm->frozen_keys != NULL) {
+        int64_t k = frozen_lower_bound(mm, key);
+
+        if (k == 0)
+            return 0;
+        *found = mm->frozen_keys[k];
+        return 1;
+    }
+
+    /* Every node we go left from is a candidate, and each one is smaller
+     * than the previous candidate.
+     */
+    while (index != NULL_INDEX) {
+        multimap_node *node = mm->root + index;
+
+        if (node->key >= key) {
+            best = index;
+            index = node->left_child;
+        }
+        else {
+            index = node->right_child;
+        }
+    }
+
+    if (best == NULL_INDEX)
+        return 0;
+
+    *found = mm->root[best].key;
+    return 1;
+}
+
+
+/* This helper function is used by mm_range() to traverse only the subtrees
+ * that can hold keys in [lo, hi).
+ */
+void mm_range_helper(multimap *mm, int32_t index, int lo, int hi,
+    void (*f)(int key, int value)) {
+    multimap_node *node;
+
+    while (index != NULL_INDEX) {
+        node = mm->root + index;
+
+        if (node->key > lo)
+            mm_range_helper(mm, node->left_child, lo, hi, f);
+
+        if (node->key >= hi)
+            return;
+
+        if (node->key >= lo)
+            emit_values(mm, node, f);
+
+        /* Loop on the right subtree instead of recursing. */
+        index = node->right_child;
+    }
 }
 
+
+/* Passes each pair with lo <= key < hi to the function, in key order. */
+void mm_range(multimap *mm, int lo, int hi, void (*f)(int key, int value)) {
+    int64_t k;
+
+    if (lo >= hi)
+        return;
+
+    if (mm->frozen_keys != NULL) {
+        for (k = frozen_lower_bound(mm, lo);
+             k != 0 && mm->frozen_keys[k] < hi; k = frozen_next(mm, k)) {
+            frozen_emit_values(mm, k, f);
+        }
+        return;
+    }
+
+    mm_range_helper(mm, mm->root_index, lo, hi, f);
+}
+
+
+/* Pushes the node at the index and its chain of left children onto the
+ * cursor's stack, so that the smallest of them ends up on top.
+ */
+void push_left_path(mm_cursor *cursor, int32_t index) {
+    while (index != NULL_INDEX) {
+        assert(cursor->depth < MAX_CURSOR_DEPTH);
+        cursor->stack[cursor->depth++] = index;
+        index = cursor->mm->root[index].left_child;
+    }
+}
+
+
+/* Allocates a cursor positioned at the first pair of the multimap. */
+mm_cursor * mm_open_cursor(multimap *mm) {
+    mm_cursor *cursor = malloc(sizeof(mm_cursor));
+
+    if (cursor == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate cursor");
+        exit(1);
+    }
+
+    cursor->mm = mm;
+    cursor->depth = 0;
+    cursor->value_pos = 0;
+    cursor->block_node = NULL_INDEX;
+    cursor->frozen_pos = 0;
+    if (mm->frozen_keys != NULL)
+        cursor->frozen_pos = frozen_first(mm, 1);
+    else
+        push_left_path(cursor, mm->root_index);
+    return cursor;
+}
+
+
+/**
+ * Positions the cursor at the first pair whose key is at least the specified
+ * key.  This descends the tree once, like mm_lower_bound(), keeping just the
+ * nodes we go left from, since those are the ones still to be visited.
+ * @param cursor the cursor to position
+ * @param key    the smallest key the cursor should return
+ */
+void mm_cursor_seek(mm_cursor *cursor, int key) {
+    multimap *mm = cursor->mm;
+    int32_t index = mm->root_index;
+
+    cursor->depth = 0;
+    cursor->value_pos = 0;
+    cursor->block_node = NULL_INDEX;
+
+    if (mm->frozen_keys != NULL) {
+        cursor->frozen_pos = frozen_lower_bound(mm, key);
+        return;
+    }
+
+    while (index != NULL_INDEX) {
+        multimap_node *node = mm->root + index;
+
+        if (node->key >= key) {
+            assert(cursor->depth < MAX_CURSOR_DEPTH);
+            cursor->stack[cursor->depth++] = index;
+            index = node->left_child;
+        }
+        else {
+            index = node->right_child;
+        }
+    }
+}
+
+
+/* Returns the pair at the cursor and advances it, or returns zero at the
+ * end of the multimap.
+ */
+int mm_cursor_next(mm_cursor *cursor, int *key, int *value) {
+    multimap *mm = cursor->mm;
+
+    if (mm->frozen_keys != NULL) {
+        while (cursor->frozen_pos != 0) {
+            int64_t k = cursor->frozen_pos;
+            int64_t i = mm->frozen_starts[k] + cursor->value_pos;
+
+            if (i < mm->frozen_starts[k + 1]) {
+                *key = mm->frozen_keys[k];
+                *value = mm->frozen_values[i];
+                cursor->value_pos++;
+                return 1;
+            }
+
+            cursor->frozen_pos = frozen_next(mm, k);
+            cursor->value_pos = 0;
+        }
+        return 0;
+    }
+
+    while (cursor->depth > 0) {
+        int32_t index = cursor->stack[cursor->depth - 1];
+        multimap_node *node = cursor->mm->root + index;
+
+        if (cursor->value_pos < node->num_values) {
+            int *values = cursor->mm->value_pool + node->values;
+
+            *key = node->key;
+            if (node->value_set != PACKED_VALUES) {
+                *value = values[cursor->value_pos++];
+                return 1;
+            }
+
+            /* Packed values are decoded a block at a time. */
+            if (cursor->block_node != index ||
+                cursor->block_num != cursor->value_pos / PACK_BLOCK) {
+                cursor->block_node = index;
+                cursor->block_num = cursor->value_pos / PACK_BLOCK;
+                unpack_block(values, node->num_values, cursor->block_num,
+                    cursor->block);
+            }
+            *value = cursor->block[cursor->value_pos++ % PACK_BLOCK];
+            return 1;
+        }
+
+        /* This node is done, so move on to its in-order successor. */
+        cursor->depth--;
+        cursor->value_pos = 0;
+        push_left_path(cursor, node->right_child);
+    }
+
+    return 0;
+}
+
+
+/* Releases a cursor. */
+void mm_close_cursor(mm_cursor *cursor) {
+    free(cursor);
+}
+
+
+/**
+ * Probes the multimap for a batch of pairs.  Rather than finishing each
+ * descent before starting the next, this keeps PROBE_GROUP descents in
+ * flight and advances them round-robin, one node per step, prefetching the
+ * node that each descent will visit next.  By the time a descent comes
+ * around again its node is usually in the cache, so the probes' cache misses
+ * overlap instead of happening one after another.  A descent that finds its
+ * key takes one more step, to prefetch the key's values, and then its slot
+ * is refilled with the next probe of the batch.  Probes that the pair filter
+ * rules out never take a slot.  Small trees are just probed one pair at a
+ * time.
+ * @param mm   pointer to the multimap
+ * @param keys the keys of the pairs to probe for
+ * @param vals the values of the pairs to probe for
+ * @param n    the number of pairs
+ * @param out  set to the answer for each pair
+ */
+void mm_contains_pairs(multimap *mm, const int *keys, const int *vals,
+    size_t n, int *out) {
+    /* The probe each slot is working on, the node it will visit next, and
+     * whether that node already has the probe's key.
+     */
+    size_t probe[PROBE_GROUP];
+    int32_t index[PROBE_GROUP];
+    int found[PROBE_GROUP];
+    size_t next_probe = 0;
+    int num_active, slot;
+
+    assert(mm != NULL);
+
+    /* Frozen lookups already prefetch ahead, so they are also done one pair
+     * at a time.
+     */
+    if (mm->frozen_keys != NULL || mm->num_nodes < MIN_INTERLEAVED_NODES) {
+        for (next_probe = 0; next_probe < n; next_probe++)
+            out[next_probe] = mm_contains_pair(mm, keys[next_probe],
+                                               vals[next_probe]);
+        return;
+    }
+
+    next_probe = skip_filtered_probes(mm, keys, vals, n, 0, out);
+    for (num_active = 0; num_active < PROBE_GROUP && next_probe < n;
+         num_active++) {
+        probe[num_active] = next_probe;
+        index[num_active] = mm->root_index;
+        found[num_active] = 0;
+        next_probe = skip_filtered_probes(mm, keys, vals, n, next_probe + 1,
+                                          out);
+    }
+
+    while (num_active > 0) {
+        for (slot = 0; slot < num_active; ) {
+            size_t i = probe[slot];
+            multimap_node *node;
+
+            if (index[slot] != NULL_INDEX) {
+                node = mm->root + index[slot];
+
+                if (!found[slot]) {
+                    if (node->key == keys[i]) {
+                        found[slot] = 1;
+                        prefetch_values(mm, node, vals[i]);
+                    }
+                    else {
+                        index[slot] = (node->key > keys[i]) ?
+                            node->left_child : node->right_child;
+                        if (index[slot] != NULL_INDEX)
+                            __builtin_prefetch(mm->root + index[slot]);
+                    }
+                    slot++;
+                    continue;
+                }
+
+                out[i] = node_contains_value(mm, node, vals[i]);
+            }
+            else {
+                out[i] = 0;
+            }
+
+            /* This probe is done, so start the next one in its slot, or
+             * retire the slot if the batch is used up.
+             */
+            if (next_probe < n) {
+                probe[slot] = next_probe;
+                index[slot] = mm->root_index;
+                found[slot] = 0;
+                next_probe = skip_filtered_probes(mm, keys, vals, n,
+                                                  next_probe + 1, out);
+                slot++;
+            }
+            else {
+                num_active--;
+                probe[slot] = probe[num_active];
+                index[slot] = index[num_active];
+                found[slot] = found[num_active];
+            }
+        }
+    }
+}
+
+
+/* Rounds an offset in an image up to the next IMAGE_ALIGN boundary. */
+int64_t image_align(int64_t offset) {
+    return (offset + IMAGE_ALIGN - 1) & ~((int64_t) IMAGE_ALIGN - 1);
+}
+
+
+/* Writes zero bytes to the file to move it from one offset to another.
+ * Returns nonzero on success.
+ */
+int write_padding(FILE *file, int64_t from, int64_t to) {
+    static const char zeros[IMAGE_ALIGN];
+
+    assert(to - from <= IMAGE_ALIGN);
+    return fwrite(zeros, 1, to - from, file) == (size_t) (to - from);
+}
+
+
+/**
+ * Writes an image of the multimap to a file.  Nodes are written in pool
+ * order, so that child indexes stay the same, but the values are packed:
+ * each node's values array is written with just its values (or its packed
+ * values, if it has them), followed by its hash set if it has one, and the
+ * node's offsets are renumbered to match.
+ * Free blocks of the value pool are left out.
+ * @param  mm   pointer to the multimap
+ * @param  path the file to write the image to
+ * @return      0 on success, or -1 if the file couldn't be written
+ */
+int mm_save(multimap *mm, const char *path) {
+    mm_image_header header;
+    multimap_node node;
+    FILE *file;
+    int64_t i, offset;
+    int ok = 1;
+
+    assert(mm != NULL);
+
+    if (mm->frozen_keys != NULL)
+        return -1;
+
+    file = fopen(path, "wb");
+    if (file == NULL)
+        return -1;
+
+    /* Size the packed value pool first, so the header can be written. */
+    offset = 0;
+    for (i = 0; i < mm->num_nodes; i++) {
+        if (mm->root[i].value_set == PACKED_VALUES)
+            offset += mm->root[i].num_spaces;
+        else
+            offset += mm->root[i].num_values;
+        if (mm->root[i].value_set >= 0)
+            offset += 2 * mm->root[i].num_spaces;
+    }
+
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, IMAGE_MAGIC);
+    header.node_size = sizeof(multimap_node);
+    header.root_index = mm->root_index;
+    header.num_nodes = mm->num_nodes;
+    header.num_pool_values = offset;
+    header.nodes_start = image_align(sizeof(header));
+    header.values_start = image_align(header.nodes_start +
+                                      mm->num_nodes * sizeof(multimap_node));
+
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+         write_padding(file, sizeof(header), header.nodes_start);
+
+    offset = 0;
+    for (i = 0; ok && i < mm->num_nodes; i++) {
+        node = mm->root[i];
+        node.values = offset;
+        if (node.value_set == PACKED_VALUES)
+            offset += node.num_spaces;
+        else
+            offset += node.num_values;
+        if (node.value_set >= 0) {
+            node.value_set = offset;
+            offset += 2 * node.num_spaces;
+        }
+        ok = fwrite(&node, sizeof(node), 1, file) == 1;
+    }
+
+    ok = ok && write_padding(file, header.nodes_start +
+                             mm->num_nodes * sizeof(multimap_node),
+                             header.values_start);
+
+    for (i = 0; ok && i < mm->num_nodes; i++) {
+        multimap_node *n = mm->root + i;
+        int32_t count = (n->value_set == PACKED_VALUES) ?
+                        n->num_spaces : n->num_values;
+
+        ok = fwrite(mm->value_pool + n->values, sizeof(int), count,
+                    file) == (size_t) count;
+        if (ok && n->value_set >= 0) {
+            ok = fwrite(mm->value_pool + n->value_set, sizeof(int),
+                        2 * n->num_spaces, file) == (size_t) (2 * n->num_spaces);
+        }
+    }
+
+    if (fclose(file) != 0 || !ok) {
+        remove(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Returns nonzero if the header describes a valid image of the specified
+ * size, written by a compatible build.  Only the header is checked, since
+ * checking every node would mean reading the whole image.
+ */
+int check_image(const mm_image_header *header, size_t image_size) {
+    if (image_size < sizeof(mm_image_header) ||
+        memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+        header->node_size != sizeof(multimap_node) ||
+        header->num_nodes < 0 || header->num_pool_values < 0) {
+        return 0;
+    }
+
+    if (header->nodes_start != image_align(sizeof(mm_image_header)) ||
+        header->values_start != image_align(header->nodes_start +
+            header->num_nodes * sizeof(multimap_node)) ||
+        header->values_start + header->num_pool_values * sizeof(int) >
+            image_size) {
+        return 0;
+    }
+
+    if (header->root_index < NULL_INDEX ||
+        header->root_index >= header->num_nodes ||
+        (header->root_index == NULL_INDEX) != (header->num_nodes == 0)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/**
+ * Opens an image written by mm_save() by mapping the whole file read-only.
+ * Since nodes and values only refer to each other by index and offset, the
+ * multimap just points its node pool and value pool into the mapping, and
+ * nothing is read until a lookup touches it.
+ * @param  path the file holding the image
+ * @return      the mapped multimap, or NULL if the image can't be opened
+ */
+multimap * mm_open_mapped(const char *path) {
+    struct stat st;
+    void *image;
+    const mm_image_header *header;
+    multimap *mm;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(mm_image_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return NULL;
+
+    header = (const mm_image_header *) image;
+    if (!check_image(header, st.st_size)) {
+        munmap(image, st.st_size);
+        return NULL;
+    }
+
+    mm = init_multimap();
+    mm->root = (multimap_node *) ((char *) image + header->nodes_start);
+    mm->size = header->num_nodes;
+    mm->num_nodes = header->num_nodes;
+    mm->root_index = header->root_index;
+    mm->value_pool = (int *) ((char *) image + header->values_start);
+    mm->pool_size = header->num_pool_values;
+    mm->pool_used = header->num_pool_values;
+    mm->image = image;
+    mm->image_size = st.st_size;
+    return mm;
+}
+
+
+/**
+ * Compacts the multimap's values.  The values of each key with more than
+ * VALUE_SET_THRESHOLD values are sorted and packed with pack_values(), in
+ * place of the values array and hash set, and every other key's values
+ * array is copied as it is.  Everything is copied into a new value pool of
+ * exactly the needed size, which also drops the free blocks of the old one.
+ * Frozen and mapped multimaps are left as they are.
+ * @param mm pointer to the multimap
+ */
+void mm_compact(multimap *mm) {
+    int *new_pool, *sorted = NULL;
+    int64_t bound = 0, used = 0, i;
+    int32_t max_values = 0;
+    int c;
+
+    assert(mm != NULL);
+
+    /* A frozen multimap's values already take exactly the space they need,
+     * and so do a mapped image's, since mm_save() leaves out free blocks
+     * and unused spaces.  A mapped image can't be changed anyway.
+     */
+    if (mm->frozen_keys != NULL || mm->image != NULL)
+        return;
+
+    for (i = 0; i < mm->num_nodes; i++) {
+        multimap_node *node = mm->root + i;
+
+        if (node->value_set == PACKED_VALUES) {
+            bound += node->num_spaces;
+        }
+        else if (node->num_values > VALUE_SET_THRESHOLD) {
+            int64_t num_blocks = (node->num_values + PACK_BLOCK - 1) /
+                                 PACK_BLOCK;
+            bound += num_blocks * (2 + PACK_BLOCK) + 1;
+            if (node->num_values > max_values)
+                max_values = node->num_values;
+        }
+        else {
+            bound += node->num_spaces;
+        }
+    }
+
+    new_pool = malloc((bound > 0 ? bound : 1) * sizeof(int));
+    if (max_values > 0)
+        sorted = malloc(max_values * sizeof(int));
+    if (new_pool == NULL || (max_values > 0 && sorted == NULL)) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate compacted value pool");
+        exit(1);
+    }
+
+    for (i = 0; i < mm->num_nodes; i++) {
+        multimap_node *node = mm->root + i;
+        int *values = mm->value_pool + node->values;
+
+        if (node->value_set != PACKED_VALUES &&
+            node->num_values > VALUE_SET_THRESHOLD) {
+            memcpy(sorted, values, node->num_values * sizeof(int));
+            qsort(sorted, node->num_values, sizeof(int), compare_values);
+            node->num_spaces = pack_values(sorted, node->num_values,
+                                           new_pool + used);
+            node->value_set = PACKED_VALUES;
+        }
+        else {
+            /* Small keys keep their power-of-2 block, so that values can
+             * still be added to them.
+             */
+            memcpy(new_pool + used, values, node->num_spaces * sizeof(int));
+        }
+
+        node->values = used;
+        used += node->num_spaces;
+    }
+
+    free(sorted);
+    free(mm->value_pool);
+
+    mm->value_pool = realloc(new_pool, (used > 0 ? used : 1) * sizeof(int));
+    if (mm->value_pool == NULL)
+        mm->value_pool = new_pool;
+    mm->pool_size = used;
+    mm->pool_used = used;
+    for (c = 0; c < NUM_BLOCK_CLASSES; c++)
+        mm->free_blocks[c] = NULL_OFFSET;
+}
+
+
+/* Appends the indexes of the nodes of the subtree to order, in key order. */
+void collect_in_order(multimap *mm, int32_t index, int32_t *order,
+    int64_t *count) {
+    while (index != NULL_INDEX) {
+        collect_in_order(mm, mm->root[index].left_child, order, count);
+        order[(*count)++] = index;
+        index = mm->root[index].right_child;
+    }
+}
+
+
+/**
+ * Assigns nodes to the positions of the subtree of the Eytzinger layout
+ * rooted at position k.  An in-order walk of the positions visits them in
+ * key order, so it just hands out the nodes of order one after another.
+ * @param  pos_node set to the node for each position
+ * @param  order    the nodes in key order
+ * @param  n        the number of nodes
+ * @param  i        the next node of order to hand out
+ * @param  k        the position at the root of the subtree
+ * @return          the next node of order after the subtree's nodes
+ */
+int64_t assign_eytzinger(int64_t *pos_node, const int32_t *order, int64_t n,
+    int64_t i, int64_t k) {
+    while (k <= n) {
+        i = assign_eytzinger(pos_node, order, n, i, 2 * k);
+        pos_node[k] = order[i++];
+        k = 2 * k + 1;
+    }
+    return i;
+}
+
+
+/**
+ * Returns the position of the smallest frozen key that is at least the
+ * specified key, or 0 if every key is smaller.  The descent always takes the
+ * same number of steps for a given multimap, and each step's comparison only
+ * picks the next position instead of branching, so the loop never
+ * mispredicts.  Every step also prefetches the cache line holding the keys
+ * FROZEN_PREFETCH_LEVELS levels further down.
+ *
+ * The path taken is recorded in the bits of the final position:  each 1 bit
+ * is a step right, past a smaller key.  The answer is the last key we stepped
+ * left from, which is found by dropping the trailing right steps and that
+ * last left step.
+ * @param  mm  pointer to the frozen multimap
+ * @param  key the key to search for
+ * @return     the position of the lower bound of the key, or 0
+ */
+int64_t frozen_lower_bound(multimap *mm, int key) {
+    const int *keys = mm->frozen_keys;
+    int64_t n = mm->num_nodes, k = 1;
+
+    while (k <= n) {
+        __builtin_prefetch(keys + (k << FROZEN_PREFETCH_LEVELS));
+        k = 2 * k + (keys[k] < key);
+    }
+
+    return k >> __builtin_ffsll(~k);
+}
+
+
+/* Returns the position of the smallest key in the subtree rooted at position
+ * k, or 0 if the subtree is empty.
+ */
+int64_t frozen_first(multimap *mm, int64_t k) {
+    if (k > mm->num_nodes)
+        return 0;
+
+    while (2 * k <= mm->num_nodes)
+        k = 2 * k;
+    return k;
+}
+
+
+/* Returns the position of the next larger key after the key at position k,
+ * or 0 if it is the largest key.
+ */
+int64_t frozen_next(multimap *mm, int64_t k) {
+    if (2 * k + 1 <= mm->num_nodes)
+        return frozen_first(mm, 2 * k + 1);
+
+    /* Go up past every ancestor whose right subtree we are in.  If we were in
+     * the root's right subtree, this ends at 0.
+     */
+    while (k & 1)
+        k >>= 1;
+    return k >> 1;
+}
+
+
+/* Returns nonzero if the frozen multimap has the (key, value) pair.  The
+ * key's sorted values are searched with a branch-free binary search.
+ */
+int frozen_contains_pair(multimap *mm, int key, int value) {
+    int64_t k = frozen_lower_bound(mm, key), len, half;
+    const int *base;
+
+    if (k == 0 || mm->frozen_keys[k] != key)
+        return 0;
+
+    base = mm->frozen_values + mm->frozen_starts[k];
+    len = mm->frozen_starts[k + 1] - mm->frozen_starts[k];
+
+    /* Every value before base is smaller than the value, and the first value
+     * that isn't is somewhere in base[0] .. base[len].
+     */
+    while (len > 1) {
+        half = len / 2;
+        base = (base[half - 1] < value) ? base + half : base;
+        len -= half;
+    }
+
+    return len == 1 && *base == value;
+}
+
+
+/* Passes each value of the frozen key at position k to the function. */
+void frozen_emit_values(multimap *mm, int64_t k,
+    void (*f)(int key, int value)) {
+    int64_t i;
+
+    for (i = mm->frozen_starts[k]; i < mm->frozen_starts[k + 1]; i++)
+        f(mm->frozen_keys[k], mm->frozen_values[i]);
+}
+
+
+/* This helper function is used by mm_traverse() to traverse the subtree of
+ * a frozen multimap rooted at position k.
+ */
+void frozen_traverse_helper(multimap *mm, int64_t k,
+    void (*f)(int key, int value)) {
+    while (k <= mm->num_nodes) {
+        frozen_traverse_helper(mm, 2 * k, f);
+        frozen_emit_values(mm, k, f);
+        k = 2 * k + 1;
+    }
+}
+
+
+/**
+ * Freezes the multimap.  The nodes are listed in key order, assigned to
+ * their positions in the Eytzinger layout, and each node's values are copied
+ * to the frozen values in position order and sorted; packed values are
+ * unpacked, since they are already sorted.  The node pool and value pool
+ * (or the mapped image) are then released.
+ * @param mm pointer to the multimap
+ */
+void mm_freeze(multimap *mm) {
+    int64_t n, count = 0, total = 0, k;
+    int32_t *order;
+    int64_t *pos_node;
+    void *keys;
+
+    assert(mm != NULL);
+
+    if (mm->frozen_keys != NULL)
+        return;
+
+    n = mm->num_nodes;
+    order = malloc((n > 0 ? n : 1) * sizeof(int32_t));
+    pos_node = malloc((n + 1) * sizeof(int64_t));
+    mm->frozen_starts = malloc((n + 2) * sizeof(int64_t));
+    if (order == NULL || pos_node == NULL || mm->frozen_starts == NULL ||
+        posix_memalign(&keys, FROZEN_ALIGN, (n + 1) * sizeof(int)) != 0) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate frozen multimap");
+        exit(1);
+    }
+
+    collect_in_order(mm, mm->root_index, order, &count);
+    assert(count == n);
+    assign_eytzinger(pos_node, order, n, 0, 1);
+
+    for (k = 1; k <= n; k++)
+        total += mm->root[pos_node[k]].num_values;
+
+    mm->frozen_values = malloc((total > 0 ? total : 1) * sizeof(int));
+    if (mm->frozen_values == NULL) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate frozen values");
+        exit(1);
+    }
+
+    mm->frozen_keys = keys;
+    mm->frozen_keys[0] = 0;
+    mm->frozen_starts[0] = 0;
+
+    total = 0;
+    for (k = 1; k <= n; k++) {
+        multimap_node *node = mm->root + pos_node[k];
+        int *values = mm->value_pool + node->values;
+        int *out = mm->frozen_values + total;
+        int block[PACK_BLOCK];
+        int32_t b, c;
+
+        mm->frozen_keys[k] = node->key;
+        mm->frozen_starts[k] = total;
+
+        if (node->value_set == PACKED_VALUES) {
+            for (b = 0; b * PACK_BLOCK < node->num_values; b++) {
+                c = unpack_block(values, node->num_values, b, block);
+                memcpy(out + b * PACK_BLOCK, block, c * sizeof(int));
+            }
+        }
+        else {
+            memcpy(out, values, node->num_values * sizeof(int));
+            qsort(out, node->num_values, sizeof(int), compare_values);
+        }
+
+        total += node->num_values;
+    }
+    mm->frozen_starts[n + 1] = total;
+
+    free(order);
+    free(pos_node);
+
+    if (mm->image != NULL) {
+        munmap(mm->image, mm->image_size);
+        mm->image = NULL;
+        mm->image_size = 0;
+    }
+    else {
+        free(mm->root);
+        free(mm->value_pool);
+    }
+
+    mm->root = NULL;
+    mm->size = 0;
+    mm->root_index = NULL_INDEX;
+    mm->value_pool = NULL;
+    mm->pool_size = 0;
+    mm->pool_used = 0;
+}
+
+
+/* Hashes a (key, value) pair to 64 bits, with the finalizer of MurmurHash3. */
+uint64_t pair_hash(int key, int value) {
+    uint64_t h = ((uint64_t) (uint32_t) key << 32) | (uint32_t) value;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+
+/* Returns the filter block for a pair's hash, chosen by the high 32 bits of
+ * the hash.
+ */
+uint32_t * filter_block(multimap *mm, uint64_t hash) {
+    uint64_t block = ((hash >> 32) * (uint64_t) mm->filter_blocks) >> 32;
+
+    return mm->filter + block * FILTER_BLOCK_WORDS;
+}
+
+
+/* The odd multipliers that pick a pair's bit in each word of its block from
+ * the low 32 bits of its hash.
+ */
+static const uint32_t filter_salts[FILTER_BLOCK_WORDS] = {
+    0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+    0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+
+/* Sets a pair's bits in the filter.  The words are independent, so the
+ * compiler can compute all of the bits at once with SIMD instructions.
+ */
+void filter_insert(multimap *mm, int key, int value) {
+    uint64_t hash = pair_hash(key, value);
+    uint32_t *block = filter_block(mm, hash);
+    int i;
+
+    for (i = 0; i < FILTER_BLOCK_WORDS; i++)
+        block[i] |= 1u << (((uint32_t) hash * filter_salts[i]) >> 27);
+}
+
+
+/* Returns zero if the pair is certainly not in the multimap, or nonzero if
+ * it may be.  Every word is checked, without branching on each one.
+ */
+int filter_contains(multimap *mm, int key, int value) {
+    uint64_t hash = pair_hash(key, value);
+    const uint32_t *block = filter_block(mm, hash);
+    uint32_t missing = 0;
+    int i;
+
+    for (i = 0; i < FILTER_BLOCK_WORDS; i++) {
+        missing |= ~block[i] &
+                   (1u << (((uint32_t) hash * filter_salts[i]) >> 27));
+    }
+    return missing == 0;
+}
+
+
+/**
+ * Returns the number of filter bits per pair that keeps the false positive
+ * rate at or below the specified rate.  The number of pairs in a block is
+ * about Poisson distributed, and a probe of a block holding j pairs is a
+ * false positive when every one of its bits is set, which for each word has
+ * a probability of 1 - (31/32)^j.  The rate is the average of that over the
+ * number of pairs per block, tried for more and more bits per pair.
+ * @param  rate the highest false positive rate allowed
+ * @return      the bits per pair needed
+ */
+double filter_bits_per_pair(double rate) {
+    double bits, per_block, p, word_set, fp;
+    int j;
+
+    for (bits = 2.0; bits < FILTER_MAX_BITS; bits += 0.25) {
+        per_block = FILTER_BLOCK_BITS / bits;
+        p = exp(-per_block);
+        fp = 0.0;
+        for (j = 0; j < 4 * per_block + 32; j++) {
+            word_set = 1.0 - pow(31.0 / 32.0, j);
+            fp += p * pow(word_set, FILTER_BLOCK_WORDS);
+            p *= per_block / (j + 1);
+        }
+        if (fp <= rate)
+            return bits;
+    }
+
+    return FILTER_MAX_BITS;
+}
+
+
+/* Returns the number of pairs in the multimap. */
+int64_t count_pairs(multimap *mm) {
+    int64_t i, total = 0;
+
+    if (mm->frozen_keys != NULL)
+        return mm->frozen_starts[mm->num_nodes + 1];
+
+    for (i = 0; i < mm->num_nodes; i++)
+        total += mm->root[i].num_values;
+    return total;
+}
+
+
+/**
+ * Builds the pair filter for the specified number of pairs, at the
+ * multimap's filter rate, and adds every pair of the multimap to it.
+ * @param mm       pointer to the multimap
+ * @param capacity the number of pairs to size the filter for
+ */
+void build_filter(multimap *mm, int64_t capacity) {
+    double bits = filter_bits_per_pair(mm->filter_rate) * capacity;
+    int64_t num_blocks = (int64_t) ceil(bits / FILTER_BLOCK_BITS), i, k;
+    void *filter;
+
+    if (num_blocks < 1)
+        num_blocks = 1;
+
+    if (posix_memalign(&filter, FILTER_ALIGN,
+                       num_blocks * FILTER_BLOCK_WORDS * sizeof(uint32_t))) {
+        /* Simple error handling for out of memory cases. */
+        printf("%s\n", "failed to allocate pair filter");
+        exit(1);
+    }
+
+    free(mm->filter);
+    mm->filter = filter;
+    mm->filter_blocks = num_blocks;
+    mm->filter_capacity = capacity;
+    memset(mm->filter, 0, num_blocks * FILTER_BLOCK_WORDS * sizeof(uint32_t));
+
+    if (mm->frozen_keys != NULL) {
+        for (k = 1; k <= mm->num_nodes; k++) {
+            for (i = mm->frozen_starts[k]; i < mm->frozen_starts[k + 1]; i++)
+                filter_insert(mm, mm->frozen_keys[k], mm->frozen_values[i]);
+        }
+    }
+    else {
+        for (k = 0; k < mm->num_nodes; k++) {
+            multimap_node *node = mm->root + k;
+            int *values = mm->value_pool + node->values;
+            int block[PACK_BLOCK];
+            int32_t b, c, j;
+
+            if (node->value_set != PACKED_VALUES) {
+                for (j = 0; j < node->num_values; j++)
+                    filter_insert(mm, node->key, values[j]);
+                continue;
+            }
+
+            for (b = 0; b * PACK_BLOCK < node->num_values; b++) {
+                c = unpack_block(values, node->num_values, b, block);
+                for (j = 0; j < c; j++)
+                    filter_insert(mm, node->key, block[j]);
+            }
+        }
+    }
+
+    mm->filter_pairs = count_pairs(mm);
+}
+
+
+/* Adds pairs that were just added to the multimap to its pair filter, if
+ * it has one.  If the filter outgrows its capacity, it is rebuilt twice as
+ * large instead, which picks up the new pairs from the multimap.
+ */
+void filter_add_pairs(multimap *mm, const int *keys, const int *vals,
+    size_t n) {
+    size_t i;
+
+    if (mm->filter == NULL)
+        return;
+
+    mm->filter_pairs += n;
+    if (mm->filter_pairs > mm->filter_capacity) {
+        build_filter(mm, 2 * mm->filter_pairs);
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        filter_insert(mm, keys[i], vals[i]);
+}
+
+
+/* Answers the probes from next_probe on that the pair filter rules out, and
+ * returns the first probe that it doesn't rule out, or n.
+ */
+size_t skip_filtered_probes(multimap *mm, const int *keys, const int *vals,
+    size_t n, size_t next_probe, int *out) {
+    if (mm->filter == NULL)
+        return next_probe;
+
+    while (next_probe < n && !filter_contains(mm, keys[next_probe],
+                                              vals[next_probe])) {
+        out[next_probe++] = 0;
+    }
+    return next_probe;
+}
+
+
+/**
+ * Sets up a Bloom filter of the multimap's pairs, so that most probes for
+ * absent pairs are answered without searching the tree.  The filter is
+ * sized for twice the current number of pairs, and grows as pairs are added.
+ * @param mm   pointer to the multimap
+ * @param rate the target false positive rate, or 0 to remove the filter
+ */
+void mm_set_pair_filter(multimap *mm, double rate) {
+    int64_t num_pairs;
+
+    assert(mm != NULL);
+
+    if (rate <= 0.0 || rate >= 1.0) {
+        free(mm->filter);
+        mm->filter = NULL;
+        mm->filter_blocks = 0;
+        mm->filter_capacity = 0;
+        mm->filter_pairs = 0;
+        return;
+    }
+
+    num_pairs = count_pairs(mm);
+    mm->filter_rate = rate;
+    build_filter(mm, 2 * (num_pairs > FILTER_MIN_PAIRS ?
+                          num_pairs : FILTER_MIN_PAIRS));
+}